@@ -12,7 +12,7 @@
 #include "unifier.h"
 #include "BCFKeyValueData.h"
 #include "RocksKeyValue.h"
-#include "ctpl_stl.h"
+#include "executor.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_sinks.h"
 #include "cli_utils.h"
@@ -45,7 +45,14 @@ static int all_steps(const vector<string> &vcf_files,
                      size_t mem_budget, size_t nr_threads,
                      bool debug,
                      bool iter_compare,
-                     size_t bucket_size) {
+                     size_t bucket_size,
+                     bool sst_load,
+                     bool ref_band_columns,
+                     size_t bucket_density_sample,
+                     bool keep_state,
+                     const string &incremental,
+                     bool pipeline,
+                     bool window_scan) {
     GLnexus::Status s;
     GLnexus::unifier_config unifier_cfg;
     GLnexus::genotyper_config genotyper_cfg;
@@ -60,12 +67,18 @@ static int all_steps(const vector<string> &vcf_files,
         GLnexus::cli::utils::load_config(console, config_name, unifier_cfg, genotyper_cfg, cfg_txt, cfg_crc32c,
                                          more_PL, squeeze, trim_uncalled_alleles));
 
-    // initilize empty database
     vector<pair<string,size_t> > contigs;
-    H("initialize database", GLnexus::cli::utils::db_init(console, dbpath, vcf_files[0], contigs,
-                                                          bucket_size));
+    if (!incremental.empty()) {
+        // add to the database of the previous run
+        H("read the contigs from the previous run's DB",
+          GLnexus::cli::utils::db_get_contigs(console, dbpath, contigs));
+    } else {
+        // initilize empty database
+        vector<string> density_sample(vcf_files.begin(),
+                                      vcf_files.begin() + min(bucket_density_sample, vcf_files.size()));
+        H("initialize database", GLnexus::cli::utils::db_init(console, dbpath, vcf_files[0], contigs,
+                                                              bucket_size, density_sample));
 
-    {
         // sanity check, see that we can get the contigs back
         vector<pair<string,size_t> > contigs_dbg;
         H("read the contigs back from DB",
@@ -77,6 +90,8 @@ static int all_steps(const vector<string> &vcf_files,
     if (nr_threads == 0) {
         nr_threads = std::thread::hardware_concurrency();
     }
+    // start the process-wide executor, on which all the steps run their tasks
+    GLnexus::Executor::Shared(nr_threads);
 
     // Load the GVCFs into the database
     unique_ptr<GLnexus::KeyValue::DB> db;
@@ -84,13 +99,36 @@ static int all_steps(const vector<string> &vcf_files,
         // use an empty range filter
         vector<GLnexus::range> ranges;
         H("bulk load into DB",
-          GLnexus::cli::utils::db_bulk_load(console, mem_budget, nr_threads, vcf_files, dbpath, ranges, contigs, &db, false));
+          GLnexus::cli::utils::db_bulk_load(console, mem_budget, nr_threads, vcf_files, dbpath, ranges, contigs, &db, false,
+                                            sst_load, ref_band_columns));
     }
     assert(db);
 
+    // for an incremental run, load the previous run's state and discover
+    // alleles only in the samples added since
+    GLnexus::cli::utils::incremental_state previous;
+    string added_sampleset, all_sampleset;
+    if (!incremental.empty()) {
+        H("load the previous run's state from DB",
+          GLnexus::cli::utils::db_get_incremental_state(db.get(), contigs, previous));
+        if (previous.config_crc32c != cfg_crc32c) {
+            H("check the configuration", GLnexus::Status::Invalid("configuration differs from the previous run's"));
+        }
+        H("create the sample set of the added samples",
+          GLnexus::cli::utils::db_added_samples(console, db.get(), previous.sampleset,
+                                                added_sampleset, all_sampleset));
+    } else if (keep_state) {
+        unique_ptr<GLnexus::BCFKeyValueData> data;
+        H("open DB", GLnexus::BCFKeyValueData::Open(db.get(), data));
+        H("get the sample set", data->all_samples_sampleset(all_sampleset));
+    }
+
     if (iter_compare) {
         H("compare database iteration methods",
           GLnexus::cli::utils::compare_db_itertion_algorithms(console, dbpath, 50));
+        GLnexus::BCFKeyValueData::ref_band_encoding_stats ref_band_stats;
+        H("compare reference band encodings",
+          GLnexus::cli::utils::compare_ref_band_encoding(console, dbpath, false, ref_band_stats));
     }
 
     // discover alleles
@@ -103,12 +141,57 @@ static int all_steps(const vector<string> &vcf_files,
     } else {
         H("parse the bed file", GLnexus::cli::utils::parse_bed_file(console, bedfilename, contigs, ranges));
     }
-    GLnexus::discovered_alleles dsals;
+    if (!incremental.empty() && ranges != previous.ranges) {
+        H("check the ranges", GLnexus::Status::Invalid("ranges differ from the previous run's"));
+    }
+
+    // output header lines
+    genotyper_cfg.output_residuals = debug;
+    vector<string> hdr_lines = {
+        ("##GLnexusConfigName="+config_name),
+        ("##GLnexusConfigCRC32C="+cfg_crc32c),
+        ("##GLnexusConfig="+cfg_txt)
+    };
+    auto DX_JOB_ID = std::getenv("DX_JOB_ID");
+    if (DX_JOB_ID) {
+        // if running in DNAnexus, record job ID in header
+        hdr_lines.push_back(string("##DX_JOB_ID=")+DX_JOB_ID);
+    }
+    string outfile("-");
+
+    if (pipeline) {
+        // discover, unify and genotype contig by contig, reopening the
+        // database read-only
+        console->info("Finishing database compaction...");
+        db.reset();
+        H("discover alleles, unify sites and genotype",
+          GLnexus::cli::utils::discover_unify_genotype(console, mem_budget, nr_threads, dbpath, ranges, contigs,
+                                                       unifier_cfg, genotyper_cfg, hdr_lines, outfile,
+                                                       window_scan));
+        return 0;
+    }
+
+    // the alleles are held in the compact flat form, to reduce peak memory
+    // usage, from discovery until the unifier is done with them
+    GLnexus::flat_discovered_alleles dsals;
     unsigned sample_count = 0;
     auto nr_threads_m2 = nr_threads > 2 ? nr_threads-2 : 1; // reserve threads for DB bg compactions
     H("discover alleles",
       GLnexus::cli::utils::discover_alleles(console, nr_threads_m2, db.get(), ranges, contigs, dsals, sample_count,
-                                            unifier_cfg.min_allele_copy_number == 0));
+                                            unifier_cfg.min_allele_copy_number == 0, added_sampleset));
+    if (!incremental.empty()) {
+        H("merge the previous run's discovered alleles",
+          GLnexus::merge_discovered_alleles(previous.dsals, dsals));
+        previous.dsals.clear();
+        sample_count += previous.sample_count;
+        console->info("merged with the previous run's alleles: {} alleles in {} samples", dsals.size(), sample_count);
+    }
+    console->info("discovered alleles occupy {} bytes", dsals.memory_bytes());
+
+    if (keep_state) {
+        H("store the discovered alleles in DB",
+          GLnexus::cli::utils::db_put_incremental_alleles(db.get(), contigs, sample_count, dsals));
+    }
     if (debug) {
         string filename("/tmp/dsals.yml");
         console->info("Writing discovered alleles as YAML to {}", filename);
@@ -116,30 +199,27 @@ static int all_steps(const vector<string> &vcf_files,
           GLnexus::cli::utils::yaml_write_discovered_alleles_to_file(dsals, contigs, sample_count, filename));
     }
 
-    // partition dsals by contig to reduce peak memory usage in the unifier
-    std::vector<GLnexus::discovered_alleles> dsals_by_contig(contigs.size());
-    for (auto p = dsals.begin(); p != dsals.end(); dsals.erase(p++)) {
-        UNPAIR(*p, al, dai);
-        assert(al.pos.rid >= 0 && al.pos.rid < contigs.size());
-        dsals_by_contig[al.pos.rid][al] = dai;
-    }
-
-    // unify sites (parallel over dsals_by_contig)
-    ctpl::thread_pool unify_pool(nr_threads_m2);
-    vector<future<GLnexus::Status>> statuses;
+    // unify sites (parallel over contigs)
+    vector<GLnexus::Status> statuses(contigs.size());
     vector<vector<GLnexus::unified_site>> sites_by_contig(contigs.size());
     vector<GLnexus::unifier_stats> stats_by_contig(contigs.size());
-    for (size_t i = 0; i < contigs.size(); i++) {
-        statuses.push_back(unify_pool.push([&, i](int tid){
-            return GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals_by_contig[i],
-                                                    sample_count, sites_by_contig[i], stats_by_contig[i]);
-        }));
+    {
+        GLnexus::TaskGroup unify_tasks(GLnexus::Executor::Shared());
+        for (size_t i = 0; i < contigs.size(); i++) {
+            unify_tasks.run([&, i](){
+                statuses[i] = GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals,
+                                                               dsals.contig_begin(i), dsals.contig_begin(i+1),
+                                                               sample_count, sites_by_contig[i], stats_by_contig[i]);
+            });
+        }
+        unify_tasks.wait();
     }
+    dsals.clear();
 
     vector<GLnexus::unified_site> sites;
     GLnexus::unifier_stats stats;
     for (size_t i = 0; i < contigs.size(); i++) {
-        H("unify sites", statuses[i].get());
+        H("unify sites", statuses[i]);
         stats += stats_by_contig[i];
         auto& sites_i = sites_by_contig[i];
         sites.insert(sites.end(), make_move_iterator(sites_i.begin()),
@@ -159,24 +239,26 @@ static int all_steps(const vector<string> &vcf_files,
           GLnexus::cli::utils::write_unified_sites_to_file(sites, contigs, filename));
     }
 
+    GLnexus::Service::genotype_reuse reuse;
+    if (!incremental.empty()) {
+        reuse.new_sampleset = added_sampleset;
+        reuse.previous_filename = incremental;
+        GLnexus::cli::utils::reusable_sites(genotyper_cfg, previous.sites, sites, reuse.reusable);
+        previous.sites.clear();
+    }
+    if (keep_state) {
+        H("store the unified sites in DB",
+          GLnexus::cli::utils::db_put_incremental_sites(db.get(), contigs, all_sampleset, cfg_crc32c,
+                                                        ranges, sites));
+    }
+
     console->info("Finishing database compaction...");
     db.reset();
 
     // genotype
-    genotyper_cfg.output_residuals = debug;
-    vector<string> hdr_lines = {
-        ("##GLnexusConfigName="+config_name),
-        ("##GLnexusConfigCRC32C="+cfg_crc32c),
-        ("##GLnexusConfig="+cfg_txt)
-    };
-    auto DX_JOB_ID = std::getenv("DX_JOB_ID");
-    if (DX_JOB_ID) {
-        // if running in DNAnexus, record job ID in header
-        hdr_lines.push_back(string("##DX_JOB_ID=")+DX_JOB_ID);
-    }
-    string outfile("-");
     H("genotype",
-      GLnexus::cli::utils::genotype(console, mem_budget, nr_threads, dbpath, genotyper_cfg, sites, hdr_lines, outfile));
+      GLnexus::cli::utils::genotype(console, mem_budget, nr_threads, dbpath, genotyper_cfg, sites, hdr_lines, outfile,
+                                    incremental.empty() ? nullptr : &reuse, window_scan));
 
     return 0;
 }
@@ -186,7 +268,7 @@ void help(const char* prog) {
     cout << "Usage: " << prog << " [options] /vcf/file/1 .. /vcf/file/N" << endl
          << "Merge and joint-call input gVCF files, emitting multi-sample BCF on standard output." << endl << endl
          << "Options:" << endl
-         << "  --dir DIR, -d DIR              scratch directory path (mustn't already exist; default: ./GLnexus.DB)" << endl
+         << "  --dir DIR, -d DIR              scratch directory path (mustn't already exist unless --incremental; default: ./GLnexus.DB)" << endl
          << "  --config X, -c X               configuration preset name or .yml filename (default: gatk)" << endl
          << "  --bed FILE, -b FILE            three-column BED file with ranges to analyze (if neither --range nor --bed: use full length of all contigs)" << endl
          << "  --list, -l                     expect given files to contain lists of gVCF filenames, one per line" << endl << endl
@@ -196,7 +278,19 @@ void help(const char* prog) {
          << "  --trim-uncalled-alleles, -a    remove alleles with no output GT calls in postprocessing" << endl << endl
 
          << "  --mem-gbytes X, -m X           memory budget, in gbytes (default: most of system memory)" << endl
-         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl << endl
+         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl
+         << "  --sst-load                     bulk load via sorted SST files ingested in one step, avoiding compactions" << endl
+         << "  --ref-band-columns             store gVCF reference bands in compact columnar form" << endl
+         << "  --bucket-density-sample N      size database buckets by the density of records in the first N gVCFs" << endl << endl
+
+         << "  --keep-state                   keep the discovered alleles and unified sites in the database, for --incremental" << endl
+         << "  --incremental FILE             add the gVCFs to the database (--dir) of a --keep-state run whose output is FILE," << endl
+         << "                                 re-genotyping all samples only at the sites that change" << endl << endl
+
+         << "  --pipeline                     discover, unify and genotype contig by contig, genotyping each while the next" << endl
+         << "                                 are discovered, bounding memory use (without --debug's allele and site dumps)" << endl
+         << "  --window-scan                  genotype adjacent sites together, decoding each database bucket once per window" << endl
+         << "                                 of sites rather than per site (helps where sites are dense, e.g. exomes)" << endl << endl
 
          << "  --help, -h                     print this help message" << endl
          << endl << "Configuration presets:" << endl;
@@ -237,6 +331,13 @@ int main(int argc, char *argv[]) {
         {"bucket_size", required_argument, 0, 'x'},
         {"debug", no_argument, 0, 'g'},
         {"iter_compare", no_argument, 0, 'i'},
+        {"sst-load", no_argument, 0, 'L'},
+        {"ref-band-columns", no_argument, 0, 'R'},
+        {"bucket-density-sample", required_argument, 0, 'D'},
+        {"keep-state", no_argument, 0, 'K'},
+        {"incremental", required_argument, 0, 'I'},
+        {"pipeline", no_argument, 0, 'p'},
+        {"window-scan", no_argument, 0, 'W'},
         {0, 0, 0, 0}
     };
 
@@ -249,9 +350,16 @@ int main(int argc, char *argv[]) {
     bool list_of_files = false;
     bool debug = false;
     bool iter_compare = false;
+    bool sst_load = false;
+    bool ref_band_columns = false;
     string bedfilename;
     size_t mem_budget = 0, nr_threads = 0;
     size_t bucket_size = GLnexus::BCFKeyValueData::default_bucket_size;
+    size_t bucket_density_sample = 0;
+    bool keep_state = false;
+    string incremental;
+    bool pipeline = false;
+    bool window_scan = false;
 
     while (-1 != (c = getopt_long(argc, argv, "hPSadil:b:x:m:t:c:",
                                   long_options, nullptr))) {
@@ -302,6 +410,39 @@ int main(int argc, char *argv[]) {
                 iter_compare = true;
                 break;
 
+            case 'L':
+                sst_load = true;
+                break;
+
+            case 'R':
+                ref_band_columns = true;
+                break;
+
+            case 'D':
+                bucket_density_sample = strtoul(optarg, nullptr, 10);
+                if (bucket_density_sample == 0) {
+                    cerr << "invalid --bucket-density-sample" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'K':
+                keep_state = true;
+                break;
+
+            case 'I':
+                incremental = string(optarg);
+                keep_state = true;
+                break;
+
+            case 'p':
+                pipeline = true;
+                break;
+
+            case 'W':
+                window_scan = true;
+                break;
+
             case 'x':
                 bucket_size = strtoul(optarg, nullptr, 10);
                 if (bucket_size == 0 || bucket_size > 1000000000) {
@@ -332,6 +473,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (keep_state && trim_uncalled_alleles) {
+        cerr << "--keep-state and --incremental are incompatible with --trim-uncalled-alleles" << endl;
+        return 1;
+    }
+
+    if (pipeline && keep_state) {
+        cerr << "--pipeline is incompatible with --keep-state and --incremental" << endl;
+        return 1;
+    }
+
     if (optind > argc-1) {
         help(argv[0]);
         return 1;
@@ -358,5 +509,7 @@ int main(int argc, char *argv[]) {
     }
 
     return all_steps(vcf_files, bedfilename, dbpath, config_name, more_PL, squeeze, trim_uncalled_alleles,
-                     mem_budget, nr_threads, debug, iter_compare, bucket_size);
+                     mem_budget, nr_threads, debug, iter_compare, bucket_size, sst_load,
+                     ref_band_columns, bucket_density_sample, keep_state, incremental, pipeline,
+                     window_scan);
 }
@@ -23,11 +23,36 @@ private:
 public:
     static const int default_bucket_size = 30000;
 
+    /// Bucket begin positions for some contigs (by name), ascending from 0.
+    /// Contigs without them are divided into buckets of the uniform length.
+    typedef std::map<std::string,std::vector<int>> bucket_boundaries;
+
     /// Initialize a brand-new database, which SHOULD be empty to begin with.
-    /// Contigs are stored and an empty sample set "*" is created.
+    /// Contigs are stored and an empty sample set "*" is created. Buckets are
+    /// interval_len long, except as given by the boundary map.
     static Status InitializeDB(KeyValue::DB* db,
                                const std::vector<std::pair<std::string,size_t> >& contigs,
-                               int interval_len = default_bucket_size);
+                               int interval_len = default_bucket_size,
+                               const bucket_boundaries& boundaries = {});
+
+    struct bucket_plan_stats {
+        uint64_t records = 0;      // # records read from the sample gVCFs
+        uint64_t buckets = 0;      // # buckets planned on contigs with records
+        uint64_t uniform_buckets = 0; // ...vs. uniform buckets on those contigs
+        double target_records = 0; // records per bucket aimed for, per gVCF
+    };
+
+    /// Plan bucket boundaries from the density of records in a sample of the
+    /// gVCFs to be imported: each contig having any records is divided into
+    /// buckets holding about as many records as a uniform interval_len
+    /// bucket does on average, but between window and max_len_factor *
+    /// interval_len long. (Records overlapping a boundary count on both
+    /// sides, as they're duplicated into each bucket they overlap.)
+    static Status PlanBucketBoundaries(const std::vector<std::pair<std::string,size_t> >& contigs,
+                                       const std::vector<std::string>& gvcfs,
+                                       int interval_len, bucket_boundaries& ans,
+                                       bucket_plan_stats& stats,
+                                       int window = 1000, int max_len_factor = 16);
 
     /// Open an existing database
     static Status Open(KeyValue::DB* db, std::unique_ptr<BCFKeyValueData>& ans);
@@ -53,13 +78,34 @@ public:
                           std::shared_ptr<const bcf_hdr_t>* hdr) override;
     Status dataset_range(const std::string& dataset, const bcf_hdr_t* hdr,
                          const range& pos, bcf_predicate predicate,
-                         std::vector<std::shared_ptr<bcf1_t>>* records) override;
+                         std::vector<std::shared_ptr<bcf1_t>>* records,
+                         unsigned flags = BCF_RANGE_ALL,
+                         const bcf_projection* projection = nullptr) override;
 
     Status sampleset_range(const MetadataCache& metadata, const std::string& sampleset,
                            const range& pos, bcf_predicate predicate,
                            std::shared_ptr<const std::set<std::string>>& samples,
                            std::shared_ptr<const std::set<std::string>>& datasets,
-                           std::vector<std::unique_ptr<RangeBCFIterator>>& iterators) override;
+                           std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                           unsigned flags = BCF_RANGE_ALL,
+                           const bcf_projection* projection = nullptr) override;
+
+    /// Read the buckets overlapping the range for the sample set's data sets,
+    /// discarding the values, so that they're in the database's block cache
+    /// by the time sampleset_range() asks for them. Buckets recently
+    /// prefetched are skipped.
+    Status prefetch(const MetadataCache& metadata, const std::string& sampleset,
+                    const range& pos) override;
+
+    /// One tile per storage bucket overlapping the range
+    Status range_tiles(const range& pos, std::vector<range>& tiles) override;
+
+    /// Discover alleles by merging the per-bucket summaries computed at
+    /// import, if each data set is either wholly in the sample set or
+    /// not at all, and has complete summaries.
+    Status sampleset_discover_alleles(const MetadataCache& metadata, const std::string& sampleset,
+                                      const range& pos, bool include_zero_copies,
+                                      unsigned& N, discovered_alleles& ans) override;
 
     // Provide a way to call the non-optimized base implementation of
     // sampleset_range. Mostly for unit testing.
@@ -67,7 +113,34 @@ public:
                                 const range& pos, bcf_predicate predicate,
                                 std::shared_ptr<const std::set<std::string>>& samples,
                                 std::shared_ptr<const std::set<std::string>>& datasets,
-                                std::vector<std::unique_ptr<RangeBCFIterator>>& iterators);
+                                std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                                unsigned flags = BCF_RANGE_ALL,
+                                const bcf_projection* projection = nullptr);
+
+    /// Bands stored column-wise (see import_options::ref_band_columns) are
+    /// answered directly from the columns, without synthesizing BCF records;
+    /// others are unpacked.
+    Status dataset_ref_bands(const std::string& dataset, const bcf_hdr_t* hdr,
+                             const range& pos, std::vector<ref_band>& ans) override;
+
+    struct ref_band_encoding_stats {
+        uint64_t buckets = 0;
+        uint64_t records = 0;
+        uint64_t ref_bands = 0;          // reference bands stored column-wise
+        size_t plain_bytes = 0;          // buckets written without columns
+        size_t columnar_bytes = 0;       // ...and with
+        double plain_scan_seconds = 0;   // full scan of each bucket
+        double columnar_scan_seconds = 0;
+        double summary_seconds = 0;      // dataset_ref_bands() on each bucket
+
+        std::string str() const;
+    };
+
+    /// Re-encode every bucket in the database with and without the columnar
+    /// reference bands, comparing their sizes and the time to scan them. If
+    /// convert is true, also store each bucket's columnar encoding, which
+    /// queries will use thereafter. Not safe with concurrent imports.
+    Status compare_ref_band_encoding(bool convert, ref_band_encoding_stats& stats);
 
     struct import_result {
         std::set<std::string> samples;
@@ -78,6 +151,8 @@ public:
         uint64_t buckets = 0;     // # buckets
         uint64_t duplicate_records = 0; // # of records duplicated in multiple buckets
         uint64_t skipped_records = 0; // # of records skipped in source gVCF for various caller-specific reasons
+        uint64_t records_read = 0;  // # of records read from the source gVCF (not seeked past with its index)
+        uint64_t filtered_records = 0; // # of records read but not overlapping the range filter
 
         import_result& add_bucket(uint64_t bucket_records, size_t bucket_bytes, uint64_t duplicates) {
             records += bucket_records;
@@ -102,21 +177,51 @@ public:
             buckets += rhs.buckets;
             duplicate_records += rhs.duplicate_records;
             skipped_records += rhs.skipped_records;
+            records_read += rhs.records_read;
+            filtered_records += rhs.filtered_records;
             return *this;
         }
     };
 
+    struct import_options {
+        /// Write the buckets into a sorted run for bulk ingestion, instead of
+        /// inserting them through the database's usual write path. The data
+        /// set's records aren't visible until the caller invokes
+        /// KeyValue::DB::ingest_sorted_runs(), although its metadata is
+        /// committed as usual. Requires database support.
+        bool sorted_runs = false;
+
+        /// If the gVCF has a tabix/CSI index, import it in pieces (by contig
+        /// and genomic region) on up to this many threads. Without an index,
+        /// the gVCF is read sequentially regardless.
+        unsigned threads = 1;
+
+        /// Store gVCF reference bands in compact columnar form where
+        /// possible, instead of as packed BCF records. Queries return
+        /// identical records either way.
+        bool ref_band_columns = false;
+    };
+
     /// Import a new data set (a gVCF file, possibly containing multiple samples).
     /// The data set name must be unique.
     /// The sample names in the data set (gVCF column names) must be unique.
     /// All samples are immediately added to the sample set "*"
     /// If range_filter is nonempty, then import only records overlapping one
-    /// of those ranges.
+    /// of those ranges. If the gVCF has a tabix/CSI index, it's used to seek
+    /// to the ranges rather than reading through the whole file.
     Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
                        const std::string& filename,
                        const std::set<range>& range_filter,
+                       const import_options& opts,
                        import_result& rslt);
 
+    Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
+                       const std::string& filename,
+                       const std::set<range>& range_filter,
+                       import_result& rslt) {
+        return import_gvcf(metadata, dataset, filename, range_filter, import_options(), rslt);
+    }
+
     Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
                        const std::string& filename,
                        std::set<std::string>& samples_imported) {
@@ -13,6 +13,12 @@ Status bcf_raw_read_header(const uint8_t* buf, int hdrlen,
 // Write BCF header
 std::string bcf_write_header(const bcf_hdr_t *hdr);
 
+// Make a copy of body, a header without samples, with the given sample
+// columns
+Status bcf_hdr_with_samples(const std::shared_ptr<const bcf_hdr_t>& body,
+                            const std::vector<std::string>& samples,
+                            std::shared_ptr<const bcf_hdr_t>& ans);
+
 // The following three functions, prefixed with bcf_raw, are copied
 // and modified from the htslib sources. They are used to read/write
 // uncompressed BCF records from/to memory. They are declared for
@@ -49,6 +55,37 @@ void bcf_raw_write_to_mem(bcf1_t *v, int reclen, uint8_t *addr);
 // This compares most, but not all, fields.
 int bcf_shallow_compare(const bcf1_t *x, const bcf1_t *y);
 
+// Location of a field's values within a packed BCF record (as written by
+// bcf_raw_write_to_mem)
+struct bcf_raw_field {
+    int offset = -1; // byte offset of the first value
+    int type = 0;    // BCF_BT_*
+    int width = 0;   // bytes per value
+    int count = 0;   // number of values (per sample, for FORMAT fields)
+};
+
+// Locations of the REF allele and of the INFO and FORMAT fields (keyed by
+// header dictionary ID) in a packed BCF record
+struct bcf_raw_layout {
+    bcf_raw_field ref;
+    std::map<int,bcf_raw_field> info, format;
+};
+
+// Parse the layout of the packed BCF record at [buf], without deserializing it.
+// Return Invalid if the record is malformed.
+Status bcf_raw_parse_layout(const uint8_t *buf, size_t len, bcf_raw_layout& ans);
+
+// Copy the packed BCF record at [buf], keeping only the INFO and FORMAT fields
+// whose header dictionary IDs are in the respective sets (nullptr: keep all).
+// The result is itself a packed record, for bcf_raw_read_from_mem.
+Status bcf_raw_project(const uint8_t *buf, size_t len,
+                       const std::set<int>* info, const std::set<int>* format,
+                       std::string& ans);
+
+// Determine whether the packed BCF record has an ALT allele which isn't
+// symbolic (<...>), e.g. isn't merely gVCF <NON_REF> or <*>.
+Status bcf_raw_has_nonsymbolic_alt(const uint8_t *buf, size_t len, bool& ans);
+
 } // namespace GLnexus
 
 #endif
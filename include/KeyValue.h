@@ -78,6 +78,22 @@ public:
         return s;
     }
 
+    /// Get the values corresponding to several keys at once: statuses[i] and
+    /// values[i] are as get0 would produce for keys[i]. Returns OK if the
+    /// lookups were attempted, regardless of their individual statuses. The
+    /// base implementation calls get0 for each key; derived classes may
+    /// batch them more efficiently.
+    virtual Status multi_get(CollectionHandle coll, const std::vector<std::string>& keys,
+                             std::vector<Status>& statuses,
+                             std::vector<std::shared_ptr<Data>>& values) const {
+        statuses.resize(keys.size());
+        values.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            statuses[i] = get0(coll, keys[i], values[i]);
+        }
+        return Status::OK();
+    }
+
     /// Create an iterator positioned at the first key equal to or greater
     /// than the given one. If key is empty then position at the beginning of
     /// the collection.
@@ -101,6 +117,34 @@ public:
     virtual Status commit() = 0;
 };
 
+/// A run of key-value records for one collection, staged outside of the
+/// database for later bulk ingestion by DB::ingest_sorted_runs(). This
+/// bypasses the usual write path (and the compactions it entails) when
+/// loading large amounts of data. Not thread-safe; use one per worker.
+class SortedRunWriter {
+public:
+    virtual ~SortedRunWriter() = default;
+
+    /// Append a record. Keys must be strictly increasing within each shard
+    /// (see DB::begin_sorted_run).
+    virtual Status put(const std::string& key, const Data& value) = 0;
+
+    /// Seal the run so that the next ingest_sorted_runs() will include it. A
+    /// run destroyed without commit() is discarded.
+    virtual Status commit() = 0;
+};
+
+/// Statistics reported by DB::ingest_sorted_runs()
+struct ingest_stats {
+    uint64_t runs = 0;          // sorted runs committed
+    uint64_t run_files = 0;     // files staged by the runs
+    uint64_t run_bytes = 0;
+    uint64_t files = 0;         // files ingested, after merging runs
+    uint64_t bytes = 0;
+    double merge_seconds = 0;
+    double ingest_seconds = 0;
+};
+
 /// Main database interface for retrieving collection handles, generating
 /// snapshopts to read from, and creating and applying write batches. The DB
 /// object itself implements the Reader interface (with no consistency
@@ -129,11 +173,29 @@ public:
     // apply a "batch" of one write. Derived classes may want to provide more
     // efficient overrides.
     Status get0(CollectionHandle coll, const std::string& key, std::shared_ptr<Data>& value) const override;
+    Status multi_get(CollectionHandle coll, const std::vector<std::string>& keys,
+                     std::vector<Status>& statuses,
+                     std::vector<std::shared_ptr<Data>>& values) const override;
     Status iterator(CollectionHandle coll, const std::string& key, std::unique_ptr<Iterator>& it) const override;
     virtual Status put(CollectionHandle coll, const std::string& key, const Data& value);
 
     /// Ensure all writes are flushed to storage
     virtual Status flush() = 0;
+
+    /// Begin a sorted run destined for the collection. Records are sharded
+    /// by their first [shard_len] key bytes, which must be the same for all
+    /// runs in the collection; keys need only increase within each shard.
+    /// Returns NotImplemented if the database doesn't support bulk ingestion.
+    virtual Status begin_sorted_run(CollectionHandle coll, size_t shard_len,
+                                    std::unique_ptr<SortedRunWriter>& run) {
+        return Status::NotImplemented();
+    }
+
+    /// Merge all committed sorted runs and ingest them into their
+    /// collections. The runs' keys must be distinct from each other.
+    virtual Status ingest_sorted_runs(ingest_stats& stats) {
+        return Status::NotImplemented();
+    }
 };
 
 }}
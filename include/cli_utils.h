@@ -9,6 +9,7 @@
 #include "RocksKeyValue.h"
 #include "BCFKeyValueData.h"
 #include "unifier.h"
+#include "service.h"
 
 namespace GLnexus {
 namespace cli {
@@ -50,6 +51,9 @@ Status contigs_of_yaml(const YAML::Node& yaml,
 Status yaml_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair<std::string,size_t> > &contigs,
                                          const discovered_alleles &dsals,
                                          std::ostream &os);
+Status yaml_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair<std::string,size_t> > &contigs,
+                                         const flat_discovered_alleles &dsals,
+                                         std::ostream &os);
 
 // Load a YAML file, previously created with the above function
 Status discovered_alleles_of_yaml_stream(std::istream &is,
@@ -61,6 +65,20 @@ Status yaml_write_discovered_alleles_to_file(const discovered_alleles &dsals,
                                              const std::vector<std::pair<std::string,size_t>> &contigs,
                                              unsigned int sample_count,
                                              const std::string &filename);
+Status yaml_write_discovered_alleles_to_file(const flat_discovered_alleles &dsals,
+                                             const std::vector<std::pair<std::string,size_t>> &contigs,
+                                             unsigned int sample_count,
+                                             const std::string &filename);
+
+// Serialize alleles [begin,end) of the flat representation in binary form
+// (FlatDiscoveredAlleles in defs.capnp), much quicker to write and read back
+// than YAML. Keep to some hundred thousand alleles per message.
+Status binary_of_discovered_alleles(const flat_discovered_alleles &dsals, size_t begin, size_t end,
+                                    std::string &ans);
+
+// Append alleles serialized by the above to dsals, which they must follow in
+// allele order
+Status discovered_alleles_of_binary(const std::string &data, flat_discovered_alleles &dsals);
 
 // Serialize a vector of unified-alleles to YAML.
 Status yaml_stream_of_unified_sites(const std::vector<unified_site> &sites,
@@ -100,12 +118,15 @@ std::string describe_config_presets();
 
 RocksKeyValue::prefix_spec* GLnexus_prefix_spec();
 
-// Initialize a database. Fills in the contigs.
+// Initialize a database. Fills in the contigs. If density_sample is nonempty,
+// bucket boundaries are planned from the density of records in those gVCFs
+// (see BCFKeyValueData::PlanBucketBoundaries), with bucket_size the mean.
 Status db_init(std::shared_ptr<spdlog::logger> logger,
                const std::string &dbpath,
                const std::string &exemplar_gvcf,
                std::vector<std::pair<std::string,size_t>> &contigs, // output parameter
-               size_t bucket_size = BCFKeyValueData::default_bucket_size);
+               size_t bucket_size = BCFKeyValueData::default_bucket_size,
+               const std::vector<std::string>& density_sample = {});
 
 // Read the contigs from a database
 Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
@@ -113,6 +134,8 @@ Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
                       std::vector<std::pair<std::string,size_t> > &contigs);
 
 // Load gvcf files into a database in parallel
+// If sst_ingest, each gVCF is written into sorted SST files which are then
+// merged and ingested into the database in one step, avoiding compactions.
 Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     size_t mem_budget, size_t nr_threads,
                     const std::vector<std::string> &gvcfs,
@@ -120,7 +143,9 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     const std::vector<range> &ranges,   // limit the bulk load to these ranges
                     std::vector<std::pair<std::string,size_t>> &contigs, // output param
                     std::unique_ptr<KeyValue::DB> *db_out = nullptr, // if supplied, return db ptr (after flush)
-                    bool delete_gvcf_after_load = false);
+                    bool delete_gvcf_after_load = false,
+                    bool sst_ingest = false,
+                    bool ref_band_columns = false);
 
 // Discover alleles in the database. Return discovered alleles, and the sample count.
 Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
@@ -137,7 +162,18 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
                         unsigned &sample_count,
-                        bool include_zero_copies = false);
+                        bool include_zero_copies = false,
+                        const std::string &sampleset = std::string()); // default: all samples
+// As above, into the compact flat representation, which each range's alleles
+// are moved into as soon as they're discovered
+Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
+                        size_t nr_threads, KeyValue::DB *db,
+                        const std::vector<range> &ranges,
+                        const std::vector<std::pair<std::string,size_t> > &contigs,
+                        flat_discovered_alleles &dsals,
+                        unsigned &sample_count,
+                        bool include_zero_copies = false,
+                        const std::string &sampleset = std::string());
 
 
 // Run unifier on given discovered alleles.
@@ -151,14 +187,95 @@ Status unify_sites(std::shared_ptr<spdlog::logger> logger,
                    std::vector<unified_site> &sites,
                    GLnexus::unifier_stats& stats);
 
-// if the file name is "-", then output is written to stdout.
+// Run unifier on alleles [begin,end) of the flat representation (left intact)
+Status unify_sites(std::shared_ptr<spdlog::logger> logger,
+                   const unifier_config &unifier_cfg,
+                   const std::vector<std::pair<std::string,size_t> > &contigs,
+                   const flat_discovered_alleles &dsals,
+                   size_t begin, size_t end,
+                   unsigned sample_count,
+                   std::vector<unified_site> &sites,
+                   GLnexus::unifier_stats& stats);
+
+// if the file name is "-", then output is written to stdout. window_scan:
+// genotype adjacent sites in windows even for small sample sets (see
+// service_config::genotype_window_scan).
 Status genotype(std::shared_ptr<spdlog::logger> logger,
                 size_t mem_budget, size_t nr_threads,
                 const std::string &dbpath,
                 const GLnexus::genotyper_config &genotyper_cfg,
                 const std::vector<unified_site> &sites,
                 const std::vector<std::string> &extra_header_lines,
-                const std::string &output_filename);
+                const std::string &output_filename,
+                const Service::genotype_reuse *reuse = nullptr,
+                bool window_scan = false);
+
+// Discover alleles, unify sites and genotype them one contig at a time, in a
+// pipeline: while one contig's sites are genotyped, the alleles of the next
+// (up to lookahead contigs) are discovered and unified on the executor, so
+// that only those few contigs' alleles and sites are in memory at once. The
+// output is the same as from discover_alleles, unify_sites (per contig) and
+// genotype (with window_scan) in turn.
+Status discover_unify_genotype(std::shared_ptr<spdlog::logger> logger,
+                               size_t mem_budget, size_t nr_threads,
+                               const std::string &dbpath,
+                               const std::vector<range> &ranges,
+                               const std::vector<std::pair<std::string,size_t> > &contigs,
+                               const unifier_config &unifier_cfg,
+                               const GLnexus::genotyper_config &genotyper_cfg,
+                               const std::vector<std::string> &extra_header_lines,
+                               const std::string &output_filename,
+                               bool window_scan = false,
+                               size_t lookahead = 2);
+
+// Incremental ("N+1") joint calling: a run may keep its discovered alleles
+// and unified sites in the database, so that a later run, having imported
+// more gVCFs into it, discovers alleles only in the added samples, and
+// genotypes all the samples only at the sites that changed. Elsewhere, it
+// reuses the previous output's columns (see Service::genotype_sites).
+struct incremental_state {
+    std::string sampleset;          // the sample set genotyped
+    std::string config_crc32c;      // of the unifier/genotyper configuration
+    std::vector<range> ranges;      // in which the alleles were discovered
+    unsigned sample_count = 0;
+    flat_discovered_alleles dsals;  // as input to the unifier
+    std::vector<unified_site> sites;
+};
+
+// Store a run's discovered alleles (before the unifier consumes them)
+Status db_put_incremental_alleles(KeyValue::DB *db,
+                                  const std::vector<std::pair<std::string,size_t> > &contigs,
+                                  unsigned sample_count,
+                                  const flat_discovered_alleles &dsals);
+
+// Store the rest of a run's state, once its sites are unified
+Status db_put_incremental_sites(KeyValue::DB *db,
+                                const std::vector<std::pair<std::string,size_t> > &contigs,
+                                const std::string &sampleset,
+                                const std::string &config_crc32c,
+                                const std::vector<range> &ranges,
+                                const std::vector<unified_site> &sites);
+
+// Load the state stored by the above; NotFound if there's none
+Status db_get_incremental_state(KeyValue::DB *db,
+                                const std::vector<std::pair<std::string,size_t> > &contigs,
+                                incremental_state &ans);
+
+// Create a sample set of the database's samples not in the previous run's
+// sample set, and get the sample set of all the samples.
+Status db_added_samples(std::shared_ptr<spdlog::logger> logger,
+                        KeyValue::DB *db,
+                        const std::string &previous_sampleset,
+                        std::string &added_sampleset,
+                        std::string &all_sampleset);
+
+// Flag the sites at which the previous output can be reused: it has a site
+// with the same position and alleles, at which genotyping produces the same
+// sample columns (see genotype_site_samples_equivalent).
+void reusable_sites(const genotyper_config &genotyper_cfg,
+                    const std::vector<unified_site> &previous_sites,
+                    const std::vector<unified_site> &sites,
+                    std::vector<bool> &ans);
 
 // compare different implementations of database iteration methods.
 //
@@ -166,6 +283,14 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
 Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
                                       const std::string &dbpath,
                                       int n_iter);
+
+// compare the size and scan time of the database's buckets with and without
+// column-wise reference bands. If convert is true, also rewrite the buckets
+// with the columns; the database mustn't be open elsewhere.
+Status compare_ref_band_encoding(std::shared_ptr<spdlog::logger> logger,
+                                 const std::string &dbpath,
+                                 bool convert,
+                                 BCFKeyValueData::ref_band_encoding_stats &stats);
 }}}
 
 #endif
@@ -6,6 +6,8 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <mutex>
+#include <atomic>
 #include <vcf.h>
 #include "types.h"
 
@@ -56,6 +58,18 @@ public:
 };
 
 
+/// Dense integer IDs for a sample set's samples and data sets: their indices
+/// in these vectors, which are sorted (as are the sets from
+/// MetadataCache::sampleset_datasets)
+struct sampleset_ids {
+    std::vector<std::string> samples;
+    std::vector<std::string> datasets;
+
+    /// ID of the sample or data set, or -1 if it isn't in the sample set
+    int sample_id(const std::string& sample) const;
+    int dataset_id(const std::string& dataset) const;
+};
+
 /// Wraps any Metadata implementation to provide in-memory caching/indexing of
 /// the immutable relationships
 class MetadataCache : public Metadata {
@@ -80,6 +94,94 @@ public:
     Status sampleset_datasets(const std::string& sampleset,
                               std::shared_ptr<const std::set<std::string> >& samples,
                               std::shared_ptr<const std::set<std::string>>& datasets) const;
+    Status sampleset_ids(const std::string& sampleset,
+                         std::shared_ptr<const GLnexus::sampleset_ids>& ans) const;
+};
+
+/// The sample set samples (by ID) in a data set's sample columns
+struct column_mapping {
+    std::vector<int> sample_of_column;          // -1 for samples not in the sample set
+    std::vector<std::pair<int,int>> columns;    // (column, sample ID), ascending
+
+    int at(int column) const {
+        int ans = sample_of_column.at(column);
+        if (ans < 0) {
+            throw std::out_of_range("column_mapping::at");
+        }
+        return ans;
+    }
+    bool empty() const { return columns.empty(); }
+    size_t size() const { return columns.size(); }
+    std::vector<std::pair<int,int>>::const_iterator begin() const { return columns.begin(); }
+    std::vector<std::pair<int,int>>::const_iterator end() const { return columns.end(); }
+};
+
+/// The column mapping of each of a sample set's data sets, by data set ID.
+/// Computing it entails the data set headers, so it's meant to be built once
+/// per operation (see BCFData::sampleset_columns) and consulted instead of
+/// looking up sample names throughout.
+struct sampleset_columns {
+    std::shared_ptr<const sampleset_ids> ids;
+    std::vector<column_mapping> datasets;
+};
+
+/// A free list of bcf1_t records for BCFData implementations to draw from,
+/// so that range queries reuse records (and the buffers htslib allocates
+/// within them) instead of allocating each one afresh. A record obtained
+/// from the pool returns to it once its last shared_ptr is released, whether
+/// explicitly through recycle() or not; the pool lives until then. Thread-safe.
+class BCFRecordPool : public std::enable_shared_from_this<BCFRecordPool> {
+    std::mutex mutex_;
+    std::vector<bcf1_t*> free_;
+    size_t capacity_;
+    std::atomic<uint64_t> allocated_, reused_;
+
+    BCFRecordPool(size_t capacity) : capacity_(capacity), allocated_(0), reused_(0) {}
+    BCFRecordPool(const BCFRecordPool&) = delete;
+
+public:
+    /// Maximum number of free records held by the pool; more are destroyed
+    static const size_t default_capacity = 4096;
+
+    static std::shared_ptr<BCFRecordPool> Create(size_t capacity = default_capacity);
+
+    /// The calling thread's pool, which range queries use by default. Records
+    /// may nonetheless be released on any thread.
+    static std::shared_ptr<BCFRecordPool> ThreadLocal();
+
+    ~BCFRecordPool();
+
+    /// Get a cleared record
+    std::shared_ptr<bcf1_t> get();
+
+    /// Release the records, returning any not shared elsewhere to the pool
+    void recycle(std::vector<std::shared_ptr<bcf1_t>>& records) {
+        records.clear();
+    }
+
+    /// Get a cleared record without the shared_ptr (and its control block),
+    /// for a caller that uses it alone and hands it back with put()
+    bcf1_t* get_raw();
+
+    /// Return a record obtained from get_raw() to the pool
+    void put(bcf1_t* rec);
+
+    /// unique_ptr deleter returning a record from get_raw() to its pool
+    struct putter {
+        BCFRecordPool* pool;
+        void operator()(bcf1_t* rec) const { pool->put(rec); }
+    };
+    typedef std::unique_ptr<bcf1_t, putter> unique_record;
+
+    /// Get a cleared record from get_raw() which returns to the pool when
+    /// released. The pool must outlive it.
+    unique_record get_unique() {
+        return unique_record(get_raw(), putter{this});
+    }
+
+    /// Number of records allocated by get(), and reused from the pool
+    uint64_t allocated() const { return allocated_; }
+    uint64_t reused() const { return reused_; }
 };
 
 /// Iterate over BCF records within some range.
@@ -88,7 +190,9 @@ public:
     virtual ~RangeBCFIterator() = default;
 
     /// Get all the records in one dataset. Returns NotFound at the end of the
-    /// iteration.
+    /// iteration. Records left in [records] by the previous call are
+    /// released first, so passing the same vector repeatedly lets the
+    /// implementation recycle them (see BCFRecordPool).
     virtual Status next(std::string& dataset, std::shared_ptr<const bcf_hdr_t>& hdr,
                         std::vector<std::shared_ptr<bcf1_t>>& records) = 0;
 };
@@ -125,17 +229,30 @@ public:
     /// function. It can unpack it if needed, in which case, it will not be
     /// unpacked again by the dataset_range function.
     ///
+    /// flags: bitwise OR of bcf_range_flags. BCF_RANGE_VARIANTS_ONLY is the
+    /// preferred way to select only variant records, since the
+    /// implementation may then avoid reading the reference confidence
+    /// records at all. The predicate, if any, is applied in addition.
+    ///
+    /// projection: optionally, a pre-filter on the packed records and the
+    /// INFO/FORMAT fields to unpack (see bcf_projection). It's applied before
+    /// the predicate.
+    ///
     /// The provided header must match the data set, otherwise the behavior is undefined!
     virtual Status dataset_range(const std::string& dataset, const bcf_hdr_t* hdr,
                                  const range& pos, bcf_predicate predicate,
-                                 std::vector<std::shared_ptr<bcf1_t>>* records) = 0;
+                                 std::vector<std::shared_ptr<bcf1_t>>* records,
+                                 unsigned flags = BCF_RANGE_ALL,
+                                 const bcf_projection* projection = nullptr) = 0;
 
     /// Wrapper for dataset_range which first fetches the appropriate header
     /// (useful if the caller doesn't already have the header in hand)
     virtual Status dataset_range_and_header(const std::string& dataset,
                                             const range& pos, bcf_predicate predicate,
                                             std::shared_ptr<const bcf_hdr_t>* hdr,
-                                            std::vector<std::shared_ptr<bcf1_t>>* records);
+                                            std::vector<std::shared_ptr<bcf1_t>>* records,
+                                            unsigned flags = BCF_RANGE_ALL,
+                                            const bcf_projection* projection = nullptr);
 
     /// Get iterators for BCF records overlapping the given range in all
     /// datasets containing at least one sample in the designated sample set.
@@ -146,11 +263,72 @@ public:
     /// relevant data set (possibly yielding zero records in some steps) --
     /// that is, they will all reach their end after the same number of steps.
     /// The iterators together will produce each relevant record exactly once.
+    /// The predicate, flags and projection are as for dataset_range; the
+    /// iterators keep their own copy of the projection.
     virtual Status sampleset_range(const MetadataCache& metadata, const std::string& sampleset,
                                    const range& pos, bcf_predicate predicate,
                                    std::shared_ptr<const std::set<std::string>>& samples,
                                    std::shared_ptr<const std::set<std::string>>& datasets,
-                                   std::vector<std::unique_ptr<RangeBCFIterator>>& iterators);
+                                   std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                                   unsigned flags = BCF_RANGE_ALL,
+                                   const bcf_projection* projection = nullptr);
+
+    /// Hint that sampleset_range() will soon be called for the range, so the
+    /// implementation may read the pertinent data into its caches ahead of
+    /// time. Thread-safe. The base implementation does nothing.
+    virtual Status prefetch(const MetadataCache& metadata, const std::string& sampleset,
+                            const range& pos) {
+        return Status::OK();
+    }
+
+    /// Split the range into consecutive tiles covering it, aligned to the
+    /// implementation's storage units (e.g. buckets) so that the records
+    /// beginning in each tile may be read separately at similar cost. The
+    /// base implementation returns the range whole.
+    virtual Status range_tiles(const range& pos, std::vector<range>& tiles) {
+        tiles.assign(1, pos);
+        return Status::OK();
+    }
+
+    /// Extent, depth/quality and genotype of one gVCF reference band (see
+    /// is_gvcf_ref_record)
+    struct ref_band {
+        range pos;
+        // FORMAT values of the first sample (bcf_int32_missing if absent)
+        int32_t gq, min_dp, dp;
+        // whether the first sample's GT is 0/0
+        bool hom_ref;
+
+        ref_band(const range& pos_, int32_t gq_, int32_t min_dp_, int32_t dp_, bool hom_ref_)
+            : pos(pos_), gq(gq_), min_dp(min_dp_), dp(dp_), hom_ref(hom_ref_) {}
+
+        /// Summarize an unpacked reference band record
+        static ref_band of_record(const bcf_hdr_t* hdr, bcf1_t* record);
+    };
+
+    /// Summarize the data set's reference bands overlapping the range, in
+    /// order of position, e.g. so that the genotyper can read their depths
+    /// without the records themselves. The implementation may answer from a
+    /// compact representation without synthesizing records; the base
+    /// implementation gets them from dataset_range.
+    virtual Status dataset_ref_bands(const std::string& dataset, const bcf_hdr_t* hdr,
+                                     const range& pos, std::vector<ref_band>& ans);
+
+    /// Map the sample set's samples onto its data sets' sample columns.
+    Status sampleset_columns(const MetadataCache& metadata, const std::string& sampleset,
+                             std::shared_ptr<const GLnexus::sampleset_columns>& ans);
+
+    /// Discover the alleles in the range for the sample set from summaries
+    /// precomputed when the data were stored, with the same result as
+    /// discover_alleles_from_iterator over sampleset_range(); N is set to the
+    /// number of samples. Returns NotImplemented if the summaries can't
+    /// answer the query, in which case the caller should scan the records.
+    /// The base implementation always does so.
+    virtual Status sampleset_discover_alleles(const MetadataCache& metadata, const std::string& sampleset,
+                                              const range& pos, bool include_zero_copies,
+                                              unsigned& N, discovered_alleles& ans) {
+        return Status::NotImplemented();
+    }
 };
 
 }
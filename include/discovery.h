@@ -6,6 +6,23 @@
 
 namespace GLnexus {
 
+class Executor;
+
+// The alleles in one gVCF variant record, with their statistics over the
+// given samples: the REF allele first, then each ALT allele matching [ACGT]+
+// regardless of its copy number.
+Status discover_alleles_from_record(const std::string& dataset, const bcf_hdr_t* hdr, bcf1_t* record,
+                                    const std::vector<unsigned>& samples,
+                                    std::vector<std::pair<allele,discovered_allele_info>>& ans);
+
+// Add the alleles discovered in a record (as above) to dsals, keeping the
+// ALT alleles with at least one copy called (or all of them, if
+// include_zero_copies), and the REF allele if any ALT allele is kept. Alleles
+// already in dsals are left alone; new ones are marked in_target pos.
+void discovered_alleles_of_record(const std::vector<std::pair<allele,discovered_allele_info>>& record_alleles,
+                                  const range& pos, bool include_zero_copies,
+                                  discovered_alleles& dsals);
+
 // Discover alleles from a RangeBCFIterator. Records not contained within pos will be ignored.
 Status discover_alleles_from_iterator(const std::set<std::string>& samples,
                                       const range& pos,
@@ -13,6 +30,39 @@ Status discover_alleles_from_iterator(const std::set<std::string>& samples,
                                       discovered_alleles& dsals,
                                       bool include_zero_copies = false);
 
+// Likewise, with the samples given by the sample set's column mapping, from
+// an iterator over the same sample set's data sets.
+Status discover_alleles_from_iterator(const sampleset_columns& columns,
+                                      const range& pos,
+                                      RangeBCFIterator& iterator,
+                                      discovered_alleles& dsals,
+                                      bool include_zero_copies = false);
+
+// Discover alleles in the records of the sample set's data sets [begin,end)
+// (by its column mapping) beginning within tile, one of the consecutive
+// tiles covering pos (see BCFData::range_tiles); the first tile also takes
+// the records beginning before pos. Over all the tiles and data sets, the
+// merged results are the same as from discover_alleles_from_iterator over
+// sampleset_range(pos).
+Status discover_alleles_from_tile(BCFData& data, const sampleset_columns& columns,
+                                  size_t begin, size_t end,
+                                  const range& pos, const range& tile,
+                                  discovered_alleles& dsals,
+                                  bool include_zero_copies = false,
+                                  std::atomic<bool>* abort = nullptr);
+
+// Merge the parts into ans (as merge_discovered_alleles one by one), by a
+// pairwise tree reduction forked on the executor. The parts are consumed.
+Status merge_discovered_alleles(Executor& executor, std::vector<discovered_alleles>& parts,
+                                discovered_alleles& ans);
+Status merge_discovered_alleles(Executor& executor, std::vector<flat_discovered_alleles>& parts,
+                                flat_discovered_alleles& ans);
+
+// The projection for range queries feeding discover_alleles_from_iterator: the
+// records must have a non-symbolic ALT allele, and only the fields examined
+// in discovery are unpacked.
+bcf_projection discovery_projection();
+
 // verify that the discovered_alleles has a REF allele for each ALT allele, and that the REF
 // alleles are all consistent with each other.
 Status discovered_alleles_refcheck(const discovered_alleles& als,
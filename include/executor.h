@@ -0,0 +1,93 @@
+#ifndef GLNEXUS_EXECUTOR_H
+#define GLNEXUS_EXECUTOR_H
+
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include "types.h"
+
+namespace GLnexus {
+
+/// Work-stealing thread pool for fork/join parallelism, shared by the
+/// operations running in the process so that together they don't use more
+/// threads than cores.
+///
+/// Each worker thread has a deque of tasks: tasks spawned by a worker go on
+/// its own deque, which it works through newest first, while idle workers
+/// steal the oldest tasks from the others. Tasks spawned from outside the
+/// pool go on a shared queue, first in first out. A thread waiting on tasks
+/// it has spawned (wait_until, TaskGroup::wait) executes pending tasks in
+/// the meantime, so nested parallelism doesn't tie up waiting threads. The
+/// flip side is that tasks shouldn't block on conditions which only a later
+/// task could satisfy, as that task might be stacked above them on the same
+/// thread.
+class Executor {
+    struct body;
+    std::unique_ptr<body> body_;
+
+    Executor();
+    Executor(const Executor&) = delete;
+
+public:
+    static Status Start(size_t threads, std::unique_ptr<Executor>& ans);
+    ~Executor();
+
+    /// The process-wide executor. A call with threads > 0 sets the number of
+    /// its threads working on tasks (see set_threads), for all the operations
+    /// in the process; 0 leaves it as it is (initially, a thread per core).
+    static Executor& Shared(size_t threads = 0);
+
+    /// Number of worker threads taking on tasks
+    size_t threads() const;
+
+    /// Set the number of worker threads taking on tasks, up to the number
+    /// started (0 for all of them); the others sit idle. Threads outside the
+    /// pool waiting on tasks they've spawned execute pending tasks
+    /// regardless.
+    void set_threads(size_t threads);
+
+    /// Enqueue a task. It mustn't throw (see TaskGroup).
+    void spawn(std::function<void()> task);
+
+    /// Execute one pending task on the calling thread, if there's any.
+    /// Returns false if there wasn't.
+    bool run_one();
+
+    /// Execute pending tasks on the calling thread until the predicate holds.
+    /// The predicate is checked whenever a task finishes, or upon notify();
+    /// tasks making it true otherwise must call notify(). A thread outside
+    /// the pool may pass help=false to just block, e.g. one which must
+    /// respond promptly once the predicate holds, rather than finish some
+    /// long task first; worker threads always help.
+    void wait_until(const std::function<bool()>& predicate, bool help = true);
+
+    /// Wake threads in wait_until to check their predicates
+    void notify();
+};
+
+/// Tasks spawned on an Executor to be waited for together (fork/join). An
+/// exception thrown by a task is rethrown from wait(), after all the tasks
+/// have finished.
+class TaskGroup {
+    Executor& executor_;
+    std::atomic<size_t> pending_;
+    std::mutex mutex_;
+    std::exception_ptr exception_;
+
+    TaskGroup(const TaskGroup&) = delete;
+
+public:
+    TaskGroup(Executor& executor) : executor_(executor), pending_(0) {}
+    ~TaskGroup();
+
+    void run(std::function<void()> task);
+
+    /// Wait for the tasks to finish, executing pending tasks meanwhile
+    void wait();
+};
+
+}
+
+#endif
@@ -14,15 +14,50 @@ namespace GLnexus {
 // residual_rec: in case there are call losses, generate a YAML formatted record giving
 // the context. This is used offline to improve the algorithms.
 //
+// The sample set's column mapping (BCFData::sampleset_columns) locates its
+// samples in the data sets; the output has a column for each, in ID order.
+//
 // May set ans to nullptr if the site ends up with all ALT alleles trimmed.
 Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
                      const unified_site& site,
-                     const std::string& sampleset, const std::vector<std::string>& samples,
+                     const std::string& sampleset, const sampleset_columns& columns,
                      const bcf_hdr_t* hdr, std::shared_ptr<bcf1_t>& ans,
                      bool residualsFlag,
                      std::shared_ptr<std::string> &residual_rec,
                      std::atomic<bool>* abort = nullptr);
 
+// Genotype a window of adjacent sites sites[begin,end) on one contig, with the
+// same results as genotype_site for each (ans[i] and residual_recs[i] being
+// for sites[begin+i]). Rather than querying the whole sample set for each
+// site in turn, the data sets are read in blocks of block_datasets, each data
+// set's records overlapping the window just once (so a bucket holding
+// several of the sites is decoded once), and dispatched to the sites they
+// overlap in one sweep. All the sites are genotyped on a block before moving
+// on to the next; the output records are assembled after the last block.
+Status genotype_site_window(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                            const std::vector<unified_site>& sites, size_t begin, size_t end,
+                            const sampleset_columns& columns, size_t block_datasets,
+                            const bcf_hdr_t* hdr, std::vector<std::shared_ptr<bcf1_t>>& ans,
+                            bool residualsFlag,
+                            std::vector<std::shared_ptr<std::string>>& residual_recs,
+                            std::atomic<bool>* abort = nullptr);
+
+// The range genotype_site queries for the site's records: the range
+// encompassing all its original alleles
+range genotype_site_query_range(const unified_site& site);
+
+// Whether genotype_site produces the same sample columns at sites a and b
+// (given the same data): they may differ only in the site-level statistics
+// it reports (QUAL, AQ and AF), and in allele frequencies only insofar as the
+// genotype priors of revise_genotypes aren't affected.
+bool genotype_site_samples_equivalent(const genotyper_config& cfg,
+                                      const unified_site& a, const unified_site& b);
+
+// The projection for range queries feeding genotype_site: only the FORMAT
+// fields it reads (GT, GQ, likelihoods, depths and the lifted-over fields) and
+// the lifted-over INFO fields are unpacked.
+bcf_projection genotyper_projection(const genotyper_config& cfg);
+
 // Reasons for emitting a non-call (.), encoded in the RNC FORMAT field in the
 // output VCF
 enum class NoCallReason {
@@ -90,7 +125,7 @@ struct bcf1_t_plus {
     bool was_haploid = false;
 };
 Status preprocess_record(const unified_site& site, const bcf_hdr_t* hdr, const std::shared_ptr<bcf1_t>& record, bcf1_t_plus& ans);
-Status revise_genotypes(const genotyper_config& cfg, const unified_site& us, const std::map<int, int>& sample_mapping,
+Status revise_genotypes(const genotyper_config& cfg, const unified_site& us, const column_mapping& sample_mapping,
                         const bcf_hdr_t* hdr, bcf1_t_plus& vr);
 
 } // namespace GLnexus
@@ -6,14 +6,65 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <functional>
 #include "types.h"
 #include "data.h"
 
 namespace GLnexus {
 
 struct service_config {
+    // The operations fork their tasks on the process-wide executor
+    // (Executor::Shared), which threads sets to run that many worker threads
+    // (0 to leave it as it is), for the whole process. The prefetch and
+    // output compression threads below come in addition.
     size_t threads = 0;
 
+    // discover_alleles: a range is read in tiles of whole storage buckets
+    // (see BCFData::range_tiles) x blocks of up to discover_block_datasets
+    // data sets, each tile taking as many buckets as keep its estimated cost
+    // (buckets x data sets) near discover_tile_cost, so that the tasks are of
+    // similar size and each one's data stay in cache. discover_tile_cost = 0
+    // to fork a task per iterator of BCFData::sampleset_range instead.
+    size_t discover_block_datasets = 256;
+    size_t discover_tile_cost = 1024;
+
+    // genotype_sites: background threads prefetching the data for upcoming
+    // sites (see BCFData::prefetch), up to prefetch_lookahead sites ahead of
+    // the worker threads. 0 to disable.
+    size_t prefetch_threads = 2;
+    size_t prefetch_lookahead = 256;
+
+    // genotype_sites: the genotyped records awaiting output in site order may
+    // take up to about genotype_pending_bytes (estimated from the records so
+    // far), or genotype_max_pending_sites sites, before further sites are
+    // held back for the output to catch up -- though each thread may always
+    // work on one window.
+    size_t genotype_pending_bytes = 256ULL << 20;
+    size_t genotype_max_pending_sites = 16384;
+
+    // genotype_sites: each task genotypes a chunk of consecutive sites, whose
+    // estimated cost (the number of original alleles they unify) totals
+    // about genotype_chunk_cost
+    size_t genotype_chunk_cost = 256;
+
+    // genotype_sites: with genotype_window_scan, or for sample sets with more
+    // than genotype_block_datasets data sets, each task genotypes a window of
+    // up to genotype_window_sites adjacent sites, reading the data sets in
+    // blocks of that many (see genotype_site_window). A window doesn't
+    // extend past the range tile (see BCFData::range_tiles) in which it
+    // begins, so that each storage bucket is decoded once per window rather
+    // than per site. genotype_window_sites <= 1 to disable.
+    bool genotype_window_scan = false;
+    size_t genotype_window_sites = 8;
+    size_t genotype_block_datasets = 1024;
+
+    // genotype_sites: BGZF compression level of BCF and bgzipped VCF output
+    // (0-9, or -1 for 1 in BCF and htslib's default in VCF), and the number
+    // of threads compressing it in parallel, in order (0 for one per four
+    // worker threads). VCF output is formatted on the worker threads.
+    int output_compression_level = -1;
+    size_t output_threads = 0;
+
     // additional (informational) lines to insert into output pVCF headers
     std::vector<std::string> extra_header_lines;
 };
@@ -26,6 +77,19 @@ class Service {
     Service(const service_config& cfg, BCFData& data);
     Service(const Service&) = delete;
 
+    // discover_alleles for one range, mapping the sample set onto the data
+    // sets' columns unless given the mapping (computed once per operation)
+    Status discover_alleles_in_range(const std::string& sampleset, const range& pos,
+                                     std::shared_ptr<const sampleset_columns> columns,
+                                     unsigned& N, discovered_alleles& ans,
+                                     bool include_zero_copies, std::atomic<bool>* abort);
+
+    // discover_alleles for each of the ranges, handing over each one's
+    // alleles to store(i, alleles) as soon as they're discovered
+    Status discover_alleles_in_ranges(const std::string& sampleset, const std::vector<range>& ranges,
+                                      unsigned& N, bool include_zero_copies, std::atomic<bool>* abort,
+                                      const std::function<Status(size_t,discovered_alleles&)>& store);
+
 public:
     static Status Start(const service_config& cfg, Metadata& metadata, BCFData& data,
                         std::unique_ptr<Service>& svc);
@@ -63,16 +127,119 @@ public:
                             bool include_zero_copies = false,
                             std::atomic<bool>* abort = nullptr);
 
+    /// As above, but moving each range's alleles into the compact flat
+    /// representation as soon as they're discovered, so that the ranges'
+    /// alleles are never all held in discovered_alleles maps at once
+    Status discover_alleles(const std::string& sampleset, const std::vector<range>& ranges,
+                            unsigned& N, std::vector<flat_discovered_alleles>& ans,
+                            bool include_zero_copies = false,
+                            std::atomic<bool>* abort = nullptr);
+
+    /// Previous genotype_sites output to build upon, when some samples have
+    /// been added to the sample set since
+    struct genotype_reuse {
+        /// the sample set of the added samples
+        std::string new_sampleset;
+        /// the previous output, having (at least) all the other samples
+        std::string previous_filename;
+        /// for each site, whether the previous output has a record with the
+        /// same position and alleles whose sample columns can be kept (see
+        /// genotype_site_samples_equivalent)
+        std::vector<bool> reusable;
+    };
+
     /// Genotype a set of samples at the given sites, producing a BCF file.
+    ///
+    /// If reuse is given, then at the reusable sites only the added samples
+    /// are genotyped, and the other samples' columns are copied from the
+    /// previous output's record. The site-level fields always reflect the
+    /// given sites, so the output is the same as without reuse.
+    /// Incompatible with genotyper_config::trim_uncalled_alleles.
     Status genotype_sites(const genotyper_config& cfg, const std::string& sampleset,
                           const std::vector<unified_site>& sites,
                           const std::string& filename,
+                          std::atomic<bool>* abort = nullptr,
+                          const genotype_reuse* reuse = nullptr);
+
+    /// An output file which successive genotype_sites calls append to, so
+    /// that a long list of sites may be genotyped piecemeal (e.g. as each
+    /// contig's sites are unified) into one file. Closed by close(), or
+    /// upon destruction if not closed already (without reporting errors).
+    class genotype_output {
+        friend class Service;
+        struct body;
+        std::unique_ptr<body> body_;
+
+        genotype_output();
+        genotype_output(const genotype_output&) = delete;
+
+    public:
+        ~genotype_output();
+        Status close();
+    };
+
+    /// Open an output for genotype_sites of the sample set (see above)
+    Status open_genotype_output(const genotyper_config& cfg, const std::string& sampleset,
+                                const std::string& filename,
+                                std::unique_ptr<genotype_output>& ans);
+
+    /// Genotype the sample set at the given sites, appending the records to
+    /// the output, which must have been opened for the same sample set and
+    /// genotyper configuration. The sites must follow those of previous
+    /// calls in order.
+    Status genotype_sites(const genotyper_config& cfg, const std::string& sampleset,
+                          const std::vector<unified_site>& sites,
+                          genotype_output& output,
                           std::atomic<bool>* abort = nullptr);
 
-    // Report cumulative time (milliseconds) worker threads in the above
-    // operations have spent 'stalled' waiting on single-threaded processing
-    // steps (e.g. output serialization)
+    struct discover_stats_t {
+        uint64_t units = 0;    // tasks scanning records (see discover_tile_cost)
+        uint64_t scan_ms = 0;  // cumulative time from forking them to joining
+        uint64_t merge_ms = 0; // cumulative time merging their alleles
+
+        std::string str() const;
+    };
+
+    // Report cumulative discover_alleles statistics (for ranges the
+    // discovered-allele summaries didn't answer)
+    discover_stats_t discover_stats() const;
+
+    // Report cumulative time (milliseconds) the above operations have held
+    // back work from the executor threads, waiting on single-threaded
+    // processing steps (e.g. output serialization)
     uint64_t threads_stalled_ms() const;
+
+    struct prefetch_stats_t {
+        uint64_t hits = 0;       // sites whose data had been prefetched
+        uint64_t waits = 0;      // ...was still being prefetched, so the worker waited
+        uint64_t misses = 0;     // ...hadn't been prefetched yet
+        uint64_t stalled_ms = 0; // cumulative time workers waited
+
+        std::string str() const;
+    };
+
+    // Report cumulative genotype_sites prefetching statistics
+    prefetch_stats_t prefetch_stats() const;
+
+    struct output_stats_t {
+        uint64_t records = 0;    // records written to genotype_sites outputs
+        uint64_t bytes = 0;      // ...their uncompressed size
+        uint64_t formatted = 0;  // ...formatted as VCF text on the worker threads
+        uint64_t write_ms = 0;   // cumulative time writing them on the output thread
+        uint64_t elapsed_ms = 0; // cumulative time from opening to closing the outputs
+
+        std::string str() const;
+    };
+
+    // Report cumulative genotype_sites output statistics
+    output_stats_t output_stats() const;
+
+private:
+    Status genotype_sites_into(const genotyper_config& cfg,
+                               const std::vector<unified_site>& sites,
+                               genotype_output& output,
+                               std::atomic<bool>* abort,
+                               const genotype_reuse* reuse);
 };
 
 }
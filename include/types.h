@@ -15,6 +15,7 @@
 #include <regex>
 #include <atomic>
 #include <algorithm>
+#include <functional>
 #include <math.h>
 
 #pragma GCC diagnostic push
@@ -278,10 +279,6 @@ struct top_AQ {
     // distinguished from lack of observations (up to COUNT)
     int V[COUNT] __attribute__ ((aligned));
 
-    // This is a temporary buffer, used when adding observations. It
-    // does not need to be serialized.
-    std::vector<int> addbuf;
-
     top_AQ() {
         clear();
     }
@@ -294,10 +291,12 @@ struct top_AQ {
 
     void clear() {
         memset(&V, -1, sizeof(int)*COUNT);
-        addbuf.clear();
     }
 
     void add(const int* rhs, const size_t rhs_count) {
+        // scratch space shared by the thread's top_AQs, rather than kept in
+        // each one (there may be tens of millions of discovered alleles)
+        static thread_local std::vector<int> addbuf;
         addbuf.resize(COUNT+rhs_count);
         memcpy(addbuf.data(), &V, COUNT*sizeof(int));
         memcpy(addbuf.data()+COUNT, rhs, rhs_count*sizeof(int));
@@ -415,6 +414,70 @@ struct discovered_allele_info {
 using discovered_alleles = std::map<allele,discovered_allele_info>;
 Status merge_discovered_alleles(const discovered_alleles& src, discovered_alleles& dest);
 
+/// Compact alternative to discovered_alleles for holding very many alleles,
+/// e.g. a whole genome's between discovery and unification: the entries lie
+/// in one array in allele order, with their DNA in a shared pool in which
+/// short sequences are interned, instead of a std::map node and std::string
+/// apiece. Built by appending alleles in order, and read by index.
+class flat_discovered_alleles {
+public:
+    struct entry {
+        range pos;
+        uint32_t dna_size = 0;
+        uint64_t dna = 0; // offset in the pool
+        discovered_allele_info info;
+
+        entry(const range& pos_) : pos(pos_) {}
+    };
+
+    /// Sequences up to this long are interned
+    static const size_t INTERN_MAX = 4;
+
+private:
+    std::vector<entry> entries_;
+    std::string pool_;
+    std::map<std::string,uint64_t> interned_;
+
+    int compare(size_t i, const allele& al) const;
+
+public:
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+    const entry& operator[](size_t i) const { return entries_[i]; }
+
+    std::string dna(size_t i) const { return pool_.substr(entries_[i].dna, entries_[i].dna_size); }
+    allele allele_at(size_t i) const { return allele(entries_[i].pos, dna(i)); }
+
+    /// Index of the first allele on contig rid or beyond
+    size_t contig_begin(int rid) const;
+
+    /// Append an allele following the last one in allele order
+    Status push_back(const allele& al, const discovered_allele_info& info);
+
+    void clear();
+    void shrink_to_fit();
+
+    /// Bytes allocated
+    size_t memory_bytes() const;
+};
+
+/// Move the alleles into the flat representation, clearing src
+Status flat_of_discovered_alleles(discovered_alleles& src, flat_discovered_alleles& ans);
+
+/// Add alleles [begin,end) of the flat representation to ans (as by
+/// merge_discovered_alleles)
+Status discovered_alleles_of_flat(const flat_discovered_alleles& src, size_t begin, size_t end,
+                                  discovered_alleles& ans);
+
+/// Merge src into dest (as merge_discovered_alleles would), yielding ans, in
+/// linear time
+Status merge_discovered_alleles(const flat_discovered_alleles& src, const flat_discovered_alleles& dest,
+                                flat_discovered_alleles& ans);
+
+/// Merge src into dest in place: appending src if its alleles all follow
+/// dest's (e.g. from disjoint ranges in order), otherwise as above
+Status merge_discovered_alleles(const flat_discovered_alleles& src, flat_discovered_alleles& dest);
+
 Status yaml_of_one_discovered_allele(const allele& allele,
                                      const discovered_allele_info& ainfo,
                                      const std::vector<std::pair<std::string,size_t> >& contigs,
@@ -509,31 +572,66 @@ struct unified_site {
 struct StatsRangeQuery {
     int64_t nBCFRecordsRead;    // how many BCF records were read from the DB
     int64_t nBCFRecordsInRange; // how many were in the requested range
+    int64_t nBucketsDecoded;    // how many bucket values were decoded to read them
+    int64_t nMultiGets;         // batched bucket lookups (KeyValue::Reader::multi_get)
+    int64_t nMultiGetKeys;      // total keys in those batches
+    int64_t maxMultiGetKeys;    // largest batch
+    double multiGetSeconds;     // total time waiting for them
 
     // constructor
     StatsRangeQuery() {
         nBCFRecordsRead = 0;
         nBCFRecordsInRange = 0;
+        nBucketsDecoded = 0;
+        nMultiGets = 0;
+        nMultiGetKeys = 0;
+        maxMultiGetKeys = 0;
+        multiGetSeconds = 0;
     }
 
     // copy constructor
     StatsRangeQuery(const StatsRangeQuery &srq) {
         nBCFRecordsRead = srq.nBCFRecordsRead;
         nBCFRecordsInRange = srq.nBCFRecordsInRange;
+        nBucketsDecoded = srq.nBucketsDecoded;
+        nMultiGets = srq.nMultiGets;
+        nMultiGetKeys = srq.nMultiGetKeys;
+        maxMultiGetKeys = srq.maxMultiGetKeys;
+        multiGetSeconds = srq.multiGetSeconds;
     }
 
     // Addition
     StatsRangeQuery& operator+=(const StatsRangeQuery& srq) {
         nBCFRecordsRead += srq.nBCFRecordsRead;
         nBCFRecordsInRange += srq.nBCFRecordsInRange;
+        nBucketsDecoded += srq.nBucketsDecoded;
+        nMultiGets += srq.nMultiGets;
+        nMultiGetKeys += srq.nMultiGetKeys;
+        maxMultiGetKeys = std::max(maxMultiGetKeys, srq.maxMultiGetKeys);
+        multiGetSeconds += srq.multiGetSeconds;
         return *this;
     }
 
+    // Record one batched lookup
+    void add_multi_get(size_t keys, double seconds) {
+        nMultiGets++;
+        nMultiGetKeys += keys;
+        maxMultiGetKeys = std::max(maxMultiGetKeys, int64_t(keys));
+        multiGetSeconds += seconds;
+    }
+
     // return a human readable string
     std::string str() {
         std::ostringstream os;
         os << "Num BCF records read " << std::to_string(nBCFRecordsRead)
-           << "  query hits " << std::to_string(nBCFRecordsInRange);
+           << "  query hits " << std::to_string(nBCFRecordsInRange)
+           << "  buckets decoded " << std::to_string(nBucketsDecoded);
+        if (nMultiGets) {
+            os << "  bucket lookups " << std::to_string(nMultiGetKeys)
+               << " in " << std::to_string(nMultiGets) << " batches (max "
+               << std::to_string(maxMultiGetKeys) << ", "
+               << std::to_string(multiGetSeconds) << "s)";
+        }
         return os.str();
     }
 };
@@ -599,6 +697,9 @@ enum class GLnexusOutputFormat {
 
     /// Uncompressed vcf (for ease of comparison in small cases)
     VCF,
+
+    /// bgzipped vcf
+    VCF_GZ,
 };
 
 enum class RetainedFieldFrom {
@@ -733,7 +834,7 @@ struct genotyper_config {
     // a file named [BCF/VCF output file].residuals.yml
     bool output_residuals = false;
 
-    /// Output format (default = bcf), choices = "BCF", "VCF"
+    /// Output format (default = bcf), choices = "BCF", "VCF", "VCF_GZ"
     GLnexusOutputFormat output_format = GLnexusOutputFormat::BCF;
 
     // FORMAT fields from the original gvcfs to be lifted over to the output
@@ -807,4 +908,35 @@ bool is_gvcf_ref_record(const bcf1_t* record);
 // corruption).
 typedef Status (*bcf_predicate)(const bcf_hdr_t*, bcf1_t*, bool &retval);
 
+// Flags modifying BCFData range queries (bitwise OR).
+enum bcf_range_flags : unsigned {
+    BCF_RANGE_ALL = 0,
+    // Yield only gVCF variant records, omitting the reference confidence
+    // records (see is_gvcf_ref_record). The storage layer may be able to skip
+    // the latter without decoding them.
+    BCF_RANGE_VARIANTS_ONLY = 1
+};
+
+// Predicate on a record in packed form (see bcf_raw_write_to_mem), which the
+// storage layer may evaluate before decoding the record at all. For example,
+// bcf_raw_range and bcf_raw_has_nonsymbolic_alt examine the packed bytes.
+typedef std::function<Status(const uint8_t* buf, size_t len, bool &retval)> bcf_raw_predicate;
+
+// Pushdown and projection for BCFData range queries: a cheap pre-filter,
+// and the INFO/FORMAT fields the caller will actually look at. These are
+// optimization hints; implementations may ignore them, so callers must
+// tolerate records that would have failed raw_predicate or that have extra
+// fields. Unlisted fields are otherwise absent from the unpacked records.
+struct bcf_projection {
+    bcf_raw_predicate raw_predicate = nullptr;
+
+    // if all_info is false, keep only the INFO fields named in info
+    bool all_info = true;
+    std::set<std::string> info;
+
+    // likewise for FORMAT fields (GT is not implicit)
+    bool all_format = true;
+    std::set<std::string> format;
+};
+
 } //namespace GLnexus
@@ -41,6 +41,15 @@ Status unified_sites(const unifier_config& cfg,
                      std::vector<unified_site>& ans,
                      unifier_stats& stats);
 
+/// Compute unified sites from alleles [begin,end) of the flat representation,
+/// as above (but leaving it intact)
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N,
+                     const flat_discovered_alleles& alleles,
+                     size_t begin, size_t end,
+                     std::vector<unified_site>& ans,
+                     unifier_stats& stats);
+
 // Find which range overlaps [pos]. The ranges are assumed to be non-overlapping.
 // (exposed for unit testing)
 Status find_target_range(const std::set<range> &ranges, const range &pos, range &ans);
@@ -1,6 +1,8 @@
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
 #include "diploid.h"
+#include "discovery.h"
+#include "executor.h"
 #include "yaml-cpp/yaml.h"
 #include "vcf.h"
 #include "hfile.h"
@@ -11,7 +13,12 @@
 #include <math.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <limits>
 #include <sys/time.h>
+#include <chrono>
+#include <deque>
+#include <numeric>
 #include "fcmm.hpp"
 #include "khash.h"
 #include <regex>
@@ -67,6 +74,13 @@ struct BCFKeyValueData_body {
     ActiveMetadata amd;
     std::mutex statsMutex;
     StatsRangeQuery statsRq; // statistics for range queries
+    std::mutex prefetchMutex;
+    std::deque<std::string> prefetched; // recently prefetched bucket prefixes
+    KeyValue::CollectionHandle discovery_coll = nullptr; // discovered-allele summaries,
+                                                         // if the database has them
+    KeyValue::CollectionHandle header_body_coll = nullptr; // likewise interned header bodies
+    std::mutex header_body_mutex;
+    std::map<std::string,shared_ptr<const bcf_hdr_t>> header_bodies; // parsed, by key
     atomic<size_t> sample_count; // number of samples in the database. could be
                                  // obtained from the size of the current
                                  // all-samples sampleset, but maintained here
@@ -74,13 +88,60 @@ struct BCFKeyValueData_body {
 };
 
 auto collections = { "config", "sampleset", "sample_dataset", "header", "bcf" };
+// Collections added later, which databases initialized before their
+// introduction lack:
+// - discovered-allele summary of each bucket, keyed as in "bcf"
+const char* DISCOVERY_COLLECTION = "discovery";
+// - header bodies shared by data sets (see capnp::DatasetHeader), keyed by
+//   hash of the contents
+const char* HEADER_BODY_COLLECTION = "header_body";
+
+static KeyValue::CollectionHandle optional_collection(KeyValue::DB* db, const char* name) {
+    KeyValue::CollectionHandle coll;
+    return db->collection(name, coll).ok() ? coll : nullptr;
+}
 
 BCFKeyValueData::BCFKeyValueData() = default;
 BCFKeyValueData::~BCFKeyValueData() = default;
 
+// Check the bucket boundary map against the contigs, and arrange it by rid
+// for BCFBucketRange
+static Status index_bucket_boundaries(const vector<pair<string,size_t>>& contigs,
+                                      const BCFKeyValueData::bucket_boundaries& boundaries,
+                                      vector<vector<int>>& ans) {
+    ans.clear();
+    if (boundaries.empty()) {
+        return Status::OK();
+    }
+    ans.resize(contigs.size());
+    size_t found = 0;
+    for (int rid = 0; rid < contigs.size(); rid++) {
+        auto p = boundaries.find(contigs[rid].first);
+        if (p == boundaries.end()) {
+            continue;
+        }
+        const auto& b = p->second;
+        if (b.empty() || b[0] != 0) {
+            return Status::Invalid("bucket boundaries must begin at position 0", p->first);
+        }
+        for (size_t i = 1; i < b.size(); i++) {
+            if (b[i] <= b[i-1]) {
+                return Status::Invalid("bucket boundaries must be ascending", p->first);
+            }
+        }
+        ans[rid] = b;
+        found++;
+    }
+    if (found != boundaries.size()) {
+        return Status::Invalid("bucket boundaries given for unknown contig(s)");
+    }
+    return Status::OK();
+}
+
 Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
                                      const vector<pair<string,size_t>>& contigs,
-                                     int interval_len) {
+                                     int interval_len,
+                                     const bucket_boundaries& boundaries) {
     Status s;
 
     // some basic sanity checks
@@ -91,11 +152,18 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
         if (contig_len > MAX_CONTIG_LEN)
             return Status::Invalid("contig is too long ", string(p.first) + " " + std::to_string(contig_len));
     }
+    if (interval_len <= 0) {
+        return Status::Invalid("bad interval length ", std::to_string(interval_len));
+    }
+    vector<vector<int>> boundaries_by_rid;
+    S(index_bucket_boundaries(contigs, boundaries, boundaries_by_rid));
 
     // create collections
     for (const auto& coll : collections) {
         S(db->create_collection(coll));
     }
+    S(db->create_collection(DISCOVERY_COLLECTION));
+    S(db->create_collection(HEADER_BODY_COLLECTION));
 
     KeyValue::CollectionHandle config;
     S(db->collection("config", config));
@@ -130,6 +198,24 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
         S(db->put(config, "param", yaml.c_str()));
     }
 
+    // store bucket boundaries, if any, in the same form as the contigs:
+    // - 21: [0, 12000, 30000, ...]
+    if (!boundaries.empty()) {
+        YAML::Emitter yaml;
+        yaml << YAML::Flow << YAML::BeginSeq;
+        for (const auto& p : contigs) {
+            auto b = boundaries.find(p.first);
+            if (b != boundaries.end()) {
+                yaml << YAML::BeginMap;
+                yaml << YAML::Key << p.first;
+                yaml << YAML::Value << YAML::Flow << b->second;
+                yaml << YAML::EndMap;
+            }
+        }
+        yaml << YAML::EndSeq;
+        S(db->put(config, "bucket_boundaries", yaml.c_str()));
+    }
+
     // create * sample set, with version number 0
     KeyValue::CollectionHandle sampleset;
     S(db->collection("sampleset", sampleset));
@@ -156,6 +242,8 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
     ans.reset(new BCFKeyValueData());
     ans->body_.reset(new BCFKeyValueData_body);
     ans->body_->db = db;
+    ans->body_->discovery_coll = optional_collection(db, DISCOVERY_COLLECTION);
+    ans->body_->header_body_coll = optional_collection(db, HEADER_BODY_COLLECTION);
 
     // Read the parameters from the DB
     const char *unexpected = "BCFKeyValueData::Open unexpected YAML";
@@ -195,7 +283,38 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
         return Status::Invalid("Corrupt database; bad interval length ", std::to_string(interval_len));
     }
 
-    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len);
+    // Read the bucket boundaries, if any
+    bucket_boundaries boundaries;
+    string boundaries_yaml;
+    s = ans->body_->db->get(coll, "bucket_boundaries", boundaries_yaml);
+    if (s.ok()) {
+        try {
+            YAML::Node n = YAML::Load(boundaries_yaml);
+            if (!n.IsSequence()) {
+                return Status::Invalid(unexpected, boundaries_yaml);
+            }
+            for (const auto& item : n) {
+                if (!item.IsMap() || item.size() != 1) {
+                    return Status::Invalid(unexpected, boundaries_yaml);
+                }
+                auto m = item.as<map<string,vector<int>>>();
+                boundaries.insert(*(m.begin()));
+            }
+        } catch(YAML::Exception& exn) {
+            return Status::Invalid("BCFKeyValueData::Open YAML parse error in bucket_boundaries", exn.msg);
+        }
+    } else if (s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+    vector<pair<string,size_t>> contigs;
+    S(ans->contigs(contigs));
+    vector<vector<int>> boundaries_by_rid;
+    s = index_bucket_boundaries(contigs, boundaries, boundaries_by_rid);
+    if (s.bad()) {
+        return Status::Invalid("Corrupt database; bad bucket boundaries", s.str());
+    }
+
+    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len, move(boundaries_by_rid));
     ans->body_->header_cache = make_unique<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE);
 
     // initialize sample_count
@@ -407,6 +526,121 @@ shared_ptr<StatsRangeQuery> BCFKeyValueData::getRangeStats() {
     return statsCopy;
 }
 
+static string write_dataset_header(const string& body_key, const vector<string>& samples) {
+    ::capnp::MallocMessageBuilder b;
+    auto msg_b = b.initRoot<capnp::DatasetHeader>();
+    msg_b.setBody(body_key.c_str());
+    auto samples_b = msg_b.initSamples(samples.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples_b.set(i, samples[i].c_str());
+    }
+    auto msg_words = ::capnp::messageToFlatArray(b);
+    auto msg_bytes = msg_words.asBytes();
+    return string((char*)msg_bytes.begin(), msg_bytes.size());
+}
+
+static Status read_dataset_header(const string& data, string& body_key, vector<string>& samples) {
+    try {
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data(), data.size() / sizeof(::capnp::word)));
+        capnp::DatasetHeader::Reader rdr = message.getRoot<capnp::DatasetHeader>();
+        body_key = rdr.getBody().cStr();
+        samples.clear();
+        for (const auto& sample : rdr.getSamples()) {
+            samples.push_back(sample.cStr());
+        }
+    } catch (exception& exn) {
+        return Status::Failure("BCFKeyValueData: corrupt data set header", exn.what());
+    }
+    return Status::OK();
+}
+
+// Get the parsed header body, reading it from the database the first time
+static Status interned_header_body(BCFKeyValueData_body* body_, const string& key,
+                                   shared_ptr<const bcf_hdr_t>& ans) {
+    Status s;
+    std::lock_guard<std::mutex> lock(body_->header_body_mutex);
+    auto it = body_->header_bodies.find(key);
+    if (it != body_->header_bodies.end()) {
+        ans = it->second;
+        return Status::OK();
+    }
+    if (!body_->header_body_coll) {
+        return Status::Invalid("BCFKeyValueData: data set header refers to missing header body", key);
+    }
+    string data;
+    S(body_->db->get(body_->header_body_coll, key, data));
+    shared_ptr<bcf_hdr_t> body;
+    int consumed;
+    S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, body));
+    ans = body;
+    body_->header_bodies[key] = ans;
+    return Status::OK();
+}
+
+// 64-bit FNV-1a hash, for content-addressed keys
+static uint64_t fnv1a64(const string& data) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Serialize the data set header for the header collection: its samples and
+// the key of its body (the rest of the header), which if not already stored
+// is returned for the caller to store too (otherwise body_key is empty).
+// Falls back to the whole header if the database lacks interned bodies, the
+// reconstituted header would differ, or (improbably) another body has the
+// same hash. Call with body_->mutex held.
+static Status intern_header(BCFKeyValueData_body *body_, const bcf_hdr_t* hdr,
+                            string& hdr_data, string& body_key, string& body_data) {
+    Status s;
+    hdr_data = bcf_write_header(hdr);
+    body_key.clear();
+    body_data.clear();
+    if (!body_->header_body_coll) {
+        return Status::OK();
+    }
+
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> body_hdr(bcf_hdr_subset(hdr, 0, nullptr, nullptr),
+                                                         &bcf_hdr_destroy);
+    if (!body_hdr) {
+        return Status::Failure("BCFKeyValueData: bcf_hdr_subset");
+    }
+    string data = bcf_write_header(body_hdr.get());
+    ostringstream key;
+    key << hex << setw(16) << setfill('0') << fnv1a64(data);
+
+    // check that the header will read back exactly
+    vector<string> samples;
+    for (int i = 0; i < bcf_hdr_nsamples(hdr); i++) {
+        samples.push_back(bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, i));
+    }
+    shared_ptr<bcf_hdr_t> parsed_body;
+    int consumed;
+    S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, parsed_body));
+    shared_ptr<const bcf_hdr_t> reconstituted;
+    S(bcf_hdr_with_samples(parsed_body, samples, reconstituted));
+    if (bcf_write_header(reconstituted.get()) != hdr_data) {
+        return Status::OK();
+    }
+
+    string existing;
+    s = body_->db->get(body_->header_body_coll, key.str(), existing);
+    if (s.ok() && existing != data) {
+        return Status::OK();
+    } else if (s.bad() && s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+    hdr_data = write_dataset_header(key.str(), samples);
+    if (s == StatusCode::NOT_FOUND) {
+        body_key = key.str();
+        body_data = move(data);
+    }
+    return Status::OK();
+}
+
 Status BCFKeyValueData::dataset_header(const string& dataset,
                                        shared_ptr<const bcf_hdr_t>* hdr) {
     auto cached = body_->header_cache->end();
@@ -424,11 +658,21 @@ Status BCFKeyValueData::dataset_header(const string& dataset,
     string data;
     S(body_->db->get(coll, dataset, data));
 
-    // Parse the header
-    shared_ptr<bcf_hdr_t> ans;
-    int consumed;
-    S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, ans));
-    *hdr = ans;
+    if (data.size() >= 5 && memcmp(data.data(), "BCF\2\2", 5) == 0) {
+        // Parse the whole header
+        shared_ptr<bcf_hdr_t> ans;
+        int consumed;
+        S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, ans));
+        *hdr = ans;
+    } else {
+        // Attach the samples to the shared header body
+        string body_key;
+        vector<string> samples;
+        S(read_dataset_header(data, body_key, samples));
+        shared_ptr<const bcf_hdr_t> body;
+        S(interned_header_body(body_.get(), body_key, body));
+        S(bcf_hdr_with_samples(body, samples, *hdr));
+    }
 
     // Memoize it
     body_->header_cache->insert(make_pair(dataset, *hdr));;
@@ -445,13 +689,26 @@ Status BCFKeyValueData::dataset_header(const string& dataset,
 //                   de-duplicated while scanning. In practice you set
 //                   include_danglers to true on the first bucket you're
 //                   scanning, and false on the rest.
+//
+// flags: with BCF_RANGE_VARIANTS_ONLY, only the records on the bucket's
+//        variant list are visited. Buckets written before the list existed
+//        are scanned in full, testing each record instead.
+//
+// projection: if any, its raw_predicate is tested on each record's packed
+//             bytes, and unwanted INFO/FORMAT fields are dropped from them,
+//             before the record is decoded
+//
+// pool: the records are drawn from it
 static Status ScanBCFBucket(const range& bucket, const string& dataset, 
                             const KeyValue::Data& data,
                             const bcf_hdr_t* hdr,
                             const range& query,
                             bcf_predicate predicate,
+                            unsigned flags,
+                            const bcf_projection* projection,
                             const bool include_danglers,
                             StatsRangeQuery &srq,
+                            BCFRecordPool& pool,
                             vector<shared_ptr<bcf1_t> >& ans) {
     Status s;
     // DO NOT ans.clear(), as caller may intend to accumulate results over consecutive buckets
@@ -472,12 +729,70 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
     try {
         ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data, data.size / sizeof(::capnp::word)));
         capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
-
-        // Scan: begin at a position informed by the 'skip index'
-        //       end on encounting a record whose beg position is >= query.end
         auto records = bucket_reader.getRecords();
-        for (int scan_index = SearchBCFBucketSkipIndex(bucket_reader, query);
-             scan_index < records.size(); ++scan_index) {
+        srq.nBucketsDecoded++;
+        const bool variants_only = (flags & BCF_RANGE_VARIANTS_ONLY);
+        const bool variants_listed = variants_only && bucket_reader.getVariantsListed();
+        const size_t ans0 = ans.size();
+        vector<int> ans_index; // record index of each ans[ans0+i]
+
+        // resolve the projected fields to header dictionary IDs
+        unique_ptr<set<int>> info_ids, format_ids;
+        auto resolve = [hdr](const set<string>& names, unique_ptr<set<int>>& ids) {
+            ids = make_unique<set<int>>();
+            for (const auto& name : names) {
+                int id = bcf_hdr_id2int(hdr, BCF_DT_ID, name.c_str());
+                if (id >= 0) {
+                    ids->insert(id);
+                }
+            }
+        };
+        if (projection && !projection->all_info) {
+            resolve(projection->info, info_ids);
+        }
+        if (projection && !projection->all_format) {
+            resolve(projection->format, format_ids);
+        }
+
+        // Decode the packed record, if it passes the raw predicate
+        string projected;
+        auto decode = [&](const uint8_t* buf, size_t len, shared_ptr<bcf1_t>& vt, bool& rec_ok) {
+            Status s;
+            rec_ok = true;
+            if (projection && projection->raw_predicate) {
+                S(projection->raw_predicate(buf, len, rec_ok));
+                if (!rec_ok) {
+                    return Status::OK();
+                }
+            }
+            if (info_ids || format_ids) {
+                S(bcf_raw_project(buf, len, info_ids.get(), format_ids.get(), projected));
+                buf = (const uint8_t*) projected.data();
+                len = projected.size();
+            }
+            vt = pool.get();
+            int bytes_read = -1;
+            return bcf_raw_read_from_mem(buf, 0, len, vt.get(), bytes_read);
+        };
+
+        // Apply the predicate to the record, and unpack it if it passes
+        auto accept = [&](const shared_ptr<bcf1_t>& vt, bool& rec_ok) {
+            Status s;
+            rec_ok = true;
+            if (predicate != nullptr) {
+                S(predicate(hdr, vt.get(), rec_ok));
+            }
+            if (rec_ok && (bcf_unpack(vt.get(), BCF_UN_ALL) != 0 || vt->errcode != 0)) {
+                return Status::IOError("BCFKeyValueData bcf_unpack",
+                                       dataset + "@" + query.str());
+            }
+            return Status::OK();
+        };
+
+        // Process one record; set done upon encountering a record whose beg
+        // position is >= query.end
+        auto scan = [&](int scan_index, bool& done) {
+            Status s;
             srq.nBCFRecordsRead++;
 
             auto buf = records[scan_index];
@@ -489,24 +804,95 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
 
             if (cur_range.overlaps(query) &&
                 (include_danglers || cur_range.beg >= bucket.beg)) {
-                shared_ptr<bcf1_t> vt(bcf_init(), &bcf_destroy);
-                int bytes_read = -1;
-                S(bcf_raw_read_from_mem(buf.begin(), 0, buf.size(), vt.get(), bytes_read));
+                shared_ptr<bcf1_t> vt;
+                bool rec_ok;
+                S(decode(buf.begin(), buf.size(), vt, rec_ok));
+                if (!rec_ok) {
+                    return Status::OK();
+                }
                 assert(range(vt) == cur_range);
 
-                bool rec_ok = true;
-                if (predicate != nullptr) {
-                    S(predicate(hdr, vt.get(), rec_ok));
-                }
-                if (rec_ok) {
-                    if (bcf_unpack(vt.get(), BCF_UN_ALL) != 0 || vt->errcode != 0) {
+                if (variants_only && !variants_listed) {
+                    if (bcf_unpack(vt.get(), BCF_UN_STR) != 0 || vt->errcode != 0) {
                         return Status::IOError("BCFKeyValueData bcf_unpack",
                                                dataset + "@" + query.str());
                     }
+                    if (is_gvcf_ref_record(vt.get())) {
+                        return Status::OK();
+                    }
+                }
+                S(accept(vt, rec_ok));
+                if (rec_ok) {
                     ans.push_back(vt);
+                    ans_index.push_back(scan_index);
                 }
             } else if (cur_range.beg >= query.end) {
-                break;
+                done = true;
+            }
+            return Status::OK();
+        };
+
+        // Scan: begin at the first record which may overlap the query, per
+        // the bucket's interval index
+        int scan_begin = BCFBucketScanBegin(bucket_reader, query);
+        bool done = false;
+        if (variants_listed) {
+            auto variants = bucket_reader.getVariants();
+            for (int i = 0; i < variants.size() && !done; ++i) {
+                if (variants[i] >= scan_begin) {
+                    S(scan(variants[i], done));
+                }
+            }
+        } else {
+            for (int scan_index = scan_begin;
+                 scan_index < records.size() && !done; ++scan_index) {
+                S(scan(scan_index, done));
+            }
+        }
+
+        // Synthesize the reference bands stored column-wise, if any (never
+        // needed for variants), and merge them into the original record order
+        if (!variants_only && bucket_reader.hasRefBands()) {
+            RefBandDecoder bands(bucket_reader.getRefBands());
+            S(bands.load(bucket.rid));
+            vector<pair<uint32_t,shared_ptr<bcf1_t>>> synthesized;
+            for (size_t i = bands.first_ending_after(query.beg); i < bands.size(); i++) {
+                range cur_range = bands.band_range(i);
+                if (cur_range.beg >= query.end) {
+                    break;
+                }
+                if (cur_range.overlaps(query) &&
+                    (include_danglers || cur_range.beg >= bucket.beg)) {
+                    srq.nBCFRecordsRead++;
+                    const uint8_t* buf = nullptr;
+                    size_t len = 0;
+                    S(bands.synthesize_raw(i, buf, len));
+                    shared_ptr<bcf1_t> vt;
+                    bool rec_ok;
+                    S(decode(buf, len, vt, rec_ok));
+                    if (!rec_ok) {
+                        continue;
+                    }
+                    assert(range(vt) == cur_range);
+                    S(accept(vt, rec_ok));
+                    if (rec_ok) {
+                        synthesized.push_back(make_pair(bands.preceding_records(i), vt));
+                    }
+                }
+            }
+            if (!synthesized.empty()) {
+                vector<shared_ptr<bcf1_t>> listed(ans.begin() + ans0, ans.end());
+                ans.resize(ans0);
+                size_t j = 0;
+                for (size_t k = 0; k < listed.size(); k++) {
+                    for (; j < synthesized.size() && synthesized[j].first <= ans_index[k]; j++) {
+                        ans.push_back(synthesized[j].second);
+                    }
+                    ans.push_back(listed[k]);
+                }
+                for (; j < synthesized.size(); j++) {
+                    ans.push_back(synthesized[j].second);
+                }
             }
         }
     } catch (exception &e) {
@@ -515,6 +901,19 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
     return Status::OK();
 }
 
+// Look up bucket keys with KeyValue::Reader::multi_get, recording the batch
+static Status multi_get_buckets(const KeyValue::Reader& reader, KeyValue::CollectionHandle coll,
+                                const vector<string>& keys, vector<Status>& statuses,
+                                vector<shared_ptr<KeyValue::Data>>& values, StatsRangeQuery& srq) {
+    Status s;
+    auto t0 = chrono::steady_clock::now();
+    S(reader.multi_get(coll, keys, statuses, values));
+    srq.add_multi_get(keys.size(),
+                      chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+    assert(statuses.size() == keys.size() && values.size() == keys.size());
+    return Status::OK();
+}
+
 // Search all the buckets that may hold records within the query range.
 //
 // Return value: list of records that overlap with the query
@@ -525,7 +924,9 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
                                       const bcf_hdr_t* hdr,
                                       const range& query,
                                       bcf_predicate predicate,
-                                      vector<shared_ptr<bcf1_t>>* records) {
+                                      vector<shared_ptr<bcf1_t>>* records,
+                                      unsigned flags,
+                                      const bcf_projection* projection) {
     Status s;
     records->clear();
 
@@ -537,32 +938,249 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
     KeyValue::CollectionHandle coll;
     S(body_->db->collection("bcf",coll));
 
-    // iterate through the buckets in range
+    // look up all the buckets in range at once
     shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(query);
+    vector<range> buckets;
+    vector<string> keys;
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        assert(r.overlaps(query));
+        buckets.push_back(r);
+        keys.push_back(body_->rangeHelper->bucket_key(r, dataset));
+    }
+    StatsRangeQuery accu;
+    vector<Status> statuses;
+    vector<shared_ptr<KeyValue::Data>> values;
+    S(multi_get_buckets(*body_->db, coll, keys, statuses, values, accu));
+
+    auto pool = BCFRecordPool::ThreadLocal();
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (statuses[i].ok()) {
+            S(ScanBCFBucket(buckets[i], dataset, *values[i], hdr, query, predicate, flags, projection,
+                            i == 0, accu, *pool, *records));
+        } else if (statuses[i] != StatusCode::NOT_FOUND) {
+            return statuses[i];
+        }
+        values[i].reset();
+    }
+    accu.nBCFRecordsInRange += records->size();
+
+    // update database statistics
+    {
+        std::lock_guard<mutex> lock(body_->statsMutex);
+        body_->statsRq += accu;
+    }
+
+    return Status::OK();
+}
+
+// Summarize the bucket's reference bands overlapping the query range;
+// include_danglers as in ScanBCFBucket. Column-wise bands are read straight
+// from the columns, while bands stored as records are unpacked.
+static Status SummarizeBCFBucketRefBands(const range& bucket, const string& dataset,
+                                         const KeyValue::Data& data,
+                                         const bcf_hdr_t* hdr,
+                                         const range& query,
+                                         const bool include_danglers,
+                                         vector<BCFKeyValueData::ref_band>& ans) {
+    Status s;
+    #ifndef __x86_64__
+    if (uint64_t(data.data) % sizeof(::capnp::word)) {
+         return Status::Failure("BCFBucketReader: input buffer isn't word-aligned");
+    }
+    #endif
+    try {
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data, data.size / sizeof(::capnp::word)));
+        capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
+        const size_t ans0 = ans.size();
+
+        if (bucket_reader.hasRefBands()) {
+            RefBandDecoder bands(bucket_reader.getRefBands());
+            S(bands.load(bucket.rid));
+            for (size_t i = bands.first_ending_after(query.beg); i < bands.size(); i++) {
+                range cur_range = bands.band_range(i);
+                if (cur_range.beg >= query.end) {
+                    break;
+                }
+                if (cur_range.overlaps(query) &&
+                    (include_danglers || cur_range.beg >= bucket.beg)) {
+                    // GT isn't among the columns, so it's the template's
+                    bool hom_ref = false;
+                    S(bands.template_hom_ref(i, hdr, hom_ref));
+                    ans.emplace_back(cur_range, bands.value(i, GQ), bands.value(i, MIN_DP),
+                                     bands.value(i, DP), hom_ref);
+                }
+            }
+        }
+
+        // reference bands remaining in the list of records
+        auto records = bucket_reader.getRecords();
+        auto variants = bucket_reader.getVariants();
+        const bool variants_listed = bucket_reader.getVariantsListed();
+        size_t next_variant = 0;
+        auto pool = BCFRecordPool::ThreadLocal();
+        auto vt = pool->get_unique();
+        for (int scan_index = BCFBucketScanBegin(bucket_reader, query);
+             s.ok() && scan_index < records.size(); ++scan_index) {
+            if (variants_listed) {
+                for (; next_variant < variants.size() && variants[next_variant] < scan_index; next_variant++);
+                if (next_variant < variants.size() && variants[next_variant] == scan_index) {
+                    continue;
+                }
+            }
+            auto buf = records[scan_index];
+            range cur_range(-1,-1,-1);
+            s = bcf_raw_range(buf.begin(), 0, buf.size(), cur_range);
+            if (s.bad() || cur_range.beg >= query.end) {
+                break;
+            }
+            if (!cur_range.overlaps(query) || (!include_danglers && cur_range.beg < bucket.beg)) {
+                continue;
+            }
+            int bytes_read = -1;
+            s = bcf_raw_read_from_mem(buf.begin(), 0, buf.size(), vt.get(), bytes_read);
+            if (s.bad()) {
+                break;
+            } else if (bcf_unpack(vt.get(), BCF_UN_ALL) != 0 || vt->errcode != 0) {
+                s = Status::IOError("BCFKeyValueData bcf_unpack", dataset + "@" + query.str());
+            } else if (variants_listed || is_gvcf_ref_record(vt.get())) {
+                ans.push_back(BCFKeyValueData::ref_band::of_record(hdr, vt.get()));
+            }
+        }
+        if (s.bad()) return s;
+
+        // merge the two (each already sorted) by position
+        stable_sort(ans.begin() + ans0, ans.end(),
+                    [](const BCFKeyValueData::ref_band& a, const BCFKeyValueData::ref_band& b) {
+                        return a.pos < b.pos;
+                    });
+    } catch (exception &e) {
+        return Status::IOError("exception deserializing BCF bucket", e.what());
+    }
+    return Status::OK();
+}
+
+Status BCFKeyValueData::dataset_ref_bands(const string& dataset, const bcf_hdr_t* hdr,
+                                          const range& query, vector<ref_band>& ans) {
+    Status s;
+    ans.clear();
+
+    if (query.rid < 0 || query.beg < 0 || query.end < 0)
+        return Status::Invalid("BCFKeyValueData::dataset_ref_bands: invalid query range", query.str());
+
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection("bcf",coll));
 
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(query);
     bool first = true;
-    StatsRangeQuery accu;
     for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
-        assert(r.overlaps(query));
         string key = body_->rangeHelper->bucket_key(r, dataset);
         shared_ptr<KeyValue::Data> data;
         s = body_->db->get0(coll, key, data);
         if (s.ok()) {
-            S(ScanBCFBucket(r, dataset, *data, hdr, query, predicate,
-                            first, accu, *records));
+            S(SummarizeBCFBucketRefBands(r, dataset, *data, hdr, query, first, ans));
         } else if (s != StatusCode::NOT_FOUND) {
             return s;
         }
         first = false;
     }
-    accu.nBCFRecordsInRange += records->size();
+    return Status::OK();
+}
 
-    // update database statistics
-    {
-        std::lock_guard<mutex> lock(body_->statsMutex);
-        body_->statsRq += accu;
-    }
+string BCFKeyValueData::ref_band_encoding_stats::str() const {
+    ostringstream os;
+    os << buckets << " buckets, " << records << " records (" << ref_bands
+       << " reference bands column-wise); plain " << plain_bytes << " bytes, scan "
+       << plain_scan_seconds << "s; columnar " << columnar_bytes << " bytes, scan "
+       << columnar_scan_seconds << "s, band summary " << summary_seconds << "s";
+    return os.str();
+}
 
+Status BCFKeyValueData::compare_ref_band_encoding(bool convert, ref_band_encoding_stats& stats) {
+    Status s;
+    stats = ref_band_encoding_stats();
+    vector<pair<string,size_t>> contigs;
+    S(this->contigs(contigs));
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection("bcf",coll));
+
+    auto elapsed = [](chrono::steady_clock::time_point t0) {
+        return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    };
+
+    auto pool = BCFRecordPool::ThreadLocal();
+    for (int rid = 0; rid < contigs.size(); rid++) {
+        shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(range(rid, 0, contigs[rid].second));
+        for (range bucket = bkExt->begin(); bucket <= bkExt->end(); bucket = bkExt->next()) {
+            string prefix = body_->rangeHelper->bucket_prefix(bucket);
+            unique_ptr<KeyValue::Iterator> it;
+            S(body_->db->iterator(coll, prefix, it));
+            unique_ptr<KeyValue::WriteBatch> writes;
+            for (; s.ok() && it->valid(); s = it->next()) {
+                string key_prefix, dataset;
+                S(body_->rangeHelper->parse_key(it->key().str(), key_prefix, dataset));
+                if (key_prefix != prefix) {
+                    break;
+                }
+                shared_ptr<const bcf_hdr_t> hdr;
+                S(dataset_header(dataset, &hdr));
+
+                // decode the bucket as stored, then re-encode it both ways
+                StatsRangeQuery srq;
+                vector<shared_ptr<bcf1_t>> records;
+                S(ScanBCFBucket(bucket, dataset, it->value(), hdr.get(), bucket, nullptr,
+                                BCF_RANGE_ALL, nullptr, true, srq, *pool, records));
+                BCFBucketWriter plain, columnar(hdr.get());
+                for (const auto& rec : records) {
+                    S(plain.add(rec.get()));
+                    S(columnar.add(rec.get()));
+                }
+                string plain_bytes, columnar_bytes;
+                S(plain.contents(plain_bytes));
+                S(columnar.contents(columnar_bytes));
+
+                stats.buckets++;
+                stats.records += records.size();
+                stats.plain_bytes += plain_bytes.size();
+                stats.columnar_bytes += columnar_bytes.size();
+
+                auto t0 = chrono::steady_clock::now();
+                records.clear();
+                S(ScanBCFBucket(bucket, dataset, KeyValue::Data(plain_bytes), hdr.get(), bucket,
+                                nullptr, BCF_RANGE_ALL, nullptr, true, srq, *pool, records));
+                stats.plain_scan_seconds += elapsed(t0);
+                t0 = chrono::steady_clock::now();
+                vector<shared_ptr<bcf1_t>> records2;
+                S(ScanBCFBucket(bucket, dataset, KeyValue::Data(columnar_bytes), hdr.get(), bucket,
+                                nullptr, BCF_RANGE_ALL, nullptr, true, srq, *pool, records2));
+                stats.columnar_scan_seconds += elapsed(t0);
+                if (records2.size() != records.size()) {
+                    return Status::Failure("BCFKeyValueData::compare_ref_band_encoding: record count mismatch",
+                                           dataset + "@" + bucket.str());
+                }
+                t0 = chrono::steady_clock::now();
+                vector<ref_band> bands;
+                S(SummarizeBCFBucketRefBands(bucket, dataset, KeyValue::Data(columnar_bytes),
+                                             hdr.get(), bucket, true, bands));
+                stats.summary_seconds += elapsed(t0);
+                {
+                    ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)columnar_bytes.data(), columnar_bytes.size() / sizeof(::capnp::word)));
+                    auto bucket_reader = message.getRoot<capnp::BCFBucket>();
+                    stats.ref_bands += records.size() - bucket_reader.getRecords().size();
+                }
+
+                if (convert) {
+                    if (!writes) {
+                        S(body_->db->begin_writes(writes));
+                    }
+                    S(writes->put(coll, it->key().str(), columnar_bytes));
+                }
+            }
+            if (s.bad()) return s;
+            if (writes) {
+                S(writes->commit());
+            }
+        }
+    }
     return Status::OK();
 }
 
@@ -578,6 +1196,8 @@ class BCFBucketIterator : public RangeBCFIterator {
 
     bool first_ = true;
     bcf_predicate predicate_;
+    unsigned flags_;
+    shared_ptr<const bcf_projection> projection_;
     bool include_danglers_ = true;
 
     range bucket_, query_;
@@ -655,7 +1275,8 @@ class BCFBucketIterator : public RangeBCFIterator {
 
         // extract the records overlapping query_
         s = ScanBCFBucket(bucket_, dataset, it_->value(), hdr.get(), query_, predicate_,
-                          include_danglers_, stats_, records);
+                          flags_, projection_.get(), include_danglers_, stats_, *BCFRecordPool::ThreadLocal(),
+                          records);
         if (s.ok()) {
             stats_.nBCFRecordsInRange += records.size();
         }
@@ -665,10 +1286,12 @@ class BCFBucketIterator : public RangeBCFIterator {
 public:
     BCFBucketIterator(BCFData& data, BCFKeyValueData_body& body, const range& query,
                       const range& bucket, const std::string& bucket_prefix,
-                      bcf_predicate predicate, bool include_danglers,
+                      bcf_predicate predicate, unsigned flags,
+                      const shared_ptr<const bcf_projection>& projection, bool include_danglers,
                       shared_ptr<const set<string>>& datasets,
                       const shared_ptr<KeyValue::Reader>& reader)
-        : data_(data), body_(body), predicate_(predicate), include_danglers_(include_danglers),
+        : data_(data), body_(body), predicate_(predicate), flags_(flags),
+          projection_(projection), include_danglers_(include_danglers),
           bucket_(bucket), query_(query), datasets_(datasets),
           dataset_(datasets->begin()), bucket_prefix_(bucket_prefix),
           reader_(reader) {}
@@ -696,25 +1319,131 @@ public:
     }
 };
 
+// For sample sets covering <10% of the samples in the database, whose
+// buckets are too sparse to scan with a KeyValue::Iterator: one iterator per
+// bucket, which looks up the bucket's keys for all the data sets with one
+// KeyValue::Reader::multi_get upon the first call to next(), instead of a
+// point lookup for each data set.
+class BCFBucketMultiGetIterator : public RangeBCFIterator {
+    BCFData& data_;
+    BCFKeyValueData_body& body_;
+
+    bcf_predicate predicate_;
+    unsigned flags_;
+    shared_ptr<const bcf_projection> projection_;
+    bool include_danglers_ = true;
+
+    range bucket_, query_;
+    shared_ptr<const set<string>> datasets_;
+    set<string>::const_iterator dataset_;
+    size_t dataset_index_ = 0;
+
+    shared_ptr<KeyValue::Reader> reader_;
+    bool fetched_ = false;
+    vector<Status> statuses_;
+    vector<shared_ptr<KeyValue::Data>> values_;
+
+    StatsRangeQuery stats_;
+
+    Status fetch() {
+        Status s;
+        KeyValue::CollectionHandle coll;
+        S(body_.db->collection("bcf",coll));
+        string bucket_prefix = body_.rangeHelper->bucket_prefix(bucket_);
+        vector<string> keys;
+        for (const auto& dataset : *datasets_) {
+            keys.push_back(body_.rangeHelper->bucket_key(bucket_prefix, dataset));
+        }
+        S(multi_get_buckets(*reader_, coll, keys, statuses_, values_, stats_));
+        fetched_ = true;
+        return Status::OK();
+    }
+
+    Status next_impl(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
+                     vector<shared_ptr<bcf1_t>>& records) {
+        Status s;
+        if (!fetched_) {
+            S(fetch());
+        }
+        dataset = *dataset_++;
+        size_t i = dataset_index_++;
+        S(data_.dataset_header(dataset, &hdr));
+
+        records.clear();
+        if (statuses_[i] == StatusCode::NOT_FOUND) {
+            // the data set has no records in this bucket
+            return Status::OK();
+        }
+        S(statuses_[i]);
+        s = ScanBCFBucket(bucket_, dataset, *values_[i], hdr.get(), query_, predicate_,
+                          flags_, projection_.get(), include_danglers_, stats_,
+                          *BCFRecordPool::ThreadLocal(), records);
+        values_[i].reset();
+        if (s.ok()) {
+            stats_.nBCFRecordsInRange += records.size();
+        }
+        return s;
+    }
+
+public:
+    BCFBucketMultiGetIterator(BCFData& data, BCFKeyValueData_body& body, const range& query,
+                              const range& bucket, bcf_predicate predicate, unsigned flags,
+                              const shared_ptr<const bcf_projection>& projection,
+                              bool include_danglers, shared_ptr<const set<string>>& datasets,
+                              const shared_ptr<KeyValue::Reader>& reader)
+        : data_(data), body_(body), predicate_(predicate), flags_(flags),
+          projection_(projection), include_danglers_(include_danglers),
+          bucket_(bucket), query_(query), datasets_(datasets),
+          dataset_(datasets->begin()), reader_(reader) {}
+
+    virtual ~BCFBucketMultiGetIterator() {
+        lock_guard<mutex> lock(body_.statsMutex);
+        body_.statsRq += stats_;
+    }
+
+    Status next(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
+                vector<shared_ptr<bcf1_t>>& records) override {
+        if (dataset_ == datasets_->end()) {
+            values_.clear();
+            return Status::NotFound();
+        }
+
+        Status s = next_impl(dataset, hdr, records);
+        if (s == StatusCode::NOT_FOUND) {
+            // censor NotFound errors so that the caller doesn't misinterpret
+            // them as normal EOF.
+            return Status::Failure("BCFBucketMultiGetIterator::next()", s.str());
+        }
+        return s;
+    }
+};
+
+// Heuristic: if the desired sample set has fewer than 10% of the samples in
+// the database, then look up their keys in each bucket instead of scanning
+// through it. This heuristic is wrong if the desired samples are actually
+// contiguous in the database, though.
+static Status lookup_buckets(const MetadataCache& metadata, const set<string>& samples, bool& ans) {
+    Status s;
+    size_t total_sample_count;
+    S(metadata.sample_count(total_sample_count));
+    ans = samples.size() == 1 || samples.size() * 10 < total_sample_count;
+    return Status::OK();
+}
+
 Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const string& sampleset,
                                         const range& pos, bcf_predicate predicate,
                                         shared_ptr<const set<string>>& samples,
                                         shared_ptr<const set<string>>& datasets,
-                                        vector<unique_ptr<RangeBCFIterator>>& iterators) {
+                                        vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                        unsigned flags,
+                                        const bcf_projection* projection) {
     Status s;
 
     // resolve samples and datasets
     S(metadata.sampleset_datasets(sampleset, samples, datasets));
 
-    // Heuristic: if the desired sample set has fewer than 10% of the samples
-    // in the database, then dispatch to the repeated-lookup strategy of
-    // sampleset_range_base. This heuristic is wrong if the desired samples
-    // are actually contiguous in the database, though.
-    size_t total_sample_count;
-    S(metadata.sample_count(total_sample_count));
-    if (samples->size() == 1 || samples->size() * 10 < total_sample_count) {
-        return sampleset_range_base(metadata, sampleset, pos, predicate, samples, datasets, iterators);
-    }
+    bool lookup;
+    S(lookup_buckets(metadata, *samples, lookup));
 
     // get a KeyValue::Reader so that all iterators read from the same
     // snapshot (this isn't strictly necessary since datasets are immutable,
@@ -723,12 +1452,24 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
     S(body_->db->current(ureader));
     shared_ptr<KeyValue::Reader> reader(move(ureader));
 
+    shared_ptr<const bcf_projection> projection_copy;
+    if (projection) {
+        projection_copy = make_shared<bcf_projection>(*projection);
+    }
+
     // create one iterator per bucket
     bool first = true;
     shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
     iterators.clear();
     for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
         assert(r.overlaps(pos));
+        if (lookup) {
+            iterators.push_back(make_unique<BCFBucketMultiGetIterator>
+                                (*this, *body_, pos, r, predicate, flags, projection_copy, first,
+                                 datasets, reader));
+            first = false;
+            continue;
+        }
         // Calculate the key prefix for this bucket. The BCFBucketIterator
         // object will use KeyValue::iterator() to position itself to scan all
         // keys with this prefix, stopping upon reaching a key with a
@@ -736,23 +1477,308 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
         string bucket = body_->rangeHelper->bucket_prefix(r);
 
         iterators.push_back(make_unique<BCFBucketIterator>
-                            (*this, *body_, pos, r, bucket, predicate, first, datasets, reader));
+                            (*this, *body_, pos, r, bucket, predicate, flags, projection_copy, first,
+                             datasets, reader));
         first = false;
     }
 
     return Status::OK();
 }
 
+// number of recently prefetched buckets to remember; consecutive genotyping
+// sites mostly lie in the same buckets
+static const size_t PREFETCH_RECENT_BUCKETS = 16;
+
+Status BCFKeyValueData::prefetch(const MetadataCache& metadata, const string& sampleset,
+                                 const range& pos) {
+    Status s;
+    shared_ptr<const set<string>> samples, datasets;
+    S(metadata.sampleset_datasets(sampleset, samples, datasets));
+    if (datasets->empty()) {
+        return Status::OK();
+    }
+    bool lookup;
+    S(lookup_buckets(metadata, *samples, lookup));
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection("bcf",coll));
+
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        string prefix = body_->rangeHelper->bucket_prefix(r);
+        {
+            lock_guard<mutex> lock(body_->prefetchMutex);
+            auto& recent = body_->prefetched;
+            if (find(recent.begin(), recent.end(), prefix) != recent.end()) {
+                continue;
+            }
+            recent.push_back(prefix);
+            if (recent.size() > PREFETCH_RECENT_BUCKETS) {
+                recent.pop_front();
+            }
+        }
+
+        // read the values as sampleset_range would, and drop them
+        if (lookup) {
+            vector<string> keys;
+            for (const auto& dataset : *datasets) {
+                keys.push_back(body_->rangeHelper->bucket_key(prefix, dataset));
+            }
+            vector<Status> statuses;
+            vector<shared_ptr<KeyValue::Data>> values;
+            S(body_->db->multi_get(coll, keys, statuses, values));
+            for (const auto& ls : statuses) {
+                if (ls.bad() && ls != StatusCode::NOT_FOUND) {
+                    return ls;
+                }
+            }
+        } else {
+            unique_ptr<KeyValue::Iterator> it;
+            S(body_->db->iterator(coll, body_->rangeHelper->bucket_key(prefix, *datasets->begin()), it));
+            for (; s.ok() && it->valid(); s = it->next()) {
+                if (it->key().size < BCFBucketRange::PREFIX_LENGTH ||
+                    memcmp(it->key().data, prefix.data(), BCFBucketRange::PREFIX_LENGTH) != 0) {
+                    break;
+                }
+                it->value();
+            }
+            S(s);
+        }
+    }
+    return Status::OK();
+}
+
+Status BCFKeyValueData::range_tiles(const range& pos, vector<range>& tiles) {
+    tiles.clear();
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        assert(r.overlaps(pos));
+        tiles.push_back(*r.intersect(pos));
+    }
+    if (tiles.empty()) {
+        tiles.push_back(pos);
+    }
+    return Status::OK();
+}
+
 // Provide a way to call the non-optimized base implementation of
 // sampleset_range. Mostly for unit testing.
 Status BCFKeyValueData::sampleset_range_base(const MetadataCache& metadata, const string& sampleset,
                                              const range& pos, bcf_predicate predicate,
                                              shared_ptr<const set<string>>& samples,
                                              shared_ptr<const set<string>>& datasets,
-                                             vector<unique_ptr<RangeBCFIterator>>& iterators) {
-    return BCFData::sampleset_range(metadata, sampleset, pos, predicate, samples, datasets, iterators);
+                                             vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                             unsigned flags,
+                                             const bcf_projection* projection) {
+    return BCFData::sampleset_range(metadata, sampleset, pos, predicate, samples, datasets, iterators, flags,
+                                    projection);
+}
+
+
+static void write_discovered_allele(const string& dna, const discovered_allele_info& ai,
+                                    capnp::DiscoveredAllele::Builder ans) {
+    ans.setDna(dna.c_str());
+    auto topAQ = ans.initTopAQ(top_AQ::COUNT);
+    for (unsigned i = 0; i < top_AQ::COUNT; i++) {
+        topAQ.set(i, ai.topAQ.V[i]);
+    }
+    auto zGQ = ans.initZygosityByGQ(zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY);
+    for (unsigned i = 0; i < zygosity_by_GQ::GQ_BANDS; i++) {
+        for (unsigned j = 0; j < zygosity_by_GQ::PLOIDY; j++) {
+            zGQ.set(i*zygosity_by_GQ::PLOIDY + j, ai.zGQ.M[i][j]);
+        }
+    }
+}
+
+static Status read_discovered_allele(capnp::DiscoveredAllele::Reader rdr, const range& rng,
+                                     bool is_ref, bool all_filtered,
+                                     vector<pair<allele,discovered_allele_info>>& ans) {
+    auto topAQ = rdr.getTopAQ();
+    auto zGQ = rdr.getZygosityByGQ();
+    if (topAQ.size() != top_AQ::COUNT ||
+        zGQ.size() != zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY) {
+        return Status::Failure("BCFKeyValueData: corrupt discovered-allele summary", rng.str());
+    }
+    discovered_allele_info ai;
+    ai.is_ref = is_ref;
+    ai.all_filtered = all_filtered;
+    for (unsigned i = 0; i < top_AQ::COUNT; i++) {
+        ai.topAQ.V[i] = topAQ[i];
+    }
+    for (unsigned i = 0; i < zygosity_by_GQ::GQ_BANDS; i++) {
+        for (unsigned j = 0; j < zygosity_by_GQ::PLOIDY; j++) {
+            ai.zGQ.M[i][j] = zGQ[i*zygosity_by_GQ::PLOIDY + j];
+        }
+    }
+    ans.push_back(make_pair(allele(rng, rdr.getDna().cStr()), ai));
+    return Status::OK();
+}
+
+// Summarize the alleles discovered in the bucket's variant records (see
+// DiscoverySummary in defs.capnp), over all of the data set's samples. A
+// record rejected by discover_alleles_from_record leaves the summary
+// incomplete, so that discovery scans the bucket and reports the error.
+static Status SummarizeBCFBucketDiscovery(const range& bucket, const string& dataset,
+                                          const string& data, const bcf_hdr_t* hdr,
+                                          string& ans) {
+    Status s;
+    vector<shared_ptr<bcf1_t>> records;
+    StatsRangeQuery srq;
+    const bcf_projection projection = discovery_projection();
+    S(ScanBCFBucket(bucket, dataset, KeyValue::Data(data), hdr, bucket, nullptr,
+                    BCF_RANGE_VARIANTS_ONLY, &projection, true, srq,
+                    *BCFRecordPool::ThreadLocal(), records));
+
+    vector<unsigned> samples(bcf_hdr_nsamples(hdr));
+    iota(samples.begin(), samples.end(), 0);
+    vector<pair<range,vector<pair<allele,discovered_allele_info>>>> summary;
+    bool complete = true;
+    for (const auto& record : records) {
+        vector<pair<allele,discovered_allele_info>> record_alleles;
+        if (discover_alleles_from_record(dataset, hdr, record.get(), samples, record_alleles).bad()) {
+            complete = false;
+            summary.clear();
+            break;
+        }
+        if (record_alleles.size() > 1) {
+            summary.push_back(make_pair(range(record.get()), move(record_alleles)));
+        }
+    }
+
+    ::capnp::MallocMessageBuilder b;
+    auto msg_b = b.initRoot<capnp::DiscoverySummary>();
+    msg_b.setComplete(complete);
+    auto records_b = msg_b.initRecords(summary.size());
+    for (size_t k = 0; k < summary.size(); k++) {
+        const auto& record_alleles = summary[k].second;
+        auto record_b = records_b[k];
+        record_b.setBeg(summary[k].first.beg);
+        record_b.setEnd(summary[k].first.end);
+        record_b.setAllFiltered(record_alleles[0].second.all_filtered);
+        write_discovered_allele(record_alleles[0].first.dna, record_alleles[0].second,
+                                record_b.initRef());
+        auto alts_b = record_b.initAlts(record_alleles.size() - 1);
+        for (size_t i = 1; i < record_alleles.size(); i++) {
+            write_discovered_allele(record_alleles[i].first.dna, record_alleles[i].second,
+                                    alts_b[i-1]);
+        }
+    }
+    auto msg_words = ::capnp::messageToFlatArray(b);
+    auto msg_bytes = msg_words.asBytes();
+    ans.assign((char*)msg_bytes.begin(), msg_bytes.size());
+    return Status::OK();
 }
 
+// Add the alleles from the bucket's summary for one data set to dsals, as
+// discover_alleles_from_iterator would from the records the bucket yields
+// for the query range. Sets complete to false, leaving dsals in an
+// unspecified state, if the summary is incomplete.
+static Status DiscoverFromBucketSummary(const range& bucket, const KeyValue::Data& data,
+                                        const range& query, bool include_danglers,
+                                        bool include_zero_copies, bool& complete,
+                                        discovered_alleles& dsals) {
+    #ifndef __x86_64__
+    if (uint64_t(data.data) % sizeof(::capnp::word)) {
+         return Status::Failure("DiscoverFromBucketSummary: input buffer isn't word-aligned");
+    }
+    #endif
+    try {
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data, data.size / sizeof(::capnp::word)));
+        capnp::DiscoverySummary::Reader summary = message.getRoot<capnp::DiscoverySummary>();
+        complete = summary.getComplete();
+        if (!complete) {
+            return Status::OK();
+        }
+        Status s;
+        vector<pair<allele,discovered_allele_info>> record_alleles;
+        for (const auto& record : summary.getRecords()) {
+            range rng(bucket.rid, record.getBeg(), record.getEnd());
+            // danglers from preceding buckets are yielded by the first
+            // bucket only, as in ScanBCFBucket
+            if (!rng.overlaps(query) || (!include_danglers && rng.beg < bucket.beg)) {
+                continue;
+            }
+            auto alts = record.getAlts();
+            record_alleles.clear();
+            S(read_discovered_allele(record.getRef(), rng, true, record.getAllFiltered(),
+                                     record_alleles));
+            for (const auto& alt : alts) {
+                S(read_discovered_allele(alt, rng, false, record.getAllFiltered(),
+                                         record_alleles));
+            }
+            discovered_alleles_of_record(record_alleles, query, include_zero_copies, dsals);
+        }
+    } catch (exception& exn) {
+        return Status::Failure("DiscoverFromBucketSummary: exception", exn.what());
+    }
+    return Status::OK();
+}
+
+Status BCFKeyValueData::sampleset_discover_alleles(const MetadataCache& metadata, const string& sampleset,
+                                                   const range& pos, bool include_zero_copies,
+                                                   unsigned& N, discovered_alleles& ans) {
+    Status s;
+    ans.clear();
+    N = 0;
+    if (!body_->discovery_coll) {
+        return Status::NotImplemented("database lacks discovered-allele summaries");
+    }
+    shared_ptr<const set<string>> samples, datasets;
+    S(metadata.sampleset_datasets(sampleset, samples, datasets));
+
+    // The summaries are over all of a data set's samples, so they can answer
+    // only if the sample set includes all the samples of each data set.
+    for (const auto& dataset : *datasets) {
+        shared_ptr<const bcf_hdr_t> hdr;
+        S(dataset_header(dataset, &hdr));
+        for (int i = 0; i < bcf_hdr_nsamples(hdr.get()); i++) {
+            if (samples->find(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, i)) == samples->end()) {
+                return Status::NotImplemented("sample set includes only some samples of data set", dataset);
+            }
+        }
+    }
+
+    StatsRangeQuery accu;
+    bool first = true;
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        string prefix = body_->rangeHelper->bucket_prefix(r);
+        vector<string> keys;
+        for (const auto& dataset : *datasets) {
+            keys.push_back(body_->rangeHelper->bucket_key(prefix, dataset));
+        }
+        vector<Status> statuses;
+        vector<shared_ptr<KeyValue::Data>> values;
+        S(multi_get_buckets(*body_->db, body_->discovery_coll, keys, statuses, values, accu));
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (statuses[i] == StatusCode::NOT_FOUND) {
+                continue;
+            }
+            S(statuses[i]);
+            // alleles repeated within a data set count once, as in
+            // discover_alleles_from_iterator; their records necessarily lie
+            // in the same bucket.
+            discovered_alleles dsals;
+            bool complete;
+            S(DiscoverFromBucketSummary(r, *values[i], pos, first, include_zero_copies,
+                                        complete, dsals));
+            if (!complete) {
+                ans.clear();
+                return Status::NotImplemented("data set lacks complete discovered-allele summary",
+                                              keys[i]);
+            }
+            S(merge_discovered_alleles(dsals, ans));
+            values[i].reset();
+        }
+        first = false;
+    }
+
+    {
+        std::lock_guard<mutex> lock(body_->statsMutex);
+        body_->statsRq += accu;
+    }
+    N = samples->size();
+    return Status::OK();
+}
 
 // Make sure that we the database doesn't already include these datasets and samples.
 static Status verify_dataset_and_samples(BCFKeyValueData_body *body_,
@@ -786,9 +1812,18 @@ static Status verify_dataset_and_samples(BCFKeyValueData_body *body_,
     return Status::OK();
 }
 
+// Where write_bucket stores the buckets: the records in the "bcf" collection
+// and, if the database has it, their discovered-allele summary (computed
+// using the header the records were parsed with)
+struct bucket_destination {
+    KeyValue::CollectionHandle coll_bcf;
+    KeyValue::CollectionHandle coll_discovery;
+    const bcf_hdr_t* hdr;
+};
+
 // Add a <key,value> pair to the database.
 // The key is a concatenation of the dataset name and the chromosome and genomic range.
-static Status write_bucket(BCFBucketRange& rangeHelper, BulkInsertBuffer& db, KeyValue::CollectionHandle& coll_bcf,
+static Status write_bucket(BCFBucketRange& rangeHelper, BulkInsertBuffer& db, const bucket_destination& dest,
                     const BCFBucketWriter& writer, unsigned int danglers, const string& dataset,
                     const range& rng,
                     BCFKeyValueData::import_result& rslt) {
@@ -803,7 +1838,12 @@ static Status write_bucket(BCFBucketRange& rangeHelper, BulkInsertBuffer& db, Ke
         S(writer.contents(data));
 
         // write to the database
-        S(db.put(coll_bcf, key, data));
+        S(db.put(dest.coll_bcf, key, data));
+        if (dest.coll_discovery) {
+            string summary;
+            S(SummarizeBCFBucketDiscovery(rng, dataset, data, dest.hdr, summary));
+            S(db.put(dest.coll_discovery, key, summary));
+        }
         assert(danglers <= writer.get_num_entries());
         rslt.add_bucket(writer.get_num_entries(), data.size(), danglers);
     } else {
@@ -869,12 +1909,13 @@ static Status write_danglers_to_in_mem_bucket(vector<shared_ptr<bcf1_t>> &dangle
 // and [next_bkt]
 static Status write_danglers_between(BCFBucketRange& rangeHelper,
                                      BulkInsertBuffer& db,
-                                     KeyValue::CollectionHandle& coll_bcf,
+                                     const bucket_destination& dest,
                                      const string& dataset,
                                      range &current_bkt,
                                      BCFKeyValueData::import_result& rslt,
                                      vector<shared_ptr<bcf1_t>> &danglers,
-                                     range &next_bkt) {
+                                     range &next_bkt,
+                                     const bcf_hdr_t* ref_bands_hdr) {
     Status s;
 
     // move to bucket K+1
@@ -888,7 +1929,7 @@ static Status write_danglers_between(BCFBucketRange& rangeHelper,
     // be needed.
     while (!danglers.empty() &&
            current < next_bkt) {
-        BCFBucketWriter writer;
+        BCFBucketWriter writer(ref_bands_hdr);
         for (const auto& dp : danglers) {
             if (range(dp.get()).overlaps(current)) {
                 CHECK_DANGLER_BUCKET(dp.get(), current);
@@ -896,7 +1937,7 @@ static Status write_danglers_between(BCFBucketRange& rangeHelper,
             }
         }
         if (writer.get_num_entries() > 0) {
-            S(write_bucket(rangeHelper, db, coll_bcf, writer, writer.get_num_entries(),
+            S(write_bucket(rangeHelper, db, dest, writer, writer.get_num_entries(),
                            dataset, current, rslt));
         }
         prune_danglers(danglers, current);
@@ -906,17 +1947,24 @@ static Status write_danglers_between(BCFBucketRange& rangeHelper,
     return Status::OK();
 }
 
+// Insert the gVCF records from src into buckets. If piece is given, src has
+// been positioned to read the records overlapping it (see
+// bulk_insert_gvcf_pieces), and we write only the buckets within it.
 static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
                                           MetadataCache& metadata,
-                                          KeyValue::DB* db,
+                                          BulkInsertBuffer& buffer,
+                                          KeyValue::CollectionHandle coll_bcf,
+                                          KeyValue::CollectionHandle coll_discovery,
                                           const string& dataset,
                                           const string& filename,
-                                          const set<range>& range_filter,
+                                          const vector<range>& range_filter,
+                                          const range* piece,
                                           const bcf_hdr_t *hdr,
-                                          vcfFile *vcf,
+                                          bool ref_band_columns,
+                                          GVCFRecordSource& src,
                                           BCFKeyValueData::import_result& rslt) {
     Status s;
-    BulkInsertBuffer buffer(*db);
+    RangeFilterCursor filter(range_filter);
     unique_ptr<bcf1_t, void(*)(bcf1_t*)> vt(bcf_init(), &bcf_destroy);
     int prev_pos = -1;
     int prev_rid = -1;
@@ -924,25 +1972,34 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
     unsigned int danglers_written_to_current_bucket = 0;
     // current bucket
     range bucket(-1, 0, rangeHelper.interval_len), last_range(-1,-1,-1);
-    BCFBucketWriter writer;
-
-    KeyValue::CollectionHandle coll_bcf;
-    S(db->collection("bcf", coll_bcf));
+    if (piece) {
+        // pretend we're coming from the bucket just before the piece, so
+        // that danglers from preceding records go into the piece's buckets
+        bucket = rangeHelper.bucket(piece->rid, piece->beg - 1);
+        assert(bucket.end == piece->beg);
+    }
+    const bcf_hdr_t* ref_bands_hdr = ref_band_columns ? hdr : nullptr;
+    BCFBucketWriter writer(ref_bands_hdr);
+    const bucket_destination dest = { coll_bcf, coll_discovery, hdr };
 
     // scan the BCF records
     int c;
-    for(c = bcf_read(vcf, hdr, vt.get());
+    for(c = src.read(vt.get());
         c == 0 && vt->errcode == 0;
-        c = bcf_read(vcf, hdr, vt.get())) {
+        c = src.read(vt.get())) {
         range vt_rng(vt.get());
         last_range = vt_rng;
-        if (!range_filter.empty()) {
-            // Test range filter if applicable. It would be nice to use a
-            // tabix index instead.
-            if (all_of(range_filter.begin(), range_filter.end(),
-                       [&vt_rng](const range& r) { return !r.overlaps(vt_rng); })) {
-                continue;
+        // Records starting before the piece belong to the preceding piece;
+        // here they only dangle into our buckets.
+        bool preceding = piece && vt->pos < piece->beg;
+        if (!preceding) {
+            rslt.records_read++;
+        }
+        if (!range_filter.empty() && !filter.overlaps(vt_rng)) {
+            if (!preceding) {
+                rslt.filtered_records++;
             }
+            continue;
         }
 
         // Check various aspects of the record's validity; e.g. make sure the
@@ -951,18 +2008,30 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
         bool skip_ingestion = false;
         S(validate_bcf(metadata.contigs(), filename, hdr, vt.get(), prev_rid, prev_pos, skip_ingestion));
         if (skip_ingestion) {
-            rslt.skipped_records++;
+            if (!preceding) {
+                rslt.skipped_records++;
+            }
+            continue;
+        }
+        if (preceding) {
+            if (vt_rng.end > piece->beg) {
+                auto dangler = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+                bcf_copy(dangler.get(), vt.get());
+                danglers.push_back(dangler);
+            }
+            prev_rid = vt->rid;
+            prev_pos = vt->pos;
             continue;
         }
 
         // should we start a new bucket?
         if (vt->rid != bucket.rid || vt->pos >= bucket.end) {
             // write old bucket K to DB
-            S(write_bucket(rangeHelper, buffer, coll_bcf, writer, danglers_written_to_current_bucket,
+            S(write_bucket(rangeHelper, buffer, dest, writer, danglers_written_to_current_bucket,
                            dataset, bucket, rslt));
             range next_bucket = rangeHelper.bucket(vt.get());
-            S(write_danglers_between(rangeHelper, buffer, coll_bcf, dataset, bucket, rslt,
-                                     danglers, next_bucket));
+            S(write_danglers_between(rangeHelper, buffer, dest, dataset, bucket, rslt,
+                                     danglers, next_bucket, ref_bands_hdr));
             bucket = next_bucket;
 
             // start a new in-memory chunk
@@ -996,22 +2065,305 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
     if (c != -1) return Status::IOError("reading from gVCF file", filename);
 
     // write out last bucket
-    S(write_bucket(rangeHelper, buffer, coll_bcf, writer, danglers_written_to_current_bucket,
+    S(write_bucket(rangeHelper, buffer, dest, writer, danglers_written_to_current_bucket,
                     dataset, bucket, rslt));
 
-    // write any last danglers
-    range end_bucket = rangeHelper.bucket_at_end_of_chrom(vt->rid, metadata.contigs());
-    S(write_danglers_between(rangeHelper, buffer, coll_bcf, dataset, bucket, rslt,
-                             danglers, end_bucket));
+    // write any last danglers, up to the end of the chromosome or, if there's
+    // a following piece, up to its first bucket
+    range end_bucket = rangeHelper.bucket_at_end_of_chrom(piece ? piece->rid : vt->rid, metadata.contigs());
+    if (piece && piece->end < metadata.contigs()[piece->rid].second) {
+        end_bucket = rangeHelper.bucket(piece->rid, piece->end);
+        assert(end_bucket.beg == piece->end);
+    }
+    S(write_danglers_between(rangeHelper, buffer, dest, dataset, bucket, rslt,
+                             danglers, end_bucket, ref_bands_hdr));
+
+    return Status::OK();
+}
+
+// Plan the index queries to read the gVCF records overlapping the (merged)
+// range filter, or all records if it's empty. If piece is given, plan instead
+// the queries for the records bulk_insert_gvcf_key_values needs for the
+// piece: those starting within it, and those starting before it but dangling
+// into it. Filter ranges separated by short gaps are read with one query,
+// since seeking costs about as much as reading through a few BGZF blocks.
+static const int IMPORT_SEEK_GAP = 65536;
+static vector<GVCFRecordSource::query> plan_gvcf_queries(MetadataCache& metadata,
+                                                         const vector<range>& range_filter,
+                                                         const range* piece) {
+    const int min_int = numeric_limits<int>::min(), max_int = numeric_limits<int>::max();
+    vector<GVCFRecordSource::query> ans;
+    range bounds(0, min_int, max_int);
+    if (piece) {
+        bounds = *piece;
+        if (bounds.end >= metadata.contigs()[piece->rid].second) {
+            // let the last piece pick up any records beyond the contig
+            // length, so that validate_bcf rejects them
+            bounds.end = max_int;
+        }
+        if (range_filter.empty()) {
+            ans.push_back({bounds, min_int, max_int});
+            return ans;
+        }
+        if (piece->beg > 0) {
+            // records dangling into the piece, which we don't otherwise get if
+            // the filter ranges they overlap lie before the piece
+            ans.push_back({range(piece->rid, piece->beg, piece->beg+1), min_int, piece->beg});
+        }
+    }
+    vector<range> main_queries;
+    for (const auto& r : range_filter) {
+        if (piece && r.rid != piece->rid) {
+            continue;
+        }
+        range q(r.rid, max(r.beg, bounds.beg), min(r.end, bounds.end));
+        if (q.beg < q.end) {
+            main_queries.push_back(q);
+        }
+    }
+    if (piece && bounds.end < max_int) {
+        // records starting within the piece and dangling out of it, which we
+        // don't otherwise get if the filter ranges they overlap lie after it
+        main_queries.push_back(range(piece->rid, bounds.end-1, bounds.end));
+    }
+    size_t first_main = ans.size();
+    for (const auto& q : main_queries) {
+        if (ans.size() > first_main && ans.back().rng.rid == q.rid &&
+            q.beg - ans.back().rng.end < IMPORT_SEEK_GAP) {
+            ans.back().rng.end = max(ans.back().rng.end, q.end);
+        } else {
+            // skip records which also overlapped the previous query
+            int min_pos = piece ? piece->beg : min_int;
+            if (ans.size() > first_main && ans.back().rng.rid == q.rid) {
+                min_pos = max(min_pos, ans.back().rng.end);
+            }
+            ans.push_back({q, min_pos, max_int});
+        }
+    }
+    return ans;
+}
+
+// Import an indexed gVCF in pieces on multiple executor threads. Each piece is a
+// bucket-aligned region of one contig, and it owns the buckets within that
+// region. The index query for a piece also returns records starting before
+// it, if they overlap it; those are written as regular records by the
+// preceding piece, and here they only seed the danglers list. So the buckets
+// come out exactly as they would from a sequential import.
+static Status bulk_insert_gvcf_pieces(BCFBucketRange& rangeHelper,
+                                      MetadataCache& metadata,
+                                      KeyValue::DB* db,
+                                      const string& dataset,
+                                      const string& filename,
+                                      const vector<range>& range_filter,
+                                      const BCFKeyValueData::import_options& opts,
+                                      const bcf_hdr_t *hdr,
+                                      const vector<range>& pieces,
+                                      BCFKeyValueData::import_result& rslt) {
+    Status s;
+    KeyValue::CollectionHandle coll_bcf;
+    S(db->collection("bcf", coll_bcf));
+    KeyValue::CollectionHandle coll_discovery = optional_collection(db, DISCOVERY_COLLECTION);
+
+    size_t nthreads = min(size_t(opts.threads), pieces.size());
+    vector<unique_ptr<BulkInsertBuffer>> buffers;
+    vector<BCFKeyValueData::import_result> results(nthreads);
+    vector<Status> statuses(nthreads);
+    for (size_t t = 0; t < nthreads; t++) {
+        buffers.emplace_back(new BulkInsertBuffer(*db, opts.sorted_runs));
+    }
+    atomic<size_t> next(0);
+
+    auto worker = [&](size_t t) {
+        Status s;
+        // each worker needs its own file handle & header copy (since parsing
+        // VCF text can modify the header)
+        unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                                   [](vcfFile* f) { bcf_close(f); });
+        if (!vcf) return Status::IOError("opening gVCF file", filename);
+        unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> whdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+        if (!whdr) return Status::IOError("reading gVCF header", filename);
+        GVCFRecordSource src(vcf.get(), whdr.get());
+        S(src.load_index(filename));
+
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+            S(src.seek(plan_gvcf_queries(metadata, range_filter, &pieces[i])));
+            S(bulk_insert_gvcf_key_values(rangeHelper, metadata, *buffers[t], coll_bcf, coll_discovery,
+                                          dataset, filename, range_filter, &pieces[i],
+                                          whdr.get(), opts.ref_band_columns, src, results[t]));
+        }
+        // parsing the records adds any fields they use which the header
+        // doesn't declare to the worker's copy, whose dictionaries then
+        // differ from those of the header stored for the data set
+        if (bcf_write_header(whdr.get()) != bcf_write_header(hdr)) {
+            return Status::Invalid("gVCF records use fields undeclared in its header; import it without intra-file parallelism",
+                                   filename);
+        }
+        return Status::OK();
+    };
+
+    // fork the workers on the executor, executing pending tasks while waiting
+    TaskGroup tasks(Executor::Shared());
+    for (size_t t = 0; t < nthreads; t++) {
+        tasks.run([&, t]() {
+            statuses[t] = worker(t);
+            if (!statuses[t].ok()) {
+                // stop the other workers early
+                next = pieces.size();
+            }
+        });
+    }
+    tasks.wait();
 
-    return buffer.flush();
+    for (const auto& ls : statuses) {
+        if (!ls.ok()) {
+            for (auto& buffer : buffers) {
+                buffer->discard();
+            }
+            return ls;
+        }
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        S(buffers[t]->flush());
+        rslt += results[t];
+    }
+    return Status::OK();
 }
 
+// Divide the indexed gVCF into pieces for bulk_insert_gvcf_pieces: regions of
+// whole buckets, up to IMPORT_PIECE_LEN long (unless one bucket is longer), on
+// each contig having any records.
+static const int IMPORT_PIECE_LEN = 10000000;
+static Status gvcf_import_pieces(BCFBucketRange& rangeHelper,
+                                 MetadataCache& metadata,
+                                 const GVCFRecordSource& src,
+                                 vector<range>& pieces) {
+    Status s;
+    vector<int> rids;
+    S(src.indexed_contigs(rids));
+    const auto& contigs = metadata.contigs();
+    pieces.clear();
+    for (int rid : rids) {
+        if (rid >= contigs.size()) {
+            return Status::Invalid("gVCF index refers to an unknown contig");
+        }
+        int contig_len = contigs[rid].second;
+        for (int beg = 0; beg < contig_len; ) {
+            range bucket = rangeHelper.bucket(rid, beg);
+            while (bucket.end < contig_len &&
+                   rangeHelper.inc_bucket(bucket).end - beg <= IMPORT_PIECE_LEN) {
+                bucket = rangeHelper.inc_bucket(bucket);
+            }
+            pieces.push_back(range(rid, beg, min(contig_len, bucket.end)));
+            beg = bucket.end;
+        }
+    }
+    return Status::OK();
+}
+
+Status BCFKeyValueData::PlanBucketBoundaries(const vector<pair<string,size_t>>& contigs,
+                                             const vector<string>& gvcfs,
+                                             int interval_len, bucket_boundaries& ans,
+                                             bucket_plan_stats& stats,
+                                             int window, int max_len_factor) {
+    if (interval_len <= 0 || window <= 0 || max_len_factor <= 0) {
+        return Status::Invalid("PlanBucketBoundaries: bad parameters");
+    }
+    ans.clear();
+    stats = bucket_plan_stats();
+    map<string,int> rids;
+    for (int rid = 0; rid < contigs.size(); rid++) {
+        rids[contigs[rid].first] = rid;
+    }
+
+    // density pre-pass: count the records overlapping each window of each
+    // contig, summed over the gVCFs
+    vector<vector<uint32_t>> density(contigs.size());
+    for (const auto& filename : gvcfs) {
+        unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                                   [](vcfFile* f) { bcf_close(f); });
+        if (!vcf) return Status::IOError("opening gVCF file", filename);
+        unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+        if (!hdr) return Status::IOError("reading gVCF header", filename);
+        unique_ptr<bcf1_t, void(*)(bcf1_t*)> vt(bcf_init(), &bcf_destroy);
+        int c;
+        while ((c = bcf_read(vcf.get(), hdr.get(), vt.get())) == 0 && vt->errcode == 0) {
+            auto p = rids.find(bcf_hdr_id2name(hdr.get(), vt->rid));
+            if (p == rids.end()) {
+                return Status::Invalid("gVCF contig isn't in the database",
+                                       filename + " " + bcf_hdr_id2name(hdr.get(), vt->rid));
+            }
+            auto& d = density[p->second];
+            if (d.empty()) {
+                d.resize(contigs[p->second].second / window + 1);
+            }
+            range rng(vt.get());
+            int w0 = max(0, rng.beg) / window, w1 = max(0, rng.end - 1) / window;
+            for (int w = w0; w <= w1 && w < d.size(); w++) {
+                d[w]++;
+            }
+            stats.records++;
+        }
+        if (vt->errcode != 0 || c != -1) {
+            return Status::IOError("reading from gVCF file", filename);
+        }
+    }
+
+    // aim for the mean records per uniform bucket
+    uint64_t total = 0;
+    for (int rid = 0; rid < contigs.size(); rid++) {
+        if (!density[rid].empty()) {
+            for (auto n : density[rid]) {
+                total += n;
+            }
+            stats.uniform_buckets += (contigs[rid].second + interval_len - 1) / interval_len;
+        }
+    }
+    if (total == 0) {
+        return Status::OK();
+    }
+    const double target = double(total) / stats.uniform_buckets;
+    stats.target_records = target / gvcfs.size();
+    const int64_t max_len = int64_t(max_len_factor) * interval_len;
+
+    // greedily divide each contig into buckets of whole windows
+    for (int rid = 0; rid < contigs.size(); rid++) {
+        const auto& d = density[rid];
+        if (d.empty()) {
+            continue;
+        }
+        const int64_t contig_len = contigs[rid].second;
+        vector<int> b = {0};
+        uint64_t n = 0;
+        for (int w = 0; w < d.size(); w++) {
+            int64_t end = min(contig_len, int64_t(w+1) * window);
+            n += d[w];
+            if (end >= contig_len) {
+                break;
+            }
+            if (n >= target || end + window - b.back() > max_len) {
+                b.push_back(end);
+                n = 0;
+            }
+        }
+        if (b.back() < contig_len) {
+            // the bucket ending at the contig's end (beyond which buckets
+            // revert to the uniform length)
+            b.push_back(contig_len);
+        }
+        stats.buckets += b.size() - 1;
+        ans[contigs[rid].first] = move(b);
+    }
+    return Status::OK();
+}
 
 // Temporary notes on DB schema, to be moved over to wiki.
 //
 //  dataset -> header
 //       for each dataset, there is a header stored
+//  header_body -> header body
+//       headers less their samples, keyed by content hash and shared among
+//       the datasets with the same one; a dataset's header then stores just
+//       its samples and the key of its body (see intern_header)
 //  sample -> dataset
 //       mapping from sample to dataset, each dataset can store multiple samples.
 //
@@ -1020,6 +2372,7 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
                                 const string& dataset,
                                 const string& filename,
                                 const set<range>& range_filter,
+                                const BCFKeyValueData::import_options& opts,
                                 BCFKeyValueData::import_result& rslt) {
     Status s;
     unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
@@ -1054,17 +2407,49 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
     // bulk insert, non atomic
     //
     // Note: we are not dealing at all with mid-flight failures
-    S(bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
-                                  dataset, filename, range_filter,
-                                  hdr.get(), vcf.get(), rslt));
+    vector<range> merged_filter = merge_range_filter(range_filter);
+    GVCFRecordSource src(vcf.get(), hdr.get());
+    vector<range> pieces;
+    if (opts.threads > 1 || !merged_filter.empty()) {
+        Status ls = src.load_index(filename);
+        if (ls != StatusCode::NOT_FOUND) {
+            S(ls);
+        }
+    }
+    if (opts.threads > 1 && src.indexed()) {
+        S(gvcf_import_pieces(*body_->rangeHelper, metadata, src, pieces));
+    }
+    if (pieces.size() > 1) {
+        S(bulk_insert_gvcf_pieces(*body_->rangeHelper, metadata, body_->db,
+                                  dataset, filename, merged_filter, opts,
+                                  hdr.get(), pieces, rslt));
+    } else {
+        if (!merged_filter.empty() && src.indexed()) {
+            // seek to the filter ranges instead of reading the whole file
+            S(src.seek(plan_gvcf_queries(metadata, merged_filter, nullptr)));
+        }
+        KeyValue::CollectionHandle coll_bcf;
+        S(body_->db->collection("bcf", coll_bcf));
+        BulkInsertBuffer buffer(*body_->db, opts.sorted_runs);
+        s = bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, buffer, coll_bcf,
+                                        body_->discovery_coll,
+                                        dataset, filename, merged_filter, nullptr,
+                                        hdr.get(), opts.ref_band_columns, src, rslt);
+        if (!s.ok()) {
+            buffer.discard();
+            return s;
+        }
+        S(buffer.flush());
+    }
 
     // Update metadata atomically, now it will point to all the data
     Status retval = Status::Invalid();
     {
         std::lock_guard<std::mutex> lock(body_->mutex);
 
-        // Serialize header into a string
-        string hdr_data = bcf_write_header(hdr.get());
+        // Serialize header into a string, interning its body if possible
+        string hdr_data, body_key, body_data;
+        S(intern_header(body_, hdr.get(), hdr_data, body_key, body_data));
 
         // Get collection handles and current * sample set version number
         KeyValue::CollectionHandle coll_header, coll_sample_dataset, coll_sampleset;
@@ -1079,6 +2464,9 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
         unique_ptr<KeyValue::WriteBatch> wb;
         S(body_->db->begin_writes(wb));
         S(wb->put(coll_header, dataset, hdr_data));
+        if (!body_key.empty()) {
+            S(wb->put(body_->header_body_coll, body_key, body_data));
+        }
         for (const auto& sample : rslt.samples) {
             // place an entry for this sample in the special "*" sample set
             S(wb->put(coll_sample_dataset, sample, dataset));
@@ -1106,6 +2494,7 @@ Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
                                     const string& dataset,
                                     const string& filename,
                                     const set<range>& range_filter,
+                                    const import_options& opts,
                                     import_result& rslt) {
     rslt = import_result(); // hygiene
 
@@ -1118,6 +2507,7 @@ Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
                                  dataset,
                                  filename,
                                  range_filter,
+                                 opts,
                                  rslt);
 
     if (!s.ok()) {
@@ -1,11 +1,14 @@
 // Helper code for BCFKeyValueData.cc
 
+#include <limits>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <defs.capnp.h>
 #include "KeyValue.h"
 #include "BCFSerialize.h"
 #include "BCF_utils.h"
+#include "data.h"
+#include "tbx.h"
 
 const uint64_t MAX_NUM_CONTIGS_PER_GVCF = 16777216; // 3 bytes wide
 const uint64_t MAX_CONTIG_LEN = 1099511627776;      // 5 bytes wide
@@ -13,45 +16,32 @@ const uint64_t MAX_RECORD_LEN = 100000;
 
 namespace GLnexus {
 
+class BCFBucketRange;
+
 // Memory efficient representation of a bucket range. This could
 // be turned into a standard C++ iterator, although, that might be
 // a bit of an overkill.
 class BucketExtent {
 private:
-    int rid_ = 0;
-    int step_ = 0;
-    int bgn_ = 0;
-    int end_ = 0;
-    int current_ = 0;
+    const BCFBucketRange& helper_;
+    range first_, last_, current_;
 
     // disable copy and assignment constructors
     BucketExtent(const BucketExtent&);
     BucketExtent& operator=(const BucketExtent&);
 
 public:
-    BucketExtent(const range &query, int interval_len) {
-        rid_ = query.rid;
-        step_ = interval_len;
-        bgn_ = (query.beg / interval_len) * interval_len;
-        end_ = std::max(bgn_, ((query.end-1) / interval_len) * interval_len);
-        current_ = 0;
-    }
+    inline BucketExtent(const BCFBucketRange& helper, const range &query);
 
     range begin() {
-        range r = range(rid_, bgn_, bgn_ + step_);
-        current_ = bgn_;
-        return r;
+        current_ = first_;
+        return current_;
     }
 
-    range next() {
-        current_ += step_;
-        range r = range(rid_, current_, current_ + step_);
-        return r;
-    }
+    inline range next();
 
     range end() {
-        range r = range(rid_, end_, end_ + step_);
-        return r;
+        return last_;
     }
 };
 
@@ -60,6 +50,11 @@ public:
 // is placed in a bucket based on its start position.
 // It could start in one bucket, and extend into an adjacent bucket(s).
 //
+// Buckets are interval_len long, unless the database has a boundary map for
+// the contig (see BCFKeyValueData::bucket_boundaries): then bucket i spans
+// [boundaries[i], boundaries[i+1]), and any buckets beyond the last boundary
+// are interval_len long again.
+//
 // This class separates out the logic for answering the following questions:
 //   1) Which buckets should I scan for this query range?
 //   2) Which bucket does a bcf1_t with this range go into?
@@ -69,12 +64,21 @@ private:
     BCFBucketRange(const BCFBucketRange&);
     BCFBucketRange& operator=(const BCFBucketRange&);
 
+    // bucket begin positions for each contig (by rid); empty for uniform
+    // buckets
+    std::vector<std::vector<int>> boundaries_;
+
 public:
     static const size_t PREFIX_LENGTH = 8;
+    // Key prefix length used to shard sorted runs for bulk ingestion: the
+    // contig and the top 16 bits of the bucket position, i.e. ~16Mbp windows
+    static const size_t SHARD_LENGTH = 5;
     int interval_len;
 
     // constructor
-    BCFBucketRange(int interval_len) : interval_len(interval_len) {};
+    BCFBucketRange(int interval_len,
+                   std::vector<std::vector<int>> boundaries = {})
+        : boundaries_(std::move(boundaries)), interval_len(interval_len) {};
 
     // Given the range of a bucket, produce the key prefix for the bucket.
     // Important: the range must be exactly that of the bucket.
@@ -119,30 +123,443 @@ public:
     // more buckets to search through in order to find all records overlapping
     // query. This may be multiple buckets, even for small query ranges, to
     // account for the possibility of records spanning multiple buckets.
-    std::shared_ptr<BucketExtent> scan(const range& query) {
-        return make_shared<BucketExtent>(query, interval_len);
+    std::shared_ptr<BucketExtent> scan(const range& query) const {
+        return make_shared<BucketExtent>(*this, query);
+    }
+
+    // Which bucket does position [pos] of contig [rid] lie in?
+    range bucket(int rid, int pos) const {
+        int base = 0;
+        if (rid >= 0 && rid < boundaries_.size() && !boundaries_[rid].empty()) {
+            const auto& b = boundaries_[rid];
+            assert(b[0] == 0);
+            auto it = upper_bound(b.begin(), b.end(), pos);
+            if (it != b.begin() && it != b.end()) {
+                return range(rid, *(it-1), *it);
+            }
+            if (it == b.end()) {
+                base = b.back();
+            }
+        }
+        // floor division, for the negative positions preceding a contig
+        int bgn = pos - base >= 0 ? (pos - base) / interval_len
+                                  : -((base - pos + interval_len - 1) / interval_len);
+        bgn = base + bgn * interval_len;
+        return range(rid, bgn, bgn + interval_len);
     }
 
     // Which bucket does this BCF record start in?
-    range bucket(bcf1_t *rec) {
-        int bgn = (rec->pos / interval_len) * interval_len;
-        return range(rec->rid, bgn, bgn + interval_len);
+    range bucket(bcf1_t *rec) const {
+        return bucket(rec->rid, rec->pos);
     }
     // The bucket after [rng], assuming [rng] is a bucket.
-    range inc_bucket(range &rng) {
-        assert((rng.end - rng.beg) == interval_len);
-        return range(rng.rid,
-                     rng.beg + interval_len,
-                     rng.end + interval_len);
+    range inc_bucket(const range &rng) const {
+        assert(bucket(rng.rid, rng.beg) == rng);
+        return bucket(rng.rid, rng.end);
     }
 
     // Create a ficticious bucket marking the end of a chromosome.
     range bucket_at_end_of_chrom(int rid,
-                                 const std::vector<std::pair<std::string,size_t> >&contigs) {
-        //const string &contig_name = contigs[rid].first;
+                                 const std::vector<std::pair<std::string,size_t> >&contigs) const {
         size_t contig_len = contigs[rid].second;
-        int bgn = ((contig_len / interval_len) + 2) * interval_len;
-        return range(rid, bgn, bgn + interval_len);
+        return inc_bucket(inc_bucket(bucket(rid, contig_len)));
+    }
+};
+
+BucketExtent::BucketExtent(const BCFBucketRange& helper, const range &query)
+    : helper_(helper),
+      first_(helper.bucket(query.rid, query.beg)),
+      last_(helper.bucket(query.rid, std::max(query.beg, query.end-1))),
+      current_(first_) {}
+
+range BucketExtent::next() {
+    current_ = helper_.inc_bucket(current_);
+    return current_;
+}
+
+// Columnar storage of gVCF reference bands. Reference confidence records
+// dominate the size of a typical gVCF, yet from one band to the next only the
+// position, the REF base and a few FORMAT values (GQ, MIN_DP, DP, PL) tend to
+// change. RefBandEncoder finds such bands among a bucket's records: each is
+// stored as a reference to a template record (another band, packed verbatim)
+// plus its values for the template's variable 'slots', in run-length encoded
+// columns. RefBandDecoder synthesizes the exact original record by patching
+// the slots of a copy of the template, or answers questions about the bands'
+// extents and depth/GQ directly from the columns. Bands not matching a
+// template byte-for-byte outside its slots are left in the bucket's records.
+
+enum RefBandColumn { REF_BASE, GQ, MIN_DP, DP, PL0, PL1, PL2, N_REF_BAND_COLUMNS };
+
+// sign-extend a BCF integer of the given width, widening the missing and
+// vector-end sentinels to their 32-bit equivalents
+static inline int32_t ref_band_get_int(const uint8_t* p, int width) {
+    switch (width) {
+        case 1: {
+            int8_t x = *(const int8_t*)p;
+            return x == bcf_int8_missing ? bcf_int32_missing : (x == bcf_int8_vector_end ? bcf_int32_vector_end : x);
+        }
+        case 2: {
+            int16_t x;
+            memcpy(&x, p, 2);
+            return x == bcf_int16_missing ? bcf_int32_missing : (x == bcf_int16_vector_end ? bcf_int32_vector_end : x);
+        }
+    }
+    int32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static inline void ref_band_put_int(uint8_t* p, int width, int32_t x) {
+    switch (width) {
+        case 1: {
+            int8_t y = x == bcf_int32_missing ? bcf_int8_missing : (x == bcf_int32_vector_end ? bcf_int8_vector_end : x);
+            *(int8_t*)p = y;
+            return;
+        }
+        case 2: {
+            int16_t y = x == bcf_int32_missing ? bcf_int16_missing : (x == bcf_int32_vector_end ? bcf_int16_vector_end : x);
+            memcpy(p, &y, 2);
+            return;
+        }
+    }
+    memcpy(p, &x, 4);
+}
+
+class RLEColumnWriter {
+    vector<int32_t> values_;
+    vector<uint32_t> runs_;
+
+public:
+    void push_back(int32_t x) {
+        if (!values_.empty() && values_.back() == x) {
+            runs_.back()++;
+        } else {
+            values_.push_back(x);
+            runs_.push_back(1);
+        }
+    }
+
+    void write(capnp::RLEColumn::Builder b) const {
+        auto values_b = b.initValues(values_.size());
+        auto runs_b = b.initRuns(runs_.size());
+        for (size_t i = 0; i < values_.size(); i++) {
+            values_b.set(i, values_[i]);
+            runs_b.set(i, runs_[i]);
+        }
+    }
+};
+
+static Status decode_rle_column(const capnp::RLEColumn::Reader& col, size_t n, vector<int32_t>& ans) {
+    ans.clear();
+    ans.reserve(n);
+    auto values = col.getValues();
+    auto runs = col.getRuns();
+    if (values.size() != runs.size()) {
+        return Status::Invalid("BCF bucket: malformed run-length encoded column");
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        if (ans.size() + runs[i] > n) {
+            return Status::Invalid("BCF bucket: run-length encoded column too long");
+        }
+        ans.insert(ans.end(), runs[i], values[i]);
+    }
+    if (ans.size() != n) {
+        return Status::Invalid("BCF bucket: run-length encoded column too short");
+    }
+    return Status::OK();
+}
+
+class RefBandEncoder {
+    struct slot {
+        int offset, width, column;
+    };
+    struct band_template {
+        const vector<uint8_t>* record;
+        vector<slot> slots;
+        int end_offset = -1, end_width = 0;
+        // sorted, disjoint byte intervals which may differ between the
+        // template and its bands
+        vector<pair<int,int>> variable;
+    };
+
+    // header dictionary IDs of END and the FORMAT fields
+    int end_id_, format_ids_[N_REF_BAND_COLUMNS];
+    vector<band_template> templates_;
+
+    size_t n_bands_ = 0;
+    int last_end_ = 0;
+    uint32_t last_preceding_ = 0;
+    RLEColumnWriter template_, beg_delta_, length_, preceding_, columns_[N_REF_BAND_COLUMNS];
+
+    bool make_template(const vector<uint8_t>& rec, band_template& ans) const {
+        bcf_raw_layout layout;
+        uint32_t n_sample;
+        memcpy(&n_sample, &rec[28], 4);
+        if ((n_sample & 0xffffff) != 1 || bcf_raw_parse_layout(rec.data(), rec.size(), layout).bad()) {
+            return false;
+        }
+        if (layout.ref.type != BCF_BT_CHAR || layout.ref.count != 1) {
+            return false;
+        }
+        ans.slots.clear();
+        ans.slots.push_back({layout.ref.offset, 1, REF_BASE});
+
+        auto is_int = [](const bcf_raw_field& fld, int count) {
+            return fld.count == count &&
+                   (fld.type == BCF_BT_INT8 || fld.type == BCF_BT_INT16 || fld.type == BCF_BT_INT32);
+        };
+        ans.end_offset = -1;
+        auto end = layout.info.find(end_id_);
+        if (end != layout.info.end()) {
+            if (!is_int(end->second, 1)) {
+                return false;
+            }
+            ans.end_offset = end->second.offset;
+            ans.end_width = end->second.width;
+        }
+        for (int c = GQ; c <= PL0; c++) {
+            if (format_ids_[c] < 0) continue;
+            auto fld = layout.format.find(format_ids_[c]);
+            int count = c == PL0 ? 3 : 1;
+            if (fld != layout.format.end() && is_int(fld->second, count)) {
+                for (int k = 0; k < count; k++) {
+                    ans.slots.push_back({fld->second.offset + k*fld->second.width, fld->second.width, c+k});
+                }
+            }
+        }
+
+        ans.variable.clear();
+        ans.variable.push_back(make_pair(12, 20)); // pos & rlen
+        if (ans.end_offset >= 0) {
+            ans.variable.push_back(make_pair(ans.end_offset, ans.end_offset + ans.end_width));
+        }
+        for (const auto& sl : ans.slots) {
+            ans.variable.push_back(make_pair(sl.offset, sl.offset + sl.width));
+        }
+        sort(ans.variable.begin(), ans.variable.end());
+        ans.record = &rec;
+        return true;
+    }
+
+    bool matches(const band_template& t, const vector<uint8_t>& rec, const range& rng) const {
+        const vector<uint8_t>& trec = *t.record;
+        if (rec.size() != trec.size()) {
+            return false;
+        }
+        int pos = 0;
+        for (const auto& v : t.variable) {
+            if (memcmp(&rec[pos], &trec[pos], v.first - pos) != 0) {
+                return false;
+            }
+            pos = v.second;
+        }
+        if (memcmp(&rec[pos], &trec[pos], rec.size() - pos) != 0) {
+            return false;
+        }
+        // END must agree with the record's extent, as we don't store it
+        return t.end_offset < 0 || ref_band_get_int(&rec[t.end_offset], t.end_width) == rng.end;
+    }
+
+public:
+    // Upper bound on templates per bucket, keeping the search for a matching
+    // template cheap
+    static const size_t MAX_TEMPLATES = 8;
+
+    RefBandEncoder(const bcf_hdr_t* hdr) {
+        end_id_ = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+        for (int c = 0; c < N_REF_BAND_COLUMNS; c++) {
+            format_ids_[c] = -1;
+        }
+        format_ids_[GQ] = bcf_hdr_id2int(hdr, BCF_DT_ID, "GQ");
+        format_ids_[MIN_DP] = bcf_hdr_id2int(hdr, BCF_DT_ID, "MIN_DP");
+        format_ids_[DP] = bcf_hdr_id2int(hdr, BCF_DT_ID, "DP");
+        format_ids_[PL0] = bcf_hdr_id2int(hdr, BCF_DT_ID, "PL");
+    }
+
+    // Try to encode the packed reference band rec, which followed the first
+    // [preceding] records left in the bucket. Bands must be added in order,
+    // and rec must outlive the encoder. Returns false if the band isn't
+    // suitable, in which case the caller should keep it as a record.
+    bool add(const vector<uint8_t>& rec, const range& rng, uint32_t preceding) {
+        if (rng.beg < last_end_ || preceding < last_preceding_) {
+            // overlapping bands would need negative deltas; rare enough
+            return false;
+        }
+        size_t t = 0;
+        for (; t < templates_.size(); t++) {
+            if (matches(templates_[t], rec, rng)) break;
+        }
+        if (t == templates_.size()) {
+            band_template bt;
+            if (templates_.size() >= MAX_TEMPLATES || !make_template(rec, bt) || !matches(bt, rec, rng)) {
+                return false;
+            }
+            templates_.push_back(move(bt));
+        }
+
+        const band_template& bt = templates_[t];
+        int32_t values[N_REF_BAND_COLUMNS];
+        for (int c = 0; c < N_REF_BAND_COLUMNS; c++) {
+            values[c] = bcf_int32_missing;
+        }
+        for (const auto& sl : bt.slots) {
+            values[sl.column] = ref_band_get_int(&rec[sl.offset], sl.width);
+        }
+        template_.push_back(t);
+        beg_delta_.push_back(rng.beg - last_end_);
+        length_.push_back(rng.size());
+        preceding_.push_back(preceding - last_preceding_);
+        for (int c = 0; c < N_REF_BAND_COLUMNS; c++) {
+            columns_[c].push_back(values[c]);
+        }
+        last_end_ = rng.end;
+        last_preceding_ = preceding;
+        n_bands_++;
+        return true;
+    }
+
+    size_t size() const {
+        return n_bands_;
+    }
+
+    void write(capnp::BCFRefBands::Builder b) const {
+        auto templates_b = b.initTemplates(templates_.size());
+        for (size_t t = 0; t < templates_.size(); t++) {
+            const auto& bt = templates_[t];
+            templates_b[t].setRecord(kj::arrayPtr((kj::byte*) bt.record->data(), bt.record->size()));
+            auto slots_b = templates_b[t].initSlots(bt.slots.size());
+            for (size_t i = 0; i < bt.slots.size(); i++) {
+                slots_b[i].setOffset(bt.slots[i].offset);
+                slots_b[i].setWidth(bt.slots[i].width);
+                slots_b[i].setColumn(bt.slots[i].column);
+            }
+            templates_b[t].setEndOffset(bt.end_offset);
+            templates_b[t].setEndWidth(bt.end_width);
+        }
+        template_.write(b.initBandTemplate());
+        beg_delta_.write(b.initBegDelta());
+        length_.write(b.initLength());
+        preceding_.write(b.initPrecedingRecords());
+        auto columns_b = b.initColumns(N_REF_BAND_COLUMNS);
+        for (int c = 0; c < N_REF_BAND_COLUMNS; c++) {
+            columns_[c].write(columns_b[c]);
+        }
+    }
+};
+
+class RefBandDecoder {
+    capnp::BCFRefBands::Reader bands_;
+    int rid_ = -1;
+    size_t n_ = 0;
+    vector<int32_t> template_, beg_, end_, preceding_, columns_[N_REF_BAND_COLUMNS];
+    vector<int8_t> template_hom_ref_; // -1 until determined
+    string buf_;
+
+public:
+    RefBandDecoder(const capnp::BCFRefBands::Reader& bands) : bands_(bands) {}
+
+    // Decode the columns of the bucket's bands, which lie on contig rid
+    Status load(int rid) {
+        Status s;
+        rid_ = rid;
+        uint64_t n = 0;
+        for (auto run : bands_.getLength().getRuns()) {
+            n += run;
+        }
+        n_ = n;
+        S(decode_rle_column(bands_.getBandTemplate(), n_, template_));
+        S(decode_rle_column(bands_.getBegDelta(), n_, beg_));
+        S(decode_rle_column(bands_.getLength(), n_, end_));
+        S(decode_rle_column(bands_.getPrecedingRecords(), n_, preceding_));
+        template_hom_ref_.assign(bands_.getTemplates().size(), -1);
+        auto columns = bands_.getColumns();
+        if (columns.size() < N_REF_BAND_COLUMNS) {
+            return Status::Invalid("BCF bucket: reference band columns missing");
+        }
+        for (int c = 0; c < N_REF_BAND_COLUMNS; c++) {
+            S(decode_rle_column(columns[c], n_, columns_[c]));
+        }
+        int32_t last_end = 0, preceding = 0;
+        for (size_t i = 0; i < n_; i++) {
+            beg_[i] += last_end;
+            end_[i] += beg_[i];
+            last_end = end_[i];
+            preceding += preceding_[i];
+            preceding_[i] = preceding;
+            if (template_[i] < 0 || template_[i] >= bands_.getTemplates().size()) {
+                return Status::Invalid("BCF bucket: invalid reference band template");
+            }
+        }
+        return Status::OK();
+    }
+
+    size_t size() const { return n_; }
+    range band_range(size_t i) const { return range(rid_, beg_[i], end_[i]); }
+    // index of the first band ending after pos (the bands don't overlap, so
+    // their ends are ascending)
+    size_t first_ending_after(int pos) const {
+        return upper_bound(end_.begin(), end_.end(), pos) - end_.begin();
+    }
+    // number of the bucket's records which preceded the band
+    uint32_t preceding_records(size_t i) const { return preceding_[i]; }
+    // the band's value of the column (bcf_int32_missing if it has none)
+    int32_t value(size_t i, RefBandColumn c) const { return columns_[c][i]; }
+
+    // Synthesize band i as a packed BCF record, valid until the next call
+    Status synthesize_raw(size_t i, const uint8_t*& ans, size_t& len) {
+        auto t = bands_.getTemplates()[template_[i]];
+        auto rec = t.getRecord();
+        buf_.assign((const char*) rec.begin(), rec.size());
+        uint8_t* p = (uint8_t*) &buf_[0];
+        if (buf_.size() < 32) {
+            return Status::Invalid("BCF bucket: malformed reference band template");
+        }
+        int32_t pos = beg_[i], rlen = end_[i] - beg_[i];
+        memcpy(p + 12, &pos, 4);
+        memcpy(p + 16, &rlen, 4);
+        if (t.getEndOffset() >= 0) {
+            if (t.getEndOffset() + t.getEndWidth() > buf_.size()) {
+                return Status::Invalid("BCF bucket: malformed reference band template");
+            }
+            ref_band_put_int(p + t.getEndOffset(), t.getEndWidth(), end_[i]);
+        }
+        for (auto sl : t.getSlots()) {
+            if (sl.getOffset() + sl.getWidth() > buf_.size() || sl.getColumn() >= N_REF_BAND_COLUMNS) {
+                return Status::Invalid("BCF bucket: malformed reference band template");
+            }
+            ref_band_put_int(p + sl.getOffset(), sl.getWidth(), columns_[sl.getColumn()][i]);
+        }
+        ans = p;
+        len = buf_.size();
+        return Status::OK();
+    }
+
+    // Synthesize band i as a BCF record
+    Status synthesize(size_t i, bcf1_t* ans) {
+        Status s;
+        const uint8_t* buf = nullptr;
+        size_t len = 0;
+        S(synthesize_raw(i, buf, len));
+        int bytes_read = -1;
+        return bcf_raw_read_from_mem(buf, 0, len, ans, bytes_read);
+    }
+
+    // Whether band i's GT is 0/0, which it shares with its template (decoded
+    // once per bucket)
+    Status template_hom_ref(size_t i, const bcf_hdr_t* hdr, bool& ans) {
+        Status s;
+        int8_t& known = template_hom_ref_[template_[i]];
+        if (known < 0) {
+            auto pool = BCFRecordPool::ThreadLocal();
+            auto vt = pool->get_unique();
+            S(synthesize(i, vt.get()));
+            if (bcf_unpack(vt.get(), BCF_UN_ALL) != 0 || vt->errcode != 0) {
+                return Status::IOError("BCF bucket: reference band template bcf_unpack");
+            }
+            known = BCFData::ref_band::of_record(hdr, vt.get()).hom_ref ? 1 : 0;
+        }
+        ans = known == 1;
+        return Status::OK();
     }
 };
 
@@ -152,29 +569,44 @@ public:
 //
 // Range queries within the bucket may be performed by a linear scan of the
 // records. Such a scan can be truncated upon seeing a record whose beg is
-// greater than the end of the query range. For further optimization, we
-// save a "skip index" along with the list of records. An entry in the skip
-// index has an index into the list of records, and the position.beg of the
-// corresponding record. A record may be represented in the skip index
-// only if no preceding records in the bucket overlap it. Given this, the
-// scan can begin at the index indicated by the last skip index entry whose
-// beg is <= the query beg, thus 'skipping' the preceding records.
+// greater than the end of the query range. To know where to begin, we save
+// an interval index along with the list of records: the running maximum of
+// their end positions. The scan begins at the first record whose running
+// maximum exceeds the query beg, as no record before it can overlap the
+// query. (Buckets of format version 0 instead have a "skip index" of
+// records which no preceding record overlaps, every 10th at most; one long
+// record near the beginning of the bucket thus defeated it.)
+//
+// The bucket also lists the indices of its gVCF variant records, so that
+// queries interested only in those (e.g. allele discovery) needn't decode the
+// far more numerous reference confidence records. Optionally, the reference
+// confidence records are stored column-wise (RefBandEncoder) rather than in
+// the list of records, in which case the skip index and variant list refer
+// to the records remaining in the list.
+
+// Format version written by BCFBucketWriter
+static const uint16_t BCF_BUCKET_VERSION = 1;
 
 class BCFBucketWriter {
+    const bcf_hdr_t* ref_bands_hdr_;
     vector<vector<uint8_t>> records_;
-    int rid_, last_beg_, end_;
-    vector<pair<int,int>> skips_;
+    vector<range> ranges_;
+    vector<bool> variant_;
+    int rid_, last_beg_;
 
 public:
-    BCFBucketWriter()
-        : rid_(-1), last_beg_(-1), end_(-1)
+    // If ref_bands_hdr is given, store reference bands column-wise; it must
+    // be the header of the records to be added.
+    BCFBucketWriter(const bcf_hdr_t* ref_bands_hdr = nullptr)
+        : ref_bands_hdr_(ref_bands_hdr), rid_(-1), last_beg_(-1)
         {
     }
 
     void clear() {
         records_.clear();
-        skips_.clear();
-        rid_ = last_beg_ = end_ = -1;
+        ranges_.clear();
+        variant_.clear();
+        rid_ = last_beg_ = -1;
     }
 
     Status add(bcf1_t* rec) {
@@ -188,18 +620,18 @@ public:
             return Status::Invalid("BCFBucketWriter: records not sorted (BUG)");
         }
         last_beg_ = rng.beg;
-        if (end_ <= rng.beg && records_.size()/10 > skips_.size()) {
-            // no preceding records in the bucket overlap this one, so record
-            // this skip index entry (for every 10th record, 10 arbitrary)
-            skips_.push_back(make_pair((int)records_.size(), rng.beg));
+
+        if (bcf_unpack(rec, BCF_UN_STR) != 0 || rec->errcode != 0) {
+            return Status::IOError("BCFBucketWriter: bcf_unpack");
         }
-        end_ = max(end_, rng.end);
+        variant_.push_back(!is_gvcf_ref_record(rec));
 
         size_t reclen = bcf_raw_calc_packed_len(rec);
         assert(reclen > 0);
         vector<uint8_t> buf(reclen);
         bcf_raw_write_to_mem(rec, reclen, buf.data());
         records_.push_back(move(buf));
+        ranges_.push_back(rng);
         return Status::OK();
     }
 
@@ -209,20 +641,53 @@ public:
 
     Status contents(string& ans) const {
         try {
+            // divide the records between the list and the reference band
+            // columns
+            vector<size_t> listed;
+            unique_ptr<RefBandEncoder> bands;
+            if (ref_bands_hdr_) {
+                bands = make_unique<RefBandEncoder>(ref_bands_hdr_);
+            }
+            for (size_t i = 0; i < records_.size(); i++) {
+                if (!bands || variant_[i] || !bands->add(records_[i], ranges_[i], listed.size())) {
+                    listed.push_back(i);
+                }
+            }
+
+            vector<int32_t> max_ends;
+            vector<uint32_t> variants;
+            int end = -1;
+            for (size_t k = 0; k < listed.size(); k++) {
+                end = max(end, ranges_[listed[k]].end);
+                max_ends.push_back(end);
+                if (variant_[listed[k]]) {
+                    variants.push_back(k);
+                }
+            }
+
             ::capnp::MallocMessageBuilder b;
             auto msg_b = b.initRoot<capnp::BCFBucket>();
-            auto records_b = msg_b.initRecords(records_.size());
-            for (int i = 0; i < records_.size(); i++) {
-                records_b.set(i, kj::arrayPtr((kj::byte*) records_[i].data(), records_[i].size()));
-                assert(records_b[i].begin() != nullptr); assert(records_b[i].size() == records_[i].size());
+            auto records_b = msg_b.initRecords(listed.size());
+            for (int k = 0; k < listed.size(); k++) {
+                const auto& rec = records_[listed[k]];
+                records_b.set(k, kj::arrayPtr((kj::byte*) rec.data(), rec.size()));
+                assert(records_b[k].begin() != nullptr); assert(records_b[k].size() == rec.size());
             }
 
-            if (skips_.size()) {
-                auto skips_b = msg_b.initSkips(skips_.size());
-                for (int i = 0; i < skips_.size(); i++) {
-                    skips_b[i].setRecordIndex(skips_[i].first);
-                    skips_b[i].setPosBeg(skips_[i].second);
-                }
+            msg_b.setVersion(BCF_BUCKET_VERSION);
+            auto max_ends_b = msg_b.initMaxEnds(max_ends.size());
+            for (int i = 0; i < max_ends.size(); i++) {
+                max_ends_b.set(i, max_ends[i]);
+            }
+
+            auto variants_b = msg_b.initVariants(variants.size());
+            for (int i = 0; i < variants.size(); i++) {
+                variants_b.set(i, variants[i]);
+            }
+            msg_b.setVariantsListed(true);
+
+            if (bands && bands->size()) {
+                bands->write(msg_b.initRefBands());
             }
 
             auto msg_words = ::capnp::messageToFlatArray(b);
@@ -243,16 +708,46 @@ public:
                     ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)(buf+ofs), ans.size() / sizeof(::capnp::word)));
                     capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
                     auto records = bucket_reader.getRecords();
-                    assert(records.size() == records_.size());
-                    for (int i = 0; i < records.size(); i++) {
-                        assert(records[i].size() == records_[i].size());
-                        assert(memcmp(records[i].begin(), records_[i].data(), records[i].size()) == 0);
+                    assert(records.size() == listed.size());
+                    for (int k = 0; k < records.size(); k++) {
+                        const auto& rec = records_[listed[k]];
+                        assert(records[k].size() == rec.size());
+                        assert(memcmp(records[k].begin(), rec.data(), records[k].size()) == 0);
+                    }
+                    assert(bucket_reader.getVersion() == BCF_BUCKET_VERSION);
+                    auto max_ends_r = bucket_reader.getMaxEnds();
+                    assert(max_ends_r.size() == max_ends.size());
+                    for (int i = 0; i < max_ends_r.size(); i++) {
+                        assert(max_ends_r[i] == max_ends[i]);
+                    }
+                    assert(bucket_reader.getVariantsListed());
+                    auto variants_r = bucket_reader.getVariants();
+                    assert(variants_r.size() == variants.size());
+                    for (int i = 0; i < variants_r.size(); i++) {
+                        assert(variants_r[i] == variants[i]);
                     }
-                    auto skips = bucket_reader.getSkips();
-                    assert(skips.size() == skips_.size());
-                    for (int i = 0; i < skips.size(); i++) {
-                        assert(skips[i].getRecordIndex() == skips_[i].first);
-                        assert(skips[i].getPosBeg() == skips_[i].second);
+                    if (bucket_reader.hasRefBands()) {
+                        // the synthesized bands must be identical to the originals
+                        RefBandDecoder decoder(bucket_reader.getRefBands());
+                        Status s = decoder.load(rid_);
+                        assert(s.ok());
+                        assert(decoder.size() + listed.size() == records_.size());
+                        size_t k = 0, j = 0;
+                        for (size_t i = 0; i < records_.size(); i++) {
+                            if (k < listed.size() && listed[k] == i) {
+                                k++;
+                                continue;
+                            }
+                            const uint8_t* syn = nullptr;
+                            size_t syn_len = 0;
+                            s = decoder.synthesize_raw(j, syn, syn_len);
+                            assert(s.ok());
+                            assert(decoder.preceding_records(j) == k);
+                            assert(decoder.band_range(j) == ranges_[i]);
+                            assert(syn_len == records_[i].size());
+                            assert(memcmp(syn, records_[i].data(), syn_len) == 0);
+                            j++;
+                        }
                     }
                     free(buf);
                 }
@@ -296,25 +791,64 @@ static int SearchBCFBucketSkipIndex(const capnp::BCFBucket::Reader& bucket, cons
     return skips[i].getRecordIndex();
 }
 
+// Find the index of the first record in the bucket which may overlap the
+// query; no preceding record does.
+static int BCFBucketScanBegin(const capnp::BCFBucket::Reader& bucket, const range& query) {
+    auto max_ends = bucket.getMaxEnds();
+    if (bucket.getVersion() < 1 || max_ends.size() != bucket.getRecords().size()) {
+        return SearchBCFBucketSkipIndex(bucket, query);
+    }
+    // binary search for the first max_end > query.beg
+    int lo = 0, hi = max_ends.size();
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (max_ends[mid] <= query.beg) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    #ifndef NDEBUG
+    int naive = 0;
+    for (; naive < max_ends.size() && max_ends[naive] <= query.beg; naive++);
+    assert(lo == naive);
+    #endif
+    return lo;
+}
+
 // helper class for bulk_insert_gvcf_key_values: accumulate sizable batches of
 // key/value pairs before insertion into the KeyValue database.
 // This is to reduce database write lock contention during intense multi-
 // threaded bulk loads, as each thread makes fewer larger inserts instead
 // of many smaller inserts.
+// Alternatively, write the key/value pairs into a sorted run for later bulk
+// ingestion (KeyValue::DB::begin_sorted_run), one per collection written; the
+// runs are committed by flush(), which therefore must be called exactly once,
+// when finished.
 class BulkInsertBuffer {
     const size_t LIMIT = 16777216;
     KeyValue::DB& db_;
     std::unique_ptr<KeyValue::WriteBatch> buf_;
     size_t bufsz_ = 0;
+    bool sorted_run_;
+    std::map<KeyValue::CollectionHandle,std::unique_ptr<KeyValue::SortedRunWriter>> runs_; // per collection
 
 public:
-    BulkInsertBuffer(KeyValue::DB& db) : db_(db) {}
+    BulkInsertBuffer(KeyValue::DB& db, bool sorted_run = false)
+        : db_(db), sorted_run_(sorted_run) {}
     ~BulkInsertBuffer() {
         assert(!buf_);
     }
 
     Status put(KeyValue::CollectionHandle coll, const std::string& key, const std::string& value) {
         Status s;
+        if (sorted_run_) {
+            auto& run = runs_[coll];
+            if (!run) {
+                S(db_.begin_sorted_run(coll, BCFBucketRange::SHARD_LENGTH, run));
+            }
+            return run->put(key, value);
+        }
         size_t delta = key.size() + value.size() + 32;
         if (bufsz_ + delta >= LIMIT) {
             S(flush());
@@ -327,10 +861,21 @@ public:
         return Status::OK();
     }
 
+    // drop anything not yet written, after a failure
+    void discard() {
+        buf_.reset();
+        bufsz_ = 0;
+        runs_.clear();
+    }
+
     // make sure to call when finished
     Status flush() {
+        Status s;
+        for (auto& run : runs_) {
+            S(run.second->commit());
+        }
+        runs_.clear();
         if (buf_ && bufsz_) {
-            Status s;
             S(buf_->commit());
         }
         buf_.reset();
@@ -339,4 +884,234 @@ public:
     }
 };
 
+// Merge a range filter into a sorted list of disjoint ranges, coalescing
+// overlapping or adjacent ones
+static std::vector<range> merge_range_filter(const std::set<range>& range_filter) {
+    std::vector<range> ans;
+    for (const auto& r : range_filter) {
+        if (!ans.empty() && ans.back().rid == r.rid && r.beg <= ans.back().end) {
+            ans.back().end = std::max(ans.back().end, r.end);
+        } else {
+            ans.push_back(r);
+        }
+    }
+    return ans;
+}
+
+// Test whether records overlap a merged range filter. The records are expected
+// to come sorted by position within each contig (as in a valid gVCF), so a
+// cursor into each contig's ranges need only move forward; but an out-of-order
+// record just resets the cursor.
+class RangeFilterCursor {
+    const std::vector<range>& ranges_;
+    // for each contig, the index range of its filter ranges, the cursor, and
+    // the last record beg
+    struct contig_cursor {
+        size_t lo, hi, cur;
+        int last_beg;
+    };
+    std::map<int,contig_cursor> cursors_;
+
+    // disable copy and assignment constructors
+    RangeFilterCursor(const RangeFilterCursor&);
+    RangeFilterCursor& operator=(const RangeFilterCursor&);
+
+public:
+    // ranges must outlive the cursor
+    RangeFilterCursor(const std::vector<range>& ranges) : ranges_(ranges) {
+        for (size_t i = 0; i < ranges_.size(); i++) {
+            auto p = cursors_.find(ranges_[i].rid);
+            if (p == cursors_.end()) {
+                cursors_[ranges_[i].rid] = contig_cursor{i, i+1, i, -1};
+            } else {
+                assert(p->second.hi == i);
+                p->second.hi = i+1;
+            }
+        }
+    }
+
+    bool overlaps(const range& rng) {
+        auto p = cursors_.find(rng.rid);
+        if (p == cursors_.end()) {
+            return false;
+        }
+        contig_cursor& c = p->second;
+        if (rng.beg < c.last_beg) {
+            c.cur = c.lo;
+        }
+        c.last_beg = rng.beg;
+        // filter ranges ending at or before this record's beg can't overlap
+        // any subsequent record either
+        while (c.cur < c.hi && ranges_[c.cur].end <= rng.beg) {
+            c.cur++;
+        }
+        return c.cur < c.hi && ranges_[c.cur].beg < rng.end;
+    }
+};
+
+// Source of gVCF records for bulk_insert_gvcf_key_values: either read the
+// whole file sequentially, or use its tabix/CSI index to read only the
+// records returned by a series of range queries.
+class GVCFRecordSource {
+public:
+    // Read the records overlapping rng and starting within [min_pos,max_pos).
+    // The latter is used to avoid returning a record again, if it also
+    // overlapped the preceding query.
+    struct query {
+        range rng;
+        int min_pos;
+        int max_pos;
+    };
+
+private:
+    vcfFile* vcf_;
+    const bcf_hdr_t* hdr_;
+    tbx_t* tbx_ = nullptr;      // index of a bgzipped VCF
+    hts_idx_t* idx_ = nullptr;  // index of a BCF
+    std::vector<query> queries_;
+    size_t cur_ = 0;
+    bool seeked_ = false;
+    hts_itr_t* itr_ = nullptr;  // for queries_[cur_]
+    kstring_t str_ = {0, 0, nullptr};
+
+    // disable copy and assignment constructors
+    GVCFRecordSource(const GVCFRecordSource&);
+    GVCFRecordSource& operator=(const GVCFRecordSource&);
+
+    // prepare itr_ for queries_[cur_]; return 0 if OK, 1 if the contig is
+    // absent from the index, or -2 on error
+    int open_query() {
+        const range& rng = queries_[cur_].rng;
+        if (tbx_) {
+            int tid = tbx_name2id(tbx_, bcf_hdr_id2name(hdr_, rng.rid));
+            if (tid < 0) {
+                return 1;
+            }
+            itr_ = tbx_itr_queryi(tbx_, tid, rng.beg, rng.end);
+        } else {
+            itr_ = bcf_itr_queryi(idx_, rng.rid, rng.beg, rng.end);
+        }
+        return itr_ ? 0 : -2;
+    }
+
+    void close_query() {
+        if (itr_) {
+            hts_itr_destroy(itr_);
+            itr_ = nullptr;
+        }
+    }
+
+public:
+    GVCFRecordSource(vcfFile* vcf, const bcf_hdr_t* hdr) : vcf_(vcf), hdr_(hdr) {}
+
+    ~GVCFRecordSource() {
+        close_query();
+        if (tbx_) tbx_destroy(tbx_);
+        if (idx_) hts_idx_destroy(idx_);
+        free(str_.s);
+    }
+
+    // Load the file's index, or return NotFound if it has none
+    Status load_index(const std::string& filename) {
+        if (tbx_ || idx_) {
+            return Status::OK();
+        }
+        if (hts_get_format(vcf_)->format == bcf) {
+            idx_ = bcf_index_load(filename.c_str());
+        } else {
+            tbx_ = tbx_index_load(filename.c_str());
+        }
+        if (!tbx_ && !idx_) {
+            return Status::NotFound("gVCF index", filename);
+        }
+        return Status::OK();
+    }
+
+    bool indexed() const {
+        return tbx_ || idx_;
+    }
+
+    // The contigs (header rids) having any records according to the index,
+    // in ascending order
+    Status indexed_contigs(std::vector<int>& rids) const {
+        assert(indexed());
+        rids.clear();
+        int n = 0;
+        const char **names = tbx_ ? tbx_seqnames(tbx_, &n) : bcf_index_seqnames(idx_, hdr_, &n);
+        if (!names && n) {
+            return Status::IOError("reading gVCF index");
+        }
+        Status ans;
+        for (int i = 0; i < n; i++) {
+            int rid = bcf_hdr_name2id(hdr_, names[i]);
+            if (rid < 0) {
+                ans = Status::Invalid("gVCF index refers to a contig missing from its header", names[i]);
+                break;
+            }
+            rids.push_back(rid);
+        }
+        free(names);
+        std::sort(rids.begin(), rids.end());
+        return ans;
+    }
+
+    // Position to read the records returned by the queries, in order. The
+    // queries' [min_pos,max_pos) windows should be increasing, so that the
+    // records come out sorted. Requires the index.
+    Status seek(std::vector<query> queries) {
+        if (!indexed()) {
+            return Status::Invalid("GVCFRecordSource::seek: no index (BUG)");
+        }
+        close_query();
+        queries_ = std::move(queries);
+        cur_ = 0;
+        seeked_ = true;
+        return Status::OK();
+    }
+
+    Status seek(const range& rng) {
+        return seek({query{rng, std::numeric_limits<int>::min(), std::numeric_limits<int>::max()}});
+    }
+
+    // Read the next record. Return values are as bcf_read: 0 on success, -1
+    // at the end of the file/queries, or less than -1 on error.
+    int read(bcf1_t* rec) {
+        if (!seeked_) {
+            return bcf_read(vcf_, hdr_, rec);
+        }
+        while (cur_ < queries_.size()) {
+            if (!itr_) {
+                int c = open_query();
+                if (c < 0) {
+                    return c;
+                } else if (c > 0) {
+                    cur_++;
+                    continue;
+                }
+            }
+            int c;
+            if (tbx_) {
+                c = tbx_itr_next(vcf_, tbx_, itr_, &str_);
+                if (c >= 0) {
+                    c = vcf_parse(&str_, hdr_, rec) == 0 ? 0 : -2;
+                }
+            } else {
+                c = bcf_itr_next(vcf_, itr_, rec);
+            }
+            if (c < -1) {
+                return c;
+            }
+            const query& q = queries_[cur_];
+            if (c == -1 || rec->pos >= q.max_pos) {
+                // done with this query
+                close_query();
+                cur_++;
+            } else if (rec->pos >= q.min_pos) {
+                return 0;
+            }
+        }
+        return -1;
+    }
+};
+
 } // namespace GLnexus
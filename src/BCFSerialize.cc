@@ -172,6 +172,207 @@ int bcf_shallow_compare(const bcf1_t *x, const bcf1_t *y) {
     return 1;
 }
 
+// Read the descriptor of a BCF typed value at buf[loc], advancing loc past it
+// (but not past the values themselves)
+static Status bcf_raw_typed_descriptor(const uint8_t *buf, size_t len, size_t& loc,
+                                       int& type, int& count) {
+    Status s;
+    BOUNDS_CHECK(loc + 1, len, "reading BCF typed value descriptor");
+    type = buf[loc] & 0xf;
+    count = buf[loc] >> 4;
+    loc++;
+    if (count == 15) {
+        // the count follows as a typed integer
+        int ctype = -1, ccount = -1;
+        S(bcf_raw_typed_descriptor(buf, len, loc, ctype, ccount));
+        if (ccount != 1) {
+            return Status::Invalid("BCF typed value has malformed count");
+        }
+        int32_t x;
+        switch (ctype) {
+            case BCF_BT_INT8: BOUNDS_CHECK(loc + 1, len, "reading BCF count"); x = *(int8_t*)&buf[loc]; loc += 1; break;
+            case BCF_BT_INT16: BOUNDS_CHECK(loc + 2, len, "reading BCF count"); x = *(int16_t*)&buf[loc]; loc += 2; break;
+            case BCF_BT_INT32: BOUNDS_CHECK(loc + 4, len, "reading BCF count"); x = *(int32_t*)&buf[loc]; loc += 4; break;
+            default: return Status::Invalid("BCF typed value has non-integer count");
+        }
+        count = x;
+    }
+    return Status::OK();
+}
+
+static int bcf_raw_type_width(int type) {
+    switch (type) {
+        case BCF_BT_NULL: return 0;
+        case BCF_BT_INT8: case BCF_BT_CHAR: return 1;
+        case BCF_BT_INT16: return 2;
+        case BCF_BT_INT32: case BCF_BT_FLOAT: return 4;
+    }
+    return -1;
+}
+
+// Read a typed value at buf[loc] with n_sample values per count (1 except for
+// FORMAT fields), advancing loc past it.
+static Status bcf_raw_typed_value(const uint8_t *buf, size_t len, size_t& loc, int n_sample,
+                                  bcf_raw_field& ans) {
+    Status s;
+    S(bcf_raw_typed_descriptor(buf, len, loc, ans.type, ans.count));
+    ans.width = bcf_raw_type_width(ans.type);
+    if (ans.width < 0 || ans.count < 0) {
+        return Status::Invalid("BCF typed value is malformed");
+    }
+    ans.offset = loc;
+    loc += size_t(ans.width) * ans.count * n_sample;
+    BOUNDS_CHECK(loc, len, "reading BCF typed value");
+    return Status::OK();
+}
+
+// Read a typed integer key (INFO or FORMAT dictionary ID)
+static Status bcf_raw_typed_key(const uint8_t *buf, size_t len, size_t& loc, int& key) {
+    Status s;
+    bcf_raw_field fld;
+    S(bcf_raw_typed_value(buf, len, loc, 1, fld));
+    if (fld.count != 1) {
+        return Status::Invalid("BCF record has malformed key");
+    }
+    switch (fld.type) {
+        case BCF_BT_INT8: key = *(int8_t*)&buf[fld.offset]; break;
+        case BCF_BT_INT16: key = *(int16_t*)&buf[fld.offset]; break;
+        case BCF_BT_INT32: key = *(int32_t*)&buf[fld.offset]; break;
+        default: return Status::Invalid("BCF record has non-integer key");
+    }
+    return Status::OK();
+}
+
+Status bcf_raw_parse_layout(const uint8_t *buf, size_t len, bcf_raw_layout& ans) {
+    Status s;
+    BOUNDS_CHECK(32, len, "reading header of BCF record");
+    uint32_t x[8];
+    memcpy(x, buf, 32);
+    size_t shared_end = 32 + size_t(x[0]) - 24, indiv_end = shared_end + x[1];
+    BOUNDS_CHECK(indiv_end, len, "reading BCF record");
+    int n_allele = x[6]>>16, n_info = x[6]&0xffff;
+    int n_fmt = x[7]>>24, n_sample = x[7]&0xffffff;
+
+    ans.ref = bcf_raw_field();
+    ans.info.clear();
+    ans.format.clear();
+
+    size_t loc = 32;
+    bcf_raw_field fld;
+    S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld)); // ID
+    for (int i = 0; i < n_allele; i++) {
+        S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld));
+        if (i == 0) {
+            ans.ref = fld;
+        }
+    }
+    S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld)); // FILTER
+    for (int i = 0; i < n_info; i++) {
+        int key;
+        S(bcf_raw_typed_key(buf, shared_end, loc, key));
+        S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld));
+        ans.info[key] = fld;
+    }
+    if (loc != shared_end) {
+        return Status::Invalid("BCF record has inconsistent shared length");
+    }
+
+    if (!x[1] || !n_sample) n_fmt = 0; // see bcf_raw_read_from_mem
+    for (int i = 0; i < n_fmt; i++) {
+        int key;
+        S(bcf_raw_typed_key(buf, indiv_end, loc, key));
+        S(bcf_raw_typed_value(buf, indiv_end, loc, n_sample, fld));
+        ans.format[key] = fld;
+    }
+    return Status::OK();
+}
+
+Status bcf_raw_project(const uint8_t *buf, size_t len,
+                       const std::set<int>* info, const std::set<int>* format,
+                       std::string& ans) {
+    Status s;
+    BOUNDS_CHECK(32, len, "reading header of BCF record");
+    uint32_t x[8];
+    memcpy(x, buf, 32);
+    size_t shared_end = 32 + size_t(x[0]) - 24, indiv_end = shared_end + x[1];
+    BOUNDS_CHECK(indiv_end, len, "reading BCF record");
+    int n_allele = x[6]>>16, n_info = x[6]&0xffff;
+    int n_fmt = x[7]>>24, n_sample = x[7]&0xffffff;
+
+    ans.clear();
+    ans.reserve(indiv_end);
+    ans.append((const char*) buf, 32);
+
+    // ID, alleles and FILTER are kept as-is
+    size_t loc = 32;
+    bcf_raw_field fld;
+    for (int i = 0; i < n_allele + 2; i++) {
+        S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld));
+    }
+    ans.append((const char*) buf + 32, loc - 32);
+
+    int kept_info = 0;
+    for (int i = 0; i < n_info; i++) {
+        size_t beg = loc;
+        int key;
+        S(bcf_raw_typed_key(buf, shared_end, loc, key));
+        S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld));
+        if (!info || info->count(key)) {
+            ans.append((const char*) buf + beg, loc - beg);
+            kept_info++;
+        }
+    }
+    if (loc != shared_end) {
+        return Status::Invalid("BCF record has inconsistent shared length");
+    }
+    uint32_t shared_len = ans.size() - 32;
+
+    int kept_fmt = 0;
+    if (!x[1] || !n_sample) n_fmt = 0; // see bcf_raw_read_from_mem
+    for (int i = 0; i < n_fmt; i++) {
+        size_t beg = loc;
+        int key;
+        S(bcf_raw_typed_key(buf, indiv_end, loc, key));
+        S(bcf_raw_typed_value(buf, indiv_end, loc, n_sample, fld));
+        if (!format || format->count(key)) {
+            ans.append((const char*) buf + beg, loc - beg);
+            kept_fmt++;
+        }
+    }
+
+    // fix up the lengths and counts
+    x[0] = shared_len + 24;
+    x[1] = ans.size() - 32 - shared_len;
+    x[6] = (x[6] & 0xffff0000) | kept_info;
+    x[7] = (x[7] & 0xffffff) | (uint32_t(kept_fmt) << 24);
+    memcpy(&ans[0], x, 32);
+    return Status::OK();
+}
+
+Status bcf_raw_has_nonsymbolic_alt(const uint8_t *buf, size_t len, bool& ans) {
+    Status s;
+    BOUNDS_CHECK(32, len, "reading header of BCF record");
+    uint32_t x[8];
+    memcpy(x, buf, 32);
+    size_t shared_end = 32 + size_t(x[0]) - 24;
+    BOUNDS_CHECK(shared_end, len, "reading BCF record");
+    int n_allele = x[6]>>16;
+
+    ans = false;
+    size_t loc = 32;
+    bcf_raw_field fld;
+    S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld)); // ID
+    for (int i = 0; i < n_allele; i++) {
+        S(bcf_raw_typed_value(buf, shared_end, loc, 1, fld));
+        // cf. is_symbolic_allele()
+        if (i > 0 && !(fld.count > 1 && buf[fld.offset] == '<' && buf[fld.offset + fld.count - 1] == '>')) {
+            ans = true;
+            return Status::OK();
+        }
+    }
+    return Status::OK();
+}
+
 /* Adapted from [htslib::vcf.c::bcf_hdr_read] to read
    from memory instead of disk.
 */
@@ -226,6 +427,30 @@ std::string bcf_write_header(const bcf_hdr_t *hdr) {
     return rc;
 }
 
+Status bcf_hdr_with_samples(const shared_ptr<const bcf_hdr_t>& body,
+                            const vector<string>& samples,
+                            shared_ptr<const bcf_hdr_t>& ans) {
+    if (bcf_hdr_nsamples(body.get()) != 0) {
+        return Status::Invalid("bcf_hdr_with_samples: header body has samples");
+    }
+
+    // a deep copy of the body, so that the result shares nothing with it
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_dup(body.get()), &bcf_hdr_destroy);
+    if (!hdr) {
+        return Status::Failure("bcf_hdr_with_samples: bcf_hdr_dup");
+    }
+    for (const auto& sample : samples) {
+        if (bcf_hdr_add_sample(hdr.get(), sample.c_str()) != 0) {
+            return Status::Invalid("bcf_hdr_with_samples: duplicate sample", sample);
+        }
+    }
+    if (bcf_hdr_sync(hdr.get()) != 0) {
+        return Status::Failure("bcf_hdr_with_samples: bcf_hdr_sync");
+    }
+    ans = hdr;
+    return Status::OK();
+}
+
 // convert a BCF record into a string
 shared_ptr<string> bcf1_to_string(const bcf_hdr_t *hdr, const bcf1_t *bcf) {
     kstring_t kstr;
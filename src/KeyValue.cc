@@ -16,6 +16,14 @@ namespace GLnexus { namespace KeyValue {
         return curr->get0(coll, key, value);
     }
 
+    Status DB::multi_get(CollectionHandle coll, const vector<string>& keys,
+                         vector<Status>& statuses, vector<shared_ptr<Data>>& values) const {
+        Status s;
+        unique_ptr<Reader> curr;
+        S(current(curr));
+        return curr->multi_get(coll, keys, statuses, values);
+    }
+
     Status DB::iterator(CollectionHandle coll, const string& key, unique_ptr<Iterator>& it) const {
         Status s;
         unique_ptr<Reader> curr;
@@ -8,10 +8,18 @@
 #include <string>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <queue>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "KeyValue.h"
 #include "RocksKeyValue.h"
+#include "executor.h"
 #include "rocksdb/db.h"
+#include "rocksdb/env.h"
 #include "rocksdb/slice.h"
 #include "rocksdb/options.h"
 #include "rocksdb/write_batch.h"
@@ -19,6 +27,8 @@
 #include "rocksdb/memtablerep.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/slice_transform.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/sst_file_reader.h"
 
 namespace GLnexus {
 namespace RocksKeyValue {
@@ -216,6 +226,39 @@ void ApplyDBOptions(OpenMode mode, size_t mem_budget, size_t thread_budget,
     }
 }
 
+// Value from a batch of lookups, pinning the whole batch
+struct MultiGetData : public KeyValue::Data {
+    MultiGetData(const std::shared_ptr<std::vector<rocksdb::PinnableSlice>>& batch, size_t i)
+        : KeyValue::Data((*batch)[i].data(), (*batch)[i].size()), batch_(batch) {}
+
+private:
+    std::shared_ptr<std::vector<rocksdb::PinnableSlice>> batch_;
+};
+
+// Look up the keys with one batched rocksdb::DB::MultiGet
+static Status multi_get(rocksdb::DB* db, KeyValue::CollectionHandle _coll,
+                        const std::vector<std::string>& keys,
+                        std::vector<Status>& statuses,
+                        std::vector<std::shared_ptr<KeyValue::Data>>& values) {
+    auto coll = reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll);
+    const rocksdb::ReadOptions r_options;
+    std::vector<rocksdb::Slice> slices(keys.begin(), keys.end());
+    auto batch = std::make_shared<std::vector<rocksdb::PinnableSlice>>(keys.size());
+    std::vector<rocksdb::Status> rstatuses(keys.size());
+    db->MultiGet(r_options, coll, keys.size(), slices.data(), batch->data(), rstatuses.data());
+    statuses.resize(keys.size());
+    values.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        statuses[i] = convertStatus(rstatuses[i]);
+        if (statuses[i].ok()) {
+            values[i] = std::make_shared<MultiGetData>(batch, i);
+        } else {
+            values[i].reset();
+        }
+    }
+    return Status::OK();
+}
+
 class Iterator : public KeyValue::Iterator {
 private:
     std::unique_ptr<rocksdb::Iterator> iter_;
@@ -291,6 +334,13 @@ public:
         return convertStatus(s);;
     }
 
+    Status multi_get(KeyValue::CollectionHandle coll,
+                     const std::vector<std::string>& keys,
+                     std::vector<Status>& statuses,
+                     std::vector<std::shared_ptr<KeyValue::Data>>& values) const override {
+        return RocksKeyValue::multi_get(db_, coll, keys, statuses, values);
+    }
+
     Status iterator(KeyValue::CollectionHandle _coll,
                     const std::string& key,
                     std::unique_ptr<KeyValue::Iterator>& it) const override {
@@ -350,6 +400,230 @@ public:
     }
 };
 
+// A file written by a SortedRunWriter, awaiting ingestion. All the keys in
+// the file share the same shard prefix.
+struct StagedFile {
+    rocksdb::ColumnFamilyHandle* coll;
+    std::string shard;
+    std::string path;
+    uint64_t bytes;
+};
+
+// Sorted runs committed so far, and the directory where their files are
+// written (created on first use).
+struct IngestStaging {
+    std::mutex mutex;
+    std::string dir;
+    bool dir_created = false;
+    uint64_t next_file = 0;
+    uint64_t runs = 0;
+    std::map<rocksdb::ColumnFamilyHandle*, size_t> shard_len;
+    std::vector<StagedFile> files;
+
+    IngestStaging(const std::string& dir_) : dir(dir_) {}
+
+    Status new_file_path(std::string& ans) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!dir_created) {
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+                return Status::IOError("creating sorted run staging directory", dir);
+            }
+            dir_created = true;
+        }
+        std::ostringstream os;
+        os << dir << "/" << std::setw(8) << std::setfill('0') << next_file++ << ".sst";
+        ans = os.str();
+        return Status::OK();
+    }
+
+    // Delete the directory and the files in it, logging any failure
+    void remove(rocksdb::Env* env, const std::shared_ptr<rocksdb::Logger>& log) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!dir_created) {
+            return;
+        }
+        std::vector<std::string> children;
+        rocksdb::Status s = env->GetChildren(dir, &children);
+        if (!s.ok()) {
+            rocksdb::Warn(log, "listing sorted run staging directory %s: %s",
+                          dir.c_str(), s.ToString().c_str());
+        }
+        for (const auto& child : children) {
+            if (child == "." || child == "..") {
+                continue;
+            }
+            std::string path = dir + "/" + child;
+            s = env->DeleteFile(path);
+            if (!s.ok()) {
+                rocksdb::Warn(log, "deleting sorted run %s: %s", path.c_str(), s.ToString().c_str());
+            }
+        }
+        s = env->DeleteDir(dir);
+        if (!s.ok()) {
+            rocksdb::Warn(log, "deleting sorted run staging directory %s: %s",
+                          dir.c_str(), s.ToString().c_str());
+        }
+        dir_created = false;
+        files.clear();
+    }
+};
+
+class SortedRunWriter : public KeyValue::SortedRunWriter {
+private:
+    IngestStaging& staging_;
+    rocksdb::ColumnFamilyHandle* coll_;
+    rocksdb::Options options_;
+    size_t shard_len_;
+    std::unique_ptr<rocksdb::SstFileWriter> writer_;
+    std::string shard_, path_;
+    std::vector<StagedFile> files_;
+    bool committed_ = false;
+
+    // No copying allowed
+    SortedRunWriter(const SortedRunWriter&) = delete;
+    void operator=(const SortedRunWriter&) = delete;
+
+    Status finish_file() {
+        if (writer_) {
+            rocksdb::ExternalSstFileInfo info;
+            rocksdb::Status s = writer_->Finish(&info);
+            writer_.reset();
+            if (!s.ok()) {
+                return convertStatus(s);
+            }
+            files_.push_back(StagedFile{coll_, shard_, path_, info.file_size});
+            path_.clear();
+        }
+        return Status::OK();
+    }
+
+public:
+    SortedRunWriter(IngestStaging& staging, rocksdb::ColumnFamilyHandle* coll,
+                    const rocksdb::Options& options, size_t shard_len)
+        : staging_(staging), coll_(coll), options_(options), shard_len_(shard_len) {}
+
+    ~SortedRunWriter() {
+        if (!committed_) {
+            writer_.reset();
+            if (!path_.empty()) {
+                unlink(path_.c_str());
+            }
+            for (const auto& f : files_) {
+                unlink(f.path.c_str());
+            }
+        }
+    }
+
+    Status put(const std::string& key, const KeyValue::Data& value) override {
+        Status s;
+        if (committed_) {
+            return Status::Invalid("RocksKeyValue::SortedRunWriter::put: run already committed");
+        }
+        if (key.size() < shard_len_) {
+            return Status::Invalid("RocksKeyValue::SortedRunWriter::put: key shorter than shard prefix", key);
+        }
+        if (!writer_ || key.compare(0, shard_len_, shard_) != 0) {
+            // start a new file for this shard
+            S(finish_file());
+            shard_ = key.substr(0, shard_len_);
+            S(staging_.new_file_path(path_));
+            writer_.reset(new rocksdb::SstFileWriter(rocksdb::EnvOptions(), options_, coll_));
+            S(convertStatus(writer_->Open(path_)));
+        }
+        return convertStatus(writer_->Put(key, rocksdb::Slice(value.data, value.size)));
+    }
+
+    Status commit() override {
+        Status s;
+        S(finish_file());
+        std::lock_guard<std::mutex> lock(staging_.mutex);
+        staging_.files.insert(staging_.files.end(), files_.begin(), files_.end());
+        staging_.runs++;
+        committed_ = true;
+        return Status::OK();
+    }
+};
+
+// Merge the staged files of one shard into one or more new files with
+// strictly increasing, non-overlapping key ranges, then delete the inputs.
+static Status MergeStagedFiles(IngestStaging& staging, const rocksdb::Options& options,
+                               const std::vector<StagedFile>& inputs,
+                               std::vector<StagedFile>& outputs) {
+    // roll over to a new output file at this size
+    const uint64_t MERGED_FILE_SIZE = uint64_t(1) << 30;
+    Status s;
+    assert(inputs.size() > 1);
+
+    rocksdb::ReadOptions ropts;
+    ropts.total_order_seek = true; // don't let the prefix index restrict the scan
+    ropts.fill_cache = false;
+    std::vector<std::unique_ptr<rocksdb::SstFileReader>> readers;
+    std::vector<std::unique_ptr<rocksdb::Iterator>> its;
+    for (const auto& f : inputs) {
+        readers.emplace_back(new rocksdb::SstFileReader(options));
+        S(convertStatus(readers.back()->Open(f.path)));
+        its.emplace_back(readers.back()->NewIterator(ropts));
+        its.back()->SeekToFirst();
+        S(convertStatus(its.back()->status()));
+    }
+
+    // k-way merge, with a min-heap of the input iterators ordered by current key
+    auto cmp = [&its](size_t a, size_t b) { return its[a]->key().compare(its[b]->key()) > 0; };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+    for (size_t i = 0; i < its.size(); i++) {
+        if (its[i]->Valid()) {
+            heap.push(i);
+        }
+    }
+
+    std::unique_ptr<rocksdb::SstFileWriter> writer;
+    std::string path, last_key;
+    auto finish = [&]() {
+        rocksdb::ExternalSstFileInfo info;
+        rocksdb::Status rs = writer->Finish(&info);
+        writer.reset();
+        if (rs.ok()) {
+            outputs.push_back(StagedFile{inputs[0].coll, inputs[0].shard, path, info.file_size});
+        }
+        return convertStatus(rs);
+    };
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        rocksdb::Slice key = its[i]->key();
+        if (writer && key.compare(rocksdb::Slice(last_key)) <= 0) {
+            return Status::Invalid("RocksKeyValue: duplicate key in sorted runs", key.ToString());
+        }
+        if (writer && writer->FileSize() >= MERGED_FILE_SIZE) {
+            S(finish());
+        }
+        if (!writer) {
+            S(staging.new_file_path(path));
+            writer.reset(new rocksdb::SstFileWriter(rocksdb::EnvOptions(), options, inputs[0].coll));
+            S(convertStatus(writer->Open(path)));
+        }
+        S(convertStatus(writer->Put(key, its[i]->value())));
+        last_key = key.ToString();
+
+        its[i]->Next();
+        if (its[i]->Valid()) {
+            heap.push(i);
+        } else {
+            S(convertStatus(its[i]->status()));
+        }
+    }
+    if (writer) {
+        S(finish());
+    }
+
+    its.clear();
+    readers.clear();
+    for (const auto& f : inputs) {
+        unlink(f.path.c_str());
+    }
+    return Status::OK();
+}
+
 class DB : public KeyValue::DB {
 private:
     rocksdb::DB* db_;
@@ -359,15 +633,20 @@ private:
     size_t mem_budget_ = 0;
     rocksdb::WriteOptions write_options_, batch_write_options_;
     std::shared_ptr<rocksdb::Cache> block_cache_;
+    size_t thread_budget_;
+    IngestStaging staging_;
 
     // No copying allowed
     DB(const DB&);
     void operator=(const DB&);
 
     DB(rocksdb::DB *db, std::map<const std::string, rocksdb::ColumnFamilyHandle*>& coll2handle,
-       OpenMode mode, prefix_spec* pfx, size_t mem_budget, std::shared_ptr<rocksdb::Cache> block_cache)
+       const std::string& dbPath, OpenMode mode, prefix_spec* pfx, size_t mem_budget,
+       size_t thread_budget, std::shared_ptr<rocksdb::Cache> block_cache)
         : db_(db), coll2handle_(std::move(coll2handle)),
-          mode_(mode), mem_budget_(mem_budget), block_cache_(block_cache) {
+          mode_(mode), mem_budget_(mem_budget), block_cache_(block_cache),
+          thread_budget_(thread_budget ? thread_budget : std::thread::hardware_concurrency()),
+          staging_(dbPath + "/glnexus_sorted_runs") {
             if (pfx) {
                 prefix_spec_ = *pfx;
             }
@@ -401,7 +680,8 @@ public:
         assert(rawdb != nullptr);
 
         std::map<const std::string, rocksdb::ColumnFamilyHandle*> coll2handle;
-        db.reset(new DB(rawdb, coll2handle, opt.mode, opt.pfx, mem_budget, block_cache));
+        db.reset(new DB(rawdb, coll2handle, dbPath, opt.mode, opt.pfx, mem_budget,
+                        opt.thread_budget, block_cache));
         if (!db) {
             delete rawdb;
             return Status::Failure();
@@ -459,7 +739,8 @@ public:
         for (size_t i = 0; i < column_families.size(); i++) {
             coll2handle[column_family_names[i]] = column_family_handles[i];
         }
-        db.reset(new DB(rawdb, coll2handle, opt.mode, opt.pfx, mem_budget, block_cache));
+        db.reset(new DB(rawdb, coll2handle, dbPath, opt.mode, opt.pfx, mem_budget,
+                        opt.thread_budget, block_cache));
         if (!db) {
             for (auto h : column_family_handles) {
                 delete h;
@@ -491,6 +772,8 @@ public:
                 db_->GetIntProperty(rocksdb::DB::Properties::kNumRunningCompactions, &num_running_compactions);
             } while(num_running_compactions>1);
         }
+        // Discard any sorted runs which were never ingested
+        staging_.remove(db_->GetEnv(), db_->GetDBOptions().info_log);
         // Free column handles
         for (const auto& p : coll2handle_) {
             delete p.second;
@@ -556,6 +839,13 @@ public:
         return convertStatus(s);
     }
 
+    Status multi_get(KeyValue::CollectionHandle coll,
+                     const std::vector<std::string>& keys,
+                     std::vector<Status>& statuses,
+                     std::vector<std::shared_ptr<KeyValue::Data>>& values) const override {
+        return RocksKeyValue::multi_get(db_, coll, keys, statuses, values);
+    }
+
     Status put(KeyValue::CollectionHandle _coll,
                const std::string& key,
                const KeyValue::Data& value) override {
@@ -577,6 +867,104 @@ public:
         }
         return Status::OK();
     }
+
+    Status begin_sorted_run(KeyValue::CollectionHandle _coll, size_t shard_len,
+                            std::unique_ptr<KeyValue::SortedRunWriter>& run) override {
+        if (mode_ == OpenMode::READ_ONLY) {
+            return Status::Invalid("RocksKeyValue::begin_sorted_run: database is read-only");
+        }
+        auto coll = reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll);
+        {
+            std::lock_guard<std::mutex> lock(staging_.mutex);
+            auto p = staging_.shard_len.find(coll);
+            if (p == staging_.shard_len.end()) {
+                staging_.shard_len[coll] = shard_len;
+            } else if (p->second != shard_len) {
+                return Status::Invalid("RocksKeyValue::begin_sorted_run: inconsistent shard length", coll->GetName());
+            }
+        }
+        run = std::make_unique<RocksKeyValue::SortedRunWriter>(staging_, coll, db_->GetOptions(coll), shard_len);
+        return Status::OK();
+    }
+
+    // Files staged by different runs in the same shard overlap, so we first
+    // merge them (in parallel across shards) to produce a set of non-
+    // overlapping files. RocksDB can then ingest these straight into the
+    // bottommost level, with no further compaction.
+    Status ingest_sorted_runs(KeyValue::ingest_stats& stats) override {
+        Status s;
+        stats = KeyValue::ingest_stats();
+
+        // group the staged files by collection & shard
+        std::map<std::pair<rocksdb::ColumnFamilyHandle*,std::string>, std::vector<StagedFile>> shards;
+        {
+            std::lock_guard<std::mutex> lock(staging_.mutex);
+            for (auto& f : staging_.files) {
+                stats.run_files++;
+                stats.run_bytes += f.bytes;
+                shards[std::make_pair(f.coll, f.shard)].push_back(std::move(f));
+            }
+            stats.runs = staging_.runs;
+            staging_.files.clear();
+            staging_.runs = 0;
+        }
+        std::vector<std::vector<StagedFile>> inputs, outputs(shards.size());
+        for (auto& p : shards) {
+            inputs.push_back(std::move(p.second));
+        }
+        shards.clear();
+
+        // merge each shard with multiple files
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<Status> statuses(inputs.size(), Status::OK());
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < inputs.size(); i = next++) {
+                if (inputs[i].size() == 1) {
+                    outputs[i] = inputs[i];
+                } else {
+                    statuses[i] = MergeStagedFiles(staging_, db_->GetOptions(inputs[i][0].coll),
+                                                   inputs[i], outputs[i]);
+                }
+            }
+        };
+        // on the process-wide executor, along with the other operations
+        TaskGroup tasks(Executor::Shared());
+        for (size_t t = 0; t < std::min(thread_budget_, inputs.size()); t++) {
+            tasks.run(worker);
+        }
+        tasks.wait();
+        for (const auto& ls : statuses) {
+            S(ls);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        stats.merge_seconds = std::chrono::duration<double>(t1 - t0).count();
+
+        // ingest each collection's files in one go; they're already in key
+        // order since the shards were
+        std::map<rocksdb::ColumnFamilyHandle*, std::vector<std::string>> paths;
+        for (const auto& shard : outputs) {
+            for (const auto& f : shard) {
+                paths[f.coll].push_back(f.path);
+                stats.files++;
+                stats.bytes += f.bytes;
+            }
+        }
+        rocksdb::IngestExternalFileOptions ifo;
+        ifo.move_files = true;
+        for (const auto& p : paths) {
+            S(convertStatus(db_->IngestExternalFile(p.first, p.second, ifo)));
+        }
+        stats.ingest_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+
+        // clean up
+        for (const auto& p : paths) {
+            for (const auto& path : p.second) {
+                unlink(path.c_str());
+            }
+        }
+        return Status::OK();
+    }
 };
 
 Status Initialize(const std::string& dbPath, const config& opt, std::unique_ptr<KeyValue::DB>& db)
@@ -1,5 +1,6 @@
 #include "cli_utils.h"
-#include "ctpl_stl.h"
+#include "executor.h"
+#include <chrono>
 #include <exception>
 #include <fts.h>
 #include <fstream>
@@ -11,8 +12,13 @@
 #include <unistd.h>
 #include "crc32c.h"
 #include "service.h"
+#include "genotyper.h"
 #include "compare_queries.h"
+#include "discovery.h"
 #include "spdlog/sinks/null_sink.h"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <defs.capnp.h>
 
 #include "BCFKeyValueData.h"
 
@@ -218,22 +224,28 @@ Status contigs_of_yaml(const YAML::Node& yaml,
 //
 // Each element is transformed to YAML, and then written to the output stream.
 // This generates the document in pieces, while keeping it valid YAML.
+static Status yaml_stream_of_discovered_alleles_header(unsigned N,
+                                                       const std::vector<std::pair<std::string,size_t> > &contigs,
+                                                       std::ostream &os) {
+    Status s;
+    os << "---" << endl;
+    YAML::Emitter yaml;
+    yaml << YAML::BeginMap;
+    yaml << YAML::Key << "N" << YAML::Value << N;
+    yaml << YAML::Key << "contigs" << YAML::Value;
+    S(yaml_of_contigs(contigs, yaml));
+    yaml << YAML::EndMap;
+    os << yaml.c_str() << endl;
+    return Status::OK();
+}
+
 Status yaml_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair<std::string,size_t> > &contigs,
                                          const discovered_alleles &dsals,
                                          std::ostream &os) {
     Status s;
 
     // write the contigs
-    {
-        os << "---" << endl;
-        YAML::Emitter yaml;
-        yaml << YAML::BeginMap;
-        yaml << YAML::Key << "N" << YAML::Value << N;
-        yaml << YAML::Key << "contigs" << YAML::Value;
-        S(yaml_of_contigs(contigs, yaml));
-        yaml << YAML::EndMap;
-        os << yaml.c_str() << endl;
-    }
+    S(yaml_stream_of_discovered_alleles_header(N, contigs, os));
 
     // Write alleles
     for (auto &pr : dsals) {
@@ -249,6 +261,21 @@ Status yaml_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair
     return Status::OK();
 }
 
+Status yaml_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair<std::string,size_t> > &contigs,
+                                         const flat_discovered_alleles &dsals,
+                                         std::ostream &os) {
+    Status s;
+    S(yaml_stream_of_discovered_alleles_header(N, contigs, os));
+    for (size_t i = 0; i < dsals.size(); i++) {
+        os << "---" << endl;
+        YAML::Emitter yaml;
+        S(yaml_of_one_discovered_allele(dsals.allele_at(i), dsals[i].info, contigs, yaml));
+        os << yaml.c_str() << endl;
+    }
+    os << "..." << endl;
+    return Status::OK();
+}
+
 
 static string yaml_begin_doc = "---";
 static string yaml_end_doc_list = "...";
@@ -364,10 +391,11 @@ Status discovered_alleles_of_yaml_stream(std::istream &is,
 }
 
 // Write the discovered alleles to a file
-Status yaml_write_discovered_alleles_to_file(const discovered_alleles &dsals,
-                                             const vector<pair<string,size_t>> &contigs,
-                                             unsigned int sample_count,
-                                             const string &filename) {
+template<class dsals_type>
+static Status yaml_write_discovered_alleles_to_file_impl(const dsals_type &dsals,
+                                                         const vector<pair<string,size_t>> &contigs,
+                                                         unsigned int sample_count,
+                                                         const string &filename) {
     Status s;
 
     ofstream ofs(filename, std::ofstream::out | std::ofstream::trunc);
@@ -379,6 +407,111 @@ Status yaml_write_discovered_alleles_to_file(const discovered_alleles &dsals,
     return Status::OK();
 }
 
+Status yaml_write_discovered_alleles_to_file(const discovered_alleles &dsals,
+                                             const vector<pair<string,size_t>> &contigs,
+                                             unsigned int sample_count,
+                                             const string &filename) {
+    return yaml_write_discovered_alleles_to_file_impl(dsals, contigs, sample_count, filename);
+}
+
+Status yaml_write_discovered_alleles_to_file(const flat_discovered_alleles &dsals,
+                                             const vector<pair<string,size_t>> &contigs,
+                                             unsigned int sample_count,
+                                             const string &filename) {
+    return yaml_write_discovered_alleles_to_file_impl(dsals, contigs, sample_count, filename);
+}
+
+Status binary_of_discovered_alleles(const flat_discovered_alleles &dsals, size_t begin, size_t end,
+                                    string &ans) {
+    if (begin > end || end > dsals.size()) {
+        return Status::Invalid("binary_of_discovered_alleles: invalid range");
+    }
+    const unsigned n = end - begin;
+    const unsigned nzGQ = zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY;
+    ::capnp::MallocMessageBuilder b;
+    auto msg_b = b.initRoot<capnp::FlatDiscoveredAlleles>();
+    auto rid_b = msg_b.initRid(n);
+    auto beg_b = msg_b.initBeg(n);
+    auto end_b = msg_b.initEnd(n);
+    auto is_ref_b = msg_b.initIsRef(n);
+    auto all_filtered_b = msg_b.initAllFiltered(n);
+    auto dna_size_b = msg_b.initDnaSize(n);
+    auto topAQ_b = msg_b.initTopAQ(n * top_AQ::COUNT);
+    auto zGQ_b = msg_b.initZygosityByGQ(n * nzGQ);
+    string dna;
+    for (unsigned k = 0; k < n; k++) {
+        const auto& e = dsals[begin+k];
+        rid_b.set(k, e.pos.rid);
+        beg_b.set(k, e.pos.beg);
+        end_b.set(k, e.pos.end);
+        is_ref_b.set(k, e.info.is_ref);
+        all_filtered_b.set(k, e.info.all_filtered);
+        dna_size_b.set(k, e.dna_size);
+        dna += dsals.dna(begin+k);
+        for (unsigned i = 0; i < top_AQ::COUNT; i++) {
+            topAQ_b.set(k*top_AQ::COUNT + i, e.info.topAQ.V[i]);
+        }
+        for (unsigned i = 0; i < zygosity_by_GQ::GQ_BANDS; i++) {
+            for (unsigned j = 0; j < zygosity_by_GQ::PLOIDY; j++) {
+                zGQ_b.set(k*nzGQ + i*zygosity_by_GQ::PLOIDY + j, e.info.zGQ.M[i][j]);
+            }
+        }
+    }
+    msg_b.setDna(kj::arrayPtr((kj::byte*) dna.data(), dna.size()));
+    auto msg_words = ::capnp::messageToFlatArray(b);
+    auto msg_bytes = msg_words.asBytes();
+    ans.assign((char*)msg_bytes.begin(), msg_bytes.size());
+    return Status::OK();
+}
+
+Status discovered_alleles_of_binary(const string &data, flat_discovered_alleles &dsals) {
+    Status s;
+    const unsigned nzGQ = zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY;
+    try {
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data(), data.size() / sizeof(::capnp::word)));
+        auto rdr = message.getRoot<capnp::FlatDiscoveredAlleles>();
+        auto rid = rdr.getRid();
+        auto beg = rdr.getBeg();
+        auto end = rdr.getEnd();
+        auto is_ref = rdr.getIsRef();
+        auto all_filtered = rdr.getAllFiltered();
+        auto dna_size = rdr.getDnaSize();
+        auto dna = rdr.getDna();
+        auto topAQ = rdr.getTopAQ();
+        auto zGQ = rdr.getZygosityByGQ();
+        const size_t n = rid.size();
+        if (beg.size() != n || end.size() != n || is_ref.size() != n || all_filtered.size() != n ||
+            dna_size.size() != n || topAQ.size() != n * top_AQ::COUNT || zGQ.size() != n * nzGQ) {
+            return Status::Invalid("discovered_alleles_of_binary: inconsistent list lengths");
+        }
+        size_t dna_pos = 0;
+        for (size_t k = 0; k < n; k++) {
+            if (dna_pos + dna_size[k] > dna.size()) {
+                return Status::Invalid("discovered_alleles_of_binary: DNA overrun");
+            }
+            allele al(range(rid[k], beg[k], end[k]),
+                      string((const char*) dna.begin() + dna_pos, dna_size[k]));
+            dna_pos += dna_size[k];
+            discovered_allele_info ai;
+            ai.is_ref = is_ref[k];
+            ai.all_filtered = all_filtered[k];
+            for (unsigned i = 0; i < top_AQ::COUNT; i++) {
+                ai.topAQ.V[i] = topAQ[k*top_AQ::COUNT + i];
+            }
+            for (unsigned i = 0; i < zygosity_by_GQ::GQ_BANDS; i++) {
+                for (unsigned j = 0; j < zygosity_by_GQ::PLOIDY; j++) {
+                    ai.zGQ.M[i][j] = zGQ[k*nzGQ + i*zygosity_by_GQ::PLOIDY + j];
+                }
+            }
+            S(dsals.push_back(al, ai));
+        }
+    } catch (exception& e) {
+        string err = e.what();
+        return Status::Invalid("discovered_alleles_of_binary: corrupt data: ", err);
+    }
+    return Status::OK();
+}
+
 // Serialize the unified sites to yaml format.
 //
 Status yaml_stream_of_unified_sites(const std::vector<unified_site> &sites,
@@ -1302,7 +1435,8 @@ Status db_init(std::shared_ptr<spdlog::logger> logger,
                const string &dbpath,
                const string &exemplar_gvcf,
                vector<pair<string,size_t>> &contigs,
-               size_t bucket_size) {
+               size_t bucket_size,
+               const vector<string>& density_sample) {
     Status s;
     logger->info("init database, exemplar_vcf={}", exemplar_gvcf);
     if (check_dir_exists(dbpath)) {
@@ -1339,12 +1473,23 @@ Status db_init(std::shared_ptr<spdlog::logger> logger,
     }
 
 
+    // plan density-adaptive buckets
+    BCFKeyValueData::bucket_boundaries boundaries;
+    if (!density_sample.empty()) {
+        BCFKeyValueData::bucket_plan_stats stats;
+        S(BCFKeyValueData::PlanBucketBoundaries(contigs, density_sample, bucket_size,
+                                                boundaries, stats));
+        logger->info("planned {} buckets (vs. {} uniform) from {} records in {} gVCF(s), about {} records per bucket per gVCF",
+                     stats.buckets, stats.uniform_buckets, stats.records, density_sample.size(),
+                     stats.target_records);
+    }
+
     // create and initialize the database
     RocksKeyValue::config cfg;
     cfg.pfx = GLnexus_prefix_spec();
     unique_ptr<KeyValue::DB> db;
     S(RocksKeyValue::Initialize(dbpath, cfg, db));
-    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size));
+    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size, boundaries));
 
     // report success
     logger->info("Initialized GLnexus database in {}", dbpath);
@@ -1390,7 +1535,9 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     const vector<range> &ranges_i,
                     std::vector<std::pair<std::string,size_t> > &contigs, // output param
                     std::unique_ptr<KeyValue::DB> *db_out, // output
-                    bool delete_gvcf_after_load) {
+                    bool delete_gvcf_after_load,
+                    bool sst_ingest,
+                    bool ref_band_columns) {
     Status s;
 
     if (nr_threads == 0) {
@@ -1426,15 +1573,38 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
         logger->info("Beginning bulk load with no range filter.");
     }
 
-    ctpl::thread_pool threadpool(nr_threads);
-    vector<future<Status>> statuses;
+    vector<Status> statuses(gvcfs.size());
     set<string> datasets_loaded;
     BCFKeyValueData::import_result stats;
     mutex mu;
     string dataset;
-
-    // load the gVCFs on the thread pool
-    for (const auto& gvcf : gvcfs) {
+    auto t_import = chrono::steady_clock::now();
+
+    // Submit the gVCFs largest first, so that the biggest ones don't end up
+    // on the tail of the bulk load. Furthermore, a gVCF larger than its fair
+    // share of the total (per thread) is imported on multiple threads, if it's
+    // indexed.
+    vector<size_t> gvcf_sizes, order;
+    size_t total_size = 0;
+    for (size_t i = 0; i < gvcfs.size(); i++) {
+        struct stat st;
+        gvcf_sizes.push_back(stat(gvcfs[i].c_str(), &st) == 0 ? st.st_size : 0);
+        total_size += gvcf_sizes.back();
+        order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(),
+                [&gvcf_sizes](size_t a, size_t b) { return gvcf_sizes[a] > gvcf_sizes[b]; });
+    size_t fair_size = max(size_t(1), total_size / nr_threads);
+
+    // load the gVCFs on the executor; the gVCFs imported on multiple threads
+    // fork their own tasks, and execute pending ones while they wait
+    TaskGroup tasks(Executor::Shared(nr_threads));
+    for (size_t i : order) {
+        const string& gvcf = gvcfs[i];
+        BCFKeyValueData::import_options import_opts;
+        import_opts.sorted_runs = sst_ingest;
+        import_opts.ref_band_columns = ref_band_columns;
+        import_opts.threads = max(size_t(1), min(nr_threads, gvcf_sizes[i] / fair_size));
         // infer dataset name as the gVCF filename minus path and extension
         size_t p = gvcf.find_last_of('/');
         if (p != string::npos && p < gvcf.size()-1) {
@@ -1451,9 +1621,9 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
             }
         }
 
-        auto fut = threadpool.push([&, gvcf, dataset](int tid) {
+        tasks.run([&, i, gvcf, dataset, import_opts]() {
                 BCFKeyValueData::import_result rslt;
-                Status ls = data->import_gvcf(*metadata, dataset, gvcf, ranges, rslt);
+                Status ls = data->import_gvcf(*metadata, dataset, gvcf, ranges, import_opts, rslt);
                 if (ls.ok()) {
                     if (delete_gvcf_after_load && unlink(gvcf.c_str())) {
                         logger->warn("Loaded {} successfully, but failed deleting it afterwards.", gvcf);
@@ -1469,18 +1639,17 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                         logger->info("{}/{} ({})...", n, gvcfs.size(), dataset);
                     }
                 }
-                return ls;
+                statuses[i] = move(ls);
             });
-        statuses.push_back(move(fut));
         dataset.clear();
     }
+    tasks.wait();
 
     // collect results
     vector<pair<string,Status>> failures;
-    for (size_t i = 0; i < gvcfs.size(); i++) {
-        Status s_i(move(statuses[i].get()));
-        if (!s_i.ok()) {
-            failures.push_back(make_pair(gvcfs[i],move(s_i)));
+    for (size_t i : order) {
+        if (!statuses[i].ok()) {
+            failures.push_back(make_pair(gvcfs[i],move(statuses[i])));
         }
     }
 
@@ -1489,6 +1658,23 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                  datasets_loaded.size(), stats.samples.size(), stats.bytes,
                  stats.records, stats.duplicate_records,
                  stats.buckets, stats.max_bytes, stats.max_records, stats.skipped_records);
+    if (ranges.size()) {
+        logger->info("Read {} BCF records from the gVCFs, of which {} were outside the ranges (indexed gVCFs are read only near the ranges)",
+                     stats.records_read, stats.filtered_records);
+    }
+    logger->info("Import phase took {:.1f}s",
+                 chrono::duration<double>(chrono::steady_clock::now() - t_import).count());
+
+    if (sst_ingest) {
+        // ingest the sorted runs of all the datasets successfully imported
+        // (even if some failed, since their metadata are already committed)
+        logger->info("Merging and ingesting sorted runs...");
+        KeyValue::ingest_stats istats;
+        S(db->ingest_sorted_runs(istats));
+        logger->info("Import wrote {} bytes in {} SST files ({} sorted runs); merge wrote {} bytes in {} SST files in {:.1f}s; ingestion took {:.1f}s",
+                     istats.run_bytes, istats.run_files, istats.runs,
+                     istats.bytes, istats.files, istats.merge_seconds, istats.ingest_seconds);
+    }
 
     // call all_samples_sampleset to create the sample set including
     // the newly loaded ones. By doing this now we make it possible
@@ -1550,7 +1736,24 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
                         unsigned &sample_count,
-                        bool include_zero_copies) {
+                        bool include_zero_copies,
+                        const string &sampleset) {
+    Status s;
+    dsals.clear();
+    flat_discovered_alleles flat_dsals;
+    S(discover_alleles(logger, nr_threads, db, ranges, contigs, flat_dsals, sample_count,
+                       include_zero_copies, sampleset));
+    return discovered_alleles_of_flat(flat_dsals, 0, flat_dsals.size(), dsals);
+}
+
+Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
+                        size_t nr_threads, KeyValue::DB* db,
+                        const vector<range> &ranges,
+                        const std::vector<std::pair<std::string,size_t> > &contigs,
+                        flat_discovered_alleles &dsals,
+                        unsigned &sample_count,
+                        bool include_zero_copies,
+                        const string &sampleset_in) {
     Status s;
     unique_ptr<BCFKeyValueData> data;
     dsals.clear();
@@ -1567,33 +1770,29 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
     unique_ptr<Service> svc;
     S(Service::Start(svccfg, *data, *data, svc));
 
-    string sampleset;
-    S(data->all_samples_sampleset(sampleset));
+    string sampleset = sampleset_in;
+    if (sampleset.empty()) {
+        S(data->all_samples_sampleset(sampleset));
+    }
     logger->info("found sample set {}", sampleset);
 
     logger->info("discovering alleles in {} range(s) on {} threads", ranges.size(), nr_threads);
-    vector<discovered_alleles> valleles;
+    vector<flat_discovered_alleles> valleles;
     S(svc->discover_alleles(sampleset, ranges, sample_count, valleles, include_zero_copies));
-
-    for (auto it = valleles.begin(); it != valleles.end(); ++it) {
-        S(merge_discovered_alleles(*it, dsals));
-        it->clear(); // free some memory
-    }
-    logger->info("discovered {} alleles", dsals.size());
+    logger->info(svc->discover_stats().str());
+
+    // the ranges are usually disjoint and in order, so that merging them
+    // amounts to concatenation
+    auto t0 = std::chrono::steady_clock::now();
+    S(merge_discovered_alleles(Executor::Shared(), valleles, dsals));
+    logger->info("discovered {} alleles; merged the ranges' alleles in {}ms", dsals.size(),
+                 std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count());
     return Status::OK();
 }
 
-Status unify_sites(std::shared_ptr<spdlog::logger> logger,
-                   const unifier_config &unifier_cfg,
-                   const vector<pair<string,size_t> > &contigs,
-                   discovered_alleles &dsals,
-                   unsigned sample_count,
-                   vector<unified_site> &sites,
-                   unifier_stats& stats) {
-    Status s;
-    S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
-
-    // sanity check, sites are in-order
+// sanity check, sites are in-order
+static Status check_unified_sites_order(const vector<pair<string,size_t> > &contigs,
+                                        const vector<unified_site> &sites) {
     if (sites.size() > 1) {
         auto p = sites.begin();
         for (auto q = p+1; q != sites.end(); ++p, ++q) {
@@ -1608,6 +1807,31 @@ Status unify_sites(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status unify_sites(std::shared_ptr<spdlog::logger> logger,
+                   const unifier_config &unifier_cfg,
+                   const vector<pair<string,size_t> > &contigs,
+                   discovered_alleles &dsals,
+                   unsigned sample_count,
+                   vector<unified_site> &sites,
+                   unifier_stats& stats) {
+    Status s;
+    S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
+    return check_unified_sites_order(contigs, sites);
+}
+
+Status unify_sites(std::shared_ptr<spdlog::logger> logger,
+                   const unifier_config &unifier_cfg,
+                   const vector<pair<string,size_t> > &contigs,
+                   const flat_discovered_alleles &dsals,
+                   size_t begin, size_t end,
+                   unsigned sample_count,
+                   vector<unified_site> &sites,
+                   unifier_stats& stats) {
+    Status s;
+    S(unified_sites(unifier_cfg, sample_count, dsals, begin, end, sites, stats));
+    return check_unified_sites_order(contigs, sites);
+}
+
 
 Status genotype(std::shared_ptr<spdlog::logger> logger,
                 size_t mem_budget, size_t nr_threads,
@@ -1615,7 +1839,9 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
                 const genotyper_config &genotyper_cfg,
                 const vector<unified_site> &sites,
                 const vector<string>& extra_header_lines,
-                const string &output_filename) {
+                const string &output_filename,
+                const Service::genotype_reuse *reuse,
+                bool window_scan) {
     Status s;
 
     if (nr_threads == 0) {
@@ -1639,6 +1865,7 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     // start service, discover alleles, unify sites, genotype sites
     service_config svccfg;
     svccfg.threads = nr_threads;
+    svccfg.genotype_window_scan = window_scan;
     svccfg.extra_header_lines = extra_header_lines;
     unique_ptr<Service> svc;
     S(Service::Start(svccfg, *data, *data, svc));
@@ -1647,13 +1874,20 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     S(data->all_samples_sampleset(sampleset));
 
     logger->info("genotyping {} sites; sample set = {} mem_budget = {} threads = {}", sites.size(), sampleset, mem_budget, nr_threads);
-    S(svc->genotype_sites(genotyper_cfg, sampleset, sites, output_filename));
+    if (reuse) {
+        size_t n = count(reuse->reusable.begin(), reuse->reusable.end(), true);
+        logger->info("reusing {} at {} sites, genotyping only sample set {} there",
+                     reuse->previous_filename, n, reuse->new_sampleset);
+    }
+    S(svc->genotype_sites(genotyper_cfg, sampleset, sites, output_filename, nullptr, reuse));
     logger->info("genotyping complete!");
 
     auto stalls_ms = svc->threads_stalled_ms();
     if (stalls_ms) {
-        logger->info("worker threads were cumulatively stalled for {}ms", stalls_ms);
+        logger->info("genotyping was held back for the output for {}ms", stalls_ms);
     }
+    logger->info(svc->prefetch_stats().str());
+    logger->info(svc->output_stats().str());
 
     std::shared_ptr<StatsRangeQuery> statsRq = data->getRangeStats();
     logger->info(statsRq->str());
@@ -1661,6 +1895,328 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status discover_unify_genotype(std::shared_ptr<spdlog::logger> logger,
+                               size_t mem_budget, size_t nr_threads,
+                               const string &dbpath,
+                               const vector<range> &ranges,
+                               const vector<pair<string,size_t> > &contigs,
+                               const unifier_config &unifier_cfg,
+                               const genotyper_config &genotyper_cfg,
+                               const vector<string> &extra_header_lines,
+                               const string &output_filename,
+                               bool window_scan,
+                               size_t lookahead) {
+    Status s;
+
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+
+    // open the database in read-only mode
+    RocksKeyValue::config cfg;
+    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
+    cfg.pfx = GLnexus_prefix_spec();
+    cfg.mem_budget = mem_budget;
+    cfg.thread_budget = nr_threads;
+    unique_ptr<KeyValue::DB> db;
+    S(RocksKeyValue::Open(dbpath, cfg, db));
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db.get(), data));
+
+    service_config svccfg;
+    svccfg.threads = nr_threads;
+    svccfg.genotype_window_scan = window_scan;
+    svccfg.extra_header_lines = extra_header_lines;
+    unique_ptr<Service> svc;
+    S(Service::Start(svccfg, *data, *data, svc));
+
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+
+    // the chunks: the ranges on each contig, in contig order. The unifier
+    // works per contig anyway, so this doesn't change the sites.
+    struct chunk {
+        int rid;
+        vector<range> ranges;
+        vector<unified_site> sites;
+        unifier_stats stats;
+        Status status;
+        atomic<bool> done;
+        chunk(int rid_) : rid(rid_), done(false) {}
+    };
+    vector<unique_ptr<chunk>> chunks;
+    {
+        map<int, vector<range>> ranges_by_contig;
+        for (const auto& r : ranges) {
+            ranges_by_contig[r.rid].push_back(r);
+        }
+        for (auto& p : ranges_by_contig) {
+            chunks.emplace_back(new chunk(p.first));
+            chunks.back()->ranges = move(p.second);
+        }
+    }
+
+    logger->info("discovering, unifying and genotyping {} contig(s); sample set = {} mem_budget = {} threads = {}",
+                 chunks.size(), sampleset, mem_budget, nr_threads);
+    unique_ptr<Service::genotype_output> output;
+    S(svc->open_genotype_output(genotyper_cfg, sampleset, output_filename, output));
+
+    Executor& executor = Executor::Shared(nr_threads);
+    atomic<bool> abort(false);
+    const bool include_zero_copies = unifier_cfg.min_allele_copy_number == 0;
+    TaskGroup tasks(executor);
+    auto start = [&](chunk* ch) {
+        tasks.run([&, ch]() {
+            // the chunk must be marked done however this ends, lest the
+            // main thread wait for it forever
+            try {
+                vector<flat_discovered_alleles> valleles;
+                flat_discovered_alleles dsals;
+                unsigned N = 0;
+                ch->status = svc->discover_alleles(sampleset, ch->ranges, N, valleles, include_zero_copies, &abort);
+                if (ch->status.ok()) {
+                    ch->status = merge_discovered_alleles(executor, valleles, dsals);
+                }
+                valleles.clear();
+                if (ch->status.ok()) {
+                    ch->status = unify_sites(logger, unifier_cfg, contigs, dsals, 0, dsals.size(), N,
+                                             ch->sites, ch->stats);
+                }
+            } catch (exception& e) {
+                ch->status = Status::Failure("exception caught in discover_unify_genotype: ", e.what());
+            } catch (...) {
+                ch->status = Status::Failure("exception caught in discover_unify_genotype");
+            }
+            ch->done = true;
+            executor.notify();
+        });
+    };
+
+    // genotype the chunks in order, as their sites become available, keeping
+    // the next few in progress meanwhile
+    size_t next = 0, nr_sites = 0;
+    unifier_stats stats;
+    for (size_t c = 0; c < chunks.size(); c++) {
+        for (; next < chunks.size() && next <= c + lookahead; next++) {
+            start(chunks[next].get());
+        }
+        chunk& ch = *chunks[c];
+        // block rather than help, which could take up a later chunk's
+        // discovery and delay the genotyping of this one
+        executor.wait_until([&ch]() { return ch.done.load(); }, false);
+        s = ch.status;
+        if (s.ok()) {
+            logger->info("contig {}: unified {} sites", contigs[ch.rid].first, ch.sites.size());
+            s = svc->genotype_sites(genotyper_cfg, sampleset, ch.sites, *output, &abort);
+        }
+        if (s.bad()) {
+            break;
+        }
+        stats += ch.stats;
+        nr_sites += ch.sites.size();
+        chunks[c].reset();
+    }
+    if (s.bad()) {
+        abort = true;
+    }
+    tasks.wait();
+    S(s);
+    S(output->close());
+
+    logger->info("unified to {} sites cleanly with {} ALT alleles. {} ALT alleles were {} and {} were filtered out on quality thresholds.",
+                 nr_sites, stats.unified_alleles, stats.lost_alleles,
+                 (unifier_cfg.monoallelic_sites_for_lost_alleles ? "additionally included in monoallelic sites" : "lost due to failure to unify"),
+                 stats.filtered_alleles);
+    logger->info("genotyping complete!");
+    logger->info(svc->discover_stats().str());
+
+    auto stalls_ms = svc->threads_stalled_ms();
+    if (stalls_ms) {
+        logger->info("genotyping was held back for the output for {}ms", stalls_ms);
+    }
+    logger->info(svc->prefetch_stats().str());
+    logger->info(svc->output_stats().str());
+
+    std::shared_ptr<StatsRangeQuery> statsRq = data->getRangeStats();
+    logger->info(statsRq->str());
+
+    return Status::OK();
+}
+
+// Keys of the incremental state in the database's config collection. The
+// sites are a YAML stream, as for the files written above. The alleles are
+// in binary form (binary_of_discovered_alleles), in chunks of up to
+// incremental_alleles_chunk under the keys incremental_alleles/0, /1 etc.,
+// following a YAML header of the sample count, contigs and number of chunks.
+static const char* incremental_alleles_key = "incremental_alleles";
+static const char* incremental_sites_key = "incremental_sites";
+static const char* incremental_run_key = "incremental_run";
+static const size_t incremental_alleles_chunk = 65536;
+
+static string incremental_alleles_chunk_key(size_t i) {
+    return string(incremental_alleles_key) + "/" + to_string(i);
+}
+
+Status db_put_incremental_alleles(KeyValue::DB *db,
+                                  const vector<pair<string,size_t> > &contigs,
+                                  unsigned sample_count,
+                                  const flat_discovered_alleles &dsals) {
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(db->collection("config", coll));
+
+    size_t chunks = 0;
+    for (size_t begin = 0; begin < dsals.size(); begin += incremental_alleles_chunk, chunks++) {
+        string data;
+        S(binary_of_discovered_alleles(dsals, begin, min(dsals.size(), begin + incremental_alleles_chunk),
+                                       data));
+        S(db->put(coll, incremental_alleles_chunk_key(chunks), data));
+    }
+
+    YAML::Emitter yaml;
+    yaml << YAML::BeginMap;
+    yaml << YAML::Key << "N" << YAML::Value << sample_count;
+    yaml << YAML::Key << "contigs" << YAML::Value;
+    S(yaml_of_contigs(contigs, yaml));
+    yaml << YAML::Key << "chunks" << YAML::Value << chunks;
+    yaml << YAML::EndMap;
+    S(db->put(coll, incremental_alleles_key, yaml.c_str()));
+    return db->flush();
+}
+
+Status db_put_incremental_sites(KeyValue::DB *db,
+                                const vector<pair<string,size_t> > &contigs,
+                                const string &sampleset,
+                                const string &config_crc32c,
+                                const vector<range> &ranges,
+                                const vector<unified_site> &sites) {
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(db->collection("config", coll));
+
+    ostringstream os;
+    S(yaml_stream_of_unified_sites(sites, contigs, os));
+    S(db->put(coll, incremental_sites_key, os.str()));
+
+    YAML::Emitter yaml;
+    yaml << YAML::BeginMap;
+    yaml << YAML::Key << "sampleset" << YAML::Value << sampleset;
+    yaml << YAML::Key << "config_crc32c" << YAML::Value << config_crc32c;
+    yaml << YAML::Key << "ranges" << YAML::Value << YAML::BeginSeq;
+    for (const auto& r : ranges) {
+        S(range_yaml(contigs, r, yaml));
+    }
+    yaml << YAML::EndSeq;
+    yaml << YAML::EndMap;
+    S(db->put(coll, incremental_run_key, yaml.c_str()));
+    return db->flush();
+}
+
+Status db_get_incremental_state(KeyValue::DB *db,
+                                const vector<pair<string,size_t> > &contigs,
+                                incremental_state &ans) {
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(db->collection("config", coll));
+
+    string run_yaml, alleles_yaml, sites_yaml;
+    S(db->get(coll, incremental_run_key, run_yaml));
+    S(db->get(coll, incremental_alleles_key, alleles_yaml));
+    S(db->get(coll, incremental_sites_key, sites_yaml));
+
+    vector<pair<string,size_t> > alleles_contigs;
+    size_t chunks = 0;
+    try {
+        YAML::Node run = YAML::Load(run_yaml);
+        ans.sampleset = run["sampleset"].as<string>();
+        ans.config_crc32c = run["config_crc32c"].as<string>();
+        ans.ranges.clear();
+        for (const auto& r : run["ranges"]) {
+            range rng(-1,-1,-1);
+            S(range_of_yaml(r, contigs, rng));
+            ans.ranges.push_back(rng);
+        }
+
+        YAML::Node alleles = YAML::Load(alleles_yaml);
+        ans.sample_count = alleles["N"].as<unsigned>();
+        S(contigs_of_yaml(alleles["contigs"], alleles_contigs));
+        chunks = alleles["chunks"].as<size_t>();
+    } catch (YAML::Exception& exn) {
+        return Status::Invalid("incremental state in database", exn.msg);
+    }
+    if (alleles_contigs != contigs) {
+        return Status::Invalid("incremental state in database: contigs don't match");
+    }
+
+    ans.dsals.clear();
+    for (size_t i = 0; i < chunks; i++) {
+        string data;
+        S(db->get(coll, incremental_alleles_chunk_key(i), data));
+        S(discovered_alleles_of_binary(data, ans.dsals));
+    }
+    ans.dsals.shrink_to_fit();
+
+    ans.sites.clear();
+    if (sites_yaml != yaml_end_doc_list + "\n") {
+        istringstream sites_is(sites_yaml);
+        S(unified_sites_of_yaml_stream(sites_is, contigs, ans.sites));
+    }
+    return Status::OK();
+}
+
+Status db_added_samples(std::shared_ptr<spdlog::logger> logger,
+                        KeyValue::DB *db,
+                        const string &previous_sampleset,
+                        string &added_sampleset,
+                        string &all_sampleset) {
+    Status s;
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db, data));
+    unique_ptr<MetadataCache> metadata;
+    S(MetadataCache::Start(*data, metadata));
+
+    S(data->all_samples_sampleset(all_sampleset));
+    shared_ptr<const set<string>> all_samples, previous_samples;
+    S(metadata->sampleset_samples(all_sampleset, all_samples));
+    S(metadata->sampleset_samples(previous_sampleset, previous_samples));
+    set<string> added;
+    set_difference(all_samples->begin(), all_samples->end(),
+                   previous_samples->begin(), previous_samples->end(),
+                   inserter(added, added.end()));
+    if (added.empty()) {
+        return Status::Invalid("no samples were added since the previous run", previous_sampleset);
+    }
+
+    // name the sample set after the version of the all-samples one ("*@k")
+    added_sampleset = "added." + all_sampleset.substr(all_sampleset.find('@')+1);
+    S(data->new_sampleset(*metadata, added_sampleset, added));
+    logger->info("Created sample set {} of the {} samples added to the {} of {}",
+                 added_sampleset, added.size(), previous_samples->size(), previous_sampleset);
+    return Status::OK();
+}
+
+void reusable_sites(const genotyper_config &genotyper_cfg,
+                    const vector<unified_site> &previous_sites,
+                    const vector<unified_site> &sites,
+                    vector<bool> &ans) {
+    assert(is_sorted(previous_sites.begin(), previous_sites.end()));
+    ans.assign(sites.size(), false);
+    auto p = previous_sites.begin();
+    for (size_t i = 0; i < sites.size(); i++) {
+        const range& pos = sites[i].pos;
+        while (p != previous_sites.end() && p->pos < pos) {
+            p++;
+        }
+        // there may be several sites at a position (e.g. monoallelic ones)
+        for (auto q = p; q != previous_sites.end() && q->pos == pos; q++) {
+            if (genotype_site_samples_equivalent(genotyper_cfg, *q, sites[i])) {
+                ans[i] = true;
+                break;
+            }
+        }
+    }
+}
+
 Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
                                       const std::string &dbpath,
                                       int n_iter) {
@@ -1691,4 +2247,32 @@ Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status compare_ref_band_encoding(std::shared_ptr<spdlog::logger> logger,
+                                 const std::string &dbpath,
+                                 bool convert,
+                                 BCFKeyValueData::ref_band_encoding_stats &stats) {
+    Status s;
+
+    unique_ptr<KeyValue::DB> db;
+    RocksKeyValue::config cfg;
+    cfg.mode = convert ? RocksKeyValue::OpenMode::NORMAL : RocksKeyValue::OpenMode::READ_ONLY;
+    cfg.pfx = GLnexus_prefix_spec();
+    S(RocksKeyValue::Open(dbpath, cfg, db));
+
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db.get(), data));
+
+    S(data->compare_ref_band_encoding(convert, stats));
+    logger->info("reference band encodings: {}", stats.str());
+    if (stats.plain_bytes) {
+        logger->info("columnar buckets are {:.1f}% the size of plain ones",
+                     100.0 * stats.columnar_bytes / stats.plain_bytes);
+    }
+    if (convert) {
+        S(db->flush());
+        logger->info("converted {} buckets", stats.buckets);
+    }
+    return Status::OK();
+}
+
 }}}
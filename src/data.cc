@@ -16,6 +16,7 @@ public:
 };
 using StringCache = fcmm::Fcmm<string,string,hash<string>,KStringHash>;
 using StringSetCache = fcmm::Fcmm<string,shared_ptr<const set<string>>,hash<string>,KStringHash>;
+using SamplesetIdsCache = fcmm::Fcmm<string,shared_ptr<const sampleset_ids>,hash<string>,KStringHash>;
 // this is not a hard limit but the FCMM performance degrades if it's too low
 const size_t CACHE_SIZE = 4096;
 
@@ -25,6 +26,7 @@ struct MetadataCache::body {
     unique_ptr<StringSetCache> sampleset_samples_cache;
     unique_ptr<StringCache> sample_dataset_cache;
     unique_ptr<StringSetCache> sampleset_datasets_cache;
+    unique_ptr<SamplesetIdsCache> sampleset_ids_cache;
 };
 
 MetadataCache::MetadataCache() = default;
@@ -37,6 +39,7 @@ Status MetadataCache::Start(Metadata& inner, unique_ptr<MetadataCache>& ptr) {
     ptr->body_->sampleset_samples_cache = make_unique<StringSetCache>(CACHE_SIZE);
     ptr->body_->sample_dataset_cache = make_unique<StringCache>(16 * CACHE_SIZE);
     ptr->body_->sampleset_datasets_cache = make_unique<StringSetCache>(CACHE_SIZE);
+    ptr->body_->sampleset_ids_cache = make_unique<SamplesetIdsCache>(CACHE_SIZE);
     return ptr->body_->inner->contigs(ptr->body_->contigs);
 }
 
@@ -74,6 +77,57 @@ Status MetadataCache::sample_dataset(const string& sample, string& ans) const {
     return Status::OK();
 }
 
+shared_ptr<BCFRecordPool> BCFRecordPool::Create(size_t capacity) {
+    return shared_ptr<BCFRecordPool>(new BCFRecordPool(capacity));
+}
+
+shared_ptr<BCFRecordPool> BCFRecordPool::ThreadLocal() {
+    static thread_local shared_ptr<BCFRecordPool> pool = Create();
+    return pool;
+}
+
+BCFRecordPool::~BCFRecordPool() {
+    for (bcf1_t* rec : free_) {
+        bcf_destroy(rec);
+    }
+}
+
+bcf1_t* BCFRecordPool::get_raw() {
+    bcf1_t* rec = nullptr;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!free_.empty()) {
+            rec = free_.back();
+            free_.pop_back();
+        }
+    }
+    if (rec) {
+        reused_++;
+    } else {
+        rec = bcf_init();
+        allocated_++;
+    }
+    return rec;
+}
+
+shared_ptr<bcf1_t> BCFRecordPool::get() {
+    // the deleter keeps the pool alive until the record returns to it
+    auto self = shared_from_this();
+    return shared_ptr<bcf1_t>(get_raw(), [self](bcf1_t* p) { self->put(p); });
+}
+
+void BCFRecordPool::put(bcf1_t* rec) {
+    bcf_clear(rec);
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (free_.size() < capacity_) {
+            free_.push_back(rec);
+            return;
+        }
+    }
+    bcf_destroy(rec);
+}
+
 Status MetadataCache::all_samples_sampleset(string& ans) {
     // not safe to cache this as it's not immutable
     return body_->inner->all_samples_sampleset(ans);
@@ -83,6 +137,40 @@ Status MetadataCache::sample_count(size_t& ans) const {
     return body_->inner->sample_count(ans);
 }
 
+static int sorted_index(const vector<string>& v, const string& x) {
+    auto p = lower_bound(v.begin(), v.end(), x);
+    return (p != v.end() && *p == x) ? int(p - v.begin()) : -1;
+}
+
+int sampleset_ids::sample_id(const string& sample) const {
+    return sorted_index(samples, sample);
+}
+
+int sampleset_ids::dataset_id(const string& dataset) const {
+    return sorted_index(datasets, dataset);
+}
+
+Status MetadataCache::sampleset_ids(const string& sampleset,
+                                    shared_ptr<const GLnexus::sampleset_ids>& ans) const {
+    auto cached = body_->sampleset_ids_cache->end();
+    if ((cached = body_->sampleset_ids_cache->find(sampleset))
+            != body_->sampleset_ids_cache->end()) {
+        ans = cached->second;
+        assert(ans);
+        return Status::OK();
+    }
+
+    Status s;
+    shared_ptr<const set<string>> samples, datasets;
+    S(sampleset_datasets(sampleset, samples, datasets));
+    auto ids = make_shared<GLnexus::sampleset_ids>();
+    ids->samples.assign(samples->begin(), samples->end());
+    ids->datasets.assign(datasets->begin(), datasets->end());
+    ans = ids;
+    body_->sampleset_ids_cache->insert(make_pair(sampleset,ans));
+    return Status::OK();
+}
+
 const vector<pair<string,size_t> >& MetadataCache::contigs() const {
     return body_->contigs;
 }
@@ -114,10 +202,39 @@ Status MetadataCache::sampleset_datasets(const string& sampleset,
 
 Status BCFData::dataset_range_and_header(const string& dataset, const range& pos, bcf_predicate predicate,
                                          shared_ptr<const bcf_hdr_t>* hdr,
-                                         vector<shared_ptr<bcf1_t>>* records) {
+                                         vector<shared_ptr<bcf1_t>>* records,
+                                         unsigned flags,
+                                         const bcf_projection* projection) {
     Status s;
     S(dataset_header(dataset, hdr));
-    return dataset_range(dataset, hdr->get(), pos, predicate, records);
+    return dataset_range(dataset, hdr->get(), pos, predicate, records, flags, projection);
+}
+
+BCFData::ref_band BCFData::ref_band::of_record(const bcf_hdr_t* hdr, bcf1_t* record) {
+    int32_t *v = nullptr, nv = 0;
+    auto format_value = [&](const char* field) {
+        return bcf_get_format_int32(hdr, record, field, &v, &nv) > 0 ? v[0] : bcf_int32_missing;
+    };
+    int32_t gq = format_value("GQ"), min_dp = format_value("MIN_DP"), dp = format_value("DP");
+    bool hom_ref = record->n_sample >= 1 && bcf_get_genotypes(hdr, record, &v, &nv) == 2*record->n_sample
+                   && !bcf_gt_is_missing(v[0]) && bcf_gt_allele(v[0]) == 0
+                   && !bcf_gt_is_missing(v[1]) && bcf_gt_allele(v[1]) == 0;
+    free(v);
+    return ref_band(range(record), gq, min_dp, dp, hom_ref);
+}
+
+Status BCFData::dataset_ref_bands(const string& dataset, const bcf_hdr_t* hdr,
+                                  const range& pos, vector<ref_band>& ans) {
+    Status s;
+    ans.clear();
+    vector<shared_ptr<bcf1_t>> records;
+    S(dataset_range(dataset, hdr, pos, nullptr, &records));
+    for (const auto& rec : records) {
+        if (is_gvcf_ref_record(rec.get())) {
+            ans.push_back(ref_band::of_record(hdr, rec.get()));
+        }
+    }
+    return Status::OK();
 }
 
 // default sampleset_range implementation:
@@ -132,12 +249,16 @@ class DefaultRangeBCFIteratorImpl : public RangeBCFIterator {
     shared_ptr<const set<string>> datasets_;
     set<string>::const_iterator it_;
     bcf_predicate predicate_;
+    unsigned flags_;
+    shared_ptr<const bcf_projection> projection_;
 
 public:
     DefaultRangeBCFIteratorImpl(BCFData& data, range range, bool first_range, bcf_predicate predicate,
+                                unsigned flags, const shared_ptr<const bcf_projection>& projection,
                                 shared_ptr<const set<string>>& datasets)
         : data_(data), range_(range), first_range_(first_range),
-          datasets_(datasets), it_(datasets->begin()), predicate_(predicate) {}
+          datasets_(datasets), it_(datasets->begin()), predicate_(predicate), flags_(flags),
+          projection_(projection) {}
 
     Status next(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
                 vector<shared_ptr<bcf1_t>>& records) override {
@@ -146,8 +267,11 @@ public:
         }
         dataset = *it_++;
 
+        // release the previous records first, so they can be recycled
+        records.clear();
         vector<shared_ptr<bcf1_t>> all_records;
-        Status s = data_.dataset_range_and_header(dataset, range_, predicate_, &hdr, &all_records);
+        Status s = data_.dataset_range_and_header(dataset, range_, predicate_, &hdr, &all_records, flags_,
+                                                  projection_.get());
         if (s.bad()) {
              if (s == StatusCode::NOT_FOUND) {
                 // censor this error so caller doesn't think this is the normal
@@ -174,13 +298,36 @@ public:
                 }
             }
         }
-        records.clear();
-        records.insert(records.begin(), all_records.begin()+skip, all_records.end());
+        records.insert(records.begin(), make_move_iterator(all_records.begin()+skip),
+                       make_move_iterator(all_records.end()));
 
         return Status::OK();
     }
 };
 
+Status BCFData::sampleset_columns(const MetadataCache& metadata, const string& sampleset,
+                                  shared_ptr<const GLnexus::sampleset_columns>& ans) {
+    Status s;
+    auto columns = make_shared<GLnexus::sampleset_columns>();
+    S(metadata.sampleset_ids(sampleset, columns->ids));
+    const auto& ids = *(columns->ids);
+    for (const auto& dataset : ids.datasets) {
+        shared_ptr<const bcf_hdr_t> hdr;
+        S(dataset_header(dataset, &hdr));
+        column_mapping mapping;
+        for (int i = 0; i < bcf_hdr_nsamples(hdr.get()); i++) {
+            int sample = ids.sample_id(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, i));
+            mapping.sample_of_column.push_back(sample);
+            if (sample >= 0) {
+                mapping.columns.push_back(make_pair(i, sample));
+            }
+        }
+        columns->datasets.push_back(move(mapping));
+    }
+    ans = columns;
+    return Status::OK();
+}
+
 /* A naive implementation that splits the range into fixed sized
  * sub-ranges. Inside a sub-range, it iterates over the datasets, and
  * reads their records with point lookups.
@@ -193,16 +340,23 @@ Status BCFData::sampleset_range(const MetadataCache& metadata, const string& sam
                                 const range& pos, bcf_predicate predicate,
                                 shared_ptr<const set<string>>& samples,
                                 shared_ptr<const set<string>>& datasets,
-                                vector<unique_ptr<RangeBCFIterator>>& iterators) {
+                                vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                unsigned flags,
+                                const bcf_projection* projection) {
     const int RANGE_STEP = 100000;
     Status s;
     S(metadata.sampleset_datasets(sampleset, samples, datasets));
+    shared_ptr<const bcf_projection> projection_copy;
+    if (projection) {
+        projection_copy = make_shared<bcf_projection>(*projection);
+    }
 
     iterators.clear();
     bool first = true;
     for (int beg = pos.beg; beg < pos.end; beg += RANGE_STEP) {
         range sub(pos.rid, beg, min(pos.end,beg+RANGE_STEP));
-        iterators.push_back(make_unique<DefaultRangeBCFIteratorImpl>(*this, sub, first, predicate, datasets));
+        iterators.push_back(make_unique<DefaultRangeBCFIteratorImpl>(*this, sub, first, predicate, flags,
+                                                                 projection_copy, datasets));
         first = false;
     }
 
@@ -1,10 +1,128 @@
 #include "discovery.h"
 #include "diploid.h"
+#include "BCFSerialize.h"
+#include "executor.h"
 
 using namespace std;
 
 namespace GLnexus {
 
+Status discover_alleles_from_record(const string& dataset, const bcf_hdr_t* hdr, bcf1_t* record,
+                                    const vector<unsigned>& samples,
+                                    vector<pair<allele,discovered_allele_info>>& ans) {
+    Status s;
+    ans.clear();
+    range rng(record);
+    bool filtered = (bcf_has_filter(hdr, record, ".") == 0);
+
+    // find the max AQ for each allele based on the genotype likelihoods
+    vector<top_AQ> topAQ;
+    S(diploid::bcf_alleles_topAQ(hdr, record, samples, topAQ));
+
+    // xAtlas special case: if we have an INFO field "P", override
+    //   AQ = -10log_10(1-P)
+    htsvecbox<float> xAtlasP;
+    if (bcf_get_info_float(hdr, record, "P", &xAtlasP.v, &xAtlasP.capacity) == 1) {
+        if (record->n_allele != 2 || record->n_sample != 1) {
+            ostringstream errmsg;
+            errmsg << dataset << "@" << rng.str();
+            return Status::Invalid("unexpected: multiple samples or alternate alleles in gVCF record with P field (assumed xAtlas)", errmsg.str());
+        }
+        vector<int> xAQ;
+        for (auto s : samples) {
+            assert(s == 0);
+            float p = xAtlasP[s];
+            if (p != p || p < 0.0 || p > 1.0) {
+                ostringstream errmsg;
+                errmsg << dataset << " " << to_string(p) << "@" << rng.str();
+                return Status::Invalid("invalid P-value", errmsg.str());
+            }
+            xAQ.push_back(p == 1.0 ? 9999 : int(-10*log10f(1-p)));
+        }
+        assert(topAQ.size() == 2);
+        topAQ[1].clear();
+        topAQ[1] += xAQ;
+    }
+
+    // find zygosity_by_GQ for each allele
+    vector<zygosity_by_GQ> zGQ;
+    S(diploid::bcf_zygosity_by_GQ(hdr, record, samples, zGQ));
+
+    // the ref allele
+    string refdna(record->d.allele[0]);
+    transform(refdna.begin(), refdna.end(), refdna.begin(), ::toupper);
+    if (refdna.size() == 0 || !is_iupac_nucleotides(refdna)) {
+        ostringstream errmsg;
+        errmsg << dataset << " " << refdna << "@" << rng.str();
+        return Status::Invalid("invalid reference allele", errmsg.str());
+    }
+    discovered_allele_info refai;
+    refai.is_ref = true;
+    refai.all_filtered = filtered;
+    refai.topAQ = topAQ[0]; assert(refai.topAQ.V[0] >= 0);
+    refai.zGQ = zGQ[0];
+    ans.push_back(make_pair(allele(rng, refdna), refai));
+
+    // each alt allele matching [ACGT]+
+    // In particular this excludes gVCF <NON_REF> symbolic alleles, and any
+    // ALT alleles containing IUPAC degenerate letters.
+    for (int i = 1; i < record->n_allele; i++) {
+        string aldna(record->d.allele[i]);
+        transform(aldna.begin(), aldna.end(), aldna.begin(), ::toupper);
+        if (aldna.size() > 0 && is_dna(aldna)) {
+            discovered_allele_info ai;
+            ai.is_ref = false;
+            ai.all_filtered = filtered;
+            ai.topAQ = topAQ[i]; assert(ai.topAQ.V[0] >= 0);
+            ai.zGQ = zGQ[i];
+            ans.push_back(make_pair(allele(rng, aldna), ai));
+        }
+    }
+    return Status::OK();
+}
+
+void discovered_alleles_of_record(const vector<pair<allele,discovered_allele_info>>& record_alleles,
+                                  const range& pos, bool include_zero_copies,
+                                  discovered_alleles& dsals) {
+    // we want to see at least one copy of an alt allele called (no GQ
+    // threshold), and the ref allele only alongside some alt allele.
+    bool any_alt = false;
+    for (size_t i = 1; i < record_alleles.size(); i++) {
+        const auto& ai = record_alleles[i].second;
+        if (include_zero_copies || ai.zGQ.copy_number(0) > 0) {
+            auto p = dsals.insert(record_alleles[i]);
+            if (p.second) {
+                p.first->second.in_target = pos;
+            }
+            any_alt = true;
+        }
+    }
+    if (any_alt) {
+        auto p = dsals.insert(record_alleles[0]);
+        if (p.second) {
+            p.first->second.in_target = pos;
+        }
+    }
+}
+
+// Discover the alleles in one data set's records, among the given samples
+static Status discover_alleles_from_dataset(const string& dataset, const bcf_hdr_t* hdr,
+                                            const vector<shared_ptr<bcf1_t>>& records,
+                                            const vector<unsigned>& samples,
+                                            const range& pos, bool include_zero_copies,
+                                            discovered_alleles& final_dsals) {
+    Status s;
+    discovered_alleles dsals;
+    vector<pair<allele,discovered_allele_info>> record_alleles;
+    for (const auto& record : records) {
+        assert(!is_gvcf_ref_record(record.get()));
+        assert(pos.overlaps(range(record)));
+        S(discover_alleles_from_record(dataset, hdr, record.get(), samples, record_alleles));
+        discovered_alleles_of_record(record_alleles, pos, include_zero_copies, dsals);
+    }
+    return merge_discovered_alleles(dsals, final_dsals);
+}
+
 Status discover_alleles_from_iterator(const set<string>& samples,
                                       const range& pos,
                                       RangeBCFIterator& iterator,
@@ -16,11 +134,8 @@ Status discover_alleles_from_iterator(const set<string>& samples,
     string dataset;
     shared_ptr<const bcf_hdr_t> dataset_header;
     vector<shared_ptr<bcf1_t>> records;
-    vector<vector<double>> copy_number;
     while ((s = iterator.next(dataset, dataset_header, records)).ok()) {
-        discovered_alleles dsals;
         // determine which of the dataset's samples are in the desired sample set
-        // TODO: FCMM-memoize this during the operation
         size_t dataset_nsamples = bcf_hdr_nsamples(dataset_header.get());
         vector<unsigned> dataset_relevant_samples;
         for (unsigned i = 0; i < dataset_nsamples; i++) {
@@ -28,87 +143,40 @@ Status discover_alleles_from_iterator(const set<string>& samples,
                 dataset_relevant_samples.push_back(i);
             }
         }
+        S(discover_alleles_from_dataset(dataset, dataset_header.get(), records, dataset_relevant_samples,
+                                        pos, include_zero_copies, final_dsals));
+        records.clear();
+    }
 
-        // for each BCF record
-        vector<top_AQ> topAQ;
-        vector<zygosity_by_GQ> zGQ;
-        htsvecbox<float> xAtlasP;
-        for (const auto& record : records) {
-            assert(!is_gvcf_ref_record(record.get()));
-            range rng(record);
-            assert(pos.overlaps(rng));
-            bool filtered = (bcf_has_filter(dataset_header.get(), record.get(), ".") == 0);
-
-            // find the max AQ for each allele based on the genotype likelihoods
-            S(diploid::bcf_alleles_topAQ(dataset_header.get(), record.get(), dataset_relevant_samples, topAQ));
-
-            // xAtlas special case: if we have an INFO field "P", override
-            //   AQ = -10log_10(1-P)
-            if (bcf_get_info_float(dataset_header.get(), record.get(), "P", &xAtlasP.v, &xAtlasP.capacity) == 1) {
-                if (record->n_allele != 2 || record->n_sample != 1) {
-                    ostringstream errmsg;
-                    errmsg << dataset << "@" << rng.str();
-                    return Status::Invalid("unexpected: multiple samples or alternate alleles in gVCF record with P field (assumed xAtlas)", errmsg.str());
-                }
-                vector<int> xAQ;
-                for (auto s : dataset_relevant_samples) {
-                    assert(s == 0);
-                    float p = xAtlasP[s];
-                    if (p != p || p < 0.0 || p > 1.0) {
-                        ostringstream errmsg;
-                        errmsg << dataset << " " << to_string(p) << "@" << rng.str();
-                        return Status::Invalid("invalid P-value", errmsg.str());
-                    }
-                    xAQ.push_back(p == 1.0 ? 9999 : int(-10*log10f(1-p)));
-                }
-                assert(topAQ.size() == 2);
-                topAQ[1].clear();
-                topAQ[1] += xAQ;
-            }
+    if (s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+    return Status::OK();
+}
 
-            // find zygosity_by_GQ for each allele
-            S(diploid::bcf_zygosity_by_GQ(dataset_header.get(), record.get(), dataset_relevant_samples, zGQ));
-
-            // create a discovered_alleles entry for each alt allele matching [ACGT]+
-            // In particular this excludes gVCF <NON_REF> symbolic alleles, and any
-            // ALT alleles containing IUPAC degenerate letters. Also, we want to see
-            // at least one copy of the allele called (no GQ threshold)
-            bool any_alt = false;
-            for (int i = 1; i < record->n_allele; i++) {
-                string aldna(record->d.allele[i]);
-                transform(aldna.begin(), aldna.end(), aldna.begin(), ::toupper);
-                if (aldna.size() > 0 && is_dna(aldna) && (include_zero_copies || zGQ[i].copy_number(0) > 0)) {
-                    discovered_allele_info ai;
-                    ai.is_ref = false;
-                    ai.all_filtered = filtered;
-                    ai.topAQ = topAQ[i]; assert(ai.topAQ.V[0] >= 0);
-                    ai.zGQ = zGQ[i];
-                    ai.in_target = pos;
-                    dsals.insert(make_pair(allele(rng, aldna), ai));
-                    any_alt = true;
-                }
-            }
+Status discover_alleles_from_iterator(const sampleset_columns& columns,
+                                      const range& pos,
+                                      RangeBCFIterator& iterator,
+                                      discovered_alleles& final_dsals,
+                                      bool include_zero_copies) {
+    Status s;
 
-            // create an entry for the ref allele, if we discovered at least one alt allele.
-            string refdna(record->d.allele[0]);
-            transform(refdna.begin(), refdna.end(), refdna.begin(), ::toupper);
-            if (refdna.size() > 0 && is_iupac_nucleotides(refdna)) {
-                if (any_alt) {
-                    discovered_allele_info ai;
-                    ai.is_ref = true;
-                    ai.all_filtered = filtered;
-                    ai.topAQ = topAQ[0]; assert(ai.topAQ.V[0] >= 0);
-                    ai.zGQ = zGQ[0];
-                    ai.in_target = pos;
-                    dsals.insert(make_pair(allele(rng, refdna), ai));
-                }
-            } else {
-                ostringstream errmsg;
-                errmsg << dataset << " " << refdna << "@" << rng.str();
-                return Status::Invalid("invalid reference allele", errmsg.str());
-            }
+    // the iterator yields the data sets in order, so the step number is the
+    // data set ID
+    string dataset;
+    shared_ptr<const bcf_hdr_t> dataset_header;
+    vector<shared_ptr<bcf1_t>> records;
+    vector<unsigned> dataset_relevant_samples;
+    for (size_t d = 0; (s = iterator.next(dataset, dataset_header, records)).ok(); d++) {
+        if (d >= columns.datasets.size() || columns.ids->datasets[d] != dataset) {
+            return Status::Failure("discover_alleles_from_iterator: iterator returned unexpected dataset", dataset);
+        }
+        dataset_relevant_samples.clear();
+        for (const auto& p : columns.datasets[d]) {
+            dataset_relevant_samples.push_back(p.first);
         }
-        S(merge_discovered_alleles(dsals, final_dsals));
+        S(discover_alleles_from_dataset(dataset, dataset_header.get(), records, dataset_relevant_samples,
+                                        pos, include_zero_copies, final_dsals));
         records.clear();
     }
 
@@ -118,6 +186,128 @@ Status discover_alleles_from_iterator(const set<string>& samples,
     return Status::OK();
 }
 
+Status discover_alleles_from_tile(BCFData& data, const sampleset_columns& columns,
+                                  size_t begin, size_t end,
+                                  const range& pos, const range& tile,
+                                  discovered_alleles& final_dsals,
+                                  bool include_zero_copies,
+                                  atomic<bool>* abort) {
+    Status s;
+    if (begin > end || end > columns.datasets.size() || !tile.within(pos)) {
+        return Status::Invalid("discover_alleles_from_tile: invalid tile", tile.str());
+    }
+    const bool first_tile = tile.beg == pos.beg;
+
+    const bcf_projection projection = discovery_projection();
+    shared_ptr<const bcf_hdr_t> dataset_header;
+    vector<shared_ptr<bcf1_t>> records;
+    vector<unsigned> dataset_relevant_samples;
+    for (size_t d = begin; d < end; d++) {
+        if (abort && *abort) {
+            return Status::Aborted();
+        }
+        const string& dataset = columns.ids->datasets[d];
+        S(data.dataset_header(dataset, &dataset_header));
+        S(data.dataset_range(dataset, dataset_header.get(), tile, nullptr,
+                             &records, BCF_RANGE_VARIANTS_ONLY, &projection));
+        if (!first_tile) {
+            // records beginning before the tile belong to an earlier one
+            records.erase(remove_if(records.begin(), records.end(),
+                                    [&](const shared_ptr<bcf1_t>& record) { return record->pos < tile.beg; }),
+                          records.end());
+        }
+        dataset_relevant_samples.clear();
+        for (const auto& p : columns.datasets[d]) {
+            dataset_relevant_samples.push_back(p.first);
+        }
+        S(discover_alleles_from_dataset(dataset, dataset_header.get(), records, dataset_relevant_samples,
+                                        pos, include_zero_copies, final_dsals));
+        records.clear();
+    }
+    return Status::OK();
+}
+
+// Merge part hi into part lo, releasing hi
+static Status merge_discovered_alleles_part(discovered_alleles& lo, discovered_alleles& hi) {
+    // merge the smaller map into the larger
+    if (lo.size() < hi.size()) {
+        swap(lo, hi);
+    }
+    Status s = merge_discovered_alleles(hi, lo);
+    discovered_alleles().swap(hi);
+    return s;
+}
+static Status merge_discovered_alleles_part(flat_discovered_alleles& lo, flat_discovered_alleles& hi) {
+    // in order, so that parts from disjoint ranges in order are appended
+    Status s = merge_discovered_alleles(hi, lo);
+    hi.clear();
+    return s;
+}
+
+// Merge parts[lo,hi) into parts[lo], merging the two halves in parallel
+// first. merge_discovered_alleles is commutative and associative (barring
+// which of several errors is reported), so the result doesn't depend on the
+// shape of the tree.
+template<class dsals_type>
+static Status merge_discovered_alleles_tree(Executor& executor, vector<dsals_type>& parts,
+                                            size_t lo, size_t hi) {
+    Status s;
+    if (hi - lo < 2) {
+        return Status::OK();
+    }
+    const size_t mid = lo + (hi - lo)/2;
+    Status s_hi;
+    {
+        TaskGroup tasks(executor);
+        tasks.run([&]() { s_hi = merge_discovered_alleles_tree(executor, parts, mid, hi); });
+        s = merge_discovered_alleles_tree(executor, parts, lo, mid);
+        tasks.wait();
+    }
+    S(s);
+    S(s_hi);
+    return merge_discovered_alleles_part(parts[lo], parts[mid]);
+}
+
+Status merge_discovered_alleles(Executor& executor, vector<discovered_alleles>& parts,
+                                discovered_alleles& ans) {
+    Status s;
+    S(merge_discovered_alleles_tree(executor, parts, 0, parts.size()));
+    if (!parts.empty()) {
+        if (ans.empty()) {
+            ans.swap(parts[0]);
+        } else {
+            S(merge_discovered_alleles(parts[0], ans));
+        }
+    }
+    parts.clear();
+    return Status::OK();
+}
+
+Status merge_discovered_alleles(Executor& executor, vector<flat_discovered_alleles>& parts,
+                                flat_discovered_alleles& ans) {
+    Status s;
+    S(merge_discovered_alleles_tree(executor, parts, 0, parts.size()));
+    if (!parts.empty()) {
+        if (ans.empty()) {
+            ans = move(parts[0]);
+        } else {
+            S(merge_discovered_alleles(parts[0], ans));
+        }
+    }
+    parts.clear();
+    return Status::OK();
+}
+
+bcf_projection discovery_projection() {
+    bcf_projection ans;
+    ans.raw_predicate = bcf_raw_has_nonsymbolic_alt;
+    ans.all_info = false;
+    ans.info = { "P" }; // xAtlas
+    ans.all_format = false;
+    ans.format = { "GT", "GQ", "PL", "GL" };
+    return ans;
+}
+
 Status discovered_alleles_refcheck(const discovered_alleles& als,
                                    const vector<pair<string,size_t>>& contigs) {
     set<range> ranges;
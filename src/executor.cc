@@ -0,0 +1,245 @@
+#include "executor.h"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <assert.h>
+
+using namespace std;
+
+namespace GLnexus {
+
+// the executor whose worker thread this is, if any, and the worker's index
+static thread_local const void* tl_executor = nullptr;
+static thread_local size_t tl_worker = 0;
+
+struct Executor::body {
+    struct task_queue {
+        mutex mutex_;
+        deque<function<void()>> tasks_;
+    };
+
+    vector<unique_ptr<task_queue>> workers_; // each worker's deque
+    task_queue shared_;                      // tasks spawned from outside
+    vector<thread> threads_;
+    atomic<size_t> active_;                  // workers taking on tasks (see set_threads)
+    atomic<size_t> queued_;                  // tasks in all the queues
+
+    // epoch_ advances whenever a task is spawned or finishes, and upon
+    // notify(); idle threads sleep until it does
+    atomic<uint64_t> epoch_;
+    atomic<size_t> sleepers_;
+    mutex idle_mutex_;
+    condition_variable idle_cv_;
+    atomic<bool> stop_;
+
+    body() : active_(0), queued_(0), epoch_(0), sleepers_(0), stop_(false) {}
+
+    void advance() {
+        epoch_++;
+        // a thread about to sleep increments sleepers_ before checking
+        // epoch_, so either it sees the new epoch or we see it
+        if (sleepers_) {
+            lock_guard<mutex> lock(idle_mutex_);
+            idle_cv_.notify_all();
+        }
+    }
+
+    bool pop(task_queue& q, bool newest, function<void()>& task) {
+        lock_guard<mutex> lock(q.mutex_);
+        if (q.tasks_.empty()) {
+            return false;
+        }
+        if (newest) {
+            task = move(q.tasks_.back());
+            q.tasks_.pop_back();
+        } else {
+            task = move(q.tasks_.front());
+            q.tasks_.pop_front();
+        }
+        return true;
+    }
+
+    void spawn(function<void()>&& task) {
+        task_queue& q = tl_executor == this ? *workers_[tl_worker] : shared_;
+        {
+            lock_guard<mutex> lock(q.mutex_);
+            q.tasks_.push_back(move(task));
+        }
+        queued_++;
+        advance();
+    }
+
+    bool run_one() {
+        if (!queued_) {
+            return false;
+        }
+        // own deque newest first, then the shared queue, then steal the
+        // oldest task from another worker
+        function<void()> task;
+        bool found = false;
+        size_t self = workers_.size();
+        if (tl_executor == this) {
+            self = tl_worker;
+            found = pop(*workers_[self], true, task);
+        }
+        if (!found) {
+            found = pop(shared_, false, task);
+        }
+        for (size_t k = 1; !found && k <= workers_.size(); k++) {
+            found = pop(*workers_[(self+k) % workers_.size()], false, task);
+        }
+        if (!found) {
+            return false;
+        }
+        queued_--;
+        task();
+        advance();
+        return true;
+    }
+
+    void wait_until(const function<bool()>& predicate, bool help) {
+        // a worker always helps, lest the pool run out of threads
+        help = help || tl_executor == this;
+        for (;;) {
+            uint64_t epoch = epoch_;
+            if (predicate()) {
+                return;
+            }
+            if (help && run_one()) {
+                continue;
+            }
+            sleep(epoch);
+        }
+    }
+
+    // sleep until the epoch advances past the given one
+    void sleep(uint64_t epoch) {
+        sleepers_++;
+        {
+            unique_lock<mutex> lock(idle_mutex_);
+            idle_cv_.wait(lock, [&]() { return epoch_ != epoch; });
+        }
+        sleepers_--;
+    }
+
+    // worker thread main loop. Workers beyond the active ones don't take on
+    // tasks here (though one still finishing a task helps with its subtasks
+    // while it waits on them).
+    void work() {
+        for (;;) {
+            uint64_t epoch = epoch_;
+            if (stop_) {
+                return;
+            }
+            if (tl_worker < active_ && run_one()) {
+                continue;
+            }
+            sleep(epoch);
+        }
+    }
+};
+
+Executor::Executor() {
+    body_.reset(new body);
+}
+
+Status Executor::Start(size_t threads, unique_ptr<Executor>& ans) {
+    if (threads == 0) {
+        threads = max(1U, thread::hardware_concurrency());
+    }
+    ans.reset(new Executor());
+    body* b = ans->body_.get();
+    for (size_t t = 0; t < threads; t++) {
+        b->workers_.emplace_back(new body::task_queue);
+    }
+    b->active_ = threads;
+    for (size_t t = 0; t < threads; t++) {
+        b->threads_.emplace_back([b, t]() {
+            tl_executor = b;
+            tl_worker = t;
+            b->work();
+        });
+    }
+    return Status::OK();
+}
+
+Executor::~Executor() {
+    body_->stop_ = true;
+    body_->advance();
+    for (auto& th : body_->threads_) {
+        th.join();
+    }
+    assert(body_->queued_ == 0);
+}
+
+Executor& Executor::Shared(size_t threads) {
+    // never destroyed, as tasks may be in flight when the process exits.
+    // Started with a thread per core (or more, if the first caller asks for
+    // more), of which later calls may set how many work.
+    static Executor* shared = [threads]() {
+        unique_ptr<Executor> ans;
+        Start(max<size_t>(threads, thread::hardware_concurrency()), ans);
+        return ans.release();
+    }();
+    if (threads) {
+        shared->set_threads(threads);
+    }
+    return *shared;
+}
+
+size_t Executor::threads() const {
+    return body_->active_;
+}
+
+void Executor::set_threads(size_t threads) {
+    size_t n = body_->threads_.size();
+    body_->active_ = threads ? min(threads, n) : n;
+    body_->advance();
+}
+
+void Executor::spawn(function<void()> task) {
+    body_->spawn(move(task));
+}
+
+bool Executor::run_one() {
+    return body_->run_one();
+}
+
+void Executor::wait_until(const function<bool()>& predicate, bool help) {
+    body_->wait_until(predicate, help);
+}
+
+void Executor::notify() {
+    body_->advance();
+}
+
+TaskGroup::~TaskGroup() {
+    executor_.wait_until([this]() { return pending_ == 0; }, true);
+}
+
+void TaskGroup::run(function<void()> task) {
+    pending_++;
+    executor_.spawn([this, task]() {
+        try {
+            task();
+        } catch (...) {
+            lock_guard<mutex> lock(mutex_);
+            if (!exception_) {
+                exception_ = current_exception();
+            }
+        }
+        pending_--;
+    });
+}
+
+void TaskGroup::wait() {
+    executor_.wait_until([this]() { return pending_ == 0; }, true);
+    if (exception_) {
+        exception_ptr e = exception_;
+        exception_ = nullptr;
+        rethrow_exception(e);
+    }
+}
+
+}
@@ -93,7 +93,7 @@ static inline bool is_deletion(const string& ref, const string& alt) {
 ///      shrink to the next most likely heterozygous genotype.
 /// Mutates the vr.p pointer.
 Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
-                        const map<int, int>& sample_mapping,
+                        const column_mapping& sample_mapping,
                         const bcf_hdr_t* hdr, bcf1_t_plus& vr) {
     assert(!vr.is_ref);
     // Speed optimization: our prior on genotypes will be effectively flat
@@ -261,7 +261,7 @@ Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
 ///        variant records
 Status prepare_dataset_records(const genotyper_config& cfg, const unified_site& site,
                                const string& dataset, const bcf_hdr_t* hdr, int bcf_nsamples,
-                               const map<int, int>& sample_mapping,
+                               const column_mapping& sample_mapping,
                                const vector<shared_ptr<bcf1_t>>& records,
                                AlleleDepthHelper& depth,
                                NoCallReason& rnc,
@@ -362,7 +362,7 @@ Status prepare_dataset_records(const genotyper_config& cfg, const unified_site&
 /// FIXME: not coded to deal with multi-sample gVCFs properly.
 static Status translate_genotypes(const genotyper_config& cfg, const unified_site& site,
                                   const string& dataset, const bcf_hdr_t* dataset_header,
-                                  int bcf_nsamples, const map<int,int>& sample_mapping,
+                                  int bcf_nsamples, const column_mapping& sample_mapping,
                                   const vector<shared_ptr<bcf1_t_plus>>& variant_records,
                                   AlleleDepthHelper& depth,
                                   vector<int>& min_ref_depth,
@@ -595,7 +595,7 @@ static Status translate_genotypes(const genotyper_config& cfg, const unified_sit
 /// FIXME: not coded to deal with multi-sample gVCFs properly.
 static Status translate_monoallelic(const genotyper_config& cfg, const unified_site& site,
                                     const string& dataset, const bcf_hdr_t* dataset_header,
-                                    int bcf_nsamples, const map<int,int>& sample_mapping,
+                                    int bcf_nsamples, const column_mapping& sample_mapping,
                                     const vector<shared_ptr<bcf1_t_plus>>& variant_records,
                                     AlleleDepthHelper& depth,
                                     vector<int>& min_ref_depth,
@@ -679,185 +679,217 @@ static Status translate_monoallelic(const genotyper_config& cfg, const unified_s
     return Status::OK();
 }
 
-Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
-                     const std::string& sampleset, const vector<string>& samples,
-                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
-                     bool residualsFlag, shared_ptr<string> &residual_rec,
-                     atomic<bool>* ext_abort) {
-    Status s;
-
-    // Initialize a vector for the unified genotype calls for each sample,
-    // starting with everything missing. We'll then loop through BCF records
-    // overlapping this site and fill in the genotypes as we encounter them.
-    vector<one_call> genotypes(2*samples.size());
-
-    // Setup format field helpers
-    vector<unique_ptr<FormatFieldHelper>> format_helpers;
-    S(setup_format_helpers(format_helpers, cfg, site, samples));
-
-    // query database for pertinent records across the samples -- the range
-    // encompassing all the original alleles
-    range query_range(site.pos);
+range genotype_site_query_range(const unified_site& site) {
+    range ans(site.pos);
     for (const auto& p : site.unification) {
         const range& pr = p.first.pos;
-        assert(pr.rid == query_range.rid);
-        query_range.beg = min(query_range.beg, pr.beg);
-        query_range.end = max(query_range.end, pr.end);
+        assert(pr.rid == ans.rid);
+        ans.beg = min(ans.beg, pr.beg);
+        ans.end = max(ans.end, pr.end);
     }
-    shared_ptr<const set<string>> samples2, datasets;
-    vector<unique_ptr<RangeBCFIterator>> iterators;
-    S(data.sampleset_range(cache, sampleset, query_range, nullptr,
-                           samples2, datasets, iterators));
-    assert(samples.size() == samples2->size());
+    return ans;
+}
 
-    auto adh = NewAlleleDepthHelper(cfg);
-    vector<DatasetResidual> lost_calls_info;
+bool genotype_site_samples_equivalent(const genotyper_config& cfg,
+                                      const unified_site& a, const unified_site& b) {
+    if (!(a.pos == b.pos) || a.monoallelic != b.monoallelic ||
+        a.unification != b.unification || a.alleles.size() != b.alleles.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.alleles.size(); i++) {
+        if (a.alleles[i].dna != b.alleles[i].dna ||
+            a.alleles[i].normalized != b.alleles[i].normalized) {
+            return false;
+        }
+    }
+    if (cfg.revise_genotypes) {
+        // the priors in revise_genotypes floor the frequencies
+        auto prior = [&cfg](float f) { return max(f, cfg.min_assumed_allele_frequency); };
+        if (prior(a.lost_allele_frequency) != prior(b.lost_allele_frequency)) {
+            return false;
+        }
+        for (size_t i = 1; i < a.alleles.size(); i++) {
+            if (prior(a.alleles[i].frequency) != prior(b.alleles[i].frequency)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-    map<string,int> samples_index;
-    for (int i = 0; i < samples.size(); i++) {
-        assert(samples_index.find(samples[i]) == samples_index.end());
-        samples_index[samples[i]] = i;
+bcf_projection genotyper_projection(const genotyper_config& cfg) {
+    bcf_projection ans;
+    ans.all_info = false;
+    ans.all_format = false;
+    ans.format = { "GT", "GQ", "PL", "GL", "DP", "AD", "MIN_DP", "RR", "VR",
+                   cfg.ref_dp_format, cfg.allele_dp_format };
+    for (const auto& field : cfg.liftover_fields) {
+        auto& names = field.from == RetainedFieldFrom::INFO ? ans.info : ans.format;
+        names.insert(field.orig_names.begin(), field.orig_names.end());
     }
+    return ans;
+}
 
-    // for each pertinent dataset
-    for (const auto& dataset : *datasets) {
-        if (ext_abort && *ext_abort) {
-            return Status::Aborted();
-        }
+// The unified calls and FORMAT fields for a site's samples, accumulated one
+// data set at a time before assembling the output record
+struct site_genotypes {
+    vector<one_call> genotypes;
+    vector<unique_ptr<FormatFieldHelper>> format_helpers;
+    unique_ptr<AlleleDepthHelper> adh;
+    vector<DatasetResidual> lost_calls_info;
+};
 
-        // load BCF records overlapping the site by "merging" the iterators
-        shared_ptr<const bcf_hdr_t> dataset_header;
-        vector<vector<shared_ptr<bcf1_t>>> recordss(iterators.size());
-        vector<shared_ptr<bcf1_t>> records;
+static Status start_site_genotypes(const genotyper_config& cfg, const unified_site& site,
+                                   const vector<string>& samples, site_genotypes& ans) {
+    // Initialize a vector for the unified genotype calls for each sample,
+    // starting with everything missing. We'll then loop through BCF records
+    // overlapping this site and fill in the genotypes as we encounter them.
+    ans.genotypes.assign(2*samples.size(), one_call());
 
-        for (const auto& iter : iterators) {
-            string this_dataset;
-            vector<shared_ptr<bcf1_t>> these_records;
-            S(iter->next(this_dataset, dataset_header, these_records));
-            if (dataset != this_dataset) {
-                return Status::Failure("genotype_site: iterator returned unexpected dataset",
-                                       this_dataset + " instead of " + dataset);
-            }
-            records.insert(records.end(), these_records.begin(), these_records.end());
-        }
+    // Setup format field helpers
+    ans.format_helpers.clear();
+    Status s;
+    S(setup_format_helpers(ans.format_helpers, cfg, site, samples));
 
-        assert(is_sorted(records.begin(), records.end(),
-                         [] (shared_ptr<bcf1_t>& p1, shared_ptr<bcf1_t>& p2) {
-                            return range(p1) < range(p2);
-                         }));
+    ans.adh = NewAlleleDepthHelper(cfg);
+    ans.lost_calls_info.clear();
+    return Status::OK();
+}
 
-        // index the samples shared between the sample set and the BCFs.
-        // this could be cached on sampleset/dataset cross
-        map<int,int> sample_mapping;
-        int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
-        for (int i = 0; i < bcf_nsamples; i++) {
-            string sample_i(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i));
-            const auto p = samples_index.find(sample_i);
-            if (p != samples_index.end()) {
-                sample_mapping[i] = p->second;
-            }
-        }
-        if (sample_mapping.empty()) {
-            continue;
+// Genotype the site's samples in one data set, given its records overlapping
+// genotype_site_query_range(site)
+static Status genotype_site_dataset(const genotyper_config& cfg, const unified_site& site,
+                                    const string& dataset, const shared_ptr<const bcf_hdr_t>& dataset_header,
+                                    const column_mapping& sample_mapping,
+                                    const vector<shared_ptr<bcf1_t>>& records,
+                                    bool residualsFlag, site_genotypes& state) {
+    Status s;
+    vector<one_call>& genotypes = state.genotypes;
+    auto& format_helpers = state.format_helpers;
+
+    assert(is_sorted(records.begin(), records.end(),
+                     [] (const shared_ptr<bcf1_t>& p1, const shared_ptr<bcf1_t>& p2) {
+                        return range(p1) < range(p2);
+                     }));
+
+    int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
+    if (sample_mapping.sample_of_column.size() != bcf_nsamples) {
+        return Status::Invalid("genotype_site: column mapping doesn't correspond to the data set header", dataset);
+    }
+    if (sample_mapping.empty()) {
+        return Status::OK();
+    }
+
+    // pre-process the records
+    vector<int> min_ref_depth(genotypes.size()/2, -1);
+    vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
+    NoCallReason rnc = NoCallReason::MissingData;
+    S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, records, *state.adh, rnc, min_ref_depth,
+                              all_records, variant_records));
+
+    if (rnc != NoCallReason::N_A) {
+        // no call for the samples in this dataset (several possible
+        // reasons)
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC =
+                genotypes[p.second*2+1].RNC = rnc;
         }
+    } else if (!site.monoallelic) {
+        // make genotype calls for the samples in this dataset
+        S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, variant_records, *state.adh, min_ref_depth,
+                              genotypes, variant_records_used));
+    } else {
+        S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                                sample_mapping, variant_records, *state.adh, min_ref_depth,
+                                genotypes, variant_records_used));
+    }
 
-        // pre-process the records
-        vector<int> min_ref_depth(samples.size(), -1);
-        vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
-        NoCallReason rnc = NoCallReason::MissingData;
-        S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, records, *adh, rnc, min_ref_depth,
-                                  all_records, variant_records));
-
-        if (rnc != NoCallReason::N_A) {
-            // no call for the samples in this dataset (several possible
-            // reasons)
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC =
-                    genotypes[p.second*2+1].RNC = rnc;
-            }
-        } else if (!site.monoallelic) {
-            // make genotype calls for the samples in this dataset
-            S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, variant_records, *adh, min_ref_depth,
-                                  genotypes, variant_records_used));
-        } else {
-            S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                    sample_mapping, variant_records, *adh, min_ref_depth,
-                                    genotypes, variant_records_used));
-        }
-
-        // Update FORMAT fields for this dataset.
-        if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                format_helpers, all_records, variant_records_used));
-            // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
-            // we must censor the FORMAT fields as potentially unreliable/misleading.
-            for (const auto& p : sample_mapping) {
-                auto rnc1 = genotypes[p.second*2].RNC;
-                auto rnc2 = genotypes[p.second*2+1].RNC;
-                bool half_call = site.monoallelic || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
-
-                if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
-                    assert(rnc1 == rnc2);
-                    for (const auto& fh : format_helpers) {
-                        S(fh->censor(p.second, false));
-                    }
-                } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
-                        rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
-                            S(fh->censor(p.second, half_call));
-                        }
+    // Update FORMAT fields for this dataset.
+    if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
+                            format_helpers, all_records, variant_records_used));
+        // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
+        // we must censor the FORMAT fields as potentially unreliable/misleading.
+        for (const auto& p : sample_mapping) {
+            auto rnc1 = genotypes[p.second*2].RNC;
+            auto rnc2 = genotypes[p.second*2+1].RNC;
+            bool half_call = site.monoallelic || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
+
+            if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
+                assert(rnc1 == rnc2);
+                for (const auto& fh : format_helpers) {
+                    S(fh->censor(p.second, false));
+                }
+            } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
+                    rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
+                        S(fh->censor(p.second, half_call));
                     }
-                } else if (half_call) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
-                            && fh->field_info.name != "FT") {
-                            S(fh->censor(p.second, true));
-                        }
+                }
+            } else if (half_call) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
+                        && fh->field_info.name != "FT") {
+                        S(fh->censor(p.second, true));
                     }
                 }
             }
-        } else {
-            // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
-            //   Update DP only and apply squeeze transform
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                   format_helpers, all_records, variant_records_used, true));
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC = NoCallReason::N_A;
-                genotypes[p.second*2+1].RNC = NoCallReason::N_A;
-            }
         }
+    } else {
+        // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
+        //   Update DP only and apply squeeze transform
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
+                               format_helpers, all_records, variant_records_used, true));
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC = NoCallReason::N_A;
+            genotypes[p.second*2+1].RNC = NoCallReason::N_A;
+        }
+    }
 
-        // Handle residuals
-        if (residualsFlag) {
-            // TODO: don't emit residuals for lost alleles which will be represented in
-            // a separate monoallelic site
-            const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
-                                                          NoCallReason::PartialData, NoCallReason::InsufficientDepth,
-                                                          NoCallReason::MonoallelicSite };
+    // Handle residuals
+    if (residualsFlag) {
+        // TODO: don't emit residuals for lost alleles which will be represented in
+        // a separate monoallelic site
+        const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
+                                                      NoCallReason::PartialData, NoCallReason::InsufficientDepth,
+                                                      NoCallReason::MonoallelicSite };
 
-            bool any_lost_calls = false;
-            for (int i = 0; i < bcf_nsamples; i++) {
-                if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
-                    non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
-                    any_lost_calls = true;
-                    break;
-                }
+        bool any_lost_calls = false;
+        for (int i = 0; i < bcf_nsamples; i++) {
+            if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
+                non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
+                any_lost_calls = true;
+                break;
             }
+        }
 
-            if (any_lost_calls) {
-                // missing call, keep it in memory
-                DatasetResidual dsr;
-                dsr.name = dataset;
-                dsr.header = dataset_header;
-                dsr.records = records;
-                lost_calls_info.push_back(dsr);
-            }
+        if (any_lost_calls) {
+            // missing call, keep it in memory
+            DatasetResidual dsr;
+            dsr.name = dataset;
+            dsr.header = dataset_header;
+            dsr.records = records;
+            state.lost_calls_info.push_back(dsr);
         }
     }
 
+    return Status::OK();
+}
+
+// Assemble the output record from the calls accumulated for all the data sets
+static Status finish_site_genotypes(const genotyper_config& cfg, MetadataCache& cache,
+                                    const unified_site& site, const vector<string>& samples,
+                                    const bcf_hdr_t* hdr, site_genotypes& state,
+                                    shared_ptr<bcf1_t>& ans,
+                                    bool residualsFlag, shared_ptr<string>& residual_rec) {
+    Status s;
+    vector<one_call>& genotypes = state.genotypes;
+    auto& format_helpers = state.format_helpers;
+    const auto& lost_calls_info = state.lost_calls_info;
+
     // Clean up emission order of alleles
     for(size_t i=0; i < samples.size(); i++) {
         if ((genotypes[2*i].allele != bcf_gt_missing && genotypes[2*i+1].allele == bcf_gt_missing) ||
@@ -1014,4 +1046,362 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     return Status::OK();
 }
 
+// The depth of a reference band in the FORMAT field (MIN_DP or DP), if the
+// band summary holds it
+static int32_t ref_band_depth(const BCFData::ref_band& band, const string& field) {
+    if (field == "MIN_DP") {
+        return band.min_dp;
+    } else if (field == "DP") {
+        return band.dp;
+    }
+    return bcf_int32_missing;
+}
+
+// Whether the configuration lets sites be genotyped from reference band
+// summaries (genotype_site_dataset_ref_bands): squeezing, so that only the
+// reference depth and DP are read from the bands, both from MIN_DP or DP.
+// dp_field is set to the field DP is lifted over from (empty if none).
+static bool ref_bands_suffice(const genotyper_config& cfg, string& dp_field) {
+    auto summarized = [](const string& field) { return field == "MIN_DP" || field == "DP"; };
+    dp_field.clear();
+    if (!cfg.squeeze || !summarized(cfg.ref_dp_format)) {
+        return false;
+    }
+    for (const auto& field : cfg.liftover_fields) {
+        if (field.name == "DP") {
+            if (field.from != RetainedFieldFrom::FORMAT || field.orig_names.empty() ||
+                !summarized(field.orig_names[0]) || !dp_field.empty()) {
+                return false;
+            }
+            dp_field = field.orig_names[0];
+        }
+    }
+    return true;
+}
+
+// Genotype the site's sample in a single-sample data set with no variant
+// records overlapping genotype_site_query_range(site), given the summaries of
+// its reference bands overlapping that range, with the same result as
+// genotype_site_dataset on the records (which takes the squeeze short path,
+// needing only their depths). Leaves done false, with no side effects, if the
+// summaries don't suffice (partial coverage, GT other than 0/0, or missing
+// depths), in which case the caller should supply the records after all.
+static Status genotype_site_dataset_ref_bands(const genotyper_config& cfg, const unified_site& site,
+                                              const string& dataset,
+                                              const shared_ptr<const bcf_hdr_t>& dataset_header,
+                                              const column_mapping& sample_mapping,
+                                              const string& dp_field,
+                                              const vector<BCFData::ref_band>& bands,
+                                              bool residualsFlag, site_genotypes& state, bool& done) {
+    Status s;
+    done = false;
+    if (bcf_hdr_nsamples(dataset_header.get()) != 1 || sample_mapping.sample_of_column.size() != 1) {
+        return Status::OK();
+    }
+
+    // the bands overlapping the site are the records genotype_site_dataset
+    // would consider
+    vector<range> band_rngs;
+    vector<int32_t> dps;
+    int32_t ref_depth = -1;
+    for (const auto& band : bands) {
+        if (!band.pos.overlaps(site.pos)) {
+            continue;
+        }
+        int32_t rd = ref_band_depth(band, cfg.ref_dp_format);
+        int32_t dp = dp_field.empty() ? 0 : ref_band_depth(band, dp_field);
+        if (!band.hom_ref || rd < 0 || dp == bcf_int32_missing || dp == bcf_int32_vector_end) {
+            return Status::OK();
+        }
+        ref_depth = ref_depth < 0 ? rd : min(ref_depth, rd);
+        dps.push_back(dp);
+        band_rngs.push_back(band.pos);
+    }
+    if (band_rngs.empty()) {
+        // MissingData, as from no records at all
+        done = true;
+        return genotype_site_dataset(cfg, site, dataset, dataset_header, sample_mapping, {},
+                                     residualsFlag, state);
+    }
+    if (!cfg.allow_partial_data && !site.pos.spanned_by(band_rngs)) {
+        return Status::OK();
+    }
+    done = true;
+
+    // hom ref calls given sufficient depth
+    const int sample = sample_mapping.at(0);
+    vector<int> min_ref_depth(state.genotypes.size()/2, -1);
+    min_ref_depth[sample] = ref_depth;
+    vector<shared_ptr<bcf1_t_plus>> no_variant_records, variant_records_used;
+    if (!site.monoallelic) {
+        S(translate_genotypes(cfg, site, dataset, dataset_header.get(), 1, sample_mapping,
+                              no_variant_records, *state.adh, min_ref_depth, state.genotypes,
+                              variant_records_used));
+    } else {
+        S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), 1, sample_mapping,
+                                no_variant_records, *state.adh, min_ref_depth, state.genotypes,
+                                variant_records_used));
+    }
+
+    // squeeze: DP only (cf. update_format_fields)
+    for (const auto& fh : state.format_helpers) {
+        if (fh->field_info.name != "DP") {
+            S(fh->censor(sample, false));
+            continue;
+        }
+        auto dp_helper = dynamic_cast<DPFieldHelper*>(fh.get());
+        assert(dp_helper);
+        for (int32_t dp : dps) {
+            dp_helper->add_ref_band_depth(sample, dp);
+        }
+        S(dp_helper->squeeze(sample));
+    }
+    state.genotypes[sample*2].RNC = state.genotypes[sample*2+1].RNC = NoCallReason::N_A;
+    return Status::OK();
+}
+
+Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
+                     const std::string& sampleset, const sampleset_columns& columns,
+                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
+                     bool residualsFlag, shared_ptr<string> &residual_rec,
+                     atomic<bool>* ext_abort) {
+    Status s;
+    const vector<string>& samples = columns.ids->samples;
+    site_genotypes state;
+    S(start_site_genotypes(cfg, site, samples, state));
+
+    // query database for pertinent records across the samples -- the range
+    // encompassing all the original alleles
+    range query_range = genotype_site_query_range(site);
+    // (the residuals record the full input records, so don't project then)
+    shared_ptr<const set<string>> samples2, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    // Where the configuration allows, a single-sample data set's variant
+    // records are read with summaries of its reference bands instead of the
+    // band records themselves, which are then read only if the summaries
+    // don't suffice (as in genotype_site_window).
+    const bcf_projection projection = genotyper_projection(cfg);
+    string dp_field;
+    const bool try_ref_bands = ref_bands_suffice(cfg, dp_field);
+    S(data.sampleset_range(cache, sampleset, query_range, nullptr,
+                           samples2, datasets, iterators,
+                           try_ref_bands ? BCF_RANGE_VARIANTS_ONLY : BCF_RANGE_ALL,
+                           residualsFlag ? nullptr : &projection));
+    assert(samples.size() == samples2->size());
+    if (datasets->size() != columns.datasets.size()) {
+        return Status::Invalid("genotype_site: column mapping doesn't correspond to the sample set", sampleset);
+    }
+
+    // for each pertinent dataset. The record vectors are reused so that the
+    // iterators can recycle the records (see BCFRecordPool).
+    vector<shared_ptr<bcf1_t>> records, these_records;
+    vector<BCFData::ref_band> bands;
+    size_t dataset_id = 0;
+    for (const auto& dataset : *datasets) {
+        const column_mapping& sample_mapping = columns.datasets[dataset_id++];
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+
+        // load BCF records overlapping the site by "merging" the iterators
+        shared_ptr<const bcf_hdr_t> dataset_header;
+        records.clear();
+
+        for (const auto& iter : iterators) {
+            string this_dataset;
+            S(iter->next(this_dataset, dataset_header, these_records));
+            if (dataset != this_dataset) {
+                return Status::Failure("genotype_site: iterator returned unexpected dataset",
+                                       this_dataset + " instead of " + dataset);
+            }
+            records.insert(records.end(), make_move_iterator(these_records.begin()),
+                           make_move_iterator(these_records.end()));
+        }
+
+        if (try_ref_bands) {
+            bool done = false;
+            if (records.empty() && bcf_hdr_nsamples(dataset_header.get()) == 1) {
+                S(data.dataset_ref_bands(dataset, dataset_header.get(), query_range, bands));
+                S(genotype_site_dataset_ref_bands(cfg, site, dataset, dataset_header, sample_mapping,
+                                                  dp_field, bands, residualsFlag, state, done));
+            }
+            if (done) {
+                continue;
+            }
+            // read all the records overlapping the site after all
+            S(data.dataset_range(dataset, dataset_header.get(), query_range, nullptr,
+                                 &records, BCF_RANGE_ALL, residualsFlag ? nullptr : &projection));
+        }
+
+        S(genotype_site_dataset(cfg, site, dataset, dataset_header, sample_mapping, records,
+                                residualsFlag, state));
+    }
+
+    return finish_site_genotypes(cfg, cache, site, samples, hdr, state, ans,
+                                 residualsFlag, residual_rec);
+}
+
+static range window_item_range(const shared_ptr<bcf1_t>& rec) {
+    return range(rec);
+}
+static range window_item_range(const BCFData::ref_band& band) {
+    return band.pos;
+}
+
+// Dispatch a data set's records (or reference band summaries) overlapping a
+// window of sites to the sites whose query ranges they overlap, in one sweep
+// over the records (sorted by position) and the sites (ordered by the
+// beginning of their query ranges)
+template<class item>
+static void dispatch_window_records(const vector<range>& query_ranges, const vector<size_t>& order,
+                                    const vector<item>& records,
+                                    vector<vector<item>>& site_records) {
+    for (auto& v : site_records) {
+        v.clear();
+    }
+    vector<size_t> active; // sites begun by the current record, and not yet ended
+    size_t next = 0;       // the next site (in order) not yet begun
+    for (const auto& rec : records) {
+        range rec_range = window_item_range(rec);
+        // sites ending before the record can't overlap any later record either
+        active.erase(remove_if(active.begin(), active.end(),
+                               [&](size_t i) { return query_ranges[i].end <= rec_range.beg; }),
+                     active.end());
+        for (; next < order.size() && query_ranges[order[next]].beg <= rec_range.beg; next++) {
+            if (query_ranges[order[next]].end > rec_range.beg) {
+                active.push_back(order[next]);
+            }
+        }
+        for (size_t i : active) {
+            site_records[i].push_back(rec);
+        }
+        // and the sites beginning within the record
+        for (size_t k = next; k < order.size() && query_ranges[order[k]].beg < rec_range.end; k++) {
+            site_records[order[k]].push_back(rec);
+        }
+    }
+}
+
+Status genotype_site_window(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                            const vector<unified_site>& sites, size_t begin, size_t end,
+                            const sampleset_columns& columns, size_t block_datasets,
+                            const bcf_hdr_t* hdr, vector<shared_ptr<bcf1_t>>& ans,
+                            bool residualsFlag, vector<shared_ptr<string>>& residual_recs,
+                            atomic<bool>* ext_abort) {
+    Status s;
+    if (begin >= end || end > sites.size() || !block_datasets) {
+        return Status::Invalid("genotype_site_window: invalid window");
+    }
+    const vector<string>& samples = columns.ids->samples;
+    const vector<string>& datasets = columns.ids->datasets;
+    if (datasets.size() != columns.datasets.size()) {
+        return Status::Invalid("genotype_site_window: column mapping doesn't correspond to the sample set");
+    }
+
+    // the sites' query ranges, and the range encompassing them all
+    vector<range> query_ranges;
+    range window_range = genotype_site_query_range(sites[begin]);
+    for (size_t i = begin; i < end; i++) {
+        query_ranges.push_back(genotype_site_query_range(sites[i]));
+        const range& qr = query_ranges.back();
+        if (qr.rid != window_range.rid) {
+            return Status::Invalid("genotype_site_window: sites on different contigs", qr.str());
+        }
+        window_range.beg = min(window_range.beg, qr.beg);
+        window_range.end = max(window_range.end, qr.end);
+    }
+
+    vector<size_t> order(end - begin);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t i, size_t j) {
+        return query_ranges[i].beg < query_ranges[j].beg;
+    });
+
+    vector<site_genotypes> states(end - begin);
+    for (size_t i = 0; i < states.size(); i++) {
+        S(start_site_genotypes(cfg, sites[begin+i], samples, states[i]));
+    }
+
+    // for each block of data sets, read each one's records overlapping the
+    // window, then genotype every site on the block before moving on.
+    // Where the configuration allows, a single-sample data set's variant
+    // records are read with summaries of its reference bands instead of
+    // the band records themselves, which are then read only for the sites
+    // the summaries don't suffice for.
+    const bcf_projection projection = genotyper_projection(cfg);
+    string dp_field;
+    const bool try_ref_bands = ref_bands_suffice(cfg, dp_field);
+    vector<shared_ptr<const bcf_hdr_t>> headers(block_datasets);
+    vector<vector<shared_ptr<bcf1_t>>> block_records(block_datasets);
+    vector<vector<BCFData::ref_band>> block_bands(block_datasets);
+    vector<bool> block_summarized(block_datasets);
+    vector<vector<shared_ptr<bcf1_t>>> site_records(states.size());
+    vector<vector<BCFData::ref_band>> site_bands(states.size());
+    vector<shared_ptr<bcf1_t>> records;
+    for (size_t block = 0; block < datasets.size(); block += block_datasets) {
+        size_t block_end = min(datasets.size(), block + block_datasets);
+        for (size_t d = block; d < block_end; d++) {
+            if (ext_abort && *ext_abort) {
+                return Status::Aborted();
+            }
+            auto& hdr_d = headers[d-block];
+            S(data.dataset_header(datasets[d], &hdr_d));
+            block_summarized[d-block] = try_ref_bands && bcf_hdr_nsamples(hdr_d.get()) == 1;
+            if (block_summarized[d-block]) {
+                S(data.dataset_range(datasets[d], hdr_d.get(), window_range, nullptr,
+                                     &block_records[d-block], BCF_RANGE_VARIANTS_ONLY,
+                                     residualsFlag ? nullptr : &projection));
+                S(data.dataset_ref_bands(datasets[d], hdr_d.get(), window_range, block_bands[d-block]));
+            } else {
+                S(data.dataset_range(datasets[d], hdr_d.get(), window_range, nullptr,
+                                     &block_records[d-block], BCF_RANGE_ALL,
+                                     residualsFlag ? nullptr : &projection));
+            }
+        }
+
+        for (size_t d = block; d < block_end; d++) {
+            dispatch_window_records(query_ranges, order, block_records[d-block], site_records);
+            if (block_summarized[d-block]) {
+                dispatch_window_records(query_ranges, order, block_bands[d-block], site_bands);
+            }
+            for (size_t i = 0; i < states.size(); i++) {
+                const vector<shared_ptr<bcf1_t>>* site_records_i = &site_records[i];
+                if (block_summarized[d-block]) {
+                    bool done = false;
+                    if (site_records[i].empty()) {
+                        S(genotype_site_dataset_ref_bands(cfg, sites[begin+i], datasets[d], headers[d-block],
+                                                          columns.datasets[d], dp_field, site_bands[i],
+                                                          residualsFlag, states[i], done));
+                    }
+                    if (done) {
+                        continue;
+                    }
+                    // read all the records overlapping this site after all
+                    S(data.dataset_range(datasets[d], headers[d-block].get(), query_ranges[i], nullptr,
+                                         &records, BCF_RANGE_ALL, residualsFlag ? nullptr : &projection));
+                    site_records_i = &records;
+                }
+                S(genotype_site_dataset(cfg, sites[begin+i], datasets[d], headers[d-block],
+                                        columns.datasets[d], *site_records_i, residualsFlag, states[i]));
+            }
+        }
+    }
+    site_records.clear();
+    site_bands.clear();
+    block_records.clear();
+    block_bands.clear();
+
+    ans.assign(states.size(), nullptr);
+    residual_recs.assign(states.size(), nullptr);
+    for (size_t i = 0; i < states.size(); i++) {
+        S(finish_site_genotypes(cfg, cache, sites[begin+i], samples, hdr, states[i], ans[i],
+                                residualsFlag, residual_recs[i]));
+        // release the site's columns as soon as its record is made
+        states[i] = site_genotypes();
+    }
+    return Status::OK();
+}
+
 }
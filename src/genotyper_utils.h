@@ -27,13 +27,13 @@ public:
     FormatFieldHelper() = default;
 
     virtual Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
-                                   const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
+                                   const column_mapping& sample_mapping, const vector<int>& allele_mapping,
                                    const int n_allele_out, const vector<string>& field_names, int n_val_per_sample) = 0;
 
     // Wrapper with default values populated for
     // field_names and n_val_per_sample
     virtual Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
-                                   const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
+                                   const column_mapping& sample_mapping, const vector<int>& allele_mapping,
                                    const int n_allele_out) {
         return add_record_data(dataset, dataset_header, record, sample_mapping, allele_mapping, n_allele_out, {}, -1);
     }
@@ -85,7 +85,7 @@ protected:
     /// (e.g. allele-specific info for a trimmed allele), and raises error
     /// if the sample cannot be mapped
     int get_out_ind_of_value(int unmapped_i, int unmapped_j,
-                                const map<int, int>& sample_mapping,
+                                const column_mapping& sample_mapping,
                                 const vector<int>& allele_mapping,
                                 const int n_allele_out) {
         int mapped_i = sample_mapping.at(unmapped_i);
@@ -283,7 +283,7 @@ public:
     virtual ~NumericFormatFieldHelper() = default;
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const column_mapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
 
@@ -411,6 +411,13 @@ public:
         }
         return Status::OK();
     }
+
+    // Add the depth of a gVCF reference band for the (output) sample, as
+    // add_record_data would from the band's record
+    void add_ref_band_depth(int sample, int32_t dp) {
+        assert(count == 1 && sample < format_v.size());
+        format_v[sample].push_back(dp);
+    }
 };
 
 // Special-case logic for the allele depth (AD) field
@@ -422,7 +429,7 @@ public:
     }
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const column_mapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
         Status s = NumericFormatFieldHelper<int32_t>::add_record_data(dataset, dataset_header, record, sample_mapping, allele_mapping, n_allele_out, field_names, n_val_per_sample);
@@ -553,7 +560,7 @@ public:
     }
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
-                           const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
+                           const column_mapping& sample_mapping, const vector<int>& allele_mapping,
                            const int n_allele_out, const vector<string>& field_names, int n_val_per_sample) override {
         int rv = bcf_get_format_int32(dataset_header, record, "PL", &buf.v, &buf.capacity);
         if (rv > 0) {
@@ -731,7 +738,7 @@ public:
     virtual ~StringFormatFieldHelper() = default;
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const column_mapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
         return Status::NotImplemented("genotyper StringFormatFieldHelper::add_record_data");
@@ -828,7 +835,7 @@ public:
     virtual ~FilterFormatFieldHelper() = default;
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                            bcf1_t* record, const map<int, int>& sample_mapping,
+                            bcf1_t* record, const column_mapping& sample_mapping,
                             const vector<int>& allele_mapping, const int n_allele_out,
                             const vector<string>& field_names, int n_val_per_sample) override {
         if (n_val_per_sample < 0) {
@@ -931,7 +938,7 @@ Status setup_format_helpers(vector<unique_ptr<FormatFieldHelper>>& format_helper
 }
 
 Status update_format_fields(const genotyper_config& cfg, const string& dataset, const bcf_hdr_t* dataset_header,
-                            const map<int,int>& sample_mapping, const unified_site& site,
+                            const column_mapping& sample_mapping, const unified_site& site,
                             vector<unique_ptr<FormatFieldHelper>>& format_helpers,
                             const vector<shared_ptr<bcf1_t_plus>>& all_records,
                             const vector<shared_ptr<bcf1_t_plus>>& variant_records,
@@ -1128,7 +1135,7 @@ unique_ptr<AlleleDepthHelper> NewAlleleDepthHelper(const genotyper_config& cfg)
 /// should be initialized to -1 before any reference confidence records are
 /// seen.
 static Status update_min_ref_depth(const string& dataset, const bcf_hdr_t* dataset_header,
-                                   int bcf_nsamples, const map<int,int>& sample_mapping,
+                                   int bcf_nsamples, const column_mapping& sample_mapping,
                                    const vector<shared_ptr<bcf1_t_plus>>& ref_records,
                                    AlleleDepthHelper& depth,
                                    vector<int>& min_ref_depth) {
@@ -5,14 +5,23 @@
 #include "genotyper.h"
 #include "residuals.h"
 #include "diploid.h"
+#include "executor.h"
+#include "hfile.h"
+#include "bgzf.h"
 #include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <deque>
+#include <cstring>
 #include <assert.h>
 #include <tuple>
-#include "ctpl_stl.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iomanip>
 
 using namespace std;
 
@@ -24,27 +33,37 @@ struct Service::body {
     BCFData& data_;
     std::unique_ptr<MetadataCache> metadata_;
 
-    // thread pool for executing discover_alleles and genotype_sites operations
-    ctpl::thread_pool threadpool_;
-
-    // "meta" thread pool for driving multiple concurrent discover_alleles and
-    // "genotype_sites operations
-    ctpl::thread_pool metapool_;
+    // the process-wide executor, on which discover_alleles and genotype_sites
+    // operations fork their tasks
+    Executor& executor_;
 
+    atomic<uint64_t> discover_units_, discover_scan_ms_, discover_merge_ms_;
     atomic<uint64_t> threads_stalled_ms_;
+    atomic<uint64_t> prefetch_hits_, prefetch_waits_, prefetch_misses_, prefetch_stalled_ms_;
+    atomic<uint64_t> output_records_, output_bytes_, output_formatted_, output_write_ms_, output_elapsed_ms_;
 
-    body(BCFData& data) : data_(data) {}
+    body(const service_config& cfg, BCFData& data)
+        : cfg_(cfg), data_(data), executor_(Executor::Shared(cfg.threads)) {}
 };
 
 Service::Service(const service_config& cfg, BCFData& data) {
-    body_ = make_unique<Service::body>(data);
-    body_->cfg_ = cfg;
+    body_ = make_unique<Service::body>(cfg, data);
     if (body_->cfg_.threads == 0) {
-        body_->cfg_.threads = thread::hardware_concurrency();
+        body_->cfg_.threads = body_->executor_.threads();
     }
-    body_->threadpool_.resize(body_->cfg_.threads);
-    body_->metapool_.resize(body_->cfg_.threads);
+    body_->discover_units_ = 0;
+    body_->discover_scan_ms_ = 0;
+    body_->discover_merge_ms_ = 0;
     body_->threads_stalled_ms_ = 0;
+    body_->prefetch_hits_ = 0;
+    body_->prefetch_waits_ = 0;
+    body_->prefetch_misses_ = 0;
+    body_->prefetch_stalled_ms_ = 0;
+    body_->output_records_ = 0;
+    body_->output_bytes_ = 0;
+    body_->output_formatted_ = 0;
+    body_->output_write_ms_ = 0;
+    body_->output_elapsed_ms_ = 0;
 }
 
 Service::~Service() = default;
@@ -59,132 +78,215 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
                                  unsigned& N, discovered_alleles& ans,
                                  bool include_zero_copies,
                                  atomic<bool>* ext_abort) {
+    return discover_alleles_in_range(sampleset, pos, nullptr, N, ans, include_zero_copies, ext_abort);
+}
+
+Status Service::discover_alleles_in_range(const string& sampleset, const range& pos,
+                                          shared_ptr<const sampleset_columns> columns,
+                                          unsigned& N, discovered_alleles& ans,
+                                          bool include_zero_copies,
+                                          atomic<bool>* ext_abort) {
     // Find the data sets containing the samples in the sample set.
     shared_ptr<const set<string>> samples, datasets;
     vector<unique_ptr<RangeBCFIterator>> iterators;
     Status s;
     N = 0;
 
-    // Query for (iterators to) records overlapping pos in all the data sets.
-    // We query for variant records only (excluding reference confidence records
-    // which have only a symbolic ALT allele)
-    bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-        if (bcf_unpack(bcf, BCF_UN_STR)) {
-            return Status::IOError("bcf_unpack");
-        }
-        retval = !is_gvcf_ref_record(bcf);
-        return Status::OK();
-    };
-    S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, predicate,
-                                   samples, datasets, iterators));
-    N = samples->size();
+    // Merge the discovered-allele summaries precomputed when the data were
+    // stored, if they can answer for this sample set; otherwise scan.
+    if (ext_abort && *ext_abort) {
+        return Status::Aborted();
+    }
+    s = body_->data_.sampleset_discover_alleles(*(body_->metadata_), sampleset, pos,
+                                                include_zero_copies, N, ans);
+    if (s.ok()) {
+        return discovered_alleles_refcheck(ans, body_->metadata_->contigs());
+    } else if (s != StatusCode::NOT_IMPLEMENTED) {
+        return s;
+    }
+    ans.clear();
+    N = 0;
 
-    // Enqueue processing of each dataset on the thread pool.
-    // TODO: improve cache-friendliness for long ranges
+    // Map the samples onto the data sets' columns, unless the caller has
+    // already
+    if (!columns) {
+        S(body_->data_.sampleset_columns(*(body_->metadata_), sampleset, columns));
+    }
+
+    // The units of work, each discovering alleles in some of the records:
+    // tiles x blocks of data sets, or else the iterators of sampleset_range
     atomic<bool> abort(false);
-    vector<future<Status>> statuses;
-    vector<discovered_alleles> results(iterators.size());
+    vector<function<Status(discovered_alleles&)>> units;
+    const size_t tile_cost = body_->cfg_.discover_tile_cost;
+    if (tile_cost) {
+        // Tile the range by storage buckets, grouping consecutive buckets so
+        // that each tile x block costs about tile_cost buckets x data sets
+        N = columns->ids->samples.size();
+        vector<range> tiles;
+        S(body_->data_.range_tiles(pos, tiles));
+        const size_t ndatasets = columns->datasets.size();
+        const size_t block = max<size_t>(1, min(ndatasets, body_->cfg_.discover_block_datasets));
+        const size_t tile_buckets = max<size_t>(1, tile_cost / block);
+        for (size_t t = 0; t < tiles.size(); t += tile_buckets) {
+            const range tile(pos.rid, tiles[t].beg, tiles[min(tiles.size(), t + tile_buckets) - 1].end);
+            for (size_t d = 0; d < ndatasets; d += block) {
+                const size_t d_end = min(ndatasets, d + block);
+                units.push_back([&, tile, d, d_end](discovered_alleles& dsals) {
+                    return discover_alleles_from_tile(body_->data_, *columns, d, d_end, pos, tile, dsals,
+                                                      include_zero_copies, &abort);
+                });
+            }
+        }
+    } else {
+        // Query for (iterators to) records overlapping pos in all the data
+        // sets. We query for variant records only (excluding reference
+        // confidence records which have only a symbolic ALT allele),
+        // unpacking just the fields used in discovery
+        const bcf_projection projection = discovery_projection();
+        S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, nullptr,
+                                       samples, datasets, iterators, BCF_RANGE_VARIANTS_ONLY,
+                                       &projection));
+        N = samples->size();
+        if (datasets->size() != columns->datasets.size()) {
+            return Status::Invalid("discover_alleles: column mapping doesn't correspond to the sample set", sampleset);
+        }
+        for (const auto& iterator : iterators) {
+            RangeBCFIterator* raw_iter = iterator.get();
+            units.push_back([&, raw_iter](discovered_alleles& dsals) {
+                return discover_alleles_from_iterator(*columns, pos, *raw_iter, dsals, include_zero_copies);
+            });
+        }
+    }
+
+    // Fork the units on the executor, and join.
+    auto t0 = chrono::steady_clock::now();
+    vector<Status> statuses(units.size());
+    vector<discovered_alleles> results(units.size());
     // ^^^ results to be filled by side-effect in the individual tasks below.
     // We assume that by virtue of preallocating, no mutex is necessary to
     // use it as follows because writes and reads of individual elements are
-    // serialized by the futures.
-    size_t i = 0;
-    for (const auto& iterator : iterators) {
-        RangeBCFIterator* raw_iter = iterator.get();
-        auto fut = body_->threadpool_.push([&, i, raw_iter](int tid){
-            if (abort || (ext_abort && *ext_abort)) {
-                abort = true;
-                return Status::Aborted();
-            }
-
-            discovered_alleles dsals;
-            Status ls = discover_alleles_from_iterator(*samples, pos, *raw_iter, dsals, include_zero_copies);
-            results[i] = move(dsals);
-            return ls;
-        });
+    // serialized by the join.
+    {
+        TaskGroup tasks(body_->executor_);
+        for (size_t i = 0; i < units.size(); i++) {
+            tasks.run([&, i]() {
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    statuses[i] = Status::Aborted();
+                    return;
+                }
 
-        statuses.push_back(move(fut));
-        i++;
+                discovered_alleles dsals;
+                statuses[i] = units[i](dsals);
+                if (statuses[i].bad()) {
+                    // tell remaining tasks to abort
+                    abort = true;
+                }
+                results[i] = move(dsals);
+            });
+        }
+        tasks.wait();
     }
-    assert(statuses.size() == iterators.size());
 
-    // Retrieve the results and merge them into ans. Record the first error
-    // that occurs, if any, but always wait for all tasks to finish.
-    ans.clear();
-    s = Status::OK();
-    for (size_t i = 0; i < iterators.size(); i++) {
-        // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
-        discovered_alleles dsals = move(results[i]);
+    auto t1 = chrono::steady_clock::now();
+    body_->discover_units_ += units.size();
+    body_->discover_scan_ms_ += chrono::duration_cast<chrono::milliseconds>(t1 - t0).count();
 
-        if (s.ok() && s_i.ok()) {
-            s = merge_discovered_alleles(dsals, ans);
-            if (s.bad()) {
-                abort = true;
-            }
-        } else if (s.ok() && s_i.bad()) {
-            // record the first error, and tell remaining tasks to abort
-            s = move(s_i);
-            abort = true;
+    // Record the first error that occurred, if any. Otherwise merge the
+    // results into ans, by tree reduction on the executor.
+    ans.clear();
+    for (auto& ls : statuses) {
+        if (ls.bad()) {
+            return move(ls);
         }
     }
-    if (s.bad()) {
-        return s;
-    }
+    S(merge_discovered_alleles(body_->executor_, results, ans));
+    body_->discover_merge_ms_ +=
+        chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t1).count();
     return discovered_alleles_refcheck(ans, body_->metadata_->contigs());
 }
 
-Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
-                                 unsigned& N, vector<discovered_alleles>& ans,
-                                 bool include_zero_copies, atomic<bool>* ext_abort) {
+Status Service::discover_alleles_in_ranges(const string& sampleset, const vector<range>& ranges,
+                                           unsigned& N, bool include_zero_copies, atomic<bool>* ext_abort,
+                                           const function<Status(size_t,discovered_alleles&)>& store) {
     atomic<bool> abort(false);
-    vector<future<Status>> statuses;
-    vector<discovered_alleles> results(ranges.size());
     N = 0;
+    Status s;
 
-    size_t i = 0;
-    for (const auto& range : ranges) {
-        auto fut = body_->metapool_.push([&, i, range](int tid){
-            if (abort || (ext_abort && *ext_abort)) {
-                abort = true;
-                return Status::Aborted();
-            }
+    // unless the discovered-allele summaries answer for the sample set, each
+    // range will need the column mapping
+    shared_ptr<const sampleset_columns> columns;
+    S(body_->data_.sampleset_columns(*(body_->metadata_), sampleset, columns));
 
-            discovered_alleles dsals;
-            unsigned tmpN;
-            Status ls = discover_alleles(sampleset, range, tmpN, dsals, include_zero_copies, &abort);
-            if (ls.ok()) {
-                if (i == 0) {
-                    // tmpN should be the same across all ranges
-                    N = tmpN;
+    // Fork a task for each range, which in turn forks tasks for its
+    // iterators and helps execute them while it waits
+    vector<Status> statuses(ranges.size());
+    {
+        TaskGroup tasks(body_->executor_);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            tasks.run([&, i]() {
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    statuses[i] = Status::Aborted();
+                    return;
                 }
-                results[i] = move(dsals);
-            }
-            return ls;
-        });
 
-        statuses.push_back(move(fut));
-        i++;
+                discovered_alleles dsals;
+                unsigned tmpN;
+                statuses[i] = discover_alleles_in_range(sampleset, ranges[i], columns, tmpN, dsals,
+                                                        include_zero_copies, &abort);
+                if (statuses[i].ok()) {
+                    if (i == 0) {
+                        // tmpN should be the same across all ranges
+                        N = tmpN;
+                    }
+                    statuses[i] = store(i, dsals);
+                }
+                if (statuses[i].bad()) {
+                    // tell remaining tasks to abort
+                    abort = true;
+                }
+            });
+        }
+        tasks.wait();
     }
 
-    ans.clear();
-    Status s = Status::OK();
-    for (i = 0; i < ranges.size(); i++) {
-        // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
-        discovered_alleles dsals = move(results[i]);
-
-        if (s.ok() && s_i.ok()) {
-            ans.push_back(move(dsals));
-        } else if (s.ok() && s_i.bad()) {
-            // record the first error, and tell remaining tasks to abort
-            s = move(s_i);
-            abort = true;
+    // Record the first error that occurred, if any
+    for (auto& ls : statuses) {
+        if (ls.bad()) {
+            return move(ls);
         }
     }
-    assert(s.bad() || ans.size() == ranges.size());
+    return Status::OK();
+}
 
-    return s;
+Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
+                                 unsigned& N, vector<discovered_alleles>& ans,
+                                 bool include_zero_copies, atomic<bool>* abort) {
+    Status s;
+    ans.clear();
+    vector<discovered_alleles> results(ranges.size());
+    S(discover_alleles_in_ranges(sampleset, ranges, N, include_zero_copies, abort,
+                                 [&](size_t i, discovered_alleles& dsals) {
+                                     results[i] = move(dsals);
+                                     return Status::OK();
+                                 }));
+    ans = move(results);
+    return Status::OK();
+}
+
+Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
+                                 unsigned& N, vector<flat_discovered_alleles>& ans,
+                                 bool include_zero_copies, atomic<bool>* abort) {
+    Status s;
+    ans.clear();
+    vector<flat_discovered_alleles> results(ranges.size());
+    S(discover_alleles_in_ranges(sampleset, ranges, N, include_zero_copies, abort,
+                                 [&](size_t i, discovered_alleles& dsals) {
+                                     return flat_of_discovered_alleles(dsals, results[i]);
+                                 }));
+    ans = move(results);
+    return Status::OK();
 }
 
 static Status prepare_bcf_header(const vector<pair<string,size_t> >& contigs,
@@ -240,41 +342,81 @@ static Status prepare_bcf_header(const vector<pair<string,size_t> >& contigs,
     return Status::OK();
 }
 
+// Writes the genotype_sites output. BGZF compression runs on an htslib
+// thread pool, which compresses the blocks in parallel and writes them in
+// order. The records are serialized off the output thread: genotype_site
+// leaves BCF records serialized, and VCF text is formatted by the worker
+// threads through format() (thread-safe), to be written with write_text().
 class BCFFileSink {
+public:
+    struct stats {
+        atomic<uint64_t> records, bytes, formatted, write_ns;
+        chrono::steady_clock::time_point t0;
+        stats() : records(0), bytes(0), formatted(0), write_ns(0), t0(chrono::steady_clock::now()) {}
+    };
+
+private:
     bool open_ = true;
-    const string& filename_;
+    const string filename_;
     bcf_hdr_t* header_;
-    vcfFile *outfile_;;
+    vcfFile *outfile_;
+    const bool text_;
+    mutable stats stats_;
 
-    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile)
-        : filename_(filename), header_(hdr), outfile_(outfile)
+    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile, bool text)
+        : filename_(filename), header_(hdr), outfile_(outfile), text_(text)
         {}
 
+    void count(size_t bytes, chrono::steady_clock::time_point t0) {
+        stats_.records++;
+        stats_.bytes += bytes;
+        stats_.write_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+    }
+
 public:
     static Status Open(const genotyper_config& cfg,
+                       int level, size_t threads,
                        const string& filename,
                        bcf_hdr_t* hdr,
                        unique_ptr<BCFFileSink>& ans) {
+        if (level < -1 || level > 9) {
+            return Status::Invalid("BCFFileSink::Open: invalid compression level", to_string(level));
+        }
 
         vcfFile* outfile;
+        bool compressed = true;
         if (cfg.output_format == GLnexusOutputFormat::VCF) {
             // open as (uncompressed) vcf
             outfile = vcf_open(filename.c_str(), "w");
+            compressed = false;
+        } else if (cfg.output_format == GLnexusOutputFormat::VCF_GZ) {
+            // open as bgzipped vcf
+            string mode = "wz";
+            if (level >= 0) {
+                mode += to_string(level);
+            }
+            outfile = vcf_open(filename.c_str(), mode.c_str());
         } else if (cfg.output_format == GLnexusOutputFormat::BCF) {
             // open as bcf
-            outfile = bcf_open(filename.c_str(), "wb1");
+            string mode = "wb" + to_string(level >= 0 ? level : 1);
+            outfile = bcf_open(filename.c_str(), mode.c_str());
         } else {
             return Status::Invalid("BCFFileSink::Open: Invalid output format");
         }
         if (!outfile) {
             return Status::IOError("failed to open BCF file for writing", filename);
         }
+        if (compressed && threads && hts_set_threads(outfile, threads) != 0) {
+            bcf_close(outfile);
+            return Status::IOError("hts_set_threads", filename);
+        }
         if (bcf_hdr_write(outfile, hdr) != 0) {
             bcf_close(outfile);
             return Status::IOError("bcf_hdr_write", filename);
         }
 
-        ans.reset(new BCFFileSink(filename, hdr, outfile));
+        ans.reset(new BCFFileSink(filename, hdr, outfile,
+                                  cfg.output_format != GLnexusOutputFormat::BCF));
         return Status::OK();
     }
 
@@ -284,11 +426,45 @@ public:
         }
     }
 
+    // Whether records should be formatted for write_text()
+    bool text() const { return text_; }
+
+    // Format the record as a VCF text line. Thread-safe, provided the record
+    // isn't shared.
+    Status format(bcf1_t* record, shared_ptr<string>& ans) const {
+        static thread_local kstring_t line = {0, 0, nullptr};
+        line.l = 0;
+        if (vcf_format(header_, record, &line) != 0) {
+            return Status::Failure("vcf_format", filename_);
+        }
+        ans = make_shared<string>(line.s, line.l);
+        stats_.formatted++;
+        return Status::OK();
+    }
+
     virtual Status write(bcf1_t* record) {
         if (!open_) return Status::Invalid("BCFFilkSink::write() called on closed writer");
-        return bcf_write(outfile_, header_, record) == 0
-                ? Status::OK() : Status::IOError("bcf_write", filename_);
+        auto t0 = chrono::steady_clock::now();
+        if (bcf_write(outfile_, header_, record) != 0) {
+            return Status::IOError("bcf_write", filename_);
+        }
+        count(text_ ? outfile_->line.l : 32 + record->shared.l + record->indiv.l, t0);
+        return Status::OK();
+    }
 
+    // Write a line formatted by format()
+    virtual Status write_text(const string& line) {
+        if (!open_) return Status::Invalid("BCFFilkSink::write_text() called on closed writer");
+        if (!text_) return Status::Invalid("BCFFileSink::write_text() called on BCF writer");
+        auto t0 = chrono::steady_clock::now();
+        ssize_t rv = outfile_->format.compression != no_compression
+                        ? bgzf_write(outfile_->fp.bgzf, line.c_str(), line.size())
+                        : hwrite(outfile_->fp.hfile, line.c_str(), line.size());
+        if (rv != ssize_t(line.size())) {
+            return Status::IOError("writing VCF", filename_);
+        }
+        count(line.size(), t0);
+        return Status::OK();
     }
 
     virtual Status close() {
@@ -297,29 +473,400 @@ public:
         return bcf_close(outfile_) == 0
                 ? Status::OK() : Status::IOError("bcf_close", filename_);
     }
+
+    const stats& get_stats() const { return stats_; }
 };
 
-Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
-                               const vector<unified_site>& sites,
-                               const string& filename,
-                               atomic<bool>* ext_abort) {
+// Reads a previous genotype_sites output in step with the sites being
+// genotyped, to complete the records of the added samples with the other
+// samples' columns.
+class PreviousOutput {
+    const string filename_;
+    vcfFile* file_;
+    shared_ptr<bcf_hdr_t> hdr_;
+    const bcf_hdr_t *out_hdr_, *new_hdr_;
+    vector<int> rids_; // our rid of each of the previous output's contigs, or -1
+    // for each output sample: whether it's one of the added samples, and its
+    // column in their records or the previous output's
+    vector<pair<bool,int>> columns_;
+    // records read ahead at the position of the current site
+    deque<shared_ptr<bcf1_t>> pending_;
+    bool eof_ = false;
+
+    PreviousOutput(const string& filename, vcfFile* file, const shared_ptr<bcf_hdr_t>& hdr,
+                   const bcf_hdr_t* out_hdr, const bcf_hdr_t* new_hdr)
+        : filename_(filename), file_(file), hdr_(hdr), out_hdr_(out_hdr), new_hdr_(new_hdr)
+        {}
+
+    Status read(shared_ptr<bcf1_t>& ans) {
+        ans = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+        int rv = bcf_read(file_, hdr_.get(), ans.get());
+        if (rv == -1) {
+            eof_ = true;
+            ans.reset();
+            return Status::OK();
+        } else if (rv != 0 || bcf_unpack(ans.get(), BCF_UN_STR) != 0) {
+            return Status::IOError("reading previous output", filename_);
+        }
+        return Status::OK();
+    }
+
+    // compare the record's position with the site's (<0 before, 0 at, >0 after)
+    int compare_pos(const bcf1_t* rec, const range& pos) const {
+        int rid = rids_[rec->rid];
+        if (rid != pos.rid) {
+            return rid < pos.rid ? -1 : 1;
+        }
+        return rec->pos < pos.beg ? -1 : (rec->pos > pos.beg ? 1 : 0);
+    }
+
+    // Splice one FORMAT field's values (w values per sample) from the added
+    // samples' record and the previous one, padding each sample to the
+    // wider of the two. Strings of a fixed Number are padded value by value.
+    template<class T>
+    void splice_values(const T* vnew, int wnew, const T* vprev, int wprev,
+                       int count, T pad, vector<T>& ans, int& w) const {
+        if (count < 1 || wnew % count || wprev % count) {
+            count = 1;
+        }
+        int sw = max(wnew, wprev) / count;
+        w = sw*count;
+        ans.assign(columns_.size()*w, pad);
+        for (size_t j = 0; j < columns_.size(); j++) {
+            int ws = (columns_[j].first ? wnew : wprev) / count;
+            const T* src = (columns_[j].first ? vnew + columns_[j].second*wnew
+                                              : vprev + columns_[j].second*wprev);
+            for (int k = 0; k < count; k++) {
+                copy(src + k*ws, src + (k+1)*ws, ans.begin() + j*w + k*sw);
+            }
+        }
+    }
+
+    template<class T>
+    Status splice_field(bcf1_t* rec_new, bcf1_t* rec_prev, const char* key, int type,
+                        int count, T pad, bcf1_t* ans) const {
+        htsvecbox<T> vnew, vprev;
+        int nnew = bcf_get_format_values(new_hdr_, rec_new, key, (void**) &vnew.v, &vnew.capacity, type);
+        int nprev = bcf_get_format_values(hdr_.get(), rec_prev, key, (void**) &vprev.v, &vprev.capacity, type);
+        if (nnew < 0 || nprev < 0) {
+            return Status::Invalid("previous output lacks FORMAT field (or it has a different type)",
+                                   string(key) + " " + filename_);
+        }
+        vector<T> values;
+        int w;
+        splice_values(vnew.v, nnew / bcf_hdr_nsamples(new_hdr_), vprev.v, nprev / bcf_hdr_nsamples(hdr_.get()),
+                      count, pad, values, w);
+        if (bcf_update_format(out_hdr_, ans, key, values.data(), values.size(), type) != 0) {
+            return Status::Failure("bcf_update_format", key);
+        }
+        return Status::OK();
+    }
+
+public:
+    static Status Open(const string& filename,
+                       const vector<pair<string,size_t>>& contigs,
+                       const vector<string>& sample_names, const bcf_hdr_t* out_hdr,
+                       const vector<string>& new_sample_names, const bcf_hdr_t* new_hdr,
+                       unique_ptr<PreviousOutput>& ans) {
+        vcfFile* file = bcf_open(filename.c_str(), "r");
+        if (!file) {
+            return Status::IOError("failed to open previous output", filename);
+        }
+        shared_ptr<bcf_hdr_t> hdr(bcf_hdr_read(file), &bcf_hdr_destroy);
+        if (!hdr) {
+            bcf_close(file);
+            return Status::IOError("failed to read previous output header", filename);
+        }
+        ans.reset(new PreviousOutput(filename, file, hdr, out_hdr, new_hdr));
+
+        int nseq = 0;
+        const char** seqnames = bcf_hdr_seqnames(hdr.get(), &nseq);
+        for (int i = 0; i < nseq; i++) {
+            int rid = -1;
+            for (int j = 0; j < contigs.size(); j++) {
+                if (contigs[j].first == seqnames[i]) {
+                    rid = j;
+                    break;
+                }
+            }
+            ans->rids_.push_back(rid);
+        }
+        free(seqnames);
+
+        size_t added = 0;
+        for (const auto& sample : sample_names) {
+            auto p = lower_bound(new_sample_names.begin(), new_sample_names.end(), sample);
+            if (p != new_sample_names.end() && *p == sample) {
+                ans->columns_.push_back(make_pair(true, int(p - new_sample_names.begin())));
+                added++;
+            } else {
+                int col = bcf_hdr_id2int(hdr.get(), BCF_DT_SAMPLE, sample.c_str());
+                if (col < 0) {
+                    return Status::Invalid("previous output lacks sample", sample + " " + filename);
+                }
+                ans->columns_.push_back(make_pair(false, col));
+            }
+        }
+        if (added != new_sample_names.size()) {
+            return Status::Invalid("genotype_sites: added samples must be in the sample set");
+        }
+        return Status::OK();
+    }
+
+    ~PreviousOutput() {
+        bcf_close(file_);
+    }
+
+    /// Given the added samples' record for the site, find the previous
+    /// output's record for it and replace the former with their splice: the
+    /// site-level fields of the added samples' record, with all the samples.
+    /// The sites must be requested in order.
+    Status splice(const unified_site& site, shared_ptr<bcf1_t>& rec) {
+        Status s;
+        while (!pending_.empty() && compare_pos(pending_.front().get(), site.pos) < 0) {
+            pending_.pop_front();
+        }
+        while (!eof_ && (pending_.empty() || compare_pos(pending_.back().get(), site.pos) <= 0)) {
+            shared_ptr<bcf1_t> prev;
+            S(read(prev));
+            if (prev && rids_[prev->rid] >= 0 && compare_pos(prev.get(), site.pos) >= 0) {
+                pending_.push_back(move(prev));
+            }
+        }
+        auto same_alleles = [&site](const bcf1_t* prev) {
+            if (prev->n_allele != site.alleles.size()) {
+                return false;
+            }
+            for (int i = 0; i < prev->n_allele; i++) {
+                if (site.alleles[i].dna != prev->d.allele[i]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto p = pending_.begin();
+        for (; p != pending_.end() && compare_pos(p->get(), site.pos) == 0; p++) {
+            if (same_alleles(p->get())) {
+                break;
+            }
+        }
+        if (p == pending_.end() || compare_pos(p->get(), site.pos) != 0) {
+            return Status::NotFound("previous output lacks site", site.pos.str() + " " + filename_);
+        }
+        shared_ptr<bcf1_t> prev = move(*p);
+        pending_.erase(p);
+
+        shared_ptr<bcf1_t> ans(bcf_dup(rec.get()), &bcf_destroy);
+        if (bcf_unpack(rec.get(), BCF_UN_FMT) != 0 || bcf_unpack(ans.get(), BCF_UN_ALL) != 0) {
+            return Status::Failure("bcf_unpack");
+        }
+        for (int i = 0; i < rec->n_fmt; i++) {
+            int id = rec->d.fmt[i].id;
+            const char* key = bcf_hdr_int2id(new_hdr_, BCF_DT_ID, id);
+            int type = bcf_hdr_id2type(new_hdr_, BCF_HL_FMT, id);
+            if (strcmp(key, "GT") == 0) {
+                // GT is a string in the header, but integers in BCF
+                type = BCF_HT_INT;
+            }
+            switch (type) {
+                case BCF_HT_INT:
+                    S(splice_field<int32_t>(rec.get(), prev.get(), key, type, 1,
+                                            bcf_int32_vector_end, ans.get()));
+                    break;
+                case BCF_HT_REAL: {
+                    float pad;
+                    bcf_float_set_vector_end(pad);
+                    S(splice_field<float>(rec.get(), prev.get(), key, type, 1, pad, ans.get()));
+                    break;
+                }
+                case BCF_HT_STR: {
+                    int count = bcf_hdr_id2length(new_hdr_, BCF_HL_FMT, id) == BCF_VL_FIXED
+                                    ? bcf_hdr_id2number(new_hdr_, BCF_HL_FMT, id) : 1;
+                    S(splice_field<char>(rec.get(), prev.get(), key, type, count, '\0', ans.get()));
+                    break;
+                }
+                default:
+                    return Status::Invalid("genotype_sites: unexpected FORMAT field type", key);
+            }
+        }
+        rec = move(ans);
+        return Status::OK();
+    }
+};
+
+// Ordered ring buffer of genotype_sites results awaiting output. The writer
+// admits a chunk of sites for genotyping only while it isn't too far ahead
+// of the output, so that the tasks genotyping them never block; they put the
+// results, and the writer takes each one, in site order, as soon as it's
+// ready. How far ahead of the output the tasks may get is the memory budget
+// divided by the average size of the records so far, within
+// [min_ahead, capacity] sites.
+class PendingResults {
+public:
+    struct result {
+        bool ready = false;
+        Status status;
+        shared_ptr<bcf1_t> bcf;
+        shared_ptr<string> text; // the record formatted as VCF, instead of bcf
+        shared_ptr<string> residual_rec;
+    };
+
+private:
+    Executor& executor_;
+    mutex mutex_;
+    vector<result> ring_;
+    const size_t budget_bytes_, min_ahead_;
+    size_t next_ = 0; // the next site for the writer to take
+    uint64_t records_ = 0, record_bytes_ = 0;
+
+    size_t ahead_locked() const {
+        size_t ans = ring_.size();
+        if (records_) {
+            ans = budget_bytes_ / max<uint64_t>(1, record_bytes_ / records_);
+        }
+        return max(min_ahead_, min(ans, ring_.size()));
+    }
+
+public:
+    PendingResults(Executor& executor, size_t capacity, size_t budget_bytes, size_t min_ahead)
+        : executor_(executor), ring_(capacity), budget_bytes_(budget_bytes),
+          min_ahead_(min(min_ahead, capacity)) {}
+
+    // How many sites past the output may be genotyped
+    size_t ahead() {
+        lock_guard<mutex> lock(mutex_);
+        return ahead_locked();
+    }
+
+    // Whether sites [begin,end) may be genotyped now, which is always so for
+    // the next ones due for output (end-begin must not exceed the capacity)
+    bool admissible(size_t begin, size_t end) {
+        assert(end - begin <= ring_.size());
+        lock_guard<mutex> lock(mutex_);
+        return begin <= next_ || end <= next_ + ahead_locked();
+    }
+
+    // Put the result for an admitted site
+    void put(size_t site, Status status, shared_ptr<bcf1_t> bcf, shared_ptr<string> text,
+             shared_ptr<string> residual_rec) {
+        bool due;
+        {
+            lock_guard<mutex> lock(mutex_);
+            result& slot = ring_[site % ring_.size()];
+            assert(!slot.ready && site >= next_ && site < next_ + ring_.size());
+            if (text) {
+                records_++;
+                record_bytes_ += text->size();
+            } else if (bcf) {
+                // genotype_site leaves the record serialized (see bcf_dup there)
+                records_++;
+                record_bytes_ += sizeof(bcf1_t) + bcf->shared.l + bcf->indiv.l;
+            }
+            slot.ready = true;
+            slot.status = move(status);
+            slot.bcf = move(bcf);
+            slot.text = move(text);
+            slot.residual_rec = move(residual_rec);
+            due = (site == next_);
+        }
+        if (due) {
+            executor_.notify();
+        }
+    }
+
+    // Take the result for the next site, blocking until it's ready: rather
+    // than helping, which could pick up some unrelated long task sharing the
+    // executor and hold up the output meanwhile. Returns the time waited, in
+    // milliseconds.
+    uint64_t take(result& ans) {
+        auto ready = [&]() {
+            lock_guard<mutex> lock(mutex_);
+            return ring_[next_ % ring_.size()].ready;
+        };
+        uint64_t waited_ms = 0;
+        if (!ready()) {
+            auto t0 = chrono::steady_clock::now();
+            executor_.wait_until(ready, false);
+            waited_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+        }
+        lock_guard<mutex> lock(mutex_);
+        result& slot = ring_[next_ % ring_.size()];
+        ans = move(slot);
+        slot = result();
+        next_++;
+        return waited_ms;
+    }
+};
+
+struct Service::genotype_output::body {
+    Service::body* svc;
+    string sampleset;
+    shared_ptr<const sampleset_columns> columns;
+    shared_ptr<bcf_hdr_t> hdr;
+    unique_ptr<BCFFileSink> sink;
+    unique_ptr<ResidualsFile> residuals;
+    bool finished = false;
+
+    // Close the output file if asked (otherwise the sink's destructor will),
+    // and add its statistics to the service's, once
+    Status finish(bool close) {
+        Status s;
+        if (close) {
+            s = sink->close();
+        }
+        if (!finished) {
+            finished = true;
+            const BCFFileSink::stats& output_stats = sink->get_stats();
+            svc->output_records_ += output_stats.records;
+            svc->output_bytes_ += output_stats.bytes;
+            svc->output_formatted_ += output_stats.formatted;
+            svc->output_write_ms_ += output_stats.write_ns / 1000000;
+            svc->output_elapsed_ms_ +=
+                chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - output_stats.t0).count();
+        }
+        return s;
+    }
+};
+
+Service::genotype_output::genotype_output() = default;
+
+Service::genotype_output::~genotype_output() {
+    if (body_) {
+        body_->finish(false);
+    }
+}
+
+Status Service::genotype_output::close() {
+    return body_->finish(true);
+}
+
+Status Service::open_genotype_output(const genotyper_config& cfg, const string& sampleset,
+                                     const string& filename,
+                                     unique_ptr<genotype_output>& ans) {
     Status s;
-    shared_ptr<const set<string>> samples;
-    S(body_->metadata_->sampleset_samples(sampleset, samples));
-    vector<string> sample_names(samples->begin(), samples->end());
+    unique_ptr<genotype_output> output(new genotype_output());
+    output->body_.reset(new genotype_output::body);
+    genotype_output::body& ob = *(output->body_);
+    ob.svc = body_.get();
+    ob.sampleset = sampleset;
+
+    // map the samples onto the data sets' columns once, for all the sites
+    S(body_->data_.sampleset_columns(*(body_->metadata_), sampleset, ob.columns));
 
     // create a BCF header for this sample set
     // TODO: make optional
-    shared_ptr<bcf_hdr_t> hdr;
-    S(prepare_bcf_header(body_->metadata_->contigs(), sample_names, cfg.liftover_fields,
-                         body_->cfg_.extra_header_lines, hdr));
+    S(prepare_bcf_header(body_->metadata_->contigs(), ob.columns->ids->samples, cfg.liftover_fields,
+                         body_->cfg_.extra_header_lines, ob.hdr));
 
     // open output BCF file
-    unique_ptr<BCFFileSink> bcf_out;
-    S(BCFFileSink::Open(cfg, filename, hdr.get(), bcf_out));
+    size_t output_threads = body_->cfg_.output_threads;
+    if (!output_threads) {
+        output_threads = max<size_t>(1, body_->cfg_.threads/4);
+    }
+    S(BCFFileSink::Open(cfg, body_->cfg_.output_compression_level, output_threads,
+                        filename, ob.hdr.get(), ob.sink));
 
     // set up the residuals file
-    unique_ptr<ResidualsFile> residualsFile = nullptr;
     string res_filename;
     if (filename != "-" && filename.find('.') > 0) {
         int lastindex = filename.find_last_of('.');
@@ -329,75 +876,356 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
         res_filename = "/tmp/residuals.yml";
     }
     if (cfg.output_residuals) {
-        S(ResidualsFile::Open(res_filename, residualsFile));
+        S(ResidualsFile::Open(res_filename, ob.residuals));
     }
 
-    // Enqueue processing of each site as a task on the thread pool.
-    vector<future<Status>> statuses;
-    vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(sites.size());
-    // ^^^ results to be filled by side-effect in the individual tasks below.
-    // We assume that by virtue of preallocating, no mutex is necessary to
-    // use it as follows because writes and reads of individual elements are
-    // serialized by the futures.
-    atomic<size_t> results_retrieved(0);
-    atomic<bool> abort(false);
-    for (size_t i = 0; i < sites.size(); i++) {
-        auto fut = body_->threadpool_.push([&, i](int tid){
-            if (abort || (ext_abort && *ext_abort)) {
-                abort = true;
-                return Status::Aborted();
-            }
+    ans = move(output);
+    return Status::OK();
+}
+
+Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
+                               const vector<unified_site>& sites,
+                               const string& filename,
+                               atomic<bool>* ext_abort,
+                               const genotype_reuse* reuse) {
+    Status s;
+    unique_ptr<genotype_output> output;
+    S(open_genotype_output(cfg, sampleset, filename, output));
+    S(genotype_sites_into(cfg, sites, *output, ext_abort, reuse));
+    return output->close();
+}
+
+Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
+                               const vector<unified_site>& sites,
+                               genotype_output& output,
+                               atomic<bool>* ext_abort) {
+    if (sampleset != output.body_->sampleset) {
+        return Status::Invalid("genotype_sites: the output is for a different sample set", sampleset);
+    }
+    return genotype_sites_into(cfg, sites, output, ext_abort, nullptr);
+}
+
+Status Service::genotype_sites_into(const genotyper_config& cfg,
+                                    const vector<unified_site>& sites,
+                                    genotype_output& output,
+                                    atomic<bool>* ext_abort,
+                                    const genotype_reuse* reuse) {
+    Status s;
+    const string& sampleset = output.body_->sampleset;
+    const shared_ptr<const sampleset_columns>& columns = output.body_->columns;
+    const vector<string>& sample_names = columns->ids->samples;
+    const shared_ptr<bcf_hdr_t>& hdr = output.body_->hdr;
+    BCFFileSink* bcf_out = output.body_->sink.get();
+    ResidualsFile* residualsFile = output.body_->residuals.get();
+
+    // When reusing a previous output, the added samples are genotyped on
+    // their own at the reusable sites, with a header of their own.
+    vector<string> new_sample_names;
+    shared_ptr<const sampleset_columns> new_columns;
+    shared_ptr<bcf_hdr_t> new_hdr;
+    unique_ptr<PreviousOutput> previous;
+    if (reuse) {
+        if (cfg.trim_uncalled_alleles) {
+            return Status::Invalid("genotype_sites: can't reuse a previous output with trim_uncalled_alleles");
+        }
+        if (reuse->reusable.size() != sites.size()) {
+            return Status::Invalid("genotype_sites: reusable flags don't correspond to the sites");
+        }
+        S(body_->data_.sampleset_columns(*(body_->metadata_), reuse->new_sampleset, new_columns));
+        new_sample_names = new_columns->ids->samples;
+        S(prepare_bcf_header(body_->metadata_->contigs(), new_sample_names, cfg.liftover_fields,
+                             body_->cfg_.extra_header_lines, new_hdr));
+        S(PreviousOutput::Open(reuse->previous_filename, body_->metadata_->contigs(),
+                               sample_names, hdr.get(), new_sample_names, new_hdr.get(), previous));
+    }
+    auto reusing = [reuse](size_t i) { return reuse && reuse->reusable[i]; };
 
-            uint64_t stalled_ms = 0;
-            while (i > results_retrieved+4*body_->cfg_.threads) {
-                // throttle worker thread if the results retrieval, below, is falling
-                // too far behind. Otherwise memory usage would be unbounded because
-                // the results have to be retrieved and written out before they can
-                // be deallocated.
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                stalled_ms += 10;
+    // Sites are genotyped in windows: single sites, unless window scanning is
+    // configured or the sample set is large enough to warrant tiling
+    // adjacent sites x blocks of data sets (genotype_site_window). A window
+    // stays on one contig and within one of the data's range tiles (its
+    // storage buckets, see BCFData::range_tiles), so that each bucket is
+    // decoded once per window rather than per site, and doesn't mix reusable
+    // sites with others. window_end(i) gives the end of the window beginning
+    // with site i.
+    const size_t window_sites = body_->cfg_.genotype_window_sites;
+    const bool tiled = window_sites > 1 && body_->cfg_.genotype_block_datasets &&
+                       (body_->cfg_.genotype_window_scan ||
+                        columns->datasets.size() > body_->cfg_.genotype_block_datasets);
+    map<int,vector<int>> tile_ends; // per contig, the ends of the tiles covering the sites
+    if (tiled) {
+        map<int,range> extents;
+        for (const auto& site : sites) {
+            const range q = genotype_site_query_range(site);
+            auto p = extents.insert(make_pair(q.rid, q));
+            p.first->second.beg = min(p.first->second.beg, q.beg);
+            p.first->second.end = max(p.first->second.end, q.end);
+        }
+        vector<range> tiles;
+        for (const auto& extent : extents) {
+            S(body_->data_.range_tiles(extent.second, tiles));
+            auto& ends = tile_ends[extent.first];
+            for (const auto& tile : tiles) {
+                ends.push_back(tile.end);
             }
-            if (i < body_->cfg_.threads && results_retrieved == 0) {
-                // throttle startup so that database cache can burn in
-                std::this_thread::sleep_for(std::chrono::milliseconds(i*10));
-                stalled_ms += i*10;
+        }
+    }
+    auto window_end = [&](size_t i) {
+        size_t j = i+1;
+        if (tiled) {
+            const range qi = genotype_site_query_range(sites[i]);
+            const vector<int>& ends = tile_ends[qi.rid];
+            auto tile_end = upper_bound(ends.begin(), ends.end(), qi.beg);
+            assert(tile_end != ends.end());
+            while (j < sites.size() && j-i < window_sites && sites[j].pos.rid == qi.rid
+                   && genotype_site_query_range(sites[j]).end <= *tile_end
+                   && reusing(j) == reusing(i)) {
+                j++;
+            }
+        }
+        return j;
+    };
+
+    // The results pending output, bounded so that memory usage doesn't grow
+    // without limit when the output falls behind: each thread may work on
+    // one window at least, and beyond that the records awaiting output are
+    // held to the memory budget.
+    const size_t max_window = tiled ? window_sites : 1;
+    const size_t min_ahead = body_->cfg_.threads * max_window;
+    const size_t max_ahead = max<size_t>(4*min_ahead, body_->cfg_.genotype_max_pending_sites);
+    PendingResults pending(body_->executor_, max_ahead, body_->cfg_.genotype_pending_bytes, min_ahead);
+
+    // Prefetch the data for upcoming sites on background threads, staying up
+    // to prefetch_lookahead sites ahead of the workers. The sites in play
+    // are fewer than max_ahead+lookahead past the output, so their states
+    // are kept in a ring of that size. prefetch_state[i % ring] is 4*i plus
+    // (0) untouched, (1) being prefetched, (2) prefetched, or (3) taken up
+    // by a worker without prefetching; any value below 4*i also means site i
+    // is untouched (the slot was last used by an earlier site).
+    const size_t lookahead = body_->cfg_.prefetch_lookahead;
+    const size_t prefetch_ring = lookahead ? max_ahead + lookahead : 0;
+    unique_ptr<atomic<int64_t>[]> prefetch_state(new atomic<int64_t>[prefetch_ring]);
+    for (size_t i = 0; i < prefetch_ring; i++) {
+        prefetch_state[i] = -1;
+    }
+    // take up site i's prefetch state from below 4*i to 4*i+state
+    auto claim_prefetch_state = [&](size_t i, int state, int64_t& prior) {
+        auto& slot = prefetch_state[i % prefetch_ring];
+        prior = slot;
+        while (prior < int64_t(4*i)) {
+            if (slot.compare_exchange_weak(prior, int64_t(4*i) + state)) {
+                return true;
             }
-            if (stalled_ms) body_->threads_stalled_ms_ += stalled_ms;
-
-            shared_ptr<string> residual_rec = nullptr;
-            shared_ptr<bcf1_t> bcf;
-            Status ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[i],
-                                      sampleset, sample_names, hdr.get(), bcf,
-                                      residualsFile != nullptr, residual_rec,
-                                      &abort);
-            if (ls.bad()) {
-                return ls;
+        }
+        return false;
+    };
+    atomic<size_t> sites_started(0), next_prefetch(0);
+    bool prefetch_done = false;
+    mutex prefetch_mutex;
+    condition_variable prefetch_cv;
+    vector<thread> prefetchers;
+    if (lookahead) {
+        for (size_t t = 0; t < body_->cfg_.prefetch_threads; t++) {
+            prefetchers.emplace_back([&]() {
+                for (size_t j = next_prefetch++; j < sites.size(); j = next_prefetch++) {
+                    {
+                        unique_lock<mutex> lock(prefetch_mutex);
+                        prefetch_cv.wait(lock, [&]() {
+                            return prefetch_done || j < sites_started + lookahead;
+                        });
+                        if (prefetch_done) {
+                            return;
+                        }
+                    }
+                    int64_t prior;
+                    if (!claim_prefetch_state(j, 1, prior)) {
+                        continue;
+                    }
+                    // errors are left for the worker's own query to report
+                    body_->data_.prefetch(*(body_->metadata_),
+                                          reusing(j) ? reuse->new_sampleset : sampleset,
+                                          genotype_site_query_range(sites[j]));
+                    {
+                        lock_guard<mutex> lock(prefetch_mutex);
+                        prefetch_state[j % prefetch_ring] = int64_t(4*j) + 2;
+                    }
+                    prefetch_cv.notify_all();
+                }
+            });
+        }
+    }
+
+    // Genotype a window of sites
+    atomic<bool> abort(false);
+    auto genotype_window = [&](pair<size_t,size_t> window, vector<shared_ptr<bcf1_t>>& bcfs,
+                               vector<shared_ptr<string>>& residual_recs) {
+        if (abort || (ext_abort && *ext_abort)) {
+            abort = true;
+            return Status::Aborted();
+        }
+
+        const size_t i = window.first;
+
+        for (size_t k = window.first; lookahead && k < window.second; k++) {
+            int64_t prior;
+            if (claim_prefetch_state(k, 3, prior)) {
+                body_->prefetch_misses_++;
+            } else if (prior == int64_t(4*k) + 2) {
+                body_->prefetch_hits_++;
+            } else {
+                // wait for the prefetch in flight rather than reading the
+                // same data concurrently
+                assert(prior == int64_t(4*k) + 1);
+                auto t0 = chrono::steady_clock::now();
+                unique_lock<mutex> lock(prefetch_mutex);
+                prefetch_cv.wait(lock, [&]() {
+                    return prefetch_state[k % prefetch_ring] == int64_t(4*k) + 2;
+                });
+                body_->prefetch_waits_++;
+                body_->prefetch_stalled_ms_ +=
+                    chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
             }
+            sites_started++;
+            prefetch_cv.notify_all();
+        }
 
-            results[i] = make_tuple(move(bcf), residual_rec);
+        if (tiled) {
+            return genotype_site_window(cfg, *(body_->metadata_), body_->data_, sites,
+                                        window.first, window.second,
+                                        reusing(i) ? *new_columns : *columns,
+                                        body_->cfg_.genotype_block_datasets,
+                                        reusing(i) ? new_hdr.get() : hdr.get(), bcfs,
+                                        residualsFile != nullptr, residual_recs, &abort);
+        }
+
+        shared_ptr<string> residual_rec = nullptr;
+        shared_ptr<bcf1_t> bcf;
+        Status ls;
+        if (reusing(i)) {
+            ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[i],
+                               reuse->new_sampleset, *new_columns, new_hdr.get(), bcf,
+                               residualsFile != nullptr, residual_rec,
+                               &abort);
+        } else {
+            ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[i],
+                               sampleset, *columns, hdr.get(), bcf,
+                               residualsFile != nullptr, residual_rec,
+                               &abort);
+        }
+        if (ls.bad()) {
             return ls;
+        }
+
+        bcfs[0] = move(bcf);
+        residual_recs[0] = move(residual_rec);
+        return ls;
+    };
+
+    // Fork the windows on the executor in chunks of consecutive ones, each
+    // chunk a task putting a result for every site of its windows (even if
+    // it fails). The chunks are sized by the sites' estimated cost -- the
+    // number of original alleles they unify -- so that they're short where
+    // complex sites abound and long through simple ones, amortizing the task
+    // dispatch; and to a share of the sites the pending results admit, so
+    // that the threads can work on chunks concurrently. They're submitted as
+    // the output proceeds and admits them, keeping a bounded number in
+    // flight, so that memory usage is independent of the number of sites.
+    // Admitting the chunks here means the tasks never block, so the executor
+    // threads (including this one, while it waits for results) are free to
+    // work on whatever's pending.
+    const size_t chunk_cost = max<size_t>(1, body_->cfg_.genotype_chunk_cost);
+    const size_t max_chunks = 4*body_->cfg_.threads;
+    const size_t max_chunk_sites = max(max_window, max_ahead / max_chunks);
+    size_t next_site = 0; // the first site not yet submitted
+    deque<size_t> chunks; // the end of each chunk with results yet to be taken
+    TaskGroup tasks(body_->executor_);
+    vector<pair<size_t,size_t>> windows; // the next chunk, if formed
+    size_t chunk_end = 0;
+    bool held = false;    // whether it's being held back for the output
+    chrono::steady_clock::time_point held_t0;
+    auto submit_chunk = [&]() {
+        if (windows.empty()) {
+            const size_t max_sites = min(max_chunk_sites,
+                                         max(max_window, pending.ahead() / body_->cfg_.threads));
+            size_t cost = 0;
+            chunk_end = next_site;
+            while (chunk_end < sites.size() && cost < chunk_cost) {
+                size_t j = window_end(chunk_end);
+                if (!windows.empty() && j - next_site > max_sites) {
+                    break;
+                }
+                for (size_t k = chunk_end; k < j; k++) {
+                    cost += max<size_t>(1, sites[k].unification.size());
+                }
+                windows.push_back(make_pair(chunk_end, j));
+                chunk_end = j;
+            }
+        }
+        assert(!windows.empty());
+        if (!pending.admissible(next_site, chunk_end)) {
+            if (!held) {
+                held = true;
+                held_t0 = chrono::steady_clock::now();
+            }
+            return false;
+        }
+        if (held) {
+            held = false;
+            body_->threads_stalled_ms_ +=
+                chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - held_t0).count();
+        }
+        tasks.run([&, windows]() {
+            for (const auto& window : windows) {
+                vector<shared_ptr<bcf1_t>> bcfs(window.second - window.first);
+                vector<shared_ptr<string>> residual_recs(bcfs.size());
+                Status ls = genotype_window(window, bcfs, residual_recs);
+                for (size_t k = window.first; k < window.second; k++) {
+                    shared_ptr<bcf1_t>& bcf = bcfs[k-window.first];
+                    shared_ptr<string> text;
+                    Status ks = ls;
+                    if (ks.ok() && bcf && bcf_out->text() && !reusing(k)) {
+                        // format VCF here rather than on the output thread;
+                        // reused sites must first be spliced there
+                        ks = bcf_out->format(bcf.get(), text);
+                        bcf.reset();
+                    }
+                    pending.put(k, move(ks), move(bcf), move(text), move(residual_recs[k-window.first]));
+                }
+            }
         });
-        statuses.push_back(move(fut));
-    }
-    assert(statuses.size() == sites.size());
+        windows.clear();
+        next_site = chunk_end;
+        chunks.push_back(next_site);
+        return true;
+    };
 
     // Retrieve the resulting BCF records, and write them to the output file,
-    // in the given order. Record the first error that occurs, if any, but
-    // always wait for all tasks to finish.
+    // in the given order. Record the first error that occurs, if any, and
+    // then stop submitting more sites, but always wait for the tasks in
+    // flight to finish.
     s = Status::OK();
-    for (size_t i = 0; i < sites.size(); i++) {
-        // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
-        // always retrieve the result BCF record, if any, to ensure we'll free
-        // the memory it takes ASAP
-        shared_ptr<bcf1_t> bcf_i = move(std::get<0>(results[i]));
-        assert(std::get<0>(results[i]) == nullptr);
-        shared_ptr<string> residual_rec =  move(std::get<1>(results[i]));
-        assert(std::get<1>(results[i]) == nullptr);
+    for (size_t i = 0; i < (s.ok() ? sites.size() : next_site); i++) {
+        while (s.ok() && next_site < sites.size() && chunks.size() < max_chunks && submit_chunk()) {}
+        assert(i < next_site);
+
+        // wait for site i's result. Always take the result BCF record, if
+        // any, to ensure we'll free the memory it takes ASAP
+        PendingResults::result result_i;
+        pending.take(result_i);
+        const Status& s_i = result_i.status;
+        shared_ptr<bcf1_t> bcf_i = move(result_i.bcf);
+        shared_ptr<string> text_i = move(result_i.text);
+        shared_ptr<string> residual_rec = move(result_i.residual_rec);
 
         if (s.ok() && s_i.ok()) {
-            // if everything's OK, proceed to write the record
-            if (bcf_i) {
+            // if everything's OK, proceed to write the record (completing it
+            // from the previous output, if reusing it)
+            if (bcf_i && reusing(i)) {
+                s = previous->splice(sites[i], bcf_i);
+            }
+            if (text_i) {
+                s = bcf_out->write_text(*text_i);
+            } else if (bcf_i && s.ok()) {
                 s = bcf_out->write(bcf_i.get());
             }
             if (s.bad()) {
@@ -411,22 +1239,83 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
             }
         } else if (s.ok() && s_i.bad()) {
             // record the first error, and tell remaining tasks to abort
-            s = move(s_i);
+            s = s_i;
             abort = true;
         }
-        results_retrieved++;
+
+        if (i+1 == chunks.front()) {
+            // all of the chunk's results are in
+            chunks.pop_front();
+        }
     }
-    if (s.bad()) {
-        return s;
+    assert(chunks.empty());
+    tasks.wait();
+    {
+        lock_guard<mutex> lock(prefetch_mutex);
+        prefetch_done = true;
+    }
+    prefetch_cv.notify_all();
+    for (auto& th : prefetchers) {
+        th.join();
     }
+    return s;
+}
 
-    // TODO: for very large sample sets, bucket cache-friendliness might be
-    // improved by genotyping in grid squares of N>1 sites and M>1 samples
+uint64_t Service::threads_stalled_ms() const { return body_->threads_stalled_ms_; }
 
-    // close the output file
-    return bcf_out->close();
+Service::discover_stats_t Service::discover_stats() const {
+    discover_stats_t ans;
+    ans.units = body_->discover_units_;
+    ans.scan_ms = body_->discover_scan_ms_;
+    ans.merge_ms = body_->discover_merge_ms_;
+    return ans;
 }
 
-uint64_t Service::threads_stalled_ms() const { return body_->threads_stalled_ms_; }
+Service::prefetch_stats_t Service::prefetch_stats() const {
+    prefetch_stats_t ans;
+    ans.hits = body_->prefetch_hits_;
+    ans.waits = body_->prefetch_waits_;
+    ans.misses = body_->prefetch_misses_;
+    ans.stalled_ms = body_->prefetch_stalled_ms_;
+    return ans;
+}
+
+Service::output_stats_t Service::output_stats() const {
+    output_stats_t ans;
+    ans.records = body_->output_records_;
+    ans.bytes = body_->output_bytes_;
+    ans.formatted = body_->output_formatted_;
+    ans.write_ms = body_->output_write_ms_;
+    ans.elapsed_ms = body_->output_elapsed_ms_;
+    return ans;
+}
+
+string Service::discover_stats_t::str() const {
+    ostringstream os;
+    os << "discovery scanned " << units << " units of work in " << scan_ms
+       << "ms and merged their alleles in " << merge_ms << "ms";
+    return os.str();
+}
+
+string Service::output_stats_t::str() const {
+    ostringstream os;
+    os << "wrote " << records << " records, " << fixed << setprecision(1) << bytes/1048576.0
+       << " MiB uncompressed (" << (elapsed_ms ? 1000.0*bytes/1048576.0/elapsed_ms : 0.0)
+       << " MiB/s); the output thread spent " << write_ms << "ms writing them";
+    if (formatted) {
+        os << ", " << formatted << " formatted as VCF on the worker threads";
+    }
+    return os.str();
+}
+
+string Service::prefetch_stats_t::str() const {
+    ostringstream os;
+    uint64_t sites = hits + waits + misses;
+    os << "prefetched " << hits << "/" << sites << " sites ahead of the worker threads ("
+       << fixed << setprecision(1) << (sites ? 100.0*hits/sites : 0.0) << "%); "
+       << waits << " sites stalled " << stalled_ms << "ms on prefetches in flight, "
+       << misses << " weren't prefetched";
+    return os.str();
+}
 
 }
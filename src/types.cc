@@ -74,32 +74,183 @@ bool is_iupac_nucleotides(const std::string& s) {
 
 // Add src alleles to dest alleles. Identical alleles alleles are merged,
 // updating topAQ and combining zygosity_by_GQ
+// Combine the information on an allele discovered again (ai) into dest
+static Status merge_discovered_allele_info(const allele& allele, const discovered_allele_info& ai,
+                                           discovered_allele_info& dest) {
+    if (ai.in_target == dest.in_target) {
+        if (ai.is_ref != dest.is_ref) {
+            return Status::Invalid("allele appears as both REF and ALT", allele.dna + "@" + allele.pos.str());
+        }
+        dest.all_filtered = dest.all_filtered && ai.all_filtered;
+        dest.topAQ += ai.topAQ;
+        dest.zGQ += ai.zGQ;
+        // we expect in_target to be the same but JIC choose the larger
+        if (ai.in_target.size() > dest.in_target.size()) {
+            dest.in_target = ai.in_target;
+        }
+    } else if (dest.in_target < ai.in_target) {
+        // It seems that the same allele has been discovered in >1 distinct
+        // target ranges. To avoid double-counting copy number, topAQ,
+        // etc., we'll (arbitrarily) keep the info from the "greater"
+        // target range.
+        dest = ai;
+    }
+    return Status::OK();
+}
+
 Status merge_discovered_alleles(const discovered_alleles& src, discovered_alleles& dest) {
+    Status s;
     for (auto& dsal : src) {
         UNPAIR(dsal,allele,ai)
-        auto p = dest.find(allele);
-        if (p == dest.end()) {
-            dest[allele] = ai;
-        } else if (ai.in_target == p->second.in_target) {
-            if (ai.is_ref != p->second.is_ref) {
-                return Status::Invalid("allele appears as both REF and ALT", allele.dna + "@" + allele.pos.str());
+        auto p = dest.lower_bound(allele);
+        if (p == dest.end() || p->first != allele) {
+            dest.emplace_hint(p, allele, ai);
+        } else {
+            S(merge_discovered_allele_info(allele, ai, p->second));
+        }
+    }
+
+    return Status::OK();
+}
+
+int flat_discovered_alleles::compare(size_t i, const allele& al) const {
+    const entry& e = entries_[i];
+    if (e.pos != al.pos) {
+        return e.pos < al.pos ? -1 : 1;
+    }
+    int c = memcmp(pool_.data() + e.dna, al.dna.data(), min<size_t>(e.dna_size, al.dna.size()));
+    if (c == 0 && e.dna_size != al.dna.size()) {
+        c = e.dna_size < al.dna.size() ? -1 : 1;
+    }
+    return c;
+}
+
+size_t flat_discovered_alleles::contig_begin(int rid) const {
+    return partition_point(entries_.begin(), entries_.end(),
+                           [rid](const entry& e) { return e.pos.rid < rid; })
+           - entries_.begin();
+}
+
+Status flat_discovered_alleles::push_back(const allele& al, const discovered_allele_info& info) {
+    if (!entries_.empty() && compare(entries_.size()-1, al) >= 0) {
+        return Status::Invalid("flat_discovered_alleles: allele out of order", al.str());
+    }
+    entry e(al.pos);
+    e.dna_size = al.dna.size();
+    e.info = info;
+    auto p = al.dna.size() <= INTERN_MAX ? interned_.find(al.dna) : interned_.end();
+    if (p != interned_.end()) {
+        e.dna = p->second;
+    } else {
+        e.dna = pool_.size();
+        pool_ += al.dna;
+        if (al.dna.size() <= INTERN_MAX) {
+            interned_[al.dna] = e.dna;
+        }
+    }
+    entries_.push_back(e);
+    return Status::OK();
+}
+
+void flat_discovered_alleles::clear() {
+    vector<entry>().swap(entries_);
+    string().swap(pool_);
+    interned_.clear();
+}
+
+void flat_discovered_alleles::shrink_to_fit() {
+    entries_.shrink_to_fit();
+    pool_.shrink_to_fit();
+}
+
+size_t flat_discovered_alleles::memory_bytes() const {
+    size_t interned_bytes = 0;
+    for (const auto& p : interned_) {
+        // tree node and key, which is short enough for the small-string buffer
+        interned_bytes += 4*sizeof(void*) + sizeof(p);
+    }
+    return entries_.capacity()*sizeof(entry) + pool_.capacity() + interned_bytes;
+}
+
+Status flat_of_discovered_alleles(discovered_alleles& src, flat_discovered_alleles& ans) {
+    Status s;
+    ans.clear();
+    // release each node once copied, so the two don't coexist in full
+    for (auto p = src.begin(); p != src.end(); src.erase(p++)) {
+        S(ans.push_back(p->first, p->second));
+    }
+    ans.shrink_to_fit();
+    return Status::OK();
+}
+
+Status discovered_alleles_of_flat(const flat_discovered_alleles& src, size_t begin, size_t end,
+                                  discovered_alleles& ans) {
+    Status s;
+    if (begin > end || end > src.size()) {
+        return Status::Invalid("discovered_alleles_of_flat: invalid range");
+    }
+    auto hint = ans.end();
+    for (size_t i = begin; i < end; i++) {
+        allele al = src.allele_at(i);
+        hint = ans.lower_bound(al);
+        if (hint == ans.end() || hint->first != al) {
+            hint = ans.emplace_hint(hint, move(al), src[i].info);
+        } else {
+            S(merge_discovered_allele_info(al, src[i].info, hint->second));
+        }
+    }
+    return Status::OK();
+}
+
+Status merge_discovered_alleles(const flat_discovered_alleles& src, const flat_discovered_alleles& dest,
+                                flat_discovered_alleles& ans) {
+    Status s;
+    ans.clear();
+    size_t i = 0, j = 0;
+    while (i < src.size() || j < dest.size()) {
+        if (j == dest.size()) {
+            S(ans.push_back(src.allele_at(i), src[i].info));
+            i++;
+            continue;
+        }
+        allele al = dest.allele_at(j);
+        if (i < src.size()) {
+            allele src_al = src.allele_at(i);
+            if (src_al < al) {
+                S(ans.push_back(src_al, src[i].info));
+                i++;
+                continue;
             }
-            p->second.all_filtered = p->second.all_filtered && ai.all_filtered;
-            p->second.topAQ += ai.topAQ;
-            p->second.zGQ += ai.zGQ;
-            // we expect in_target to be the same but JIC choose the larger
-            if (ai.in_target.size() > p->second.in_target.size()) {
-                p->second.in_target = ai.in_target;
+            if (src_al == al) {
+                discovered_allele_info info = dest[j].info;
+                S(merge_discovered_allele_info(al, src[i].info, info));
+                S(ans.push_back(al, info));
+                i++;
+                j++;
+                continue;
             }
-        } else if (p->second.in_target < ai.in_target) {
-            // It seems that the same allele has been discovered in >1 distinct
-            // target ranges. To avoid double-counting copy number, topAQ,
-            // etc., we'll (arbitrarily) keep the info from the "greater"
-            // target range.
-            p->second = ai;
         }
+        S(ans.push_back(al, dest[j].info));
+        j++;
     }
+    ans.shrink_to_fit();
+    return Status::OK();
+}
 
+Status merge_discovered_alleles(const flat_discovered_alleles& src, flat_discovered_alleles& dest) {
+    Status s;
+    if (src.empty()) {
+        return Status::OK();
+    }
+    if (dest.empty() || dest.allele_at(dest.size()-1) < src.allele_at(0)) {
+        for (size_t i = 0; i < src.size(); i++) {
+            S(dest.push_back(src.allele_at(i), src[i].info));
+        }
+        return Status::OK();
+    }
+    flat_discovered_alleles ans;
+    S(merge_discovered_alleles(src, dest, ans));
+    dest = std::move(ans);
     return Status::OK();
 }
 
@@ -835,6 +986,8 @@ Status genotyper_config::yaml(YAML::Emitter& ans) const {
         ans << "BCF";
     } else if (output_format == GLnexusOutputFormat::VCF) {
         ans << "VCF";
+    } else if (output_format == GLnexusOutputFormat::VCF_GZ) {
+        ans << "VCF_GZ";
     } else {
         return Status::Invalid("genotyper_config::yaml: invalid output_format");
     }
@@ -947,8 +1100,10 @@ Status genotyper_config::of_yaml(const YAML::Node& yaml, genotyper_config& ans)
             ans.output_format = GLnexusOutputFormat::BCF;
         } else if (s_output_format == "VCF") {
             ans.output_format = GLnexusOutputFormat::VCF;
+        } else if (s_output_format == "VCF_GZ") {
+            ans.output_format = GLnexusOutputFormat::VCF_GZ;
         } else {
-            return Status::Invalid("genotyper_config::of_yaml: invalid output_format. Must be one of {BCF, VCF}.");
+            return Status::Invalid("genotyper_config::of_yaml: invalid output_format. Must be one of {BCF, VCF, VCF_GZ}.");
         }
     }
 
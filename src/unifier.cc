@@ -416,6 +416,88 @@ Status unify_nonaligned_alts(const allele& ref, const minimized_alleles& alts,
     return Status::OK();
 }
 
+using delineated_sites = map<range,tuple<discovered_alleles,minimized_alleles,minimized_alleles>>;
+
+// Decompose one active region into sites, adding them to ans (see
+// delineate_sites below)
+static Status delineate_active_region(const unifier_config& cfg, const pair<range,discovered_alleles>& active_region,
+                                      delineated_sites& ans,
+                                      vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
+    Status s;
+
+    // minimize the alt alleles
+    map<range,discovered_allele> refs_by_range;
+    minimized_alleles alts, pruned;
+    S(minimize_alleles(cfg, active_region.second, refs_by_range, alts));
+
+    // exclude alleles not overlapping the discovery target range, if any,
+    // after minimization.
+    for (auto it = alts.begin(); it != alts.end(); ) {
+        auto trg = it->second.in_target;
+        if (trg.rid < 0 || trg.overlaps(it->first.pos)) {
+            ++it;
+        } else {
+            alts.erase(it++);
+        }
+    }
+
+    // reconstruct the active region's reference allele
+    discovered_alleles refs;
+    for (const auto& p : refs_by_range) {
+        refs.insert(p.second);
+    }
+    allele active_region_ref(active_region.first,"A");
+    S(unify_ref(active_region.first, refs, active_region_ref));
+
+    // detect equivalent alt alleles at different positions, and collapse them
+    minimized_alleles aligned_alts;
+    S(unify_nonaligned_alts(active_region_ref, alts, aligned_alts));
+    alts = move(aligned_alts);
+
+    // prune alt alleles as necessary to yield sites
+    const auto sites = prune_alleles(cfg, alts, pruned);
+
+    for (const auto& site : sites) {
+        // find the ref alleles overlapping this site
+        discovered_alleles site_refs;
+        for (const auto& ref : refs) {
+            if (ref.first.pos.overlaps(site.first)) {
+                site_refs.insert(ref);
+            }
+        }
+
+        // and the pruned alleles
+        minimized_alleles site_pruned;
+        for (const auto& p : pruned) {
+            if (p.first.pos.overlaps(site.first)) {
+                site_pruned.insert(p);
+            }
+        }
+
+        assert(ans.find(site.first) == ans.end());
+        ans[site.first] = make_tuple(site_refs,site.second,site_pruned);
+    }
+
+    for (const auto& pa : pruned) {
+        // we need to supply a discovered reference allele to go along with
+        // the pruned alt allele; find the shortest one which contains the
+        // alt. note, we realigned the alt so this might not cover the
+        // original!
+        const discovered_allele *shortest_containing_ref = nullptr;
+        for (const auto& ref : refs_by_range) {
+            if (ref.first.contains(pa.first.pos) &&
+                (!shortest_containing_ref || ref.first.size() < shortest_containing_ref->first.pos.size())) {
+                    shortest_containing_ref = &ref.second;
+            }
+        }
+        if (!shortest_containing_ref) {
+            return Status::Invalid("delineate_sites: missing REF allele for ", pa.first.str());
+        }
+        all_pruned_alleles.push_back(make_pair(pa, *shortest_containing_ref));
+    }
+    return Status::OK();
+}
+
 // Delineate sites given all discovered alleles, potentially pruning some as
 // described above. The result maps the range of each site to a tuple of the
 // discovered REF alleles, the minimized ALT alleles, and any pruned alleles
@@ -425,7 +507,7 @@ Status unify_nonaligned_alts(const allele& ref, const minimized_alleles& alts,
 // corresponding reference allele.
 // The input alleles is cleared by side-effect to save memory.
 Status delineate_sites(const unifier_config& cfg, discovered_alleles& alleles,
-                       map<range,tuple<discovered_alleles,minimized_alleles,minimized_alleles>>& ans,
+                       delineated_sites& ans,
                        vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
     Status s;
 
@@ -437,78 +519,38 @@ Status delineate_sites(const unifier_config& cfg, discovered_alleles& alleles,
     ans.clear();
     all_pruned_alleles.clear();
     for (auto par = active_regions.begin(); par != active_regions.end(); active_regions.erase(par++)) {
-        const auto& active_region = *par;
-
-        // minimize the alt alleles
-        map<range,discovered_allele> refs_by_range;
-        minimized_alleles alts, pruned;
-        S(minimize_alleles(cfg, active_region.second, refs_by_range, alts));
-
-        // exclude alleles not overlapping the discovery target range, if any,
-        // after minimization.
-        for (auto it = alts.begin(); it != alts.end(); ) {
-            auto trg = it->second.in_target;
-            if (trg.rid < 0 || trg.overlaps(it->first.pos)) {
-                ++it;
-            } else {
-                alts.erase(it++);
-            }
-        }
-
-        // reconstruct the active region's reference allele
-        discovered_alleles refs;
-        for (const auto& p : refs_by_range) {
-            refs.insert(p.second);
-        }
-        allele active_region_ref(active_region.first,"A");
-        S(unify_ref(active_region.first, refs, active_region_ref));
-
-        // detect equivalent alt alleles at different positions, and collapse them
-        minimized_alleles aligned_alts;
-        S(unify_nonaligned_alts(active_region_ref, alts, aligned_alts));
-        alts = move(aligned_alts);
-
-        // prune alt alleles as necessary to yield sites
-        const auto sites = prune_alleles(cfg, alts, pruned);
-
-        for (const auto& site : sites) {
-            // find the ref alleles overlapping this site
-            discovered_alleles site_refs;
-            for (const auto& ref : refs) {
-                if (ref.first.pos.overlaps(site.first)) {
-                    site_refs.insert(ref);
-                }
-            }
-
-            // and the pruned alleles
-            minimized_alleles site_pruned;
-            for (const auto& p : pruned) {
-                if (p.first.pos.overlaps(site.first)) {
-                    site_pruned.insert(p);
-                }
-            }
+        S(delineate_active_region(cfg, *par, ans, all_pruned_alleles));
+    }
+    return Status::OK();
+}
 
-            assert(ans.find(site.first) == ans.end());
-            ans[site.first] = make_tuple(site_refs,site.second,site_pruned);
-        }
+// Delineate sites given alleles [begin,end) of the flat representation, as
+// above. The active regions are formed one at a time by scanning the array,
+// so only the alleles of the current one are expanded into a map.
+Status delineate_sites(const unifier_config& cfg, const flat_discovered_alleles& alleles,
+                       size_t begin, size_t end, delineated_sites& ans,
+                       vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
+    Status s;
+    ans.clear();
+    all_pruned_alleles.clear();
 
-        for (const auto& pa : pruned) {
-            // we need to supply a discovered reference allele to go along with
-            // the pruned alt allele; find the shortest one which contains the
-            // alt. note, we realigned the alt so this might not cover the
-            // original!
-            const discovered_allele *shortest_containing_ref = nullptr;
-            for (const auto& ref : refs_by_range) {
-                if (ref.first.contains(pa.first.pos) &&
-                    (!shortest_containing_ref || ref.first.size() < shortest_containing_ref->first.pos.size())) {
-                        shortest_containing_ref = &ref.second;
-                }
-            }
-            if (!shortest_containing_ref) {
-                return Status::Invalid("delineate_sites: missing REF allele for ", pa.first.str());
+    pair<range,discovered_alleles> active_region(range(-1,-1,-1), discovered_alleles());
+    for (size_t i = begin; i < end; i++) {
+        const range& pos = alleles[i].pos;
+        range& rng = active_region.first;
+        assert(rng <= pos);
+        if (rng.rid != pos.rid || rng.end < pos.beg) {
+            if (rng.rid != -1) {
+                S(delineate_active_region(cfg, active_region, ans, all_pruned_alleles));
             }
-            all_pruned_alleles.push_back(make_pair(pa, *shortest_containing_ref));
+            rng = pos;
+            active_region.second.clear();
         }
+        rng.end = max(rng.end, pos.end);
+        active_region.second.emplace_hint(active_region.second.end(), alleles.allele_at(i), alleles[i].info);
+    }
+    if (active_region.first.rid != -1) {
+        S(delineate_active_region(cfg, active_region, ans, all_pruned_alleles));
     }
     return Status::OK();
 }
@@ -591,30 +633,13 @@ Status unify_alleles(const unifier_config& cfg, unsigned N, const range& pos,
     return Status::OK();
 }
 
-Status unified_sites(const unifier_config& cfg,
-                     unsigned N, discovered_alleles& alleles,
-                     vector<unified_site>& ans,
-                     unifier_stats& stats_out) {
+// Unify the delineated sites and the lost alleles, appending to ans
+static Status unify_delineated_sites(const unifier_config& cfg, unsigned N, delineated_sites& sites,
+                                     const vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles,
+                                     vector<unified_site>& ans, unifier_stats& stats_out) {
     Status s;
     unifier_stats stats;
 
-    /* desperate-straits debugging:
-    for (const auto& allele : alleles) {
-        if (allele.first.pos.overlaps(range(7, 16188960, 16188970))) {
-            cerr << allele.first.str();
-            if (allele.second.is_ref) {
-                cerr << " *";
-            }
-            cerr << endl;
-        }
-    }
-    */
-
-    map<range,tuple<discovered_alleles,minimized_alleles,minimized_alleles>> sites;
-    vector<pair<minimized_allele,discovered_allele>> all_pruned_alleles;
-    S(delineate_sites(cfg, alleles, sites, all_pruned_alleles));
-    // at this point, alleles has been cleared to save memory usage
-
     for (auto psite = sites.begin(); psite != sites.end(); sites.erase(psite++)) {
         UNPAIR(*psite, pos, site_alleles);
         const auto& ref_alleles = get<0>(site_alleles);
@@ -651,4 +676,47 @@ Status unified_sites(const unifier_config& cfg,
     return Status::OK();
 }
 
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N, discovered_alleles& alleles,
+                     vector<unified_site>& ans,
+                     unifier_stats& stats_out) {
+    Status s;
+
+    /* desperate-straits debugging:
+    for (const auto& allele : alleles) {
+        if (allele.first.pos.overlaps(range(7, 16188960, 16188970))) {
+            cerr << allele.first.str();
+            if (allele.second.is_ref) {
+                cerr << " *";
+            }
+            cerr << endl;
+        }
+    }
+    */
+
+    delineated_sites sites;
+    vector<pair<minimized_allele,discovered_allele>> all_pruned_alleles;
+    S(delineate_sites(cfg, alleles, sites, all_pruned_alleles));
+    // at this point, alleles has been cleared to save memory usage
+
+    return unify_delineated_sites(cfg, N, sites, all_pruned_alleles, ans, stats_out);
+}
+
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N, const flat_discovered_alleles& alleles,
+                     size_t begin, size_t end,
+                     vector<unified_site>& ans,
+                     unifier_stats& stats_out) {
+    Status s;
+    if (begin > end || end > alleles.size()) {
+        return Status::Invalid("unified_sites: invalid range of discovered alleles");
+    }
+
+    delineated_sites sites;
+    vector<pair<minimized_allele,discovered_allele>> all_pruned_alleles;
+    S(delineate_sites(cfg, alleles, begin, end, sites, all_pruned_alleles));
+
+    return unify_delineated_sites(cfg, N, sites, all_pruned_alleles, ans, stats_out);
+}
+
 }
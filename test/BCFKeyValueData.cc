@@ -1,9 +1,17 @@
 #include <iostream>
 #include <map>
+#include <fstream>
 #include <chrono>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <defs.capnp.h>
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
+#include "discovery.h"
+#include "service.h"
+#include "unifier.h"
 #include "compare_queries.h"
+#include "test_utils.h"
 #include "catch.hpp"
 #include "ctpl_stl.h"
 using namespace std;
@@ -1340,6 +1348,414 @@ TEST_CASE("BCFKeyValueData::sampleset_range") {
     REQUIRE(records.size() == 0);
 }
 
+// Rewrite every BCF bucket in the database without its variant record list
+// or interval index, as written by older versions
+static void strip_variant_lists(KeyValue::DB& db) {
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("bcf", coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, "", it).ok());
+    vector<pair<string,string>> legacy;
+    Status s;
+    for (; s.ok() && it->valid(); s = it->next()) {
+        auto value = it->value();
+        string buf(value.data, value.size);
+        ::capnp::FlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((const ::capnp::word*)buf.data(), buf.size() / sizeof(::capnp::word)));
+        auto bucket = message.getRoot<GLnexus::capnp::BCFBucket>();
+        REQUIRE(bucket.getVariantsListed());
+
+        ::capnp::MallocMessageBuilder b;
+        auto msg_b = b.initRoot<GLnexus::capnp::BCFBucket>();
+        msg_b.setRecords(bucket.getRecords());
+        msg_b.setSkips(bucket.getSkips());
+        auto msg_bytes = ::capnp::messageToFlatArray(b).asBytes();
+        legacy.push_back(make_pair(it->key().str(), string((char*)msg_bytes.begin(), msg_bytes.size())));
+    }
+    REQUIRE(s.ok());
+    REQUIRE(legacy.size() > 0);
+    for (const auto& kv : legacy) {
+        REQUIRE(db.put(coll, kv.first, kv.second).ok());
+    }
+}
+
+TEST_CASE("BCFKeyValueData variant records only") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs, 25000).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "1", "test/data/sampleset_range1.gvcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "2", "test/data/sampleset_range2.gvcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "3", "test/data/sampleset_range3.gvcf", samples_imported).ok());
+    string sampleset;
+    REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+
+    // collect (dataset, range) of the records yielded for each query
+    auto query = [&](const range& rng, unsigned flags, bool variants_by_predicate) {
+        bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
+            retval = !is_gvcf_ref_record(bcf);
+            return Status::OK();
+        };
+        shared_ptr<const set<string>> samples, datasets;
+        vector<unique_ptr<RangeBCFIterator>> iterators;
+        REQUIRE(data->sampleset_range(*cache, sampleset, rng,
+                                      variants_by_predicate ? predicate : nullptr,
+                                      samples, datasets, iterators, flags).ok());
+        vector<pair<string,range>> ans;
+        for (auto& iterator : iterators) {
+            string dataset;
+            shared_ptr<const bcf_hdr_t> hdr;
+            vector<shared_ptr<bcf1_t>> records;
+            Status s;
+            while ((s = iterator->next(dataset, hdr, records)).ok()) {
+                for (const auto& rec : records) {
+                    ans.push_back(make_pair(dataset, range(rec)));
+                }
+            }
+            REQUIRE(s == StatusCode::NOT_FOUND);
+        }
+        return ans;
+    };
+
+    vector<range> ranges = { range(0, 0, 1000000), range(0, 190000, 200000),
+                             range(0, 290000, 300050), range(0, 400200, 400201) };
+    vector<vector<pair<string,range>>> expected;
+    size_t nvariants = 0, nall = 0;
+    for (const auto& rng : ranges) {
+        expected.push_back(query(rng, BCF_RANGE_ALL, true));
+        REQUIRE(query(rng, BCF_RANGE_VARIANTS_ONLY, false) == expected.back());
+        REQUIRE(query(rng, BCF_RANGE_VARIANTS_ONLY, true) == expected.back());
+        nvariants += expected.back().size();
+        nall += query(rng, BCF_RANGE_ALL, false).size();
+    }
+    REQUIRE(nvariants > 0);
+    REQUIRE(nvariants < nall);
+
+    // variant records are read from the list, skipping reference records
+    auto stats0 = *(data->getRangeStats());
+    query(ranges[0], BCF_RANGE_VARIANTS_ONLY, false);
+    auto stats1 = *(data->getRangeStats());
+    query(ranges[0], BCF_RANGE_ALL, false);
+    auto stats2 = *(data->getRangeStats());
+    REQUIRE(stats1.nBCFRecordsRead - stats0.nBCFRecordsRead >= expected[0].size());
+    REQUIRE(stats1.nBCFRecordsRead - stats0.nBCFRecordsRead < stats2.nBCFRecordsRead - stats1.nBCFRecordsRead);
+
+    // buckets lacking the list (from older versions) are filtered record by record
+    strip_variant_lists(db);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        REQUIRE(query(ranges[i], BCF_RANGE_VARIANTS_ONLY, false) == expected[i]);
+    }
+}
+
+TEST_CASE("BCFKeyValueData interval index") {
+    // reference bands of 50bp every 100bp, with a long deletion among them
+    string gvcf_path = "/tmp/BCFKeyValueData_interval_index.gvcf";
+    {
+        ofstream fout(gvcf_path);
+        fout << "##fileformat=VCFv4.1\n"
+             << "##ALT=<ID=NON_REF,Description=\"Represents any possible alternative allele at this location\">\n"
+             << "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">\n"
+             << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+             << "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality\">\n"
+             << "##contig=<ID=21,length=48129895>\n"
+             << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tIX0001\n";
+        for (int i = 0; i < 100; i++) {
+            int pos = 1001 + i*100;
+            fout << "21\t" << pos << "\t.\tT\t<NON_REF>\t.\t.\tEND=" << (pos+49)
+                 << "\tGT:GQ\t0/0:30\n";
+            if (i == 20) {
+                // 0-based [3009,8009)
+                fout << "21\t3010\t.\t" << string(5000, 'A') << "\tA,<NON_REF>\t.\t.\t.\tGT:GQ\t0/1:30\n";
+            }
+        }
+    }
+
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs, 25000).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "1", gvcf_path, samples_imported).ok());
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("1", &hdr).ok());
+
+    // yield the ranges of the records overlapping the query, and the number
+    // of records read to find them
+    auto query = [&](const range& rng, vector<range>& ans) {
+        auto stats0 = *(data->getRangeStats());
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data->dataset_range("1", hdr.get(), rng, nullptr, &records).ok());
+        ans.clear();
+        for (const auto& rec : records) {
+            ans.push_back(range(rec));
+        }
+        return data->getRangeStats()->nBCFRecordsRead - stats0.nBCFRecordsRead;
+    };
+
+    vector<range> ans;
+    // the scan begins exactly at the first overlapping band, and stops
+    // upon the next
+    REQUIRE(query(range(0, 2000, 2010), ans) == 2);
+    REQUIRE(ans == vector<range>({range(0, 2000, 2050)}));
+    REQUIRE(query(range(0, 9020, 9100), ans) == 2);
+    REQUIRE(ans == vector<range>({range(0, 9000, 9050)}));
+    REQUIRE(query(range(0, 9060, 9090), ans) == 1);
+    REQUIRE(ans.empty());
+    // within the deletion, the scan begins with it
+    REQUIRE(query(range(0, 7000, 7010), ans) == 42);
+    REQUIRE(ans == vector<range>({range(0, 3009, 8009), range(0, 7000, 7050)}));
+    vector<vector<range>> expected;
+    vector<range> ranges = { range(0, 0, 1000000), range(0, 2000, 2010), range(0, 7000, 7010),
+                             range(0, 8000, 8020), range(0, 9060, 9090) };
+    for (const auto& rng : ranges) {
+        query(rng, ans);
+        expected.push_back(ans);
+    }
+
+    // buckets lacking the index (from older versions) yield the same records
+    strip_variant_lists(db);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        query(ranges[i], ans);
+        REQUIRE(ans == expected[i]);
+    }
+}
+
+TEST_CASE("BCFKeyValueData bucket boundaries") {
+    vector<pair<string,size_t>> contigs = {make_pair<string,size_t>("21", 48129895)};
+    vector<string> gvcfs = { "test/data/sampleset_range1.gvcf", "test/data/sampleset_range2.gvcf",
+                             "test/data/sampleset_range3.gvcf" };
+
+    SECTION("invalid") {
+        KeyValueMem::DB db({});
+        REQUIRE(T::InitializeDB(&db, contigs, 25000, {{"21", {1000, 2000}}}) == StatusCode::INVALID);
+        REQUIRE(T::InitializeDB(&db, contigs, 25000, {{"21", {0, 2000, 2000}}}) == StatusCode::INVALID);
+        REQUIRE(T::InitializeDB(&db, contigs, 25000, {{"22", {0, 2000}}}) == StatusCode::INVALID);
+    }
+
+    // plan buckets from the density of the records, which are clustered
+    // around a few positions
+    T::bucket_boundaries boundaries;
+    T::bucket_plan_stats stats;
+    REQUIRE(T::PlanBucketBoundaries(contigs, gvcfs, 25000, boundaries, stats, 100).ok());
+    REQUIRE(boundaries.size() == 1);
+    const auto& b = boundaries["21"];
+    REQUIRE(b.size() > 2);
+    REQUIRE(b[0] == 0);
+    REQUIRE(b.back() == 48129895);
+    REQUIRE(stats.records > 0);
+    REQUIRE(stats.buckets == b.size() - 1);
+    REQUIRE(stats.uniform_buckets == 1926);
+    REQUIRE(stats.buckets < stats.uniform_buckets);
+    int min_len = b[1] - b[0], max_len = min_len;
+    for (size_t i = 1; i < b.size(); i++) {
+        REQUIRE(b[i] > b[i-1]);
+        REQUIRE(b[i] - b[i-1] <= 16*25000);
+        min_len = min(min_len, b[i] - b[i-1]);
+        max_len = max(max_len, b[i] - b[i-1]);
+    }
+    REQUIRE(min_len < 25000);
+    REQUIRE(max_len > 25000);
+
+    // import into databases with uniform and planned buckets
+    KeyValueMem::DB uniform_db({}), planned_db({});
+    unique_ptr<T> uniform, planned;
+    REQUIRE(T::InitializeDB(&uniform_db, contigs, 25000).ok());
+    REQUIRE(T::InitializeDB(&planned_db, contigs, 25000, boundaries).ok());
+    for (auto p : {make_pair(&uniform_db, &uniform), make_pair(&planned_db, &planned)}) {
+        REQUIRE(T::Open(p.first, *p.second).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(**p.second, cache).ok());
+        set<string> samples_imported;
+        for (int i = 0; i < gvcfs.size(); i++) {
+            REQUIRE((*p.second)->import_gvcf(*cache, to_string(i+1), gvcfs[i], samples_imported).ok());
+        }
+    }
+
+    // they yield the same records
+    auto formatted = [&](T& data, const string& dataset, const range& q) {
+        shared_ptr<const bcf_hdr_t> hdr;
+        REQUIRE(data.dataset_header(dataset, &hdr).ok());
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data.dataset_range(dataset, hdr.get(), q, nullptr, &records).ok());
+        vector<string> ans;
+        kstring_t kstr = {0, 0, nullptr};
+        for (const auto& rec : records) {
+            kstr.l = 0;
+            REQUIRE(vcf_format(hdr.get(), rec.get(), &kstr) == 0);
+            ans.push_back(string(kstr.s, kstr.l));
+        }
+        free(kstr.s);
+        return ans;
+    };
+    vector<range> ranges = { range(0, 0, 1000000), range(0, 190000, 200000), range(0, 199950, 200050),
+                             range(0, 290000, 300050), range(0, 400200, 400201) };
+    size_t n = 0;
+    for (const auto& rng : ranges) {
+        for (int i = 1; i <= gvcfs.size(); i++) {
+            auto expected = formatted(*uniform, to_string(i), rng);
+            REQUIRE(formatted(*planned, to_string(i), rng) == expected);
+            n += expected.size();
+        }
+    }
+    REQUIRE(n > 0);
+}
+
+TEST_CASE("BCFRecordPool") {
+    auto pool = BCFRecordPool::Create(2);
+    vector<shared_ptr<bcf1_t>> records;
+    for (int i = 0; i < 3; i++) {
+        records.push_back(pool->get());
+    }
+    REQUIRE(pool->allocated() == 3);
+    REQUIRE(pool->reused() == 0);
+    auto shared = records[0];
+    pool->recycle(records);
+    REQUIRE(records.empty());
+    records.push_back(pool->get());
+    records.push_back(pool->get());
+    records.push_back(pool->get());
+    REQUIRE(pool->allocated() == 4);
+    REQUIRE(pool->reused() == 2);
+    REQUIRE(records[0].get() != shared.get());
+    REQUIRE(records[1].get() != shared.get());
+
+    // raw records go back to the pool explicitly
+    records.clear();
+    bcf1_t* raw = pool->get_raw();
+    REQUIRE(pool->reused() == 3);
+    pool->put(raw);
+    {
+        auto unique = pool->get_unique();
+        REQUIRE(unique.get() == raw);
+        REQUIRE(pool->reused() == 4);
+    }
+    REQUIRE(pool->get_raw() == raw);
+    pool->put(raw);
+    REQUIRE(pool->allocated() == 4);
+
+    // records outlive the pool's owner
+    pool.reset();
+    shared.reset();
+    records.clear();
+
+    // range queries recycle the records on the calling thread
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs, 25000).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "1", "test/data/sampleset_range1.gvcf", samples_imported).ok());
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("1", &hdr).ok());
+
+    auto formatted = [&](const vector<shared_ptr<bcf1_t>>& recs) {
+        vector<string> ans;
+        kstring_t kstr = {0, 0, nullptr};
+        for (const auto& rec : recs) {
+            kstr.l = 0;
+            REQUIRE(vcf_format(hdr.get(), rec.get(), &kstr) == 0);
+            ans.push_back(string(kstr.s, kstr.l));
+        }
+        free(kstr.s);
+        return ans;
+    };
+    range rng(0, 0, 1000000);
+    REQUIRE(data->dataset_range("1", hdr.get(), rng, nullptr, &records).ok());
+    REQUIRE(records.size() > 1);
+    auto expected = formatted(records);
+    auto local = BCFRecordPool::ThreadLocal();
+    uint64_t reused0 = local->reused();
+    local->recycle(records);
+    REQUIRE(data->dataset_range("1", hdr.get(), rng, nullptr, &records).ok());
+    REQUIRE(local->reused() - reused0 >= expected.size());
+    REQUIRE(formatted(records) == expected);
+}
+
+TEST_CASE("BCFKeyValueData projection") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs, 25000).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "1", "test/data/sampleset_range1.gvcf", samples_imported).ok());
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("1", &hdr).ok());
+
+    range rng(0, 0, 1000000);
+    vector<shared_ptr<bcf1_t>> all, projected;
+    REQUIRE(data->dataset_range("1", hdr.get(), rng, nullptr, &all).ok());
+
+    // records ending after 200000 with only GT
+    bcf_projection projection;
+    projection.raw_predicate = [](const uint8_t* buf, size_t len, bool& ans) {
+        range rec_rng(-1, -1, -1);
+        Status s;
+        S(bcf_raw_range(buf, 0, len, rec_rng));
+        ans = rec_rng.end > 200000;
+        return Status::OK();
+    };
+    projection.all_info = false;
+    projection.all_format = false;
+    projection.format = { "GT" };
+    REQUIRE(data->dataset_range("1", hdr.get(), rng, nullptr, &projected, BCF_RANGE_ALL, &projection).ok());
+
+    vector<shared_ptr<bcf1_t>> expected;
+    for (const auto& rec : all) {
+        if (range(rec).end > 200000) {
+            expected.push_back(rec);
+        }
+    }
+    REQUIRE(expected.size() > 0);
+    REQUIRE(expected.size() < all.size());
+    REQUIRE(projected.size() == expected.size());
+    int32_t *gt1 = nullptr, *gt2 = nullptr, n1 = 0, n2 = 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        REQUIRE(range(projected[i]) == range(expected[i]));
+        REQUIRE(projected[i]->n_allele == expected[i]->n_allele);
+        REQUIRE(projected[i]->n_info == 0);
+        REQUIRE(projected[i]->n_fmt == 1);
+        int ngt = bcf_get_genotypes(hdr.get(), projected[i].get(), &gt1, &n1);
+        REQUIRE(ngt == bcf_get_genotypes(hdr.get(), expected[i].get(), &gt2, &n2));
+        REQUIRE(memcmp(gt1, gt2, ngt*sizeof(int32_t)) == 0);
+    }
+    free(gt1);
+    free(gt2);
+
+    // through the iterators, too
+    string sampleset;
+    REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+    shared_ptr<const set<string>> samples, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    REQUIRE(data->sampleset_range(*cache, sampleset, rng, nullptr,
+                                  samples, datasets, iterators, BCF_RANGE_ALL, &projection).ok());
+    size_t n = 0;
+    for (auto& iterator : iterators) {
+        string dataset;
+        vector<shared_ptr<bcf1_t>> records;
+        Status s;
+        while ((s = iterator->next(dataset, hdr, records)).ok()) {
+            for (const auto& rec : records) {
+                REQUIRE(range(rec) == range(expected[n++]));
+                REQUIRE(rec->n_fmt == 1);
+            }
+        }
+        REQUIRE(s == StatusCode::NOT_FOUND);
+    }
+    REQUIRE(n == expected.size());
+}
+
 TEST_CASE("BCFKeyValueData compare iterator implementations") {
     // This tests the optimized bucket-based range slicing in BCFKeyValueData
     int nRegions = 13;
@@ -1395,6 +1811,20 @@ TEST_CASE("BCFKeyValueData compare iterator implementations") {
     }
 
     //cout << "Compared " << (nIter+1) << " range queries between the two iterators" << endl;
+
+    // a single-sample set is looked up in each bucket with one multi_get
+    REQUIRE(data->new_sampleset(*cache, "one", set<string>{*samples_imported.begin()}).ok());
+    auto stats0 = *(data->getRangeStats());
+    rc = compare_queries::compare_query(*data, *cache, "one", range(0, 0, lenChrom));
+    REQUIRE(rc != 0);
+    auto stats1 = *(data->getRangeStats());
+    REQUIRE(stats1.nMultiGets > stats0.nMultiGets);
+    REQUIRE(stats1.maxMultiGetKeys >= 1);
+
+    // prefetching reads the same buckets, by either strategy
+    REQUIRE(data->prefetch(*cache, sampleset, range(0, 0, lenChrom)).ok());
+    REQUIRE(data->prefetch(*cache, "one", range(0, 0, lenChrom)).ok());
+    REQUIRE(data->prefetch(*cache, "one", range(0, 190000, 200000)).ok());
 }
 
 /* disabled when we raised max contigs from 10,000 to 2^24
@@ -1575,3 +2005,436 @@ TEST_CASE("BCFKeyValueData NA12878 import and query") {
     auto stats = data->getRangeStats();
     REQUIRE(double(stats->nBCFRecordsInRange) / stats->nBCFRecordsRead >= 0.25);
 }
+
+TEST_CASE("BCFKeyValueData window-scan genotyping benchmark") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    vector<pair<string,uint64_t>> contigs;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open("test/data/NA12878.g.vcf.gz", "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    int ncontigs = 0;
+    const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+    for (int i = 0; i < ncontigs; i++) {
+        contigs.push_back(make_pair(string(contignames[i]),
+                                    hdr->id[BCF_DT_CTG][i].val->info[0]));
+    }
+    free(contignames);
+
+    KeyValueMem::DB db({});
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "NA12878", "test/data/NA12878.g.vcf.gz", samples_imported).ok());
+    string sampleset;
+    REQUIRE(data->all_samples_sampleset(sampleset).ok());
+
+    // the exome's variant sites on chr17, often several to a bucket
+    unique_ptr<Service> svc;
+    REQUIRE(Service::Start(service_config(), *data, *data, svc).ok());
+    unsigned N;
+    discovered_alleles dsals;
+    REQUIRE(svc->discover_alleles(sampleset, range(16, 0, 83257441), N, dsals).ok());
+    vector<unified_site> sites;
+    unifier_stats ustats;
+    REQUIRE(unified_sites(unifier_config(), N, dsals, sites, ustats).ok());
+    REQUIRE(sites.size() > 100);
+
+    auto genotype = [&](bool window_scan, const string& filename, double& buckets_per_site) {
+        service_config cfg;
+        cfg.prefetch_threads = 0;
+        cfg.genotype_window_scan = window_scan;
+        cfg.genotype_window_sites = 64;
+        REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+        int64_t buckets0 = data->getRangeStats()->nBucketsDecoded;
+        auto t0 = std::chrono::steady_clock::now();
+        REQUIRE(svc->genotype_sites(genotyper_config(), sampleset, sites, filename).ok());
+        auto t1 = std::chrono::steady_clock::now();
+        buckets_per_site = double(data->getRangeStats()->nBucketsDecoded - buckets0) / sites.size();
+        WARN((window_scan ? "window scan: " : "per site: ") << buckets_per_site
+             << " buckets decoded per site, " << std::chrono::duration<double>(t1-t0).count()
+             << "s for " << sites.size() << " sites");
+    };
+    const string per_site_fn("/tmp/GLnexus_unit_tests.per_site.bcf");
+    const string window_scan_fn("/tmp/GLnexus_unit_tests.window_scan.bcf");
+    double per_site = 0, window_scan = 0;
+    genotype(false, per_site_fn, per_site);
+    genotype(true, window_scan_fn, window_scan);
+
+    // the same output, decoding fewer buckets
+    REQUIRE(slurp_file(window_scan_fn) == slurp_file(per_site_fn));
+    REQUIRE(per_site >= 1.0);
+    REQUIRE(window_scan < per_site);
+}
+
+TEST_CASE("BCFKeyValueData reference band columns") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    vector<pair<string,uint64_t>> contigs;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open("test/data/NA12878.g.vcf.gz", "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    int ncontigs = 0;
+    const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+    for (int i = 0; i < ncontigs; i++) {
+        contigs.push_back(make_pair(string(contignames[i]),
+                                    hdr->id[BCF_DT_CTG][i].val->info[0]));
+    }
+    free(contignames);
+
+    // import chr17 into two databases, with and without the columns
+    KeyValueMem::DB plain_db({}), columnar_db({});
+    unique_ptr<T> plain, columnar;
+    for (auto p : {make_pair(&plain_db, &plain), make_pair(&columnar_db, &columnar)}) {
+        REQUIRE(T::InitializeDB(p.first, contigs).ok());
+        REQUIRE(T::Open(p.first, *p.second).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(**p.second, cache).ok());
+        T::import_options opts;
+        opts.ref_band_columns = (p.second == &columnar);
+        T::import_result rslt;
+        REQUIRE((*p.second)->import_gvcf(*cache, "NA12878", "test/data/NA12878.g.vcf.gz",
+                                         {range(16, 0, 83257441)}, opts, rslt).ok());
+    }
+
+    auto formatted = [&](T& data, const range& q) {
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data.dataset_range("NA12878", hdr.get(), q, nullptr, &records).ok());
+        vector<string> ans;
+        kstring_t kstr = {0, 0, nullptr};
+        for (const auto& rec : records) {
+            kstr.l = 0;
+            REQUIRE(vcf_format(hdr.get(), rec.get(), &kstr) == 0);
+            ans.push_back(string(kstr.s, kstr.l));
+        }
+        free(kstr.s);
+        return ans;
+    };
+
+    auto same_bands = [](const vector<T::ref_band>& a, const vector<T::ref_band>& b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].pos != b[i].pos || a[i].gq != b[i].gq ||
+                a[i].min_dp != b[i].min_dp || a[i].dp != b[i].dp || a[i].hom_ref != b[i].hom_ref) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    vector<range> queries = { range(16, 0, 83257441), range(16, 1000000, 1100000),
+                              range(16, 29999, 30001), range(16, 7500000, 7500001) };
+    for (const auto& q : queries) {
+        auto expected = formatted(*plain, q);
+        REQUIRE(formatted(*columnar, q) == expected);
+
+        // bands summarized from the records themselves
+        vector<T::ref_band> expected_bands;
+        REQUIRE(plain->BCFData::dataset_ref_bands("NA12878", hdr.get(), q, expected_bands).ok());
+        for (T* data : {plain.get(), columnar.get()}) {
+            vector<T::ref_band> bands;
+            REQUIRE(data->dataset_ref_bands("NA12878", hdr.get(), q, bands).ok());
+            REQUIRE(same_bands(bands, expected_bands));
+        }
+    }
+    vector<T::ref_band> all_bands;
+    REQUIRE(columnar->dataset_ref_bands("NA12878", hdr.get(), queries[0], all_bands).ok());
+    REQUIRE(all_bands.size() > 1000);
+
+    // squeezed genotyping of sites within and straddling the reference bands
+    // gives the same output per site and in windows, from the columnar bands
+    // as from the band records
+    vector<unified_site> sites;
+    auto add_site = [&](int rid, int beg) {
+        range pos(rid, beg, beg+1);
+        unified_site us(pos);
+        us.unification[allele(pos, "A")] = 0;
+        us.unification[allele(pos, "G")] = 1;
+        us.alleles.push_back(unified_allele(pos, "A"));
+        us.alleles.push_back(unified_allele(pos, "G"));
+        us.alleles[1].frequency = 0.1;
+        sites.push_back(us);
+    };
+    for (size_t i = 1; i < all_bands.size(); i += 20) {
+        const range& pos = all_bands[i].pos;
+        add_site(pos.rid, pos.beg - 1);
+        if (pos.size() >= 4) {
+            add_site(pos.rid, pos.beg + pos.size()/2);
+        }
+    }
+    sort(sites.begin(), sites.end());
+    REQUIRE(sites.size() > 50);
+
+    genotyper_config gcfg;
+    gcfg.squeeze = true;
+    gcfg.liftover_fields.push_back(retained_format_field({"MIN_DP", "DP"}, "DP", RetainedFieldFrom::FORMAT,
+                                                         RetainedFieldType::INT, FieldCombinationMethod::MIN,
+                                                         RetainedFieldNumber::BASIC, 1));
+    auto genotype = [&](T& data, bool window_scan, const string& filename) {
+        string sampleset;
+        REQUIRE(data.all_samples_sampleset(sampleset).ok());
+        service_config cfg;
+        cfg.genotype_window_scan = window_scan;
+        unique_ptr<Service> svc;
+        REQUIRE(Service::Start(cfg, data, data, svc).ok());
+        REQUIRE(svc->genotype_sites(gcfg, sampleset, sites, filename).ok());
+    };
+    const string per_site_fn("/tmp/GLnexus_unit_tests.ref_bands_per_site.bcf");
+    const string window_scan_fn("/tmp/GLnexus_unit_tests.ref_bands_window_scan.bcf");
+    genotype(*plain, false, per_site_fn);
+    for (T* data : {plain.get(), columnar.get()}) {
+        for (bool window_scan : {false, true}) {
+            genotype(*data, window_scan, window_scan_fn);
+            REQUIRE(slurp_file(window_scan_fn) == slurp_file(per_site_fn));
+        }
+    }
+
+    // compare the encodings, then convert the plain database in place
+    T::ref_band_encoding_stats stats;
+    REQUIRE(plain->compare_ref_band_encoding(false, stats).ok());
+    REQUIRE(stats.records >= 8199);
+    REQUIRE(stats.ref_bands > stats.records / 2);
+    REQUIRE(stats.columnar_bytes < stats.plain_bytes);
+    REQUIRE(stats.buckets > 0);
+    REQUIRE(stats.buckets <= stats.records);
+
+    T::ref_band_encoding_stats columnar_stats;
+    REQUIRE(columnar->compare_ref_band_encoding(false, columnar_stats).ok());
+    REQUIRE(columnar_stats.columnar_bytes == stats.columnar_bytes);
+
+    auto expected = formatted(*plain, queries[0]);
+    REQUIRE(plain->compare_ref_band_encoding(true, stats).ok());
+    REQUIRE(formatted(*plain, queries[0]) == expected);
+    REQUIRE(plain->compare_ref_band_encoding(false, columnar_stats).ok());
+    REQUIRE(columnar_stats.plain_bytes == stats.plain_bytes);
+}
+
+TEST_CASE("BCFKeyValueData discovered-allele summaries") {
+    // small buckets, so that some records dangle into the next
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000), make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs, 8).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", samples_imported).ok());
+    string all;
+    REQUIRE(cache->all_samples_sampleset(all).ok());
+    REQUIRE(data->new_sampleset(*cache, "trio1", {"trio1.fa", "trio1.mo", "trio1.ch"}).ok());
+    REQUIRE(data->new_sampleset(*cache, "fa", {"trio1.fa"}).ok());
+
+    // discover the alleles by scanning the records
+    auto scan = [&](const string& sampleset, const range& pos, bool include_zero_copies) {
+        shared_ptr<const set<string>> samples, datasets;
+        vector<unique_ptr<RangeBCFIterator>> iterators;
+        const bcf_projection projection = discovery_projection();
+        REQUIRE(data->sampleset_range(*cache, sampleset, pos, nullptr,
+                                      samples, datasets, iterators, BCF_RANGE_VARIANTS_ONLY, &projection).ok());
+        discovered_alleles ans;
+        for (auto& iterator : iterators) {
+            discovered_alleles dsals;
+            REQUIRE(discover_alleles_from_iterator(*samples, pos, *iterator, dsals, include_zero_copies).ok());
+            REQUIRE(merge_discovered_alleles(dsals, ans).ok());
+        }
+        return ans;
+    };
+
+    vector<range> ranges = { range(0, 0, 1000000), range(0, 1000, 1002), range(0, 1005, 1110),
+                             range(1, 1000, 1020), range(1, 1010, 1012), range(1, 1016, 1017),
+                             range(2, 0, 1000000), range(2, 2000, 3000) };
+    size_t nonempty = 0;
+    for (const auto& pos : ranges) {
+        for (bool include_zero_copies : {false, true}) {
+            for (const auto& sampleset : {all, string("trio1")}) {
+                unsigned N;
+                discovered_alleles dsals;
+                REQUIRE(data->sampleset_discover_alleles(*cache, sampleset, pos, include_zero_copies,
+                                                         N, dsals).ok());
+                REQUIRE(N == (sampleset == all ? 6 : 3));
+                REQUIRE(dsals == scan(sampleset, pos, include_zero_copies));
+                if (!dsals.empty()) {
+                    nonempty++;
+                }
+            }
+        }
+    }
+    REQUIRE(nonempty > 0);
+
+    // the summaries are over all of each data set's samples
+    unsigned N;
+    discovered_alleles dsals;
+    REQUIRE(data->sampleset_discover_alleles(*cache, "fa", ranges[0], false, N, dsals)
+            == StatusCode::NOT_IMPLEMENTED);
+    REQUIRE(data->sampleset_discover_alleles(*cache, "bogus", ranges[0], false, N, dsals)
+            == StatusCode::NOT_FOUND);
+}
+
+TEST_CASE("BCFKeyValueData discovery tiles") {
+    // small buckets, so that some records dangle into the next
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000), make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs, 8).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", samples_imported).ok());
+    // sample sets for which the summaries can't answer, so the records are scanned
+    REQUIRE(data->new_sampleset(*cache, "fathers", {"trio1.fa", "trio2.fa"}).ok());
+    REQUIRE(data->new_sampleset(*cache, "fa", {"trio1.fa"}).ok());
+
+    // one tile per bucket, covering the range
+    vector<range> tiles;
+    REQUIRE(data->range_tiles(range(0, 1005, 1030), tiles).ok());
+    REQUIRE(tiles.size() == 4);
+    REQUIRE(tiles.front() == range(0, 1005, 1008));
+    REQUIRE(tiles.back() == range(0, 1024, 1030));
+
+    auto discover = [&](size_t tile_cost, size_t block_datasets, const string& sampleset,
+                        const range& pos) {
+        service_config cfg;
+        cfg.discover_tile_cost = tile_cost;
+        cfg.discover_block_datasets = block_datasets;
+        unique_ptr<Service> svc;
+        REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+        unsigned N;
+        discovered_alleles dsals;
+        REQUIRE(svc->discover_alleles(sampleset, pos, N, dsals).ok());
+        REQUIRE(N == (sampleset == "fa" ? 1 : 2));
+        return dsals;
+    };
+
+    // tiles of one or more buckets x blocks of one or both data sets find
+    // the same alleles as the iterators
+    vector<range> ranges = { range(0, 0, 4000), range(0, 1002, 1012), range(0, 1005, 1110),
+                             range(1, 1000, 1020), range(1, 1012, 1018), range(2, 0, 4000) };
+    size_t nonempty = 0;
+    for (const auto& pos : ranges) {
+        for (const auto& sampleset : {string("fathers"), string("fa")}) {
+            discovered_alleles expected = discover(0, 0, sampleset, pos);
+            REQUIRE(discover(1, 1, sampleset, pos) == expected);
+            REQUIRE(discover(3, 1, sampleset, pos) == expected);
+            REQUIRE(discover(8, 2, sampleset, pos) == expected);
+            REQUIRE(discover(1000000, 256, sampleset, pos) == expected);
+            if (!expected.empty()) {
+                nonempty++;
+            }
+        }
+    }
+    REQUIRE(nonempty > 0);
+}
+
+TEST_CASE("BCFKeyValueData header interning") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000), make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", samples_imported).ok());
+
+    auto file_header = [](const string& filename) {
+        unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                                   [](vcfFile* f) { bcf_close(f); });
+        unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+        return bcf_write_header(hdr.get());
+    };
+
+    // the data sets' headers differ only in the samples, so they share one
+    // stored and parsed body
+    KeyValue::CollectionHandle coll_header, coll_body;
+    REQUIRE(db.collection("header", coll_header).ok());
+    REQUIRE(db.collection("header_body", coll_body).ok());
+    string stored;
+    REQUIRE(db.get(coll_header, "trio1", stored).ok());
+    REQUIRE(stored.substr(0, 3) != "BCF");
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll_body, "", it).ok());
+    size_t bodies = 0;
+    Status s;
+    for (; s.ok() && it->valid(); s = it->next()) {
+        bodies++;
+    }
+    REQUIRE(s.ok());
+    REQUIRE(bodies == 1);
+
+    shared_ptr<const bcf_hdr_t> hdr1, hdr2;
+    REQUIRE(data->dataset_header("trio1", &hdr1).ok());
+    REQUIRE(data->dataset_header("trio2", &hdr2).ok());
+    REQUIRE(hdr1->id[BCF_DT_ID] == hdr2->id[BCF_DT_ID]);
+    REQUIRE(hdr1->id[BCF_DT_CTG] == hdr2->id[BCF_DT_CTG]);
+    REQUIRE(bcf_hdr_nsamples(hdr2.get()) == 3);
+    REQUIRE(string(bcf_hdr_int2id(hdr2.get(), BCF_DT_SAMPLE, 0)) == "trio2.fa");
+    REQUIRE(bcf_hdr_id2int(hdr2.get(), BCF_DT_SAMPLE, "trio2.ch") == 2);
+    REQUIRE(bcf_hdr_id2int(hdr2.get(), BCF_DT_SAMPLE, "trio1.ch") < 0);
+    REQUIRE(bcf_write_header(hdr1.get()) == file_header("test/data/discover_alleles_trio1.vcf"));
+    REQUIRE(bcf_write_header(hdr2.get()) == file_header("test/data/discover_alleles_trio2.vcf"));
+
+    vector<shared_ptr<bcf1_t>> records;
+    REQUIRE(data->dataset_range("trio2", hdr2.get(), range(1, 0, 1000000), nullptr, &records).ok());
+    REQUIRE(records.size() == 1);
+    REQUIRE(*bcf1_to_string(hdr2.get(), records[0].get()) ==
+            "B\t1002\t.\tCCCCCCCCCCCCCCC\tAAAAAAAAAAAAAAA,<*>\t.\tPASS\t.\tGT\t0/0\t1/1\t1/0");
+
+    // whole headers stored by earlier versions are still read
+    REQUIRE(db.put(coll_header, "legacy", file_header("test/data/discover_alleles_trio1.vcf")).ok());
+    shared_ptr<const bcf_hdr_t> legacy;
+    REQUIRE(data->dataset_header("legacy", &legacy).ok());
+    REQUIRE(bcf_write_header(legacy.get()) == bcf_write_header(hdr1.get()));
+    REQUIRE(legacy->id[BCF_DT_ID] != hdr1->id[BCF_DT_ID]);
+}
+
+TEST_CASE("BCFData::sampleset_columns") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000), make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", samples_imported).ok());
+    REQUIRE(data->new_sampleset(*cache, "parents",
+                                set<string>{"trio1.fa", "trio1.mo", "trio2.mo"}).ok());
+
+    shared_ptr<const sampleset_ids> ids;
+    REQUIRE(cache->sampleset_ids("parents", ids).ok());
+    REQUIRE(ids->samples == vector<string>({"trio1.fa", "trio1.mo", "trio2.mo"}));
+    REQUIRE(ids->datasets == vector<string>({"trio1", "trio2"}));
+    REQUIRE(ids->sample_id("trio2.mo") == 2);
+    REQUIRE(ids->sample_id("trio2.fa") == -1);
+    REQUIRE(ids->dataset_id("trio2") == 1);
+    REQUIRE(ids->dataset_id("trio3") == -1);
+    REQUIRE(cache->sampleset_ids("bogus", ids) == StatusCode::NOT_FOUND);
+
+    shared_ptr<const sampleset_columns> columns;
+    REQUIRE(data->sampleset_columns(*cache, "parents", columns).ok());
+    REQUIRE(columns->ids->samples.size() == 3);
+    REQUIRE(columns->datasets.size() == 2);
+    REQUIRE(columns->datasets[0].sample_of_column == vector<int>({0, 1, -1}));
+    REQUIRE(columns->datasets[0].columns == vector<pair<int,int>>({{0, 0}, {1, 1}}));
+    REQUIRE(columns->datasets[1].sample_of_column == vector<int>({-1, 2, -1}));
+    REQUIRE(columns->datasets[1].size() == 1);
+    REQUIRE(columns->datasets[1].at(1) == 2);
+    REQUIRE_THROWS(columns->datasets[1].at(0));
+}
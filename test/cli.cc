@@ -5,6 +5,7 @@
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
 #include "cli_utils.h"
+#include "test_utils.h"
 #include "catch.hpp"
 #include "spdlog/sinks/null_sink.h"
 
@@ -101,6 +102,17 @@ TEST_CASE("cli") {
         filename = DB_DIR + "/results.bcf";
         s = cli::utils::genotype(console, 0, nr_threads, DB_PATH, genotyper_cfg, sites, {}, filename);
         REQUIRE(s.ok());
+
+        // the contig-by-contig pipeline gives the same output, with or
+        // without contigs in progress ahead of the one being genotyped
+        for (size_t lookahead : {0, 2}) {
+            string pipeline_filename = DB_DIR + "/pipeline.bcf";
+            s = cli::utils::discover_unify_genotype(console, 0, nr_threads, DB_PATH, ranges, contigs,
+                                                    unifier_cfg, genotyper_cfg, {}, pipeline_filename,
+                                                    false, lookahead);
+            REQUIRE(s.ok());
+            REQUIRE(slurp_file(pipeline_filename) == slurp_file(filename));
+        }
     }
 
     SECTION("read contigs") {
@@ -141,6 +141,48 @@ TEST_CASE("cli_utils") {
         REQUIRE(dsals.size() == dsals2.size());
     }
 
+    SECTION("binary_discovered_alleles") {
+        flat_discovered_alleles flat;
+        {
+            discovered_alleles dsals;
+            YAML::Node n = YAML::Load(da_yaml1);
+            REQUIRE(discovered_alleles_of_yaml(n, contigs, dsals).ok());
+            n = YAML::Load(da_yaml2);
+            discovered_alleles dal2;
+            REQUIRE(discovered_alleles_of_yaml(n, contigs, dal2).ok());
+            merge_discovered_alleles(dal2, dsals);
+            REQUIRE(flat_of_discovered_alleles(dsals, flat).ok());
+        }
+        REQUIRE(flat.size() == 4);
+
+        // split over two messages, appended in turn
+        string data1, data2;
+        REQUIRE(utils::binary_of_discovered_alleles(flat, 0, 3, data1).ok());
+        REQUIRE(utils::binary_of_discovered_alleles(flat, 3, 4, data2).ok());
+        flat_discovered_alleles flat2;
+        REQUIRE(utils::discovered_alleles_of_binary(data1, flat2).ok());
+        REQUIRE(flat2.size() == 3);
+        REQUIRE(utils::discovered_alleles_of_binary(data2, flat2).ok());
+        REQUIRE(flat2.size() == flat.size());
+        for (size_t i = 0; i < flat.size(); i++) {
+            REQUIRE(flat2.allele_at(i) == flat.allele_at(i));
+            REQUIRE(flat2[i].info == flat[i].info);
+        }
+        REQUIRE(flat2.contig_begin(1) == flat.contig_begin(1));
+
+        // out of order
+        flat_discovered_alleles flat3;
+        REQUIRE(utils::discovered_alleles_of_binary(data2, flat3).ok());
+        REQUIRE(utils::discovered_alleles_of_binary(data1, flat3).bad());
+
+        // invalid range and corrupt data
+        string data3;
+        REQUIRE(utils::binary_of_discovered_alleles(flat, 3, 5, data3).bad());
+        flat_discovered_alleles flat4;
+        REQUIRE(utils::discovered_alleles_of_binary(data1.substr(0, data1.size()/2), flat4).bad());
+        REQUIRE(utils::discovered_alleles_of_binary(string(64, '\xff'), flat4).bad());
+    }
+
     const char* bad_yaml_1 = 1 + R"(
 contigs: xxx
 alleles: yyy
@@ -566,4 +608,11 @@ TEST_CASE("iter_compare") {
     int n_iter = 50;
     s = cli::utils::compare_db_itertion_algorithms(console, dbpath, n_iter);
     console->info("Passed {} iterator comparison tests", n_iter);
+
+    BCFKeyValueData::ref_band_encoding_stats stats;
+    s = cli::utils::compare_ref_band_encoding(console, dbpath, true, stats);
+    REQUIRE(s.ok());
+    REQUIRE(stats.buckets > 0);
+    REQUIRE(stats.ref_bands > 0);
+    REQUIRE(stats.columnar_bytes < stats.plain_bytes);
 }
@@ -78,8 +78,9 @@ unification: []
 #CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	A
 )eof";
 
-    map<int,int> sample_mapping;
-    sample_mapping[0] = 0;
+    column_mapping sample_mapping;
+    sample_mapping.sample_of_column = { 0 };
+    sample_mapping.columns = { make_pair(0, 0) };
 
     shared_ptr<bcf_hdr_t> hdr;
     shared_ptr<bcf1_t> rec;
@@ -355,12 +355,21 @@ public:
         }
         REQUIRE(s.ok());
 
+        // the flat representation must unify identically
+        flat_discovered_alleles flat_als;
+        discovered_alleles als_copy(als);
+        REQUIRE(flat_of_discovered_alleles(als_copy, flat_als).ok());
+        vector<unified_site> flat_sites(sites);
+        unifier_stats flat_stats;
+        REQUIRE(unified_sites(unifier_cfg, N, flat_als, 0, flat_als.size(), flat_sites, flat_stats).ok());
+
         unifier_stats stats;
         s = unified_sites(unifier_cfg, N, als, sites, stats);
         if (!s.ok()) {
             cout << s.str() << endl;
         }
         REQUIRE(s.ok());
+        REQUIRE(flat_sites == sites);
 
         REQUIRE(is_sorted(sites.begin(), sites.end()));
         sort(truth_sites.begin(), truth_sites.end());
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <math.h>
 #include <memory>
+#include <set>
+#include <vector>
 
 #include <vcf.h>
 #include <hfile.h>
@@ -291,6 +293,63 @@ TEST_CASE("htslib gVCF representation") {
     REQUIRE(records[4]->rlen == 3);
 }
 
+TEST_CASE("BCFSerialize raw predicates and projection") {
+    UPD(vcfFile, vcf, bcf_open("test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", "r"), [](vcfFile* f) { bcf_close(f); });
+    UPD(bcf_hdr_t, hdr, bcf_hdr_read(vcf), &bcf_hdr_destroy);
+    shared_ptr<bcf1_t> vt(bcf_init(), &bcf_destroy);
+    set<int> no_info, gt_pl = { bcf_hdr_id2int(hdr, BCF_DT_ID, "GT"), bcf_hdr_id2int(hdr, BCF_DT_ID, "PL") };
+    int n = 0;
+
+    while (bcf_read(vcf, hdr, vt.get()) == 0) {
+        REQUIRE(bcf_unpack(vt.get(), BCF_UN_ALL) == 0);
+        int reclen = GLnexus::bcf_raw_calc_packed_len(vt.get());
+        vector<uint8_t> buf(reclen);
+        GLnexus::bcf_raw_write_to_mem(vt.get(), reclen, buf.data());
+
+        bool nonsymbolic = false;
+        REQUIRE(GLnexus::bcf_raw_has_nonsymbolic_alt(buf.data(), buf.size(), nonsymbolic).ok());
+        REQUIRE(nonsymbolic == !GLnexus::is_gvcf_ref_record(vt.get()));
+
+        // the identity projection
+        string projected;
+        REQUIRE(GLnexus::bcf_raw_project(buf.data(), buf.size(), nullptr, nullptr, projected).ok());
+        REQUIRE(projected == string((char*) buf.data(), buf.size()));
+
+        // keep only GT and PL
+        REQUIRE(GLnexus::bcf_raw_project(buf.data(), buf.size(), &no_info, &gt_pl, projected).ok());
+        REQUIRE(projected.size() < buf.size());
+        shared_ptr<bcf1_t> pt(bcf_init(), &bcf_destroy);
+        int bytes_read = 0;
+        REQUIRE(GLnexus::bcf_raw_read_from_mem((const uint8_t*) projected.data(), 0, projected.size(),
+                                               pt.get(), bytes_read).ok());
+        REQUIRE(bytes_read == projected.size());
+        REQUIRE(bcf_unpack(pt.get(), BCF_UN_ALL) == 0);
+        REQUIRE(pt->pos == vt->pos);
+        REQUIRE(pt->rlen == vt->rlen);
+        REQUIRE(pt->n_allele == vt->n_allele);
+        for (int i = 0; i < vt->n_allele; i++) {
+            REQUIRE(string(pt->d.allele[i]) == string(vt->d.allele[i]));
+        }
+        REQUIRE(pt->n_info == 0);
+        REQUIRE(pt->n_fmt == 2);
+        REQUIRE(bcf_get_info(hdr, pt.get(), "END") == nullptr);
+        REQUIRE(bcf_get_fmt(hdr, pt.get(), "GQ") == nullptr);
+
+        int32_t *v1 = nullptr, *v2 = nullptr, n1 = 0, n2 = 0;
+        REQUIRE(bcf_get_genotypes(hdr, pt.get(), &v1, &n1) == 2);
+        REQUIRE(bcf_get_genotypes(hdr, vt.get(), &v2, &n2) == 2);
+        REQUIRE(memcmp(v1, v2, 2*sizeof(int32_t)) == 0);
+        int npl = bcf_get_format_int32(hdr, pt.get(), "PL", &v1, &n1);
+        REQUIRE(npl > 0);
+        REQUIRE(bcf_get_format_int32(hdr, vt.get(), "PL", &v2, &n2) == npl);
+        REQUIRE(memcmp(v1, v2, npl*sizeof(int32_t)) == 0);
+        free(v1);
+        free(v2);
+        n++;
+    }
+    REQUIRE(n == 5);
+}
+
 
 /*
 Ensure the code we've torn out remains functionally equivalent going
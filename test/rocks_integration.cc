@@ -8,6 +8,7 @@
 #include "KeyValue.h"
 #include "BCFKeyValueData.h"
 #include "RocksKeyValue.h"
+#include "tbx.h"
 
 #include "rocksdb/db.h"
 #include "rocksdb/slice.h"
@@ -91,6 +92,23 @@ TEST_CASE("RocksDB open/initialize states") {
     REQUIRE(snapshot->get0(coll, "foo", v2).ok());
     REQUIRE(v2->str() == "bar");
     v2.reset();
+
+    // batched lookups, through the snapshot and the database itself
+    for (const KeyValue::Reader* reader : {(const KeyValue::Reader*) snapshot.get(),
+                                           (const KeyValue::Reader*) db.get()}) {
+        std::vector<Status> statuses;
+        std::vector<std::shared_ptr<KeyValue::Data>> values;
+        REQUIRE(reader->multi_get(coll, {"foo", "xyz", "foo"}, statuses, values).ok());
+        REQUIRE(statuses.size() == 3);
+        REQUIRE(values.size() == 3);
+        REQUIRE(statuses[0].ok());
+        REQUIRE(values[0]->str() == "bar");
+        REQUIRE(statuses[1] == StatusCode::NOT_FOUND);
+        REQUIRE(statuses[2].ok());
+        REQUIRE(values[2]->str() == "bar");
+        REQUIRE(reader->multi_get(coll, {}, statuses, values).ok());
+        REQUIRE(statuses.empty());
+    }
     REQUIRE(db->put(coll, "foo", "bar").bad());
     REQUIRE(db->put(coll, "bar", "baz").bad());
     db.reset();
@@ -504,6 +522,251 @@ static void printDBSamples(T *data) {
 }
 
 
+TEST_CASE("RocksKeyValue sorted run ingestion") {
+    RocksKeyValue::prefix_spec prefix_spec("bcf", BCFKeyValueDataPrefixLength());
+    RocksKeyValue::config opt;
+    opt.pfx = &prefix_spec;
+    opt.mode = RocksKeyValue::OpenMode::BULK_LOAD;
+    vector<pair<string,size_t>> contigs = { make_pair("A", 1000000), make_pair("B", 1000000),
+                                            make_pair("C", 1000000) };
+    vector<string> datasets = { "trio1", "trio2" };
+
+    // load the same gVCFs into two databases (with small buckets so that
+    // there are danglers), one using sorted runs
+    vector<string> dbPaths;
+    vector<unique_ptr<KeyValue::DB>> dbs;
+    vector<unique_ptr<T>> datas;
+    vector<unique_ptr<MetadataCache>> caches;
+    for (int i = 0; i < 2; i++) {
+        dbPaths.push_back(createRandomDBFileName());
+        std::unique_ptr<KeyValue::DB> db;
+        REQUIRE(RocksKeyValue::Initialize(dbPaths.back(), opt, db).ok());
+        REQUIRE(T::InitializeDB(db.get(), contigs, 10).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(db.get(), data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+        T::import_options import_opts;
+        import_opts.sorted_runs = (i == 1);
+        uint64_t duplicate_records = 0;
+        for (const auto& dataset : datasets) {
+            T::import_result rslt;
+            Status s = data->import_gvcf(*cache, dataset, "test/data/discover_alleles_" + dataset + ".vcf",
+                                         {}, import_opts, rslt);
+            REQUIRE(s.ok());
+            duplicate_records += rslt.duplicate_records;
+        }
+        REQUIRE(duplicate_records > 0);
+        dbs.push_back(move(db));
+        datas.push_back(move(data));
+        caches.push_back(move(cache));
+    }
+
+    shared_ptr<const bcf_hdr_t> hdr;
+    vector<shared_ptr<bcf1_t>> records, records2;
+    REQUIRE(datas[1]->dataset_header("trio1", &hdr).ok());
+    REQUIRE(datas[1]->dataset_range("trio1", hdr.get(), range(0, 0, 1000000), nullptr, &records).ok());
+    REQUIRE(records.empty()); // not yet ingested
+
+    KeyValue::ingest_stats stats;
+    REQUIRE(dbs[1]->ingest_sorted_runs(stats).ok());
+    REQUIRE(stats.runs == 2);
+    REQUIRE(stats.run_files >= 2);
+    REQUIRE(stats.files >= 1);
+    REQUIRE(stats.files <= stats.run_files);
+
+    for (const auto& dataset : datasets) {
+        REQUIRE(datas[0]->dataset_header(dataset, &hdr).ok());
+        for (int rid = 0; rid < 3; rid++) {
+            range rng(rid, 0, 1000000);
+            REQUIRE(datas[0]->dataset_range(dataset, hdr.get(), rng, nullptr, &records).ok());
+            REQUIRE(datas[1]->dataset_range(dataset, hdr.get(), rng, nullptr, &records2).ok());
+            REQUIRE(records.size() == records2.size());
+            for (size_t i = 0; i < records.size(); i++) {
+                REQUIRE(range(records[i]) == range(records2[i]));
+                REQUIRE(records[i]->n_allele == records2[i]->n_allele);
+            }
+        }
+    }
+
+    // nothing left to ingest
+    REQUIRE(dbs[1]->ingest_sorted_runs(stats).ok());
+    REQUIRE(stats.runs == 0);
+    REQUIRE(stats.files == 0);
+
+    caches.clear();
+    datas.clear();
+    dbs.clear();
+    for (const auto& dbPath : dbPaths) {
+        RocksKeyValue::destroy(dbPath);
+    }
+}
+
+
+// Make a tabix-indexed copy of test/data/NA12878.g.vcf.gz, and get its contigs
+static void indexed_NA12878_copy(string& gvcf, vector<pair<string,size_t>>& contigs) {
+    gvcf = createRandomDBFileName() + ".g.vcf.gz";
+    REQUIRE(system(("cp test/data/NA12878.g.vcf.gz " + gvcf).c_str()) == 0);
+    REQUIRE(tbx_index_build(gvcf.c_str(), 0, &tbx_conf_vcf) == 0);
+
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(gvcf.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    int ncontigs = 0;
+    const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+    contigs.clear();
+    for (int i = 0; i < ncontigs; i++) {
+        contigs.push_back(make_pair(string(contignames[i]),
+                                    hdr->id[BCF_DT_CTG][i].val->info[0]));
+    }
+    free(contignames);
+}
+
+// Import a gVCF into a new bulk-load database
+static void import_NA12878(const string& gvcf, const vector<pair<string,size_t>>& contigs,
+                           const set<range>& range_filter, const T::import_options& import_opts,
+                           vector<string>& dbPaths, vector<unique_ptr<KeyValue::DB>>& dbs,
+                           vector<T::import_result>& results) {
+    dbPaths.push_back(createRandomDBFileName());
+    RocksKeyValue::config opt;
+    opt.mode = RocksKeyValue::OpenMode::BULK_LOAD;
+    std::unique_ptr<KeyValue::DB> db;
+    REQUIRE(RocksKeyValue::Initialize(dbPaths.back(), opt, db).ok());
+    REQUIRE(T::InitializeDB(db.get(), contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(db.get(), data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+    T::import_result rslt;
+    REQUIRE(data->import_gvcf(*cache, "NA12878", gvcf, range_filter, import_opts, rslt).ok());
+    REQUIRE(rslt.samples.size() == 1);
+    if (import_opts.sorted_runs) {
+        KeyValue::ingest_stats stats;
+        REQUIRE(db->ingest_sorted_runs(stats).ok());
+        REQUIRE(stats.runs == import_opts.threads);
+    }
+    results.push_back(move(rslt));
+    dbs.push_back(move(db));
+}
+
+// Require the bcf collections of two databases to be identical
+static void require_same_buckets(KeyValue::DB* db0, KeyValue::DB* db1, uint64_t buckets) {
+    KeyValue::CollectionHandle coll0, coll1;
+    REQUIRE(db0->collection("bcf", coll0).ok());
+    REQUIRE(db1->collection("bcf", coll1).ok());
+    unique_ptr<KeyValue::Iterator> it0, it1;
+    REQUIRE(db0->iterator(coll0, "", it0).ok());
+    REQUIRE(db1->iterator(coll1, "", it1).ok());
+    uint64_t n = 0;
+    while (it0->valid()) {
+        REQUIRE(it1->valid());
+        REQUIRE(it0->key().str() == it1->key().str());
+        REQUIRE(it0->value().str() == it1->value().str());
+        REQUIRE(it0->next().ok());
+        REQUIRE(it1->next().ok());
+        n++;
+    }
+    REQUIRE(!it1->valid());
+    REQUIRE(n == buckets);
+}
+
+TEST_CASE("RocksDB::import_gvcf in pieces") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    string gvcf;
+    vector<pair<string,size_t>> contigs;
+    indexed_NA12878_copy(gvcf, contigs);
+
+    // import sequentially, in pieces, and in pieces into sorted runs
+    vector<string> dbPaths;
+    vector<unique_ptr<KeyValue::DB>> dbs;
+    vector<T::import_result> results;
+    for (int i = 0; i < 3; i++) {
+        T::import_options import_opts;
+        import_opts.threads = (i == 0 ? 1 : 4);
+        import_opts.sorted_runs = (i == 2);
+        import_NA12878(gvcf, contigs, {}, import_opts, dbPaths, dbs, results);
+    }
+
+    for (int i = 1; i < 3; i++) {
+        REQUIRE(results[i].records == results[0].records);
+        REQUIRE(results[i].buckets == results[0].buckets);
+        REQUIRE(results[i].bytes == results[0].bytes);
+        REQUIRE(results[i].duplicate_records == results[0].duplicate_records);
+        REQUIRE(results[i].skipped_records == results[0].skipped_records);
+        REQUIRE(results[i].records_read == results[0].records_read);
+        // the buckets must be identical
+        require_same_buckets(dbs[0].get(), dbs[i].get(), results[0].buckets);
+    }
+
+    dbs.clear();
+    for (const auto& dbPath : dbPaths) {
+        RocksKeyValue::destroy(dbPath);
+    }
+    unlink(gvcf.c_str());
+    unlink((gvcf + ".tbi").c_str());
+}
+
+TEST_CASE("RocksDB::import_gvcf range filter") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    string gvcf;
+    vector<pair<string,size_t>> contigs;
+    indexed_NA12878_copy(gvcf, contigs);
+
+    // scattered ranges, some overlapping each other or close together, and
+    // some bordering import pieces
+    set<range> range_filter;
+    for (int rid = 0; rid < 3; rid++) {
+        for (int beg = 1000000; beg < 100000000; beg += 2999999) {
+            range_filter.insert(range(rid, beg, beg + 50000));
+            range_filter.insert(range(rid, beg + 25000, beg + 80000));
+            range_filter.insert(range(rid, beg + 100000, beg + 100100));
+        }
+        range_filter.insert(range(rid, 9990000 - 100, 9990000 + 100));
+        range_filter.insert(range(rid, 19980000 - 1000, 19980000));
+    }
+
+    // import the unindexed original, and the indexed copy sequentially and
+    // in pieces
+    vector<string> dbPaths;
+    vector<unique_ptr<KeyValue::DB>> dbs;
+    vector<T::import_result> results;
+    T::import_options import_opts;
+    import_NA12878("test/data/NA12878.g.vcf.gz", contigs, range_filter, import_opts, dbPaths, dbs, results);
+    import_NA12878(gvcf, contigs, range_filter, import_opts, dbPaths, dbs, results);
+    import_opts.threads = 4;
+    import_NA12878(gvcf, contigs, range_filter, import_opts, dbPaths, dbs, results);
+
+    REQUIRE(results[0].records > 0);
+    REQUIRE(results[0].records_read == 301244);
+    REQUIRE(results[0].filtered_records > results[0].records);
+    for (int i = 1; i < 3; i++) {
+        REQUIRE(results[i].records == results[0].records);
+        REQUIRE(results[i].buckets == results[0].buckets);
+        REQUIRE(results[i].duplicate_records == results[0].duplicate_records);
+        REQUIRE(results[i].skipped_records == results[0].skipped_records);
+        // the index saves reading most of the file
+        REQUIRE(results[i].records_read < results[0].records_read / 4);
+        REQUIRE(results[i].records_read - results[i].filtered_records ==
+                results[0].records_read - results[0].filtered_records);
+        require_same_buckets(dbs[0].get(), dbs[i].get(), results[0].buckets);
+    }
+
+    dbs.clear();
+    for (const auto& dbPath : dbPaths) {
+        RocksKeyValue::destroy(dbPath);
+    }
+    unlink(gvcf.c_str());
+    unlink((gvcf + ".tbi").c_str());
+}
+
 // Test concurrent upload, and then concurrent queries.
 // Do not test upload failures, and query during upload.
 TEST_CASE("Multi-threading") {
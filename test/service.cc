@@ -1,10 +1,16 @@
 #include <iostream>
 #include <algorithm>
+#include <fstream>
+#include <thread>
+#include <chrono>
 #include <vcf.h>
 #include "service.h"
 #include "unifier.h"
 #include "genotyper.h"
+#include "executor.h"
+#include "discovery.h"
 #include "utils.cc"
+#include "test_utils.h"
 #include "catch.hpp"
 using namespace std;
 using namespace GLnexus;
@@ -34,12 +40,15 @@ public:
     }
 
     Status dataset_range(const string& dataset, const bcf_hdr_t *hdr, const range& pos,
-                         bcf_predicate predicate, vector<shared_ptr<bcf1_t>>* records) override {
+                         bcf_predicate predicate,
+                         vector<shared_ptr<bcf1_t>>* records,
+                         unsigned flags = BCF_RANGE_ALL,
+                         const bcf_projection* projection = nullptr) override {
         if (i_++ % fail_every_ == 0) {
             failed_once_ = true;
             return Status::IOError("SIM");
         }
-        return inner_.dataset_range(dataset, hdr, pos, predicate, records);
+        return inner_.dataset_range(dataset, hdr, pos, predicate, records, flags, projection);
     }
 
     bool failed_once() { return failed_once_; }
@@ -104,6 +113,19 @@ TEST_CASE("service::discover_alleles") {
         REQUIRE(mals[5].empty());
 
         REQUIRE(mals[6].empty());
+
+        // merging the results (each twice) by tree reduction on the executor
+        // gives the same as merging them one by one
+        vector<discovered_alleles> parts(mals);
+        parts.insert(parts.end(), mals.begin(), mals.end());
+        discovered_alleles sequential, tree;
+        for (const auto& dsals : parts) {
+            REQUIRE(merge_discovered_alleles(dsals, sequential).ok());
+        }
+        REQUIRE(merge_discovered_alleles(Executor::Shared(), parts, tree).ok());
+        REQUIRE(parts.empty());
+        REQUIRE(tree == sequential);
+        REQUIRE(tree.find(allele(range(0, 1000, 1001), "G"))->second.zGQ.copy_number() == 12);
     }
 
     SECTION("allele overlaps two ranges") {
@@ -485,6 +507,216 @@ TEST_CASE("genotyper placeholder") {
         REQUIRE(sites[0].pos.rid == 0);
         REQUIRE(sites[sites.size()-1].pos.rid == 1);
     }
+
+    SECTION("bounded pending results") {
+        s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als);
+        REQUIRE(s.ok());
+        vector<unified_site> sites;
+        unifier_stats stats;
+        s = unified_sites(unifier_config(), N, als, sites, stats);
+        REQUIRE(s.ok());
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+        REQUIRE(s.ok());
+
+        // workers held to one site ahead of the output each, with or
+        // without windows, and with chunks of one site or all of them, give
+        // the same output
+        const string bounded_fn("/tmp/GLnexus_unit_tests.bounded.bcf");
+        for (bool window_scan : {false, true}) {
+            for (size_t chunk_cost : {1, 1000000}) {
+                service_config cfg;
+                cfg.threads = 2;
+                cfg.genotype_pending_bytes = 1;
+                cfg.genotype_max_pending_sites = 1;
+                cfg.genotype_window_scan = window_scan;
+                cfg.genotype_window_sites = 2;
+                cfg.genotype_chunk_cost = chunk_cost;
+                s = Service::Start(cfg, *data, *data, svc);
+                REQUIRE(s.ok());
+                s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, bounded_fn);
+                REQUIRE(s.ok());
+                REQUIRE(slurp_file(bounded_fn) == slurp_file(tfn));
+            }
+        }
+        // cfg.threads applied to the process-wide executor; restore it
+        Executor::Shared().set_threads(0);
+    }
+
+    SECTION("tiled genotyping") {
+        discovered_alleles als0, als1;
+        s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als0);
+        REQUIRE(s.ok());
+        s = svc->discover_alleles("<ALL>", range(1, 0, 1000000), N, als1);
+        REQUIRE(s.ok());
+        REQUIRE(merge_discovered_alleles(als0, als).ok());
+        REQUIRE(merge_discovered_alleles(als1, als).ok());
+        vector<unified_site> sites;
+        unifier_stats stats;
+        s = unified_sites(unifier_config(), N, als, sites, stats);
+        REQUIRE(s.ok());
+
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+        REQUIRE(s.ok());
+
+        // windows of sites x one data set at a time, with the windows broken
+        // at the contig boundary, give the same output; as do windows
+        // scanning all the data sets at once
+        const string tiled_fn("/tmp/GLnexus_unit_tests.tiled.bcf");
+        for (size_t window_sites : {2, 4, 100}) {
+            service_config cfg;
+            cfg.genotype_window_sites = window_sites;
+            cfg.genotype_block_datasets = 1;
+            s = Service::Start(cfg, *data, *data, svc);
+            REQUIRE(s.ok());
+            s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tiled_fn);
+            REQUIRE(s.ok());
+            REQUIRE(slurp_file(tiled_fn) == slurp_file(tfn));
+
+            cfg.genotype_window_scan = true;
+            cfg.genotype_block_datasets = 1024;
+            s = Service::Start(cfg, *data, *data, svc);
+            REQUIRE(s.ok());
+            s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tiled_fn);
+            REQUIRE(s.ok());
+            REQUIRE(slurp_file(tiled_fn) == slurp_file(tfn));
+        }
+    }
+
+    SECTION("output formats") {
+        s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als);
+        REQUIRE(s.ok());
+        vector<unified_site> sites;
+        unifier_stats stats;
+        s = unified_sites(unifier_config(), N, als, sites, stats);
+        REQUIRE(s.ok());
+
+        // read back the records of any output format, as VCF text
+        auto read_records = [](const string& fn, vector<string>& lines) {
+            lines.clear();
+            vcfFile* vcf = bcf_open(fn.c_str(), "r");
+            REQUIRE(vcf != nullptr);
+            shared_ptr<bcf_hdr_t> hdr(bcf_hdr_read(vcf), &bcf_hdr_destroy);
+            REQUIRE(hdr);
+            shared_ptr<bcf1_t> rec(bcf_init(), &bcf_destroy);
+            kstring_t line = {0, 0, nullptr};
+            while (bcf_read(vcf, hdr.get(), rec.get()) == 0) {
+                line.l = 0;
+                REQUIRE(vcf_format(hdr.get(), rec.get(), &line) == 0);
+                lines.push_back(string(line.s, line.l));
+            }
+            free(line.s);
+            REQUIRE(bcf_close(vcf) == 0);
+        };
+
+        vector<string> bcf_lines, lines;
+        s = svc->genotype_sites(genotyper_config(GLnexusOutputFormat::BCF), "<ALL>", sites, tfn);
+        REQUIRE(s.ok());
+        read_records(tfn, bcf_lines);
+        REQUIRE(bcf_lines.size() == sites.size());
+
+        // VCF is formatted on the worker threads; bgzipped VCF and BCF are
+        // compressed on the output threads
+        service_config cfg;
+        cfg.output_threads = 3;
+        for (int level : {-1, 0, 6}) {
+            cfg.output_compression_level = level;
+            s = Service::Start(cfg, *data, *data, svc);
+            REQUIRE(s.ok());
+
+            const string vcf_fn("/tmp/GLnexus_unit_tests.vcf");
+            s = svc->genotype_sites(genotyper_config(GLnexusOutputFormat::VCF), "<ALL>", sites, vcf_fn);
+            REQUIRE(s.ok());
+            read_records(vcf_fn, lines);
+            REQUIRE(lines == bcf_lines);
+
+            const string vcf_gz_fn("/tmp/GLnexus_unit_tests.vcf.gz");
+            s = svc->genotype_sites(genotyper_config(GLnexusOutputFormat::VCF_GZ), "<ALL>", sites, vcf_gz_fn);
+            REQUIRE(s.ok());
+            read_records(vcf_gz_fn, lines);
+            REQUIRE(lines == bcf_lines);
+
+            s = svc->genotype_sites(genotyper_config(GLnexusOutputFormat::BCF), "<ALL>", sites, tfn);
+            REQUIRE(s.ok());
+            read_records(tfn, lines);
+            REQUIRE(lines == bcf_lines);
+
+            auto output_stats = svc->output_stats();
+            REQUIRE(output_stats.records == 3*sites.size());
+            REQUIRE(output_stats.formatted == 2*sites.size());
+            REQUIRE(output_stats.bytes > 0);
+        }
+
+        cfg.output_compression_level = 10;
+        s = Service::Start(cfg, *data, *data, svc);
+        REQUIRE(s.ok());
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+    }
+
+    SECTION("reusing a previous output") {
+        // alleles discovered in trio2 merge with trio1's into all of them
+        discovered_alleles als1, als2;
+        s = svc->discover_alleles("discover_alleles_trio1", range(0, 0, 1000000), N, als1);
+        REQUIRE(s.ok());
+        REQUIRE(N == 3);
+        s = svc->discover_alleles("discover_alleles_trio2", range(0, 0, 1000000), N, als2);
+        REQUIRE(s.ok());
+        s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als);
+        REQUIRE(s.ok());
+        REQUIRE(N == 6);
+        REQUIRE(merge_discovered_alleles(als1, als2).ok());
+        REQUIRE(als2 == als);
+
+        vector<unified_site> sites1, sites;
+        unifier_stats stats;
+        s = unified_sites(unifier_config(), 3, als1, sites1, stats);
+        REQUIRE(s.ok());
+        s = unified_sites(unifier_config(), N, als, sites, stats);
+        REQUIRE(s.ok());
+        REQUIRE(sites1.size() == 6);
+        REQUIRE(sites.size() == 6);
+
+        // the allele frequencies changed, but only the priors of
+        // revise_genotypes depend on them
+        genotyper_config gcfg;
+        REQUIRE(genotype_site_samples_equivalent(gcfg, sites1[0], sites[0]));
+        REQUIRE(!genotype_site_samples_equivalent(gcfg, sites1[1], sites[1])); // added alleles
+        REQUIRE(!genotype_site_samples_equivalent(gcfg, sites1[2], sites[2]));
+        gcfg.revise_genotypes = true;
+        REQUIRE(!genotype_site_samples_equivalent(gcfg, sites1[0], sites[0]));
+        gcfg.revise_genotypes = false;
+
+        const string prev_fn("/tmp/GLnexus_unit_tests.prev.bcf");
+        const string reuse_fn("/tmp/GLnexus_unit_tests.reuse.bcf");
+        s = svc->genotype_sites(gcfg, "discover_alleles_trio1", sites, prev_fn);
+        REQUIRE(s.ok());
+        s = svc->genotype_sites(gcfg, "<ALL>", sites, tfn);
+        REQUIRE(s.ok());
+
+        Service::genotype_reuse reuse;
+        reuse.new_sampleset = "discover_alleles_trio2";
+        reuse.previous_filename = prev_fn;
+        for (int every : {1, 2, 3}) {
+            reuse.reusable.clear();
+            for (size_t i = 0; i < sites.size(); i++) {
+                reuse.reusable.push_back(i % every == 0);
+            }
+            s = svc->genotype_sites(gcfg, "<ALL>", sites, reuse_fn, nullptr, &reuse);
+            REQUIRE(s.ok());
+            REQUIRE(slurp_file(reuse_fn) == slurp_file(tfn));
+        }
+
+        // previous output lacking a site
+        s = svc->genotype_sites(gcfg, "discover_alleles_trio1", sites1, prev_fn);
+        REQUIRE(s.ok());
+        reuse.reusable.assign(sites.size(), true);
+        s = svc->genotype_sites(gcfg, "<ALL>", sites, reuse_fn, nullptr, &reuse);
+        REQUIRE(s == StatusCode::NOT_FOUND);
+
+        gcfg.trim_uncalled_alleles = true;
+        s = svc->genotype_sites(gcfg, "<ALL>", sites, reuse_fn, nullptr, &reuse);
+        REQUIRE(s == StatusCode::INVALID);
+    }
 }
 
 TEST_CASE("gVCF genotyper") {
@@ -533,6 +765,20 @@ TEST_CASE("gVCF genotyper") {
 
         s = svc->genotype_sites(genotyper_config(), string("NA12878D_HiSeqX.21.10009462-10009469"), sites, tfn);
         REQUIRE(s.ok());
+        // each site was prefetched, or else taken up by a worker first
+        auto ps = svc->prefetch_stats();
+        REQUIRE(ps.hits + ps.waits + ps.misses == sites.size());
+
+        // without prefetching
+        service_config cfg;
+        cfg.prefetch_threads = 0;
+        s = Service::Start(cfg, *data, *data, svc);
+        REQUIRE(s.ok());
+        s = svc->genotype_sites(genotyper_config(), string("NA12878D_HiSeqX.21.10009462-10009469"), sites, tfn);
+        REQUIRE(s.ok());
+        ps = svc->prefetch_stats();
+        REQUIRE(ps.hits + ps.waits == 0);
+        REQUIRE(ps.misses == sites.size());
     }
 
     SECTION("require depth > 12") {
@@ -624,3 +870,102 @@ TEST_CASE("genotype residuals") {
     // are parsed as a yaml map.
     REQUIRE(resFile.IsMap());
 }
+
+static uint64_t fork_join_fib(Executor& executor, int n) {
+    if (n < 12) {
+        return n < 2 ? n : fork_join_fib(executor, n-1) + fork_join_fib(executor, n-2);
+    }
+    uint64_t a = 0, b = 0;
+    TaskGroup tasks(executor);
+    tasks.run([&]() { a = fork_join_fib(executor, n-1); });
+    b = fork_join_fib(executor, n-2);
+    tasks.wait();
+    return a + b;
+}
+
+TEST_CASE("Executor") {
+    SECTION("nested fork/join") {
+        // the waiting tasks help execute their subtasks, so the nesting is
+        // much deeper than the threads
+        for (size_t threads : {1, 2, 4}) {
+            unique_ptr<Executor> executor;
+            REQUIRE(Executor::Start(threads, executor).ok());
+            REQUIRE(executor->threads() == threads);
+            REQUIRE(fork_join_fib(*executor, 24) == 46368);
+
+            vector<uint64_t> results(16);
+            TaskGroup tasks(*executor);
+            for (size_t i = 0; i < results.size(); i++) {
+                tasks.run([&, i]() { results[i] = fork_join_fib(*executor, 12+i); });
+            }
+            tasks.wait();
+            REQUIRE(results[0] == 144);
+            REQUIRE(results[15] == 196418);
+        }
+    }
+
+    SECTION("set_threads") {
+        unique_ptr<Executor> executor;
+        REQUIRE(Executor::Start(4, executor).ok());
+        executor->set_threads(2);
+        REQUIRE(executor->threads() == 2);
+        atomic<int> running(0), max_running(0);
+        TaskGroup tasks(*executor);
+        for (int i = 0; i < 64; i++) {
+            tasks.run([&]() {
+                int r = ++running, m = max_running;
+                while (r > m && !max_running.compare_exchange_weak(m, r)) {}
+                this_thread::sleep_for(chrono::milliseconds(1));
+                running--;
+            });
+        }
+        tasks.wait();
+        // the two workers, and this thread while it waits
+        REQUIRE(max_running <= 3);
+
+        executor->set_threads(0);
+        REQUIRE(executor->threads() == 4);
+        REQUIRE(fork_join_fib(*executor, 20) == 6765);
+    }
+
+    SECTION("exceptions") {
+        unique_ptr<Executor> executor;
+        REQUIRE(Executor::Start(2, executor).ok());
+        atomic<int> ran(0);
+        TaskGroup tasks(*executor);
+        for (int i = 0; i < 100; i++) {
+            tasks.run([&, i]() {
+                ran++;
+                if (i == 42) {
+                    throw runtime_error("task 42");
+                }
+            });
+        }
+        REQUIRE_THROWS_AS(tasks.wait(), runtime_error);
+        REQUIRE(ran == 100);
+    }
+
+    SECTION("wait_until") {
+        unique_ptr<Executor> executor;
+        REQUIRE(Executor::Start(2, executor).ok());
+        for (int rep = 0; rep < 100; rep++) {
+            atomic<int> started(0), wrong(0);
+            TaskGroup tasks(*executor);
+            for (int i = 0; i < 4; i++) {
+                tasks.run([&]() {
+                    // signal, then keep running, as genotype_sites tasks do
+                    // after putting each result
+                    started++;
+                    executor->notify();
+                    if (fork_join_fib(*executor, 14) != 377) {
+                        wrong++;
+                    }
+                });
+            }
+            executor->wait_until([&]() { return started >= 2; });
+            tasks.wait();
+            REQUIRE(started == 4);
+            REQUIRE(wrong == 0);
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef GLNEXUS_TEST_UTILS_H
+#define GLNEXUS_TEST_UTILS_H
+
+#include <fstream>
+#include <iterator>
+#include <string>
+
+// Helpers shared by the unit test files
+
+// Read a whole file, e.g. to compare outputs byte for byte
+inline std::string slurp_file(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+#endif
@@ -265,6 +265,108 @@ TEST_CASE("yaml_of_discovered_alleles") {
     }
 }
 
+TEST_CASE("flat_discovered_alleles") {
+    // synthesize alleles as discovered on two contigs: mostly SNVs, with an
+    // occasional longer indel
+    auto synthesize = [](int rid, int beg, int end, int step, discovered_alleles& ans) {
+        const char* bases = "ACGT";
+        for (int pos = beg; pos < end; pos += step) {
+            discovered_allele_info ref_info;
+            ref_info.is_ref = true;
+            ans[allele(range(rid, pos, pos+1), string(1, bases[pos%4]))] = ref_info;
+
+            discovered_allele_info alt_info;
+            alt_info.topAQ += vector<int>{pos%100, 30};
+            alt_info.zGQ.add(1 + pos%2, pos%100);
+            ans[allele(range(rid, pos, pos+1), string(1, bases[(pos+1)%4]))] = alt_info;
+            if (pos % 10 == 0) {
+                ans[allele(range(rid, pos, pos+1), string(20 + pos%7, bases[(pos+2)%4]))] = alt_info;
+            }
+        }
+    };
+
+    SECTION("memory benchmark") {
+        discovered_alleles dsals;
+        synthesize(0, 0, 60000, 1, dsals);
+        synthesize(1, 0, 40000, 1, dsals);
+        const size_t n = dsals.size();
+        REQUIRE(n == 210000);
+
+        // a map node holds the value after the red-black tree header (color
+        // and three pointers); the allele's DNA is on the heap unless short
+        // enough for the string's own buffer
+        size_t map_bytes = 0;
+        for (const auto& p : dsals) {
+            map_bytes += 4*sizeof(void*) + sizeof(p);
+            if (p.first.dna.size() > 15) {
+                map_bytes += p.first.dna.size() + 1;
+            }
+        }
+
+        discovered_alleles original(dsals);
+        flat_discovered_alleles flat;
+        REQUIRE(flat_of_discovered_alleles(dsals, flat).ok());
+        REQUIRE(dsals.empty());
+        REQUIRE(flat.size() == n);
+
+        size_t flat_bytes = flat.memory_bytes();
+        WARN("discovered_alleles bytes per allele: map " << double(map_bytes)/n
+             << ", flat " << double(flat_bytes)/n);
+        REQUIRE(flat_bytes < map_bytes);
+
+        discovered_alleles roundtrip;
+        REQUIRE(discovered_alleles_of_flat(flat, 0, flat.size(), roundtrip).ok());
+        REQUIRE(roundtrip == original);
+
+        REQUIRE(flat.contig_begin(0) == 0);
+        REQUIRE(flat.contig_begin(1) == 126000);
+        REQUIRE(flat.contig_begin(2) == n);
+        REQUIRE(flat.allele_at(flat.contig_begin(1)).pos == range(1, 0, 1));
+    }
+
+    SECTION("merge") {
+        // overlapping sets, so that some alleles are merged and others not
+        discovered_alleles dsals1, dsals2;
+        synthesize(0, 0, 3000, 2, dsals1);
+        synthesize(0, 1000, 5000, 3, dsals2);
+        synthesize(1, 0, 1000, 1, dsals2);
+
+        discovered_alleles expected(dsals2);
+        REQUIRE(merge_discovered_alleles(dsals1, expected).ok());
+
+        flat_discovered_alleles flat1, flat2, merged;
+        REQUIRE(flat_of_discovered_alleles(dsals1, flat1).ok());
+        REQUIRE(flat_of_discovered_alleles(dsals2, flat2).ok());
+        REQUIRE(merge_discovered_alleles(flat1, flat2, merged).ok());
+        REQUIRE(merged.size() == expected.size());
+
+        discovered_alleles actual;
+        REQUIRE(discovered_alleles_of_flat(merged, 0, merged.size(), actual).ok());
+        REQUIRE(actual == expected);
+
+        // in place, by merging or (the second contig following) appending
+        REQUIRE(merge_discovered_alleles(flat1, flat2).ok());
+        REQUIRE(flat2.size() == expected.size());
+        for (size_t i = 0; i < merged.size(); i++) {
+            REQUIRE(flat2.allele_at(i) == merged.allele_at(i));
+            REQUIRE(flat2[i].info == merged[i].info);
+        }
+        discovered_alleles dsals3;
+        synthesize(2, 0, 1000, 1, dsals3);
+        REQUIRE(merge_discovered_alleles(dsals3, expected).ok());
+        flat_discovered_alleles flat3;
+        REQUIRE(flat_of_discovered_alleles(dsals3, flat3).ok());
+        REQUIRE(merge_discovered_alleles(flat3, flat2).ok());
+        actual.clear();
+        REQUIRE(discovered_alleles_of_flat(flat2, 0, flat2.size(), actual).ok());
+        REQUIRE(actual == expected);
+        REQUIRE(flat2.contig_begin(2) == merged.size());
+
+        // out of order
+        REQUIRE(merged.push_back(allele(range(0, 0, 1), "A"), discovered_allele_info()) == StatusCode::INVALID);
+    }
+}
+
 TEST_CASE("unified_site::of_yaml") {
     vector<pair<string,size_t>> contigs;
     contigs.push_back(make_pair("16",12345));
@@ -182,7 +182,9 @@ public:
 
     Status dataset_range(const string& dataset, const bcf_hdr_t *hdr,
                          const range& pos, bcf_predicate predicate,
-                         vector<shared_ptr<bcf1_t>>* records) override {
+                         vector<shared_ptr<bcf1_t>>* records,
+                         unsigned flags = BCF_RANGE_ALL,
+                         const bcf_projection* projection = nullptr) override {
         Status s;
         auto p = datasets_.find(dataset);
         if (p == datasets_.end()) {
@@ -193,6 +195,9 @@ public:
             if (!range(bcf).overlaps(pos))
                 continue;
 
+            if ((flags & BCF_RANGE_VARIANTS_ONLY) && is_gvcf_ref_record(bcf.get()))
+                continue;
+
             bool rec_ok = false;
             if (predicate == nullptr) {
                 rec_ok = true;